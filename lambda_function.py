@@ -1,9 +1,324 @@
 import json
-import boto3
+import base64
+import os
+import random
+import time
 from decimal import Decimal
 
-dynamodb = boto3.resource('dynamodb')
-table = dynamodb.Table('PoolFlowData')
+TABLE_NAME = os.environ.get('TABLE_NAME', 'PoolFlowData')
+
+# The table's sort key: recordKey ("<timestamp>#<sequence>"), or timestamp for
+# tables created before it. A timestamp table holds one item per second, so
+# records sharing a second are merged into one item rather than written as
+# duplicate keys.
+SORT_KEYS = ('recordKey', 'timestamp')
+TABLE_SORT_KEY = os.environ.get('TABLE_SORT_KEY', 'recordKey')
+
+# BatchWriteItem takes at most 25 puts; unprocessed ones are resent with
+# exponential backoff, and a payload still not written after the last attempt
+# fails so the webhook is retried (the keys make the retry harmless)
+BATCH_WRITE_LIMIT = 25
+MAX_WRITE_ATTEMPTS = 6
+RETRY_BASE_SECONDS = 0.05
+
+# DynamoDB service resource, created on first use; tools/ingest_local.py sets
+# a stand-in instead
+dynamodb = None
+
+# Compact payloads: base64 of a versioned binary record. The format is
+# specified in src/CompactPayload.h; decoding yields the same fields as the
+# JSON payloads, rounded the same way.
+COMPACT_PAYLOAD_VERSION = 6
+COMPACT_TYPE_FLOW_BATCH = 1
+COMPACT_TYPE_DIAGNOSTICS = 2
+
+# Matches DataReporter::translateResetReason()
+RESET_REASONS = {
+    20: 'Pin Reset',
+    30: 'Power Management',
+    60: 'Watchdog Timer',
+    70: 'Firmware Update',
+    90: 'Firmware Update Timeout',
+    100: 'Factory Reset',
+    110: 'Safe Mode',
+    120: 'DFU Mode',
+    130: 'System Panic',
+    140: 'User Requested'
+}
+
+class CompactReader:
+    def __init__(self, data):
+        self.data = data
+        self.pos = 0
+
+    def byte(self):
+        if self.pos >= len(self.data):
+            raise ValueError('compact payload truncated')
+        value = self.data[self.pos]
+        self.pos += 1
+        return value
+
+    def uvar(self):
+        value = 0
+        shift = 0
+        while True:
+            byte = self.byte()
+            value |= (byte & 0x7F) << shift
+            if not byte & 0x80:
+                return value
+            shift += 7
+            if shift >= 64:
+                raise ValueError('compact varint too long')
+
+    def svar(self):
+        value = self.uvar()
+        return (value >> 1) ^ -(value & 1)
+
+    def string(self):
+        length = self.uvar()
+        text = bytes(self.byte() for _ in range(length))
+        return text.decode('utf-8')
+
+def gallons(milli_gallons, decimals):
+    # Round half up to the printed precision, like Volume::format()
+    step = 10 ** (3 - decimals)
+    return Decimal((milli_gallons + step // 2) // step).scaleb(-decimals)
+
+def decode_compact(text):
+    reader = CompactReader(base64.b64decode(text, validate=True))
+    version = reader.byte()
+    if not 1 <= version <= COMPACT_PAYLOAD_VERSION:
+        raise ValueError('unsupported compact payload version %d' % version)
+    record_type = reader.byte()
+    device_id = reader.string()
+
+    if record_type == COMPACT_TYPE_FLOW_BATCH:
+        records = []
+        timestamp = 0
+        for _ in range(reader.uvar()):
+            timestamp += reader.svar()
+            milli_gallons = reader.uvar()
+            hourly_average = reader.uvar()
+            records.append({
+                'timestamp': timestamp,
+                'gallons_used': milli_gallons // 1000,
+                'hourly_average': gallons(hourly_average, 1)
+            })
+        batch = {'device_id': device_id, 'records': records}
+        # Version 6: per-meter gallons of each record when the device has
+        # more than one meter
+        channels = [reader.string() for _ in range(reader.uvar())] if version >= 6 else []
+        if channels:
+            batch['channels'] = channels
+            for record in records:
+                record['channel_gallons'] = [reader.uvar() // 1000 for _ in channels]
+        return batch
+
+    if record_type == COMPACT_TYPE_DIAGNOSTICS:
+        diagnostics = {'device_id': device_id}
+        diagnostics['timestamp'] = reader.uvar()
+        diagnostics['firmware'] = reader.string()
+        diagnostics['reset_reason'] = RESET_REASONS.get(reader.uvar(), 'Unknown')
+        diagnostics['lifetime_gallons'] = gallons(reader.uvar(), 2)
+        diagnostics['daily_total'] = gallons(reader.uvar(), 2)
+        for field in ('hours_elapsed', 'total_pulses', 'flow_events_today'):
+            diagnostics[field] = reader.uvar()
+        diagnostics['signal_strength'] = reader.svar()
+        for field in ('storage_records', 'storage_writes_avoided', 'queue_depth',
+                      'queue_dropped', 'flow_records_pending'):
+            diagnostics[field] = reader.uvar()
+        if version >= 2:
+            diagnostics['sleep_seconds'] = reader.uvar()
+            diagnostics['wakeups'] = reader.uvar()
+        if version >= 3:
+            diagnostics['alert_flags'] = reader.uvar()
+            diagnostics['continuous_flow_s'] = reader.uvar()
+            diagnostics['longest_flow_s'] = reader.uvar()
+            for field in ('hour_floor_gpm', 'day_floor_gpm', 'baseline_gpm'):
+                diagnostics[field] = gallons(reader.uvar(), 3)
+            diagnostics['implausible_pulses'] = reader.uvar()
+        if version >= 4:
+            diagnostics['peak_gpm'] = gallons(reader.uvar(), 2)
+            diagnostics['average_gpm'] = gallons(reader.uvar(), 2)
+        if version >= 5:
+            watchdog_gap_ms = reader.uvar()
+            worst_probe = reader.string()
+            worst_us = reader.uvar()
+            latency_us = {}
+            for _ in range(reader.uvar()):
+                name = reader.string()
+                latency_us[name] = [reader.uvar() for _ in range(4)]
+            # Firmware built without latency probes sends an empty list,
+            # and its JSON payload leaves the fields out
+            if latency_us:
+                diagnostics['watchdog_gap_ms'] = watchdog_gap_ms
+                diagnostics['worst_probe'] = worst_probe
+                diagnostics['worst_us'] = worst_us
+                diagnostics['latency_us'] = latency_us
+        if version >= 6:
+            channels = []
+            for _ in range(reader.uvar()):
+                channels.append((reader.string(), reader.uvar(), reader.uvar(), reader.uvar()))
+            if channels:
+                diagnostics['channels'] = [channel[0] for channel in channels]
+                diagnostics['channel_lifetime_gallons'] = [gallons(channel[1], 2) for channel in channels]
+                diagnostics['channel_daily_total'] = [gallons(channel[2], 2) for channel in channels]
+                diagnostics['channel_flow_events'] = [channel[3] for channel in channels]
+        return diagnostics
+
+    raise ValueError('unknown compact payload type %d' % record_type)
+
+class PayloadError(ValueError):
+    """A payload that no retry can fix; answered with 400."""
+
+def parse_device_data(data):
+    # JSON payloads start with '{', which never appears in base64
+    if data.lstrip().startswith('{'):
+        return json.loads(data)
+    return decode_compact(data.strip())
+
+def is_whole(value):
+    return isinstance(value, int) and not isinstance(value, bool)
+
+def is_number(value):
+    return isinstance(value, (int, float, Decimal)) and not isinstance(value, bool)
+
+def validate_flow_data(device_data):
+    """The flow records of a flow_data payload, checked against the fields
+    DataReporter sends: a batch of hourly records, or one record from older
+    firmware (which also sent signal_strength, no longer stored)."""
+    if not isinstance(device_data, dict):
+        raise PayloadError('payload is not an object')
+    device_id = device_data.get('device_id')
+    if not isinstance(device_id, str) or not device_id:
+        raise PayloadError('missing device_id')
+
+    if 'records' in device_data:
+        records = device_data['records']
+        if not isinstance(records, list) or not records:
+            raise PayloadError('records must be a non-empty list')
+    elif 'gallons_used' in device_data:
+        records = [device_data]
+    else:
+        raise PayloadError('not a flow_data payload')
+
+    channels = device_data.get('channels')
+    if channels is not None and (not isinstance(channels, list) or
+                                 not all(isinstance(name, str) and name for name in channels)):
+        raise PayloadError('channels must be a list of names')
+
+    for index, record in enumerate(records):
+        if not isinstance(record, dict):
+            raise PayloadError('record %d is not an object' % index)
+        if not is_whole(record.get('timestamp')) or not 0 < record['timestamp'] < 2 ** 32:
+            raise PayloadError('record %d: bad timestamp' % index)
+        if not is_number(record.get('gallons_used')) or record['gallons_used'] < 0:
+            raise PayloadError('record %d: bad gallons_used' % index)
+        if 'hourly_average' in record and (not is_number(record['hourly_average']) or
+                                           record['hourly_average'] < 0):
+            raise PayloadError('record %d: bad hourly_average' % index)
+        if 'channel_gallons' in record:
+            values = record['channel_gallons']
+            if (not channels or not isinstance(values, list) or len(values) != len(channels) or
+                    not all(is_whole(value) and value >= 0 for value in values)):
+                raise PayloadError('record %d: channel_gallons does not match channels' % index)
+    return device_id, records, channels
+
+def build_item(device_id, record, sequence, channels=None):
+    # One DynamoDB item per hourly flow record. Records sharing a second are
+    # told apart by their order in the payload, so a redelivered payload
+    # produces the same keys and overwrites rather than duplicates.
+    timestamp = int(record['timestamp'])
+    item = {
+        'deviceId': device_id,
+        'recordKey': '%010d#%d' % (timestamp, sequence),
+        'timestamp': timestamp,
+        'sequence': sequence,
+        'gallonsUsed': Decimal(str(record['gallons_used']))
+    }
+    if 'hourly_average' in record:
+        item['hourlyAverage'] = Decimal(str(record['hourly_average']))
+    if channels and 'channel_gallons' in record:
+        item['channelGallons'] = {name: Decimal(str(value))
+                                  for name, value in zip(channels, record['channel_gallons'])}
+    return item
+
+def merge_records(records):
+    """Records sharing a second as one: volumes added up, the hourly average
+    of the last one in the payload."""
+    merged = {}
+    for record in records:
+        timestamp = int(record['timestamp'])
+        if timestamp not in merged:
+            merged[timestamp] = (dict(record), 1)
+            continue
+        total, count = merged[timestamp]
+        total['gallons_used'] = (Decimal(str(total['gallons_used'])) +
+                                 Decimal(str(record['gallons_used'])))
+        if 'hourly_average' in record:
+            total['hourly_average'] = record['hourly_average']
+        if 'channel_gallons' in record:
+            previous = total.get('channel_gallons') or [0] * len(record['channel_gallons'])
+            total['channel_gallons'] = [a + b for a, b in zip(previous, record['channel_gallons'])]
+        merged[timestamp] = (total, count + 1)
+    return list(merged.values())
+
+def build_items(device_id, records, channels=None, sort_key=None):
+    sort_key = sort_key or TABLE_SORT_KEY
+    if sort_key not in SORT_KEYS:
+        raise RuntimeError('TABLE_SORT_KEY must be one of %s' % ', '.join(SORT_KEYS))
+
+    items = []
+    if sort_key == 'timestamp':
+        for record, count in merge_records(records):
+            item = build_item(device_id, record, 0, channels)
+            if count > 1:
+                item['mergedRecords'] = count
+            items.append(item)
+        return items
+
+    seen = {}
+    for record in records:
+        timestamp = int(record['timestamp'])
+        sequence = seen.get(timestamp, 0)
+        seen[timestamp] = sequence + 1
+        items.append(build_item(device_id, record, sequence, channels))
+    return items
+
+def write_items(items, resource=None, sleep=time.sleep):
+    """BatchWriteItem in chunks of BATCH_WRITE_LIMIT, resending unprocessed
+    items with backoff. Returns the number of retried puts."""
+    global dynamodb
+    if resource is None:
+        if dynamodb is None:
+            import boto3
+            dynamodb = boto3.resource('dynamodb')
+        resource = dynamodb
+
+    retried = 0
+    for start in range(0, len(items), BATCH_WRITE_LIMIT):
+        requests = {TABLE_NAME: [{'PutRequest': {'Item': item}}
+                                 for item in items[start:start + BATCH_WRITE_LIMIT]]}
+        for attempt in range(MAX_WRITE_ATTEMPTS):
+            response = resource.batch_write_item(RequestItems=requests)
+            requests = response.get('UnprocessedItems') or {}
+            if not requests:
+                break
+            retried += len(requests.get(TABLE_NAME, []))
+            sleep(random.uniform(0, RETRY_BASE_SECONDS * 2 ** attempt))
+        if requests:
+            raise RuntimeError('%d items still unprocessed after %d attempts' %
+                               (len(requests.get(TABLE_NAME, [])), MAX_WRITE_ATTEMPTS))
+    return retried
+
+def response(status, body):
+    return {
+        'statusCode': status,
+        'headers': {
+            'Content-Type': 'application/json'
+        },
+        'body': json.dumps(body)
+    }
 
 def lambda_handler(event, context):
     print('Received event:', json.dumps(event))
@@ -13,42 +328,34 @@ def lambda_handler(event, context):
         body = json.loads(event['body'])
         print('Parsed body:', json.dumps(body))
         
-        # Extract the device data
-        device_data = json.loads(body['data'])
-        print('Device data:', json.dumps(device_data))
-        
-        # Prepare DynamoDB item
-        item = {
-            'deviceId': device_data['device_id'],
-            'timestamp': int(device_data['timestamp']),
-            'gallonsUsed': Decimal(str(device_data['gallons_used'])),
-            'signalStrength': int(device_data['signal_strength'])
-        }
-        
-        # Write to DynamoDB
-        table.put_item(Item=item)
-        print('Data saved to DynamoDB successfully')
+        # Extract and check the device data
+        device_data = parse_device_data(body['data'])
+        print('Device data:', json.dumps(device_data, default=str))
+        device_id, records, channels = validate_flow_data(device_data)
+    except (KeyError, TypeError, ValueError) as e:
+        # Malformed payloads fail the same way every time, so the webhook
+        # shouldn't retry them
+        print('Rejected payload:', str(e))
+        return response(400, {
+            'success': False,
+            'message': 'Invalid payload',
+            'error': str(e)
+        })
+    
+    try:
+        items = build_items(device_id, records, channels)
+        retried = write_items(items)
+        print('Saved %d records to DynamoDB successfully (%d puts retried)' % (len(items), retried))
         
-        return {
-            'statusCode': 200,
-            'headers': {
-                'Content-Type': 'application/json'
-            },
-            'body': json.dumps({
-                'success': True,
-                'message': 'Data saved successfully'
-            })
-        }
+        return response(200, {
+            'success': True,
+            'message': 'Data saved successfully',
+            'records': len(items)
+        })
     except Exception as e:
         print('Error processing data:', str(e))
-        return {
-            'statusCode': 500,
-            'headers': {
-                'Content-Type': 'application/json'
-            },
-            'body': json.dumps({
-                'success': False,
-                'message': 'Error processing data',
-                'error': str(e)
-            })
-        }
\ No newline at end of file
+        return response(500, {
+            'success': False,
+            'message': 'Error processing data',
+            'error': str(e)
+        })
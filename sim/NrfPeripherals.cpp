@@ -0,0 +1,332 @@
+// Emulation of the nRF52840 GPIOTE -> PPI -> TIMER chain used by the
+// hardware pulse counter. Pin edges from the harness raise GPIOTE events,
+// enabled PPI channels forward them to timer tasks, and the timer counts
+// without any CPU involvement.
+//
+// GPIOTE and PPI channels must be reserved through the nrfx allocators before
+// they are set up. The PPI allocator never hands out the channels the S140
+// SoftDevice reserves, and setting up a channel nobody reserved (or one the
+// SoftDevice owns) stops the run, since on the device it would corrupt
+// another user's configuration.
+
+#include "Particle.h"
+#include "SimControl.h"
+#include "nrf_gpio.h"
+#include "nrf_gpiote.h"
+#include "nrf_ppi.h"
+#include "nrf_timer.h"
+#include "nrfx_gpiote.h"
+#include "nrfx_ppi.h"
+#include "pinmap_hal.h"
+
+#include <cstdio>
+#include <cstdlib>
+
+NRF_TIMER_Type simNrfTimers[5] = {};
+
+namespace {
+
+const uint32_t GPIOTE_BASE = 0x40006000;
+const uint32_t GPIOTE_CHANNELS = 8;
+const uint32_t PPI_CHANNELS = 20;
+
+// NRF_SOC_SD_PPI_CHANNELS_SD_ENABLED_MSK for the S140 SoftDevice
+const uint32_t SOFTDEVICE_PPI_CHANNELS = (1UL << 17) | (1UL << 18) | (1UL << 19);
+
+struct GpioteChannel {
+  uint32_t pin;
+  nrf_gpiote_polarity_t polarity;
+  bool allocated;
+  bool configured;
+  bool enabled;
+};
+
+struct PpiChannel {
+  uint32_t eep;
+  uint32_t tep;
+  bool allocated;
+  bool enabled;
+};
+
+GpioteChannel gpioteChannels[GPIOTE_CHANNELS] = {};
+PpiChannel ppiChannels[PPI_CHANNELS] = {};
+hal_pin_info_t pinMap[TOTAL_PINS];
+uint64_t peripheralEventCount = 0;
+bool gpioteInitialized = true;  // Device OS brings the driver up before setup()
+
+void fault(const char* what, uint32_t channel) {
+  fflush(stdout);
+  fprintf(stderr, "peripheral fault: %s %lu\n", what, (unsigned long)channel);
+  exit(1);
+}
+
+void requireGpiote(uint32_t idx) {
+  if (idx >= GPIOTE_CHANNELS || !gpioteChannels[idx].allocated) {
+    fault("GPIOTE channel used without being allocated:", idx);
+  }
+}
+
+void requirePpi(uint32_t channel) {
+  if (channel >= PPI_CHANNELS || (SOFTDEVICE_PPI_CHANNELS & (1UL << channel))) {
+    fault("PPI channel reserved by the SoftDevice:", channel);
+  }
+  if (!ppiChannels[channel].allocated) {
+    fault("PPI channel used without being allocated:", channel);
+  }
+}
+
+// The GPIOTE channel an input pin was given, or GPIOTE_CHANNELS
+uint32_t gpioteChannelOf(uint32_t pin) {
+  for (uint32_t idx = 0; idx < GPIOTE_CHANNELS; idx++) {
+    if (gpioteChannels[idx].allocated && gpioteChannels[idx].pin == pin) {
+      return idx;
+    }
+  }
+  return GPIOTE_CHANNELS;
+}
+
+uint32_t taskAddress(NRF_TIMER_Type* timer, int task) {
+  return (uint32_t)(uintptr_t)&timer->TASKS[task];
+}
+
+// Run whichever timer task lives at the given (truncated) address
+void triggerTaskAt(uint32_t address) {
+  for (NRF_TIMER_Type& timer : simNrfTimers) {
+    for (int task = NRF_TIMER_TASK_START; task <= NRF_TIMER_TASK_CAPTURE5; task++) {
+      if (taskAddress(&timer, task) == address) {
+        nrf_timer_task_trigger(&timer, (nrf_timer_task_t)task);
+        return;
+      }
+    }
+  }
+}
+
+uint32_t widthMask(nrf_timer_bit_width_t width) {
+  switch (width) {
+    case NRF_TIMER_BIT_WIDTH_8:  return 0xFF;
+    case NRF_TIMER_BIT_WIDTH_16: return 0xFFFF;
+    case NRF_TIMER_BIT_WIDTH_24: return 0xFFFFFF;
+    default:                     return 0xFFFFFFFF;
+  }
+}
+
+} // namespace
+
+namespace sim {
+
+void peripheralEdge(pin_t pin) {
+  // Harness edges are falling edges on a port 0 pin
+  uint32_t nrfPin = NRF_GPIO_PIN_MAP(0, pin);
+  for (uint32_t idx = 0; idx < GPIOTE_CHANNELS; idx++) {
+    const GpioteChannel& channel = gpioteChannels[idx];
+    if (!channel.enabled || channel.pin != nrfPin || channel.polarity == NRF_GPIOTE_POLARITY_LOTOHI) {
+      continue;
+    }
+
+    uint32_t event = nrf_gpiote_event_addr_get(
+      (nrf_gpiote_events_t)(NRF_GPIOTE_EVENTS_IN_0 + idx * sizeof(uint32_t)));
+    for (const PpiChannel& ppi : ppiChannels) {
+      if (ppi.enabled && ppi.eep == event) {
+        peripheralEventCount++;
+        triggerTaskAt(ppi.tep);
+      }
+    }
+  }
+}
+
+uint64_t peripheralEvents() {
+  return peripheralEventCount;
+}
+
+} // namespace sim
+
+hal_pin_info_t* hal_pin_map(void) {
+  for (pin_t pin = 0; pin < TOTAL_PINS; pin++) {
+    pinMap[pin].gpio_port = 0;
+    pinMap[pin].gpio_pin = (uint8_t)pin;
+  }
+  return pinMap;
+}
+
+// TIMER
+void nrf_timer_task_trigger(NRF_TIMER_Type* p_reg, nrf_timer_task_t task) {
+  switch (task) {
+    case NRF_TIMER_TASK_START:
+      p_reg->running = true;
+      break;
+    case NRF_TIMER_TASK_STOP:
+    case NRF_TIMER_TASK_SHUTDOWN:
+      p_reg->running = false;
+      break;
+    case NRF_TIMER_TASK_CLEAR:
+      p_reg->counter = 0;
+      break;
+    case NRF_TIMER_TASK_COUNT:
+      // COUNT only has an effect in one of the counter modes
+      if (p_reg->running && p_reg->mode != NRF_TIMER_MODE_TIMER) {
+        p_reg->counter = (p_reg->counter + 1) & widthMask(p_reg->bitWidth);
+      }
+      break;
+    default:
+      p_reg->CC[task - NRF_TIMER_TASK_CAPTURE0] = p_reg->counter;
+      break;
+  }
+}
+
+uint32_t* nrf_timer_task_address_get(NRF_TIMER_Type* p_reg, nrf_timer_task_t task) {
+  return &p_reg->TASKS[task];
+}
+
+void nrf_timer_mode_set(NRF_TIMER_Type* p_reg, nrf_timer_mode_t mode) {
+  p_reg->mode = mode;
+}
+
+void nrf_timer_bit_width_set(NRF_TIMER_Type* p_reg, nrf_timer_bit_width_t bit_width) {
+  p_reg->bitWidth = bit_width;
+}
+
+uint32_t nrf_timer_cc_read(NRF_TIMER_Type* p_reg, nrf_timer_cc_channel_t cc_channel) {
+  return p_reg->CC[cc_channel];
+}
+
+// GPIOTE
+void nrf_gpiote_event_configure(uint32_t idx, uint32_t pin, nrf_gpiote_polarity_t polarity) {
+  requireGpiote(idx);
+  if (idx < GPIOTE_CHANNELS) {
+    gpioteChannels[idx].pin = pin;
+    gpioteChannels[idx].polarity = polarity;
+    gpioteChannels[idx].configured = true;
+  }
+}
+
+void nrf_gpiote_event_enable(uint32_t idx) {
+  requireGpiote(idx);
+  if (idx < GPIOTE_CHANNELS && gpioteChannels[idx].configured) {
+    gpioteChannels[idx].enabled = true;
+  }
+}
+
+void nrf_gpiote_event_disable(uint32_t idx) {
+  if (idx < GPIOTE_CHANNELS) {
+    gpioteChannels[idx].enabled = false;
+  }
+}
+
+uint32_t nrf_gpiote_event_addr_get(nrf_gpiote_events_t event) {
+  return GPIOTE_BASE + (uint32_t)event;
+}
+
+// PPI
+void nrf_ppi_channel_endpoint_setup(nrf_ppi_channel_t channel, uint32_t eep, uint32_t tep) {
+  requirePpi(channel);
+  if (channel < PPI_CHANNELS) {
+    ppiChannels[channel].eep = eep;
+    ppiChannels[channel].tep = tep;
+  }
+}
+
+void nrf_ppi_channel_enable(nrf_ppi_channel_t channel) {
+  requirePpi(channel);
+  if (channel < PPI_CHANNELS) {
+    ppiChannels[channel].enabled = true;
+  }
+}
+
+void nrf_ppi_channel_disable(nrf_ppi_channel_t channel) {
+  if (channel < PPI_CHANNELS) {
+    ppiChannels[channel].enabled = false;
+  }
+}
+
+// nrfx GPIOTE driver, high-accuracy inputs
+bool nrfx_gpiote_is_init(void) {
+  return gpioteInitialized;
+}
+
+nrfx_err_t nrfx_gpiote_init(void) {
+  if (gpioteInitialized) {
+    return NRFX_ERROR_INVALID_STATE;
+  }
+  gpioteInitialized = true;
+  return NRFX_SUCCESS;
+}
+
+nrfx_err_t nrfx_gpiote_in_init(nrfx_gpiote_pin_t pin, const nrfx_gpiote_in_config_t* p_config,
+                               nrfx_gpiote_evt_handler_t) {
+  if (!gpioteInitialized || gpioteChannelOf(pin) < GPIOTE_CHANNELS) {
+    return NRFX_ERROR_INVALID_STATE;
+  }
+  if (!p_config->hi_accuracy) {
+    return NRFX_ERROR_INVALID_PARAM;
+  }
+  for (uint32_t idx = 0; idx < GPIOTE_CHANNELS; idx++) {
+    GpioteChannel& channel = gpioteChannels[idx];
+    if (!channel.allocated) {
+      channel = GpioteChannel();
+      channel.allocated = true;
+      nrf_gpiote_event_configure(idx, pin, p_config->sense);
+      return NRFX_SUCCESS;
+    }
+  }
+  return NRFX_ERROR_NO_MEM;
+}
+
+void nrfx_gpiote_in_uninit(nrfx_gpiote_pin_t pin) {
+  uint32_t idx = gpioteChannelOf(pin);
+  if (idx < GPIOTE_CHANNELS) {
+    gpioteChannels[idx] = GpioteChannel();
+  }
+}
+
+void nrfx_gpiote_in_event_enable(nrfx_gpiote_pin_t pin, bool) {
+  uint32_t idx = gpioteChannelOf(pin);
+  if (idx >= GPIOTE_CHANNELS) {
+    fault("GPIOTE event enabled on a pin with no channel:", pin);
+  }
+  nrf_gpiote_event_enable(idx);
+}
+
+uint32_t nrfx_gpiote_in_event_addr_get(nrfx_gpiote_pin_t pin) {
+  uint32_t idx = gpioteChannelOf(pin);
+  if (idx >= GPIOTE_CHANNELS) {
+    fault("GPIOTE event address of a pin with no channel:", pin);
+  }
+  return nrf_gpiote_event_addr_get((nrf_gpiote_events_t)(NRF_GPIOTE_EVENTS_IN_0 + idx * sizeof(uint32_t)));
+}
+
+// nrfx PPI driver
+nrfx_err_t nrfx_ppi_channel_alloc(nrf_ppi_channel_t* p_channel) {
+  for (uint32_t channel = 0; channel < PPI_CHANNELS; channel++) {
+    if (!ppiChannels[channel].allocated && !(SOFTDEVICE_PPI_CHANNELS & (1UL << channel))) {
+      ppiChannels[channel] = PpiChannel();
+      ppiChannels[channel].allocated = true;
+      *p_channel = (nrf_ppi_channel_t)channel;
+      return NRFX_SUCCESS;
+    }
+  }
+  return NRFX_ERROR_NO_MEM;
+}
+
+nrfx_err_t nrfx_ppi_channel_free(nrf_ppi_channel_t channel) {
+  if (channel >= PPI_CHANNELS || !ppiChannels[channel].allocated) {
+    return NRFX_ERROR_INVALID_PARAM;
+  }
+  ppiChannels[channel] = PpiChannel();
+  return NRFX_SUCCESS;
+}
+
+nrfx_err_t nrfx_ppi_channel_assign(nrf_ppi_channel_t channel, uint32_t eep, uint32_t tep) {
+  if (channel >= PPI_CHANNELS || !ppiChannels[channel].allocated) {
+    return NRFX_ERROR_INVALID_STATE;
+  }
+  nrf_ppi_channel_endpoint_setup(channel, eep, tep);
+  return NRFX_SUCCESS;
+}
+
+nrfx_err_t nrfx_ppi_channel_enable(nrf_ppi_channel_t channel) {
+  if (channel >= PPI_CHANNELS || !ppiChannels[channel].allocated) {
+    return NRFX_ERROR_INVALID_STATE;
+  }
+  nrf_ppi_channel_enable(channel);
+  return NRFX_SUCCESS;
+}
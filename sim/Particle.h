@@ -0,0 +1,370 @@
+#pragma once
+
+// Host stand-in for the Device OS API surface used by the firmware in src/.
+// Only what the firmware actually touches is modelled. Time is virtual and
+// only moves when the harness (or delay()) advances it, see SimControl.h.
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdarg>
+#include <cmath>
+#include <ctime>
+#include <functional>
+#include <string>
+
+// The simulated device is a Boron (nRF52840); see the nrf_*.h stand-ins
+#define HAL_PLATFORM_NRF52840 1
+
+#define SIM_PRINTF_FORMAT(fmtIndex, argIndex) __attribute__((format(printf, fmtIndex, argIndex)))
+
+// Pins and GPIO
+typedef uint16_t pin_t;
+typedef uint32_t system_tick_t;
+
+enum PinMode { INPUT, OUTPUT, INPUT_PULLUP, INPUT_PULLDOWN };
+enum InterruptMode { CHANGE, RISING, FALLING };
+
+const pin_t D0 = 0, D1 = 1, D2 = 2, D3 = 3, D4 = 4, D5 = 5, D6 = 6, D7 = 7, D8 = 8;
+const pin_t A0 = 19, A1 = 18, A2 = 17, A3 = 16, A4 = 15, A5 = 14;
+const pin_t TOTAL_PINS = 20;
+
+#define HIGH 0x1
+#define LOW  0x0
+
+typedef void (*raw_interrupt_handler_t)(void);
+
+void pinMode(pin_t pin, PinMode mode);
+void digitalWrite(pin_t pin, uint8_t value);
+int32_t digitalRead(pin_t pin);
+bool attachInterrupt(pin_t pin, raw_interrupt_handler_t handler, InterruptMode mode,
+                     int8_t priority = -1, uint8_t subpriority = 0);
+void detachInterrupt(pin_t pin);
+void noInterrupts();
+void interrupts();
+
+// ATOMIC_BLOCK() { ... } masks interrupts for the enclosed statements and
+// restores the previous mask state on exit, like the Device OS macro.
+class SimAtomicSection {
+public:
+  SimAtomicSection();
+  ~SimAtomicSection();
+  bool active;
+
+private:
+  bool _wasMasked;
+};
+
+#define ATOMIC_BLOCK() for (SimAtomicSection _simAtomic; _simAtomic.active; _simAtomic.active = false)
+
+// Timing
+system_tick_t millis();
+uint32_t micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+// Wiring math helpers
+template<typename T>
+T constrain(T value, T low, T high) {
+  return value < low ? low : (value > high ? high : value);
+}
+
+// Minimal Wiring String
+class String {
+public:
+  String() {}
+  String(const char* str) : _str(str ? str : "") {}
+  String(const String& other) = default;
+  String& operator=(const String& other) = default;
+
+  const char* c_str() const { return _str.c_str(); }
+  unsigned int length() const { return (unsigned int)_str.length(); }
+  char charAt(unsigned int index) const { return index < _str.length() ? _str[index] : 0; }
+  String& operator+=(const char* str) { _str += str; return *this; }
+  String& operator+=(const String& str) { _str += str._str; return *this; }
+  bool equals(const char* str) const { return _str == str; }
+  long toInt() const { return atol(_str.c_str()); }
+
+private:
+  std::string _str;
+};
+
+// Serial ports. USB serial and Serial1 share one recording implementation.
+class SimSerial {
+public:
+  SimSerial(const char* name, size_t txBufferSize);
+
+  void begin(unsigned long baud = 9600);
+  void end();
+  bool isConnected() const { return true; }
+
+  size_t write(uint8_t c);
+  size_t write(const uint8_t* buffer, size_t size);
+  size_t write(const char* str);
+  size_t print(const char* str);
+  size_t println(const char* str);
+  size_t println();
+  size_t printf(const char* format, ...) SIM_PRINTF_FORMAT(2, 3);
+  size_t printlnf(const char* format, ...) SIM_PRINTF_FORMAT(2, 3);
+  int availableForWrite();
+  int available() { return 0; }
+  int read() { return -1; }
+  void flush() {}
+
+  const char* name() const { return _name; }
+  unsigned long baud() const { return _baud; }
+
+private:
+  const char* _name;
+  unsigned long _baud;
+  size_t _txBufferSize;   // 0 = never back-pressures (USB CDC)
+  double _txLevel;        // bytes still waiting in the TX FIFO
+  uint64_t _lastDrainUs;
+
+  void drainTx();
+};
+
+extern SimSerial Serial;
+extern SimSerial Serial1;
+
+// WITH_LOCK(Serial) { ... } holds a port for the enclosed statements, like the
+// Device OS macro; the simulation has a single thread, so there is no lock
+#define WITH_LOCK(object) for (bool _simLocked = true; _simLocked; _simLocked = false)
+
+// Logging
+enum LogLevel {
+  LOG_LEVEL_ALL = 1,
+  LOG_LEVEL_TRACE = 1,
+  LOG_LEVEL_INFO = 30,
+  LOG_LEVEL_WARN = 40,
+  LOG_LEVEL_ERROR = 50,
+  LOG_LEVEL_NONE = 70
+};
+
+class Logger {
+public:
+  void trace(const char* format, ...) const SIM_PRINTF_FORMAT(2, 3);
+  void info(const char* format, ...) const SIM_PRINTF_FORMAT(2, 3);
+  void warn(const char* format, ...) const SIM_PRINTF_FORMAT(2, 3);
+  void error(const char* format, ...) const SIM_PRINTF_FORMAT(2, 3);
+};
+
+extern Logger Log;
+
+class SerialLogHandler {
+public:
+  explicit SerialLogHandler(LogLevel level = LOG_LEVEL_INFO);
+};
+
+// Emulated EEPROM (4 KB on Gen 3 devices)
+class EEPROMClass {
+public:
+  static const size_t SIZE = 4096;
+
+  EEPROMClass();
+
+  uint8_t read(int address) const;
+  void write(int address, uint8_t value);
+  size_t length() const { return SIZE; }
+  void clear();
+  uint8_t* data() { return _data; }  // Harness access for saving between runs
+
+  template<typename T>
+  T& get(int address, T& value) const {
+    if (address >= 0 && address + sizeof(T) <= SIZE) {
+      memcpy(&value, &_data[address], sizeof(T));
+    }
+    return value;
+  }
+
+  template<typename T>
+  const T& put(int address, const T& value) {
+    if (address >= 0 && address + sizeof(T) <= SIZE) {
+      recordWrite(address, reinterpret_cast<const uint8_t*>(&value), sizeof(T));
+    }
+    return value;
+  }
+
+private:
+  uint8_t _data[SIZE];
+  void recordWrite(int address, const uint8_t* bytes, size_t size);
+};
+
+extern EEPROMClass EEPROM;
+
+// Wall clock. Becomes valid once a cloud time sync completes.
+class TimeClass {
+public:
+  static bool isValid();
+  static time_t now();
+  static int hour();
+  static int minute();
+  static int second();
+  static int day();
+  static int month();
+  static int year();
+  static void zone(float offset);
+};
+
+extern TimeClass Time;
+
+// Cloud
+enum PublishFlag { PUBLIC = 0, PRIVATE = 1, NO_ACK = 2, WITH_ACK = 8 };
+
+class CloudClass {
+public:
+  bool publish(const char* eventName, const char* eventData, PublishFlag flags = PUBLIC);
+  bool connected();
+  void connect();
+  void disconnect();
+  bool syncTime();
+  bool syncTimePending();
+  bool function(const char* name, int (*handler)(String));
+  void process();
+};
+
+extern CloudClass Particle;
+
+class CellularSignal {
+public:
+  explicit CellularSignal(float strength = 0.0f, float quality = 0.0f) :
+    _strength(strength), _quality(quality) {}
+  float getStrength() const { return _strength; }
+  float getQuality() const { return _quality; }
+
+private:
+  float _strength;
+  float _quality;
+};
+
+class CellularClass {
+public:
+  CellularSignal RSSI();
+  bool ready();
+};
+
+extern CellularClass Cellular;
+
+// System
+enum ResetReason {
+  RESET_REASON_NONE = 0,
+  RESET_REASON_UNKNOWN = 10,
+  RESET_REASON_PIN_RESET = 20,
+  RESET_REASON_POWER_MANAGEMENT = 30,
+  RESET_REASON_POWER_DOWN = 40,
+  RESET_REASON_POWER_BROWNOUT = 50,
+  RESET_REASON_WATCHDOG = 60,
+  RESET_REASON_UPDATE = 70,
+  RESET_REASON_UPDATE_ERROR = 80,
+  RESET_REASON_UPDATE_TIMEOUT = 90,
+  RESET_REASON_FACTORY_RESET = 100,
+  RESET_REASON_SAFE_MODE = 110,
+  RESET_REASON_DFU_MODE = 120,
+  RESET_REASON_PANIC = 130,
+  RESET_REASON_USER = 140
+};
+
+enum HAL_Feature { FEATURE_RESET_INFO = 1, FEATURE_RETAINED_MEMORY = 2 };
+
+// System events (subset)
+enum system_event_t : uint64_t {
+  reset_pending = 1ULL << 8,
+  reset = 1ULL << 9,
+  firmware_update = 1ULL << 10,
+};
+
+typedef void (*system_event_handler_t)(system_event_t event, int param);
+
+// Sleep (System.sleep() with a configuration object, Device OS 2.0 and later)
+enum class SystemSleepMode : uint8_t { NONE, STOP, ULTRA_LOW_POWER, HIBERNATE };
+enum class SystemSleepWakeupReason : uint16_t { UNKNOWN, BY_GPIO, BY_ADC, BY_DAC, BY_RTC, BY_LPCOMP,
+                                                BY_USART, BY_CAN, BY_NETWORK };
+
+class SystemSleepConfiguration {
+public:
+  SystemSleepConfiguration& mode(SystemSleepMode mode) { _mode = mode; return *this; }
+  SystemSleepConfiguration& gpio(pin_t pin, InterruptMode) {
+    if (_wakePinCount < MAX_WAKE_PINS) {
+      _wakePins[_wakePinCount++] = pin;
+    }
+    return *this;
+  }
+  SystemSleepConfiguration& duration(system_tick_t ms) { _durationMs = ms; return *this; }
+
+  SystemSleepMode sleepMode() const { return _mode; }
+  bool wakesOn(pin_t pin) const {
+    for (int i = 0; i < _wakePinCount; i++) {
+      if (_wakePins[i] == pin) {
+        return true;
+      }
+    }
+    return false;
+  }
+  system_tick_t durationMs() const { return _durationMs; }
+
+private:
+  SystemSleepMode _mode = SystemSleepMode::NONE;
+  static const int MAX_WAKE_PINS = 8;
+  pin_t _wakePins[MAX_WAKE_PINS] = {};
+  int _wakePinCount = 0;
+  system_tick_t _durationMs = 0;
+};
+
+class SystemSleepResult {
+public:
+  SystemSleepResult(SystemSleepWakeupReason reason = SystemSleepWakeupReason::UNKNOWN, pin_t pin = 0xFFFF) :
+    _reason(reason), _pin(pin) {}
+  SystemSleepWakeupReason wakeupReason() const { return _reason; }
+  pin_t wakeupPin() const { return _pin; }
+  int error() const { return 0; }
+
+private:
+  SystemSleepWakeupReason _reason;
+  pin_t _pin;
+};
+
+class SystemClass {
+public:
+  bool on(system_event_t events, system_event_handler_t handler);
+  int resetReason();
+  bool enableFeature(HAL_Feature feature);
+  void reset();
+  SystemSleepResult sleep(const SystemSleepConfiguration& config);
+  uint64_t millis();
+  uint32_t freeMemory();
+  bool waitCondition(std::function<bool()> condition, system_tick_t timeout);
+};
+
+extern SystemClass System;
+
+class ApplicationWatchdog {
+public:
+  ApplicationWatchdog(unsigned timeoutMs, std::function<void()> handler, unsigned stackSize = 512);
+  void checkin();
+
+private:
+  unsigned _timeoutMs;
+  std::function<void()> _handler;
+};
+
+// Application-level macros
+#define SIM_CONCAT_(a, b) a##b
+#define SIM_CONCAT(a, b) SIM_CONCAT_(a, b)
+
+// Retained RAM: the process never restarts, so these already survive System.reset().
+// They are gathered in one section so the harness can carry them into a later run.
+#define retained __attribute__((section("retained_user")))
+
+#define SYSTEM_MODE(mode)
+#define SYSTEM_THREAD(state)
+#define STARTUP(code) \
+  namespace { struct SIM_CONCAT(SimStartup_, __LINE__) { SIM_CONCAT(SimStartup_, __LINE__)() { code; } } \
+  SIM_CONCAT(simStartup_, __LINE__); }
+
+#define waitFor(condition, timeout) System.waitCondition([]{ return (condition)(); }, (timeout))
+
+// Entry points provided by the firmware
+void setup();
+void loop();
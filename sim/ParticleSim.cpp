@@ -0,0 +1,857 @@
+#include "Particle.h"
+#include "SimControl.h"
+#include "nrfx_gpiote.h"
+
+#include <map>
+
+namespace {
+
+struct SimState {
+  uint64_t nowUs = 0;
+  bool advancing = false;
+
+  std::multimap<uint64_t, std::function<void()>> actions;
+  std::vector<sim::EdgeSource*> edgeSources;
+
+  raw_interrupt_handler_t handlers[TOTAL_PINS] = {};
+  bool pendingInterrupt[TOTAL_PINS] = {};
+  bool interruptsMasked = false;
+  uint8_t pinLevel[TOTAL_PINS] = {};
+  uint64_t pinTransitions[TOTAL_PINS] = {};
+
+  bool sleeping = false;
+  const SystemSleepConfiguration* sleepConfig = nullptr;
+  pin_t wokenByPin = sim::NO_PIN;
+
+  bool linkUp = false;           // network coverage, set by the harness
+  bool cloudRequested = true;    // AUTOMATIC mode connects until told otherwise
+  bool cloudConnected = false;
+  bool connecting = false;
+  uint32_t connectGeneration = 0;
+  uint32_t reconnectLatencyMs = 15000;
+  uint64_t connectedSinceUs = 0;
+  uint64_t connectedUsTotal = 0;
+  bool timeValid = false;
+  bool syncPending = false;
+  float signalStrength = 60.0f;
+  uint32_t syncLatencyMs = 1500;
+  uint32_t publishLatencyMs = 500;
+  time_t epochBase = 1735689600; // 2025-01-01 00:00:00 UTC
+  float zoneHours = 0.0f;
+  int resetReason = RESET_REASON_POWER_DOWN;
+  LogLevel logLevel = LOG_LEVEL_NONE;
+  std::vector<std::pair<system_event_t, system_event_handler_t>> systemHandlers;
+  std::map<std::string, int (*)(String)> cloudFunctions;
+
+  uint64_t watchdogLastCheckinUs = 0;
+  unsigned watchdogTimeoutMs = 0;
+
+  FILE* usbEcho = nullptr;
+  std::string serial1Pending;
+  std::function<void(uint8_t)> serial1Tap;
+  std::vector<sim::SerialLine> serial1Lines;
+  std::vector<sim::PublishRecord> publishes;
+  std::vector<uint32_t> eepromCellWrites = std::vector<uint32_t>(EEPROMClass::SIZE, 0);
+  uint64_t eepromPowerCutPuts = 0;  // 0 = never
+  bool poweredOff = false;
+
+  sim::Stats stats = {};
+};
+
+SimState& state() {
+  static SimState s;
+  return s;
+}
+
+// Bounds of the retained section, provided by the linker
+extern "C" uint8_t __start_retained_user[] __attribute__((weak));
+extern "C" uint8_t __stop_retained_user[] __attribute__((weak));
+
+uint8_t* retainedStart() {
+  return __start_retained_user;
+}
+
+size_t retainedSize() {
+  return __start_retained_user ? (size_t)(__stop_retained_user - __start_retained_user) : 0;
+}
+
+// A missing or wrong-sized image leaves memory as it is
+bool readImage(const char* path, uint8_t* data, size_t size) {
+  FILE* file = fopen(path, "rb");
+  if (!file) {
+    return false;
+  }
+  std::vector<uint8_t> image(size + 1);
+  bool ok = fread(image.data(), 1, image.size(), file) == size;
+  fclose(file);
+  if (ok) {
+    memcpy(data, image.data(), size);
+  }
+  return ok;
+}
+
+bool writeImage(const char* path, const uint8_t* data, size_t size) {
+  FILE* file = fopen(path, "wb");
+  if (!file) {
+    return false;
+  }
+  bool ok = fwrite(data, 1, size, file) == size;
+  return fclose(file) == 0 && ok;
+}
+
+void requestTimeSync() {
+  SimState& s = state();
+  s.syncPending = true;
+  s.actions.emplace(s.nowUs + (uint64_t)s.syncLatencyMs * 1000, [] {
+    state().syncPending = false;
+    if (state().cloudConnected) {
+      state().timeValid = true;
+    }
+  });
+}
+
+void setSession(bool connected) {
+  SimState& s = state();
+  s.connecting = false;
+  s.connectGeneration++;  // Cancels a connect still in progress
+  if (connected == s.cloudConnected) {
+    return;
+  }
+  s.cloudConnected = connected;
+  if (connected) {
+    s.connectedSinceUs = s.nowUs;
+    s.stats.cloudConnects++;
+    // Device OS requests a time sync as part of every cloud handshake
+    requestTimeSync();
+  } else {
+    s.connectedUsTotal += s.nowUs - s.connectedSinceUs;
+  }
+}
+
+// Power the modem up and handshake, unless already connected or connecting
+void beginConnect(uint32_t latencyMs) {
+  SimState& s = state();
+  if (s.cloudConnected || s.connecting || !s.linkUp) {
+    return;
+  }
+  s.connecting = true;
+  uint32_t generation = ++s.connectGeneration;
+  s.actions.emplace(s.nowUs + (uint64_t)latencyMs * 1000, [generation] {
+    SimState& s = state();
+    if (generation != s.connectGeneration) {
+      return;
+    }
+    s.connecting = false;
+    if (s.linkUp && s.cloudRequested) {
+      setSession(true);
+    }
+  });
+}
+
+void serialSink(SimSerial* port, const uint8_t* bytes, size_t size) {
+  SimState& s = state();
+  if (port == &Serial) {
+    s.stats.usbSerialBytes += size;
+    if (s.usbEcho) {
+      fwrite(bytes, 1, size, s.usbEcho);
+    }
+    return;
+  }
+
+  s.stats.serial1Bytes += size;
+  for (size_t i = 0; i < size; i++) {
+    if (s.serial1Tap) {
+      s.serial1Tap(bytes[i]);
+    }
+    if (bytes[i] == '\n') {
+      s.serial1Lines.push_back({s.nowUs, s.serial1Pending});
+      s.serial1Pending.clear();
+    } else if (bytes[i] != '\r') {
+      s.serial1Pending.push_back((char)bytes[i]);
+    }
+  }
+}
+
+void logLine(LogLevel level, const char* levelName, const char* format, va_list args) {
+  if (level < state().logLevel) {
+    return;
+  }
+  char message[512];
+  vsnprintf(message, sizeof(message), format, args);
+  Serial.printlnf("%010lu [app] %s: %s", (unsigned long)millis(), levelName, message);
+}
+
+} // namespace
+
+// Virtual clock and event dispatch
+namespace sim {
+
+uint64_t nowUs() {
+  return state().nowUs;
+}
+
+void advanceTo(uint64_t timeUs) {
+  SimState& s = state();
+  if (timeUs <= s.nowUs) {
+    return;
+  }
+  if (s.advancing) {
+    // Re-entrant delay() from an action; just move the clock
+    s.nowUs = timeUs;
+    return;
+  }
+  s.advancing = true;
+
+  while (true) {
+    EdgeSource* nextSource = nullptr;
+    uint64_t nextTime = timeUs + 1;
+    for (EdgeSource* source : s.edgeSources) {
+      uint64_t edge = source->nextEdgeUs();
+      if (edge <= timeUs && edge < nextTime) {
+        nextTime = edge;
+        nextSource = source;
+      }
+    }
+
+    auto action = s.actions.begin();
+    if (action != s.actions.end() && action->first <= timeUs && action->first <= nextTime) {
+      if (action->first > s.nowUs) {
+        s.nowUs = action->first;
+      }
+      std::function<void()> run = action->second;
+      s.actions.erase(action);
+      run();
+      continue;
+    }
+
+    if (!nextSource) {
+      break;
+    }
+    if (nextTime > s.nowUs) {
+      s.nowUs = nextTime;
+    }
+    if (s.sleeping && s.sleepConfig && s.sleepConfig->wakesOn(nextSource->sensePin())) {
+      // The edge wakes the CPU through the pin's sense logic; no interrupt
+      // or counter sees it, and time stops here for System.sleep()
+      nextSource->absorbEdge();
+      s.stats.edgesFired++;
+      s.stats.sleepWakeEdges++;
+      s.wokenByPin = nextSource->sensePin();
+      s.sleeping = false;
+      s.advancing = false;
+      return;
+    }
+    nextSource->consumeEdge();
+    s.stats.edgesFired++;
+    if (nextSource->pin() != NO_PIN) {
+      triggerInterrupt(nextSource->pin());
+    }
+  }
+
+  s.nowUs = timeUs;
+  s.advancing = false;
+}
+
+void advanceUs(uint64_t us) {
+  advanceTo(state().nowUs + us);
+}
+
+void schedule(uint64_t timeUs, std::function<void()> action) {
+  state().actions.emplace(timeUs, action);
+}
+
+void addEdgeSource(EdgeSource* source) {
+  state().edgeSources.push_back(source);
+}
+
+void triggerInterrupt(pin_t pin) {
+  SimState& s = state();
+  if (pin >= TOTAL_PINS) {
+    return;
+  }
+  // GPIOTE sees the edge regardless of whether the CPU takes an interrupt
+  peripheralEdge(pin);
+  if (!s.handlers[pin]) {
+    return;
+  }
+  if (s.interruptsMasked) {
+    // The GPIOTE event latches once; further edges while masked are lost
+    if (s.pendingInterrupt[pin]) {
+      s.stats.edgesLost++;
+    } else {
+      s.pendingInterrupt[pin] = true;
+      s.stats.edgesDeferred++;
+    }
+    return;
+  }
+  s.stats.interruptsServiced++;
+  s.handlers[pin]();
+}
+
+uint64_t pinTransitions(pin_t pin) {
+  return pin < TOTAL_PINS ? state().pinTransitions[pin] : 0;
+}
+
+void setCloudConnected(bool connected) {
+  SimState& s = state();
+  s.linkUp = connected;
+  if (!connected) {
+    setSession(false);
+  } else if (s.cloudRequested) {
+    // The modem is already up and searching, so the session comes back at once
+    beginConnect(0);
+  }
+}
+
+void setReconnectLatencyMs(uint32_t ms) {
+  state().reconnectLatencyMs = ms;
+}
+
+uint64_t cloudConnectedUs() {
+  SimState& s = state();
+  return s.connectedUsTotal + (s.cloudConnected ? s.nowUs - s.connectedSinceUs : 0);
+}
+
+void setSignalStrength(float percent) {
+  state().signalStrength = percent;
+}
+
+void setSyncLatencyMs(uint32_t ms) {
+  state().syncLatencyMs = ms;
+}
+
+void setPublishLatencyMs(uint32_t ms) {
+  state().publishLatencyMs = ms;
+}
+
+void setEpochBase(time_t epoch) {
+  state().epochBase = epoch;
+}
+
+void setResetReason(int reason) {
+  state().resetReason = reason;
+}
+
+void setUsbSerialEcho(FILE* file) {
+  state().usbEcho = file;
+}
+
+void setSerial1Tap(std::function<void(uint8_t)> tap) {
+  state().serial1Tap = tap;
+}
+
+bool loadRetained(const char* path) {
+  return readImage(path, retainedStart(), retainedSize());
+}
+
+bool saveRetained(const char* path) {
+  return writeImage(path, retainedStart(), retainedSize());
+}
+
+bool loadEeprom(const char* path) {
+  return readImage(path, EEPROM.data(), EEPROMClass::SIZE);
+}
+
+bool saveEeprom(const char* path) {
+  return writeImage(path, EEPROM.data(), EEPROMClass::SIZE);
+}
+
+int callFunction(const char* name, const char* argument) {
+  SimState& s = state();
+  auto match = s.cloudFunctions.find(name);
+  if (match == s.cloudFunctions.end()) {
+    return -1;
+  }
+  return match->second(String(argument));
+}
+
+const std::vector<PublishRecord>& publishes() {
+  return state().publishes;
+}
+
+const std::vector<SerialLine>& serial1Lines() {
+  return state().serial1Lines;
+}
+
+const Stats& stats() {
+  return state().stats;
+}
+
+void setEepromPowerCut(uint64_t puts) {
+  state().eepromPowerCutPuts = puts;
+}
+
+bool poweredOff() {
+  return state().poweredOff;
+}
+
+uint32_t eepromCellWrites(int address) {
+  if (address < 0 || address >= (int)EEPROMClass::SIZE) {
+    return 0;
+  }
+  return state().eepromCellWrites[address];
+}
+
+} // namespace sim
+
+// GPIO and interrupts
+void pinMode(pin_t pin, PinMode mode) {
+  if (pin < TOTAL_PINS && (mode == INPUT_PULLUP)) {
+    state().pinLevel[pin] = HIGH;
+  }
+}
+
+void digitalWrite(pin_t pin, uint8_t value) {
+  SimState& s = state();
+  if (pin >= TOTAL_PINS) {
+    return;
+  }
+  uint8_t level = value ? HIGH : LOW;
+  if (s.pinLevel[pin] != level) {
+    s.pinTransitions[pin]++;
+  }
+  s.pinLevel[pin] = level;
+}
+
+int32_t digitalRead(pin_t pin) {
+  return pin < TOTAL_PINS ? state().pinLevel[pin] : LOW;
+}
+
+bool attachInterrupt(pin_t pin, raw_interrupt_handler_t handler, InterruptMode, int8_t, uint8_t) {
+  if (pin >= TOTAL_PINS) {
+    return false;
+  }
+  // Device OS takes a GPIOTE channel for the pin from the nrfx driver, the
+  // same pool the hardware pulse counter draws on
+  if (!state().handlers[pin]) {
+    nrfx_gpiote_in_config_t config = NRFX_GPIOTE_CONFIG_IN_SENSE_HITOLO(true);
+    if (nrfx_gpiote_in_init(NRF_GPIO_PIN_MAP(0, pin), &config, nullptr) != NRFX_SUCCESS) {
+      return false;
+    }
+  }
+  state().handlers[pin] = handler;
+  return true;
+}
+
+void detachInterrupt(pin_t pin) {
+  if (pin < TOTAL_PINS && state().handlers[pin]) {
+    nrfx_gpiote_in_uninit(NRF_GPIO_PIN_MAP(0, pin));
+    state().handlers[pin] = nullptr;
+  }
+}
+
+void noInterrupts() {
+  state().interruptsMasked = true;
+}
+
+void interrupts() {
+  SimState& s = state();
+  s.interruptsMasked = false;
+  for (pin_t pin = 0; pin < TOTAL_PINS; pin++) {
+    if (s.pendingInterrupt[pin]) {
+      s.pendingInterrupt[pin] = false;
+      if (s.handlers[pin]) {
+        s.stats.interruptsServiced++;
+        s.handlers[pin]();
+      }
+    }
+  }
+}
+
+SimAtomicSection::SimAtomicSection() :
+  active(true),
+  _wasMasked(state().interruptsMasked)
+{
+  noInterrupts();
+}
+
+SimAtomicSection::~SimAtomicSection() {
+  if (!_wasMasked) {
+    interrupts();
+  }
+}
+
+// Timing
+system_tick_t millis() {
+  return (system_tick_t)(state().nowUs / 1000);
+}
+
+uint32_t micros() {
+  return (uint32_t)state().nowUs;
+}
+
+void delay(unsigned long ms) {
+  state().stats.delayUs += (uint64_t)ms * 1000;
+  sim::advanceUs((uint64_t)ms * 1000);
+}
+
+void delayMicroseconds(unsigned int us) {
+  sim::advanceUs(us);
+}
+
+// Serial ports
+SimSerial Serial("Serial", 0);
+SimSerial Serial1("Serial1", 64);
+
+SimSerial::SimSerial(const char* name, size_t txBufferSize) :
+  _name(name),
+  _baud(9600),
+  _txBufferSize(txBufferSize),
+  _txLevel(0.0),
+  _lastDrainUs(0)
+{
+}
+
+void SimSerial::begin(unsigned long baud) {
+  _baud = baud;
+  _txLevel = 0.0;
+  _lastDrainUs = sim::nowUs();
+}
+
+void SimSerial::end() {
+}
+
+void SimSerial::drainTx() {
+  uint64_t now = sim::nowUs();
+  double bytesPerUs = _baud / 10.0 / 1000000.0; // 8N1 framing
+  _txLevel -= (now - _lastDrainUs) * bytesPerUs;
+  if (_txLevel < 0.0) {
+    _txLevel = 0.0;
+  }
+  _lastDrainUs = now;
+}
+
+int SimSerial::availableForWrite() {
+  if (_txBufferSize == 0) {
+    return 64;
+  }
+  drainTx();
+  return (int)(_txBufferSize - (size_t)ceil(_txLevel));
+}
+
+size_t SimSerial::write(uint8_t c) {
+  if (_txBufferSize > 0) {
+    drainTx();
+    if (_txLevel + 1.0 > _txBufferSize) {
+      // Blocking write: wait for the FIFO to make room, as HAL_USART_Write_Data does
+      double waitUs = (_txLevel + 1.0 - _txBufferSize) * 10.0 * 1000000.0 / _baud;
+      uint64_t blockedUs = (uint64_t)ceil(waitUs);
+      state().stats.serial1BlockedUs += blockedUs;
+      sim::advanceUs(blockedUs);
+      drainTx();
+    }
+    _txLevel += 1.0;
+  }
+  serialSink(this, &c, 1);
+  return 1;
+}
+
+size_t SimSerial::write(const uint8_t* buffer, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    write(buffer[i]);
+  }
+  return size;
+}
+
+size_t SimSerial::write(const char* str) {
+  return write(reinterpret_cast<const uint8_t*>(str), strlen(str));
+}
+
+size_t SimSerial::print(const char* str) {
+  return write(str);
+}
+
+size_t SimSerial::println(const char* str) {
+  return write(str) + println();
+}
+
+size_t SimSerial::println() {
+  return write("\r\n");
+}
+
+size_t SimSerial::printf(const char* format, ...) {
+  char buffer[512];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(buffer, sizeof(buffer), format, args);
+  va_end(args);
+  return write(buffer);
+}
+
+size_t SimSerial::printlnf(const char* format, ...) {
+  char buffer[512];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(buffer, sizeof(buffer), format, args);
+  va_end(args);
+  return write(buffer) + println();
+}
+
+// Logging
+Logger Log;
+
+void Logger::trace(const char* format, ...) const {
+  va_list args;
+  va_start(args, format);
+  logLine(LOG_LEVEL_TRACE, "TRACE", format, args);
+  va_end(args);
+}
+
+void Logger::info(const char* format, ...) const {
+  va_list args;
+  va_start(args, format);
+  logLine(LOG_LEVEL_INFO, "INFO", format, args);
+  va_end(args);
+}
+
+void Logger::warn(const char* format, ...) const {
+  va_list args;
+  va_start(args, format);
+  logLine(LOG_LEVEL_WARN, "WARN", format, args);
+  va_end(args);
+}
+
+void Logger::error(const char* format, ...) const {
+  va_list args;
+  va_start(args, format);
+  logLine(LOG_LEVEL_ERROR, "ERROR", format, args);
+  va_end(args);
+}
+
+SerialLogHandler::SerialLogHandler(LogLevel level) {
+  state().logLevel = level;
+}
+
+// EEPROM
+EEPROMClass EEPROM;
+
+EEPROMClass::EEPROMClass() {
+  clear();
+}
+
+uint8_t EEPROMClass::read(int address) const {
+  return (address >= 0 && address < (int)SIZE) ? _data[address] : 0xFF;
+}
+
+void EEPROMClass::write(int address, uint8_t value) {
+  if (address >= 0 && address < (int)SIZE) {
+    recordWrite(address, &value, 1);
+  }
+}
+
+void EEPROMClass::clear() {
+  memset(_data, 0xFF, sizeof(_data));
+}
+
+void EEPROMClass::recordWrite(int address, const uint8_t* bytes, size_t size) {
+  SimState& s = state();
+  if (s.poweredOff) {
+    return;
+  }
+  s.stats.eepromPuts++;
+  if (s.stats.eepromPuts == s.eepromPowerCutPuts) {
+    // Power fails part way through this write
+    s.poweredOff = true;
+    size /= 2;
+  }
+  s.stats.eepromBytesWritten += size;
+  for (size_t i = 0; i < size; i++) {
+    if (_data[address + i] != bytes[i]) {
+      // The flash emulation only rewrites bytes whose value changes
+      _data[address + i] = bytes[i];
+      s.stats.eepromBytesChanged++;
+      s.eepromCellWrites[address + i]++;
+    }
+  }
+}
+
+// Wall clock
+TimeClass Time;
+
+bool TimeClass::isValid() {
+  return state().timeValid;
+}
+
+time_t TimeClass::now() {
+  SimState& s = state();
+  time_t uptime = (time_t)(s.nowUs / 1000000);
+  return s.timeValid ? s.epochBase + uptime : uptime;
+}
+
+namespace {
+struct tm localTime() {
+  time_t t = Time.now() + (time_t)(state().zoneHours * 3600);
+  struct tm result;
+  gmtime_r(&t, &result);
+  return result;
+}
+} // namespace
+
+int TimeClass::hour() { return localTime().tm_hour; }
+int TimeClass::minute() { return localTime().tm_min; }
+int TimeClass::second() { return localTime().tm_sec; }
+int TimeClass::day() { return localTime().tm_mday; }
+int TimeClass::month() { return localTime().tm_mon + 1; }
+int TimeClass::year() { return localTime().tm_year + 1900; }
+
+void TimeClass::zone(float offset) {
+  state().zoneHours = offset;
+}
+
+// Cloud
+CloudClass Particle;
+
+bool CloudClass::publish(const char* eventName, const char* eventData, PublishFlag) {
+  SimState& s = state();
+  bool delivered = s.cloudConnected;
+  s.publishes.push_back({s.nowUs, eventName, eventData ? eventData : "", delivered});
+  if (delivered) {
+    // Acknowledged publishes block the calling thread for a cloud round trip
+    sim::advanceUs((uint64_t)s.publishLatencyMs * 1000);
+  }
+  return delivered;
+}
+
+bool CloudClass::connected() {
+  return state().cloudConnected;
+}
+
+void CloudClass::connect() {
+  SimState& s = state();
+  s.cloudRequested = true;
+  beginConnect(s.reconnectLatencyMs);
+}
+
+void CloudClass::disconnect() {
+  state().cloudRequested = false;
+  setSession(false);
+}
+
+bool CloudClass::syncTime() {
+  if (!state().cloudConnected) {
+    return false;
+  }
+  requestTimeSync();
+  return true;
+}
+
+bool CloudClass::syncTimePending() {
+  return state().syncPending;
+}
+
+bool CloudClass::function(const char* name, int (*handler)(String)) {
+  state().cloudFunctions[name] = handler;
+  return true;
+}
+
+void CloudClass::process() {
+}
+
+CellularClass Cellular;
+
+CellularSignal CellularClass::RSSI() {
+  SimState& s = state();
+  return CellularSignal(s.cloudConnected ? s.signalStrength : 0.0f, s.signalStrength);
+}
+
+bool CellularClass::ready() {
+  return state().cloudConnected;
+}
+
+// System
+SystemClass System;
+
+int SystemClass::resetReason() {
+  return state().resetReason;
+}
+
+bool SystemClass::enableFeature(HAL_Feature) {
+  return true;
+}
+
+bool SystemClass::on(system_event_t events, system_event_handler_t handler) {
+  state().systemHandlers.emplace_back(events, handler);
+  return true;
+}
+
+void SystemClass::reset() {
+  // Device OS notifies subscribers before restarting
+  for (auto& entry : state().systemHandlers) {
+    if (entry.first & ::reset) {
+      entry.second(::reset, 0);
+    }
+  }
+  fprintf(stderr, "sim: System.reset() requested at %llu us\n", (unsigned long long)state().nowUs);
+}
+
+SystemSleepResult SystemClass::sleep(const SystemSleepConfiguration& config) {
+  SimState& s = state();
+  uint64_t start = s.nowUs;
+  uint64_t durationUs = (uint64_t)(config.durationMs() > 0 ? config.durationMs() : 86400000) * 1000;
+
+  // Without a network wake source the modem is powered down for the sleep
+  setSession(false);
+  s.sleeping = true;
+  s.sleepConfig = &config;
+  sim::advanceTo(start + durationUs);
+  bool byPin = !s.sleeping;
+  s.sleeping = false;
+  s.sleepConfig = nullptr;
+
+  s.stats.sleeps++;
+  s.stats.sleepUs += s.nowUs - start;
+  if (s.cloudRequested) {
+    // AUTOMATIC mode reconnects after waking
+    beginConnect(s.reconnectLatencyMs);
+  }
+  if (byPin) {
+    return SystemSleepResult(SystemSleepWakeupReason::BY_GPIO, s.wokenByPin);
+  }
+  return SystemSleepResult(SystemSleepWakeupReason::BY_RTC);
+}
+
+uint64_t SystemClass::millis() {
+  return state().nowUs / 1000;
+}
+
+uint32_t SystemClass::freeMemory() {
+  return 80 * 1024;
+}
+
+bool SystemClass::waitCondition(std::function<bool()> condition, system_tick_t timeout) {
+  uint64_t start = sim::nowUs();
+  while (!condition()) {
+    if (sim::nowUs() - start >= (uint64_t)timeout * 1000) {
+      return false;
+    }
+    Particle.process();
+    sim::advanceUs(1000);
+  }
+  return true;
+}
+
+ApplicationWatchdog::ApplicationWatchdog(unsigned timeoutMs, std::function<void()> handler, unsigned) :
+  _timeoutMs(timeoutMs),
+  _handler(handler)
+{
+  SimState& s = state();
+  s.watchdogTimeoutMs = timeoutMs;
+  s.watchdogLastCheckinUs = s.nowUs;
+}
+
+void ApplicationWatchdog::checkin() {
+  SimState& s = state();
+  uint64_t gap = s.nowUs - s.watchdogLastCheckinUs;
+  s.stats.watchdogCheckins++;
+  if (gap > s.stats.watchdogMaxGapUs) {
+    s.stats.watchdogMaxGapUs = gap;
+  }
+  if (gap > (uint64_t)_timeoutMs * 1000) {
+    // On hardware this is a reset; the harness counts it and keeps going
+    s.stats.watchdogExpirations++;
+    if (_handler) {
+      _handler();
+    }
+  }
+  s.watchdogLastCheckinUs = s.nowUs;
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+// Harness-side controls for the host simulation: virtual clock, pin edge
+// sources, cloud/modem behaviour and the recording sinks behind Serial1,
+// USB serial, EEPROM and Particle.publish().
+
+#include "Particle.h"
+#include <vector>
+
+namespace sim {
+
+const pin_t NO_PIN = 0xFFFF;
+
+// Anything that produces edges on a pin along the virtual timeline
+class EdgeSource {
+public:
+  virtual ~EdgeSource() {}
+  // Pin the edge is delivered to, or NO_PIN if consumeEdge() delivers it itself
+  virtual pin_t pin() const = 0;
+  // Pin the edge physically appears on, for waking the CPU from sleep
+  virtual pin_t sensePin() const { return pin(); }
+  // Time of the next edge, or NO_EDGE when exhausted
+  virtual uint64_t nextEdgeUs() const = 0;
+  virtual void consumeEdge() = 0;
+  // Consume the next edge without delivering it (it woke the CPU instead)
+  virtual void absorbEdge() = 0;
+
+  static const uint64_t NO_EDGE = UINT64_MAX;
+};
+
+struct PublishRecord {
+  uint64_t timeUs;
+  std::string name;
+  std::string data;
+  bool delivered;
+};
+
+struct SerialLine {
+  uint64_t timeUs;
+  std::string text;
+};
+
+struct Stats {
+  uint64_t edgesFired;
+  uint64_t edgesDeferred;        // edges that arrived while interrupts were masked
+  uint64_t edgesLost;            // edges merged into an already-pending interrupt
+  uint64_t interruptsServiced;   // pin interrupt handlers run on the CPU
+  uint64_t eepromPuts;
+  uint64_t eepromBytesWritten;
+  uint64_t eepromBytesChanged;
+  uint64_t watchdogCheckins;
+  uint64_t watchdogMaxGapUs;
+  uint64_t watchdogExpirations;
+  uint64_t usbSerialBytes;
+  uint64_t serial1Bytes;
+  uint64_t serial1BlockedUs;     // time writers spent waiting on a full TX FIFO
+  uint64_t delayUs;              // time spent in delay(), i.e. deliberately idle
+  uint64_t sleeps;               // System.sleep() calls
+  uint64_t sleepUs;              // time spent in System.sleep()
+  uint64_t sleepWakeEdges;       // edges that ended a sleep instead of being counted
+  uint64_t cloudConnects;        // cloud sessions established
+};
+
+// Virtual clock
+uint64_t nowUs();
+void advanceUs(uint64_t us);
+void advanceTo(uint64_t timeUs);
+
+// Run an action when the virtual clock reaches timeUs
+void schedule(uint64_t timeUs, std::function<void()> action);
+
+// Pin edges
+void addEdgeSource(EdgeSource* source);
+void triggerInterrupt(pin_t pin);
+
+// nRF peripheral stand-ins (NrfPeripherals.cpp)
+void peripheralEdge(pin_t pin);
+uint64_t peripheralEvents();     // edges routed through GPIOTE/PPI without the CPU
+uint64_t pinTransitions(pin_t pin);
+
+// Cloud and modem model. setCloudConnected() is network coverage; the
+// firmware's Particle.connect()/disconnect() decide whether it is used.
+void setCloudConnected(bool connected);
+void setReconnectLatencyMs(uint32_t ms);
+uint64_t cloudConnectedUs();     // total time with a cloud session up
+void setSignalStrength(float percent);
+void setSyncLatencyMs(uint32_t ms);
+void setPublishLatencyMs(uint32_t ms);
+void setEpochBase(time_t epoch);
+void setResetReason(int reason);
+
+// Call a cloud function the firmware registered, as the console would;
+// returns its result, or -1 if no such function exists
+int callFunction(const char* name, const char* argument);
+
+// Device state kept between runs (see --flash-dir): retained RAM survives a
+// warm reset, EEPROM survives anything. Load before setup(), save at exit.
+bool loadRetained(const char* path);
+bool saveRetained(const char* path);
+bool loadEeprom(const char* path);
+bool saveEeprom(const char* path);
+
+// Cut the power during the Nth EEPROM put: it writes only its first half and
+// nothing reaches EEPROM after it. The driver stops once poweredOff().
+void setEepromPowerCut(uint64_t puts);
+bool poweredOff();
+
+// Sinks
+void setUsbSerialEcho(FILE* file);
+void setSerial1Tap(std::function<void(uint8_t)> tap);  // Sees every raw Serial1 byte
+const std::vector<PublishRecord>& publishes();
+const std::vector<SerialLine>& serial1Lines();
+const Stats& stats();
+uint32_t eepromCellWrites(int address);
+
+} // namespace sim
@@ -0,0 +1,51 @@
+#include "SimulatedPulseSource.h"
+
+SimulatedPulseSource::SimulatedPulseSource(int) :
+  _started(false),
+  _pulseCount(0),
+  _pulseDetected(false)
+{
+}
+
+void SimulatedPulseSource::begin() {
+  _started = true;
+}
+
+unsigned long SimulatedPulseSource::readPulseCount() const {
+  return _pulseCount;
+}
+
+bool SimulatedPulseSource::hasTimestamps() const {
+  return true;
+}
+
+size_t SimulatedPulseSource::drainTimestamps(uint32_t* out, size_t maxCount) {
+  return _pulseRing.drain(out, maxCount);
+}
+
+bool SimulatedPulseSource::takePulseDetected() {
+  bool detected = _pulseDetected;
+  _pulseDetected = false;
+  return detected;
+}
+
+void SimulatedPulseSource::creditWakePulse() {
+  inject();
+}
+
+unsigned long SimulatedPulseSource::getOverflowCount() const {
+  return _pulseRing.getOverflowCount();
+}
+
+const char* SimulatedPulseSource::getName() const {
+  return "simulated";
+}
+
+void SimulatedPulseSource::inject() {
+  if (!_started) {
+    return;
+  }
+  _pulseCount++;
+  _pulseRing.push(micros());
+  _pulseDetected = true;
+}
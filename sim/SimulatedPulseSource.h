@@ -0,0 +1,33 @@
+#pragma once
+
+// PulseSource fed directly by the harness: no pin, no interrupt, no counter
+// peripheral. Each injected pulse is counted and timestamped exactly, which
+// isolates FlowSensor logic from the pulse capture path.
+
+#include "Particle.h"
+#include "PulseSource.h"
+#include "PulseRing.h"
+
+class SimulatedPulseSource : public PulseSource {
+public:
+  // The pin is accepted for parity with the hardware backends and unused
+  explicit SimulatedPulseSource(int sensorPin = -1);
+
+  void begin() override;
+  unsigned long readPulseCount() const override;
+  bool hasTimestamps() const override;
+  size_t drainTimestamps(uint32_t* out, size_t maxCount) override;
+  bool takePulseDetected() override;
+  void creditWakePulse() override;
+  unsigned long getOverflowCount() const override;
+  const char* getName() const override;
+
+  // Harness side: one pulse at the current virtual time
+  void inject();
+
+private:
+  bool _started;
+  unsigned long _pulseCount;
+  bool _pulseDetected;
+  PulseRing _pulseRing;
+};
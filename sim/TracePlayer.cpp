@@ -0,0 +1,159 @@
+#include "TracePlayer.h"
+
+#include <algorithm>
+#include <functional>
+
+TracePlayer::TracePlayer(pin_t pin) :
+  _pin(pin),
+  _segmentsQueued(0),
+  _pulsesScheduled(0),
+  _pulsesFired(0)
+{
+}
+
+void TracePlayer::addPulse(uint64_t timeUs) {
+  addSegment({timeUs, 1, 0.0});
+}
+
+void TracePlayer::addRate(uint64_t startUs, uint64_t durationUs, double hz) {
+  if (hz <= 0.0) {
+    return;
+  }
+  uint64_t pulses = (uint64_t)(durationUs * hz / 1000000.0);
+  addSegment({startUs, pulses, 1000000.0 / hz});
+}
+
+void TracePlayer::addFill(uint64_t startUs, double gallons, double gpm, double pulsesPerGallon) {
+  if (gpm <= 0.0) {
+    return;
+  }
+  double hz = gpm * pulsesPerGallon / 60.0;
+  uint64_t pulses = (uint64_t)llround(gallons * pulsesPerGallon);
+  addSegment({startUs, pulses, 1000000.0 / hz});
+}
+
+void TracePlayer::addBurst(uint64_t startUs, uint32_t pulses, double hz) {
+  if (hz <= 0.0) {
+    return;
+  }
+  addSegment({startUs, pulses, 1000000.0 / hz});
+}
+
+bool TracePlayer::loadFile(const char* path, double pulsesPerGallon) {
+  FILE* file = fopen(path, "r");
+  if (!file) {
+    fprintf(stderr, "trace: cannot open %s\n", path);
+    return false;
+  }
+
+  char line[256];
+  int lineNumber = 0;
+  bool ok = true;
+  while (fgets(line, sizeof(line), file)) {
+    lineNumber++;
+    char* comment = strchr(line, '#');
+    if (comment) {
+      *comment = '\0';
+    }
+
+    char kind[16];
+    double a = 0.0, b = 0.0, c = 0.0;
+    int fields = sscanf(line, "%15s %lf %lf %lf", kind, &a, &b, &c);
+    if (fields <= 0) {
+      continue;
+    }
+
+    uint64_t startUs = (uint64_t)llround(a * 1000000.0);
+    if (strcmp(kind, "pulse") == 0 && fields == 2) {
+      addPulse(startUs);
+    } else if (strcmp(kind, "rate") == 0 && fields == 4) {
+      addRate(startUs, (uint64_t)llround(b * 1000000.0), c);
+    } else if (strcmp(kind, "fill") == 0 && fields == 4) {
+      addFill(startUs, b, c, pulsesPerGallon);
+    } else if (strcmp(kind, "burst") == 0 && fields == 4) {
+      addBurst(startUs, (uint32_t)b, c);
+    } else {
+      fprintf(stderr, "trace: %s:%d: unrecognised line\n", path, lineNumber);
+      ok = false;
+    }
+  }
+
+  fclose(file);
+  return ok;
+}
+
+void TracePlayer::deliverTo(std::function<void()> handler) {
+  _handler = handler;
+}
+
+pin_t TracePlayer::pin() const {
+  return _handler ? sim::NO_PIN : _pin;
+}
+
+pin_t TracePlayer::sensePin() const {
+  return _pin;
+}
+
+uint64_t TracePlayer::nextEdgeUs() const {
+  queuePendingSegments();
+  return _cursors.empty() ? NO_EDGE : _cursors.front().timeUs;
+}
+
+void TracePlayer::consumeEdge() {
+  nextEdge(true);
+}
+
+void TracePlayer::absorbEdge() {
+  nextEdge(false);
+}
+
+void TracePlayer::nextEdge(bool deliver) {
+  queuePendingSegments();
+  if (_cursors.empty()) {
+    return;
+  }
+
+  std::pop_heap(_cursors.begin(), _cursors.end(), std::greater<Cursor>());
+  Cursor& cursor = _cursors.back();
+  _pulsesFired++;
+  if (_handler && deliver) {
+    _handler();
+  }
+
+  const Segment& segment = _segments[cursor.segment];
+  if (++cursor.index < segment.pulses) {
+    cursor.timeUs = edgeTime(segment, cursor.index);
+    std::push_heap(_cursors.begin(), _cursors.end(), std::greater<Cursor>());
+  } else {
+    _cursors.pop_back();
+  }
+}
+
+uint64_t TracePlayer::pulsesScheduled() const {
+  return _pulsesScheduled;
+}
+
+uint64_t TracePlayer::pulsesFired() const {
+  return _pulsesFired;
+}
+
+void TracePlayer::addSegment(const Segment& segment) {
+  if (segment.pulses == 0) {
+    return;
+  }
+  _segments.push_back(segment);
+  _pulsesScheduled += segment.pulses;
+}
+
+void TracePlayer::queuePendingSegments() const {
+  while (_segmentsQueued < _segments.size()) {
+    const Segment& segment = _segments[_segmentsQueued];
+    _cursors.push_back({segment.startUs, _segmentsQueued, 0});
+    std::push_heap(_cursors.begin(), _cursors.end(), std::greater<Cursor>());
+    _segmentsQueued++;
+  }
+}
+
+uint64_t TracePlayer::edgeTime(const Segment& segment, uint64_t index) const {
+  return segment.startUs + (uint64_t)llround(index * segment.periodUs);
+}
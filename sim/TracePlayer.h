@@ -0,0 +1,67 @@
+#pragma once
+
+// Replays pulse timelines onto a pin: recorded edge timestamps, constant-rate
+// segments and synthetic fill/burst/surge patterns. Pulses are generated lazily
+// so multi-day traces cost no memory beyond their segment list.
+
+#include "SimControl.h"
+#include <vector>
+
+class TracePlayer : public sim::EdgeSource {
+public:
+  explicit TracePlayer(pin_t pin);
+
+  // Timeline building (all times in microseconds of virtual uptime)
+  void addPulse(uint64_t timeUs);
+  void addRate(uint64_t startUs, uint64_t durationUs, double hz);
+  void addFill(uint64_t startUs, double gallons, double gpm, double pulsesPerGallon);
+  void addBurst(uint64_t startUs, uint32_t pulses, double hz);
+
+  // Load a text trace. Lines (times in seconds, '#' starts a comment):
+  //   pulse <t>                       single recorded edge
+  //   rate  <start> <duration> <hz>   constant-frequency segment
+  //   fill  <start> <gallons> <gpm>   fill at the configured pulses per gallon
+  //   burst <start> <pulses> <hz>     short run of pulses
+  bool loadFile(const char* path, double pulsesPerGallon);
+
+  // Deliver pulses to a callback instead of raising edges on the pin
+  void deliverTo(std::function<void()> handler);
+
+  // sim::EdgeSource
+  pin_t pin() const override;
+  pin_t sensePin() const override;
+  uint64_t nextEdgeUs() const override;
+  void consumeEdge() override;
+  void absorbEdge() override;
+
+  uint64_t pulsesScheduled() const;
+  uint64_t pulsesFired() const;
+
+private:
+  struct Segment {
+    uint64_t startUs;
+    uint64_t pulses;
+    double periodUs;
+  };
+
+  // Next pending edge of one segment; segments may overlap
+  struct Cursor {
+    uint64_t timeUs;
+    size_t segment;
+    uint64_t index;
+    bool operator>(const Cursor& other) const { return timeUs > other.timeUs; }
+  };
+
+  pin_t _pin;
+  std::function<void()> _handler;
+  std::vector<Segment> _segments;
+  mutable std::vector<Cursor> _cursors;  // min-heap on timeUs
+  mutable size_t _segmentsQueued;
+  uint64_t _pulsesScheduled;
+  uint64_t _pulsesFired;
+
+  void addSegment(const Segment& segment);
+  void nextEdge(bool deliver);
+  void queuePendingSegments() const;
+  uint64_t edgeTime(const Segment& segment, uint64_t index) const;
+};
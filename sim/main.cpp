@@ -0,0 +1,878 @@
+// Host simulation driver: runs the unmodified firmware setup()/loop() on a
+// virtual clock while a TracePlayer drives the flow meter pin, then reports
+// loop cost and everything the firmware emitted.
+
+#include "Particle.h"
+#include "SimControl.h"
+#include "TracePlayer.h"
+#include "FlowSensor.h"
+#include "FlowHistory.h"
+#include "FlowAnalyzer.h"
+#include "DisplayComm.h"
+#include "DisplayFrame.h"
+#include "Storage.h"
+#include "PublishQueue.h"
+#include "DataReporter.h"
+#include "CompactPayload.h"
+#include "Clock.h"
+#include "Scheduler.h"
+#include "PowerManager.h"
+#include "LatencyProfile.h"
+#include "DeferredLog.h"
+#include "ReportingPolicy.h"
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(PULSE_SOURCE_SIMULATED)
+#include "SimulatedPulseSource.h"
+#endif
+
+// Firmware globals from BoronTest.cpp
+extern FlowSensor flowSensor;
+extern FlowHistory flowHistory;
+extern FlowAnalyzer flowAnalyzer;
+extern DisplayComm displayComm;
+extern PublishQueue publishQueue;
+extern DataReporter dataReporter;
+extern Scheduler scheduler;
+extern PowerManager powerManager;
+extern ReportingPolicy reportingPolicy;
+#if defined(PULSE_SOURCE_SIMULATED)
+extern SimulatedPulseSource pulseSource;
+#endif
+#if FLOW_CHANNELS > 1
+extern FlowSensor backwashSensor;
+#if defined(PULSE_SOURCE_SIMULATED)
+extern SimulatedPulseSource backwashPulseSource;
+#endif
+#endif
+#if FLOW_CHANNELS > 2
+extern FlowSensor makeupSensor;
+#if defined(PULSE_SOURCE_SIMULATED)
+extern SimulatedPulseSource makeupPulseSource;
+#endif
+#endif
+
+namespace {
+
+const pin_t FLOW_PIN = D2;  // FLOW_SENSOR_PIN in BoronTest.cpp
+const pin_t BACKWASH_PIN = D3;  // BACKWASH_SENSOR_PIN
+const pin_t MAKEUP_PIN = D4;    // MAKEUP_SENSOR_PIN
+const double BACKWASH_PULSES_PER_GALLON = 330.0;
+const double MAKEUP_PULSES_PER_GALLON = 1700.0;
+const uint64_t US_PER_SECOND = 1000000ULL;
+const uint64_t US_PER_HOUR = 3600ULL * US_PER_SECOND;
+const uint64_t US_PER_DAY = 24ULL * US_PER_HOUR;
+
+// Device memory images kept in the flash directory between runs
+const char* const EEPROM_IMAGE = "sim_eeprom.bin";
+const char* const RETAINED_IMAGE = "sim_retained.bin";
+
+struct Options {
+  double hours = 24.0;
+  uint32_t tickMs = 10;
+  const char* scenario = "daily-fill";
+  std::vector<const char*> traces;
+  double pulsesPerGallon = 1700.0;
+  long connectMs = 8000;
+  long reconnectMs = -1;
+  std::vector<std::pair<double, double>> offline;  // start hour, duration hours
+  std::vector<std::pair<double, double>> fills;    // hour, minutes the valve is commanded open
+  float signal = 60.0f;
+  long publishLatencyMs = -1;
+  long long epoch = -1;
+  int resetReason = -1;
+  bool echo = false;
+  const char* usbCapture = nullptr;
+  bool binaryLog = false;
+  bool dumpPublishes = false;
+  bool dumpDisplay = false;
+  bool binaryDisplay = false;
+  bool compactPayloads = false;
+  bool lowPower = false;
+  bool powerCycle = false;
+  long long powerCutPuts = 0;
+  const char* flashDir = nullptr;
+  const char* exportTier = nullptr;
+  const char* reporting = nullptr;
+};
+
+// Reference receiver for binary display frames: splits the Serial1 stream on
+// 0x00 and decodes each frame the way the display would
+struct DisplayFrameStats {
+  std::vector<uint8_t> pending;
+  uint64_t decoded = 0;
+  uint64_t errors = 0;
+  uint64_t bytes = 0;
+  bool dump = false;
+};
+
+struct LoopStats {
+  uint64_t calls = 0;
+  double hostNsTotal = 0.0;
+  double hostNsMax = 0.0;
+  uint64_t stallUsMax = 0;
+  uint64_t stallUsTotal = 0;
+  uint64_t stalledCalls = 0;  // loop() calls that blocked virtual time at all
+  uint64_t idleUs = 0;        // time loop() spent in delay() waiting for work
+  uint64_t sleepUs = 0;       // time loop() spent in System.sleep()
+};
+
+void usage() {
+  fprintf(stderr,
+    "usage: boron_sim [options]\n"
+    "  --days N                 simulated duration in days\n"
+    "  --hours N                simulated duration in hours (default 24)\n"
+    "  --tick-ms N              virtual time between loop() calls (default 10)\n"
+    "  --scenario NAME          idle | daily-fill | bursts | surge | leak (default daily-fill)\n"
+    "  --trace FILE             add a pulse trace (format in TracePlayer.h)\n"
+    "  --pulses-per-gallon N    calibration used for synthetic fills (default 1700)\n"
+    "  --connect-ms N           uptime at which the cloud connects, -1 = never (default 8000)\n"
+    "  --offline H:D            drop the cloud link at hour H for D hours (repeatable)\n"
+    "  --reconnect-ms N         time Particle.connect() takes to bring the cloud back (default 15000)\n"
+    "  --signal N               reported signal strength in percent (default 60)\n"
+    "  --publish-latency-ms N   time a delivered publish blocks (default 500)\n"
+    "  --reset-reason N         value returned by System.resetReason()\n"
+    "  --epoch N                Unix time at virtual uptime 0 (default 1735689600, 2025-01-01)\n"
+    "  --echo                   echo USB serial output to stdout\n"
+    "  --usb-capture FILE       write USB serial output to FILE (for tools/decode_log.py)\n"
+    "  --log-format FORMAT      text | binary deferred log output (default text)\n"
+    "  --dump-publishes         print every Particle.publish()\n"
+    "  --dump-display           print every line written to Serial1\n"
+    "  --display-format FORMAT  json | binary display frames (default json)\n"
+    "  --payload-format FORMAT  json | compact cloud event payloads (default json)\n"
+    "  --low-power              sleep between reports while no water flows\n"
+    "  --command-fill H:M       call the fill cloud function at hour H for M minutes\n"
+    "                           (repeatable)\n"
+    "  --reporting SETTINGS     call the reporting cloud function after setup, e.g.\n"
+    "                           batch_idle=1440,publishes=20 (saved in the flash directory)\n"
+    "  --export-history TIER    call the history cloud function at the end of the run\n"
+    "                           (minute | quarter | hour) and send what it queues\n"
+    "  --flash-dir DIR          keep flash files, EEPROM and retained RAM in DIR so a\n"
+    "                           later run continues after a reset (default: a scratch\n"
+    "                           directory removed at exit)\n"
+    "  --power-cycle            start without the retained RAM saved in --flash-dir\n"
+    "  --power-cut-puts N       lose power during the Nth EEPROM put (torn write) and\n"
+    "                           stop; only EEPROM is saved to --flash-dir\n");
+}
+
+bool parseOptions(int argc, char** argv, Options& options) {
+  for (int i = 1; i < argc; i++) {
+    const char* arg = argv[i];
+    const char* value = (i + 1 < argc) ? argv[i + 1] : nullptr;
+    bool needsValue = true;
+
+    if (strcmp(arg, "--echo") == 0) {
+      options.echo = true;
+      needsValue = false;
+    } else if (strcmp(arg, "--dump-publishes") == 0) {
+      options.dumpPublishes = true;
+      needsValue = false;
+    } else if (strcmp(arg, "--dump-display") == 0) {
+      options.dumpDisplay = true;
+      needsValue = false;
+    } else if (strcmp(arg, "--low-power") == 0) {
+      options.lowPower = true;
+      needsValue = false;
+    } else if (strcmp(arg, "--power-cycle") == 0) {
+      options.powerCycle = true;
+      needsValue = false;
+    } else if (!value) {
+      usage();
+      return false;
+    } else if (strcmp(arg, "--days") == 0) {
+      options.hours = atof(value) * 24.0;
+    } else if (strcmp(arg, "--hours") == 0) {
+      options.hours = atof(value);
+    } else if (strcmp(arg, "--tick-ms") == 0) {
+      options.tickMs = (uint32_t)atol(value);
+    } else if (strcmp(arg, "--scenario") == 0) {
+      options.scenario = value;
+    } else if (strcmp(arg, "--trace") == 0) {
+      options.traces.push_back(value);
+    } else if (strcmp(arg, "--pulses-per-gallon") == 0) {
+      options.pulsesPerGallon = atof(value);
+    } else if (strcmp(arg, "--connect-ms") == 0) {
+      options.connectMs = atol(value);
+    } else if (strcmp(arg, "--reconnect-ms") == 0) {
+      options.reconnectMs = atol(value);
+    } else if (strcmp(arg, "--offline") == 0) {
+      double start = 0.0, duration = 0.0;
+      if (sscanf(value, "%lf:%lf", &start, &duration) != 2) {
+        usage();
+        return false;
+      }
+      options.offline.push_back({start, duration});
+    } else if (strcmp(arg, "--command-fill") == 0) {
+      double hour = 0.0, minutes = 0.0;
+      if (sscanf(value, "%lf:%lf", &hour, &minutes) != 2) {
+        usage();
+        return false;
+      }
+      options.fills.push_back({hour, minutes});
+    } else if (strcmp(arg, "--signal") == 0) {
+      options.signal = (float)atof(value);
+    } else if (strcmp(arg, "--publish-latency-ms") == 0) {
+      options.publishLatencyMs = atol(value);
+    } else if (strcmp(arg, "--reset-reason") == 0) {
+      options.resetReason = atoi(value);
+    } else if (strcmp(arg, "--epoch") == 0) {
+      options.epoch = atoll(value);
+    } else if (strcmp(arg, "--payload-format") == 0) {
+      if (strcmp(value, "compact") == 0) {
+        options.compactPayloads = true;
+      } else if (strcmp(value, "json") != 0) {
+        usage();
+        return false;
+      }
+    } else if (strcmp(arg, "--usb-capture") == 0) {
+      options.usbCapture = value;
+    } else if (strcmp(arg, "--log-format") == 0) {
+      if (strcmp(value, "binary") == 0) {
+        options.binaryLog = true;
+      } else if (strcmp(value, "text") != 0) {
+        usage();
+        return false;
+      }
+    } else if (strcmp(arg, "--reporting") == 0) {
+      options.reporting = value;
+    } else if (strcmp(arg, "--export-history") == 0) {
+      options.exportTier = value;
+    } else if (strcmp(arg, "--power-cut-puts") == 0) {
+      options.powerCutPuts = atoll(value);
+    } else if (strcmp(arg, "--flash-dir") == 0) {
+      options.flashDir = value;
+    } else if (strcmp(arg, "--display-format") == 0) {
+      if (strcmp(value, "binary") == 0) {
+        options.binaryDisplay = true;
+      } else if (strcmp(value, "json") != 0) {
+        usage();
+        return false;
+      }
+    } else {
+      usage();
+      return false;
+    }
+
+    if (needsValue) {
+      i++;
+    }
+  }
+
+  if (options.tickMs == 0) {
+    options.tickMs = 1;
+  }
+  return true;
+}
+
+uint64_t hoursToUs(double hours) {
+  return (uint64_t)(hours * US_PER_HOUR);
+}
+
+// Synthetic pool-fill days. Virtual uptime 0 is midnight of the epoch base.
+bool buildScenario(const Options& options, TracePlayer& player) {
+  const char* name = options.scenario;
+  double ppg = options.pulsesPerGallon;
+  bool fills = strcmp(name, "daily-fill") == 0 || strcmp(name, "bursts") == 0 ||
+               strcmp(name, "surge") == 0 || strcmp(name, "leak") == 0;
+
+  if (!fills && strcmp(name, "idle") != 0) {
+    fprintf(stderr, "unknown scenario: %s\n", name);
+    return false;
+  }
+
+  uint64_t endUs = hoursToUs(options.hours);
+  if (strcmp(name, "leak") == 0) {
+    // A fill valve that no longer seats: 0.03 gpm around the clock, too
+    // little for checkFlow() to count as an event
+    player.addRate(0, endUs, 0.03 * ppg / 60.0);
+  }
+  for (uint64_t day = 0; day * US_PER_DAY < endUs && fills; day++) {
+    uint64_t midnight = day * US_PER_DAY;
+
+    // Morning top-up and a shorter evening top-up after swim use
+    player.addFill(midnight + hoursToUs(9.0), 120.0, 8.0, ppg);
+    player.addFill(midnight + hoursToUs(17.5), 35.0, 6.0, ppg);
+
+    if (strcmp(name, "bursts") == 0) {
+      // Valve chatter: short bursts every 20 minutes around the clock
+      for (uint64_t t = 0; t < US_PER_DAY; t += 20 * 60 * US_PER_SECOND) {
+        player.addBurst(midnight + t + 7 * US_PER_SECOND, 60, 40.0);
+      }
+    }
+
+    if (strcmp(name, "surge") == 0) {
+      // Five minutes pinned at 500 Hz, beyond the meter's rated range
+      player.addRate(midnight + hoursToUs(12.0), 300 * US_PER_SECOND, 500.0);
+    }
+  }
+
+  for (const char* trace : options.traces) {
+    if (!player.loadFile(trace, ppg)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+#if FLOW_CHANNELS > 1
+// The other meters of a multi-channel build: a three minute filter backwash
+// at 60 gpm each morning, and the auto-fill topping up a little at a time
+void buildChannelScenario(const Options& options, TracePlayer& backwash, TracePlayer& makeup) {
+  if (strcmp(options.scenario, "idle") == 0) {
+    return;
+  }
+  uint64_t endUs = hoursToUs(options.hours);
+  for (uint64_t day = 0; day * US_PER_DAY < endUs; day++) {
+    uint64_t midnight = day * US_PER_DAY;
+    backwash.addFill(midnight + hoursToUs(7.0), 180.0, 60.0, BACKWASH_PULSES_PER_GALLON);
+    for (double hour = 1.0; hour < 24.0; hour += 4.0) {
+      makeup.addFill(midnight + hoursToUs(hour), 6.0, 0.5, MAKEUP_PULSES_PER_GALLON);
+    }
+  }
+}
+#endif
+
+void scheduleCloud(const Options& options) {
+  if (options.connectMs >= 0) {
+    sim::schedule((uint64_t)options.connectMs * 1000, [] { sim::setCloudConnected(true); });
+  }
+  for (const auto& window : options.offline) {
+    uint64_t start = hoursToUs(window.first);
+    uint64_t end = start + hoursToUs(window.second);
+    sim::schedule(start, [] { sim::setCloudConnected(false); });
+    sim::schedule(end, [] { sim::setCloudConnected(true); });
+  }
+}
+
+// Run the firmware inside the flash directory. A scratch directory (no
+// --flash-dir given) is returned in scratch so it can be removed at exit.
+bool enterFlashDir(const Options& options, std::string& scratch) {
+  if (options.flashDir) {
+    mkdir(options.flashDir, 0777);
+    if (chdir(options.flashDir) != 0) {
+      fprintf(stderr, "cannot use flash directory %s\n", options.flashDir);
+      return false;
+    }
+    return true;
+  }
+
+  char pattern[] = "/tmp/boron_sim_flash.XXXXXX";
+  if (!mkdtemp(pattern) || chdir(pattern) != 0) {
+    fprintf(stderr, "cannot create a scratch flash directory\n");
+    return false;
+  }
+  scratch = pattern;
+  return true;
+}
+
+void removeScratchDir(const std::string& scratch) {
+  if (scratch.empty()) {
+    return;
+  }
+  if (DIR* dir = opendir(scratch.c_str())) {
+    while (struct dirent* entry = readdir(dir)) {
+      if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+        unlink((scratch + "/" + entry->d_name).c_str());
+      }
+    }
+    closedir(dir);
+  }
+  if (chdir("/") == 0) {
+    rmdir(scratch.c_str());
+  }
+}
+
+void receiveDisplayByte(DisplayFrameStats& frames, uint8_t byte) {
+  frames.bytes++;
+  if (byte != 0x00) {
+    frames.pending.push_back(byte);
+    return;
+  }
+
+  DisplayStatus status = {};
+  DisplayFrame::DecodeResult result =
+    DisplayFrame::decode(frames.pending.data(), frames.pending.size(), status);
+  frames.pending.clear();
+  if (result != DisplayFrame::DECODE_OK) {
+    frames.errors++;
+    printf("display frame %10.3f s decode error %d\n", sim::nowUs() / 1e6, (int)result);
+    return;
+  }
+
+  frames.decoded++;
+  if (frames.dump) {
+    printf("display frame %10.3f s gpm %.2f peak %.2f lifetime %.3f gal daily %.3f gal "
+           "events %u signal %u%% %02u:%02u:%02u flags 0x%02x\n",
+           sim::nowUs() / 1e6, status.gpmCenti / 100.0, status.peakGpmCenti / 100.0,
+           status.lifetimeMilliGallons / 1000.0, status.dailyMilliGallons / 1000.0,
+           status.flowEventsToday, status.signalPercent, status.hour, status.minute,
+           status.second, status.flags);
+  }
+}
+
+// Reference decode of a compact publish, printed the way the cloud sees it
+bool decodeCompactPublish(const sim::PublishRecord& record, bool dump) {
+  CompactEvent event;
+  CompactPayload::DecodeResult result = CompactPayload::decode(record.data.c_str(), event);
+  if (result != CompactPayload::DECODE_OK) {
+    printf("compact %10.3f s %-16s decode error %d\n", record.timeUs / 1e6, record.name.c_str(), (int)result);
+    return false;
+  }
+  if (!dump) {
+    return true;
+  }
+
+  if (event.type == COMPACT_TYPE_FLOW_BATCH) {
+    for (size_t i = 0; i < event.flowCount; i++) {
+      printf("compact %10.3f s %-16s %s timestamp %lu, %.3f gal, hourly average %.3f gal",
+             record.timeUs / 1e6, record.name.c_str(), event.deviceId,
+             (unsigned long)event.flow[i].timestamp, event.flow[i].milliGallons / 1000.0,
+             event.flow[i].hourlyAverageMilliGallons / 1000.0);
+      for (uint32_t c = 0; c < event.flow[i].channelCount; c++) {
+        printf(", %s %.3f gal", event.channelNames[c], event.flow[i].channelMilliGallons[c] / 1000.0);
+      }
+      printf("\n");
+    }
+  } else {
+    const DiagnosticSample& d = event.diagnostics;
+    printf("compact %10.3f s %-16s %s timestamp %lu, firmware %s, reset %lu, lifetime %.3f gal, "
+           "daily %.3f gal, hours %lu, pulses %lu, events %lu, signal %ld, storage %lu/%lu, "
+           "queue %lu/%lu, pending %lu, slept %lu s, wakeups %lu, alerts %lu, run %lu s, longest %lu s, "
+           "floor %.3f/%.3f gpm, baseline %.3f gpm, implausible %lu, peak %.2f gpm, average %.2f gpm\n",
+           record.timeUs / 1e6, record.name.c_str(), event.deviceId, (unsigned long)d.timestamp,
+           d.firmware, (unsigned long)d.resetReason, d.lifetimeMilliGallons / 1000.0,
+           d.dailyMilliGallons / 1000.0, (unsigned long)d.hoursElapsed, (unsigned long)d.totalPulses,
+           (unsigned long)d.flowEventsToday, (long)d.signalStrength, (unsigned long)d.storageRecords,
+           (unsigned long)d.storageWritesAvoided, (unsigned long)d.queueDepth,
+           (unsigned long)d.queueDropped, (unsigned long)d.flowRecordsPending,
+           (unsigned long)d.sleepSeconds, (unsigned long)d.wakeups, (unsigned long)d.alertFlags,
+           (unsigned long)d.continuousSeconds, (unsigned long)d.longestFlowSeconds,
+           d.hourFloorMilliGpm / 1000.0, d.dayFloorMilliGpm / 1000.0, d.baselineMilliGpm / 1000.0,
+           (unsigned long)d.implausiblePulses, d.peakMilliGpm / 1000.0, d.averageMilliGpm / 1000.0);
+    if (d.latencyCount > 0) {
+      printf("compact %10.3f s %-16s latency: watchdog gap %lu ms, worst %s %lu us,",
+             record.timeUs / 1e6, record.name.c_str(), (unsigned long)d.watchdogGapMillis, d.worstProbe,
+             (unsigned long)d.worstMicros);
+      for (uint32_t i = 0; i < d.latencyCount; i++) {
+        printf(" %s %lu/%lu/%lu/%lu us", d.latency[i].name, (unsigned long)d.latency[i].minMicros,
+               (unsigned long)d.latency[i].p50Micros, (unsigned long)d.latency[i].p99Micros,
+               (unsigned long)d.latency[i].maxMicros);
+      }
+      printf("\n");
+    }
+    for (uint32_t c = 0; c < d.channelCount; c++) {
+      printf("compact %10.3f s %-16s channel %s: lifetime %.3f gal, daily %.3f gal, events %lu\n",
+             record.timeUs / 1e6, record.name.c_str(), d.channels[c].name,
+             d.channels[c].lifetimeMilliGallons / 1000.0, d.channels[c].dailyMilliGallons / 1000.0,
+             (unsigned long)d.channels[c].flowEventsToday);
+    }
+  }
+  return true;
+}
+
+// Volume held in a tier's closed buckets
+uint64_t heldMilliGallons(int tier) {
+  uint16_t values[256];
+  uint64_t total = 0;
+  size_t index = 0;
+  size_t read;
+  while ((read = flowHistory.readBuckets(tier, index, values, 256)) > 0) {
+    for (size_t i = 0; i < read; i++) {
+      total += values[i];
+    }
+    index += read;
+  }
+  return total * FlowHistory::getUnitMilliGallons(tier);
+}
+
+void report(const Options& options, const TracePlayer& player, const LoopStats& loops,
+            const DisplayFrameStats& frames, double wallSeconds, int historyEvents) {
+  const sim::Stats& stats = sim::stats();
+  double simSeconds = sim::nowUs() / (double)US_PER_SECOND;
+
+  printf("== boron_sim: scenario %s, %.2f h simulated in %.2f s wall (x%.0f)\n",
+         options.scenario, simSeconds / 3600.0, wallSeconds,
+         wallSeconds > 0.0 ? simSeconds / wallSeconds : 0.0);
+
+  printf("loop():      %llu calls, host mean %.0f ns, host max %.0f ns\n",
+         (unsigned long long)loops.calls,
+         loops.calls ? loops.hostNsTotal / loops.calls : 0.0, loops.hostNsMax);
+  printf("             blocked virtual time in %llu calls, total %.1f s, worst %.1f ms\n",
+         (unsigned long long)loops.stalledCalls, loops.stallUsTotal / 1e6, loops.stallUsMax / 1e3);
+  printf("             idle in delay() %.1f s (%.1f%% of the run)\n",
+         loops.idleUs / 1e6, simSeconds > 0.0 ? loops.idleUs / 1e4 / simSeconds : 0.0);
+  if (powerManager.isEnabled()) {
+    printf("sleep:       %llu sleeps, %.1f s asleep (%.1f%% of the run), %lu wakeups (%lu by pulse), "
+           "%lu watchdog check-ins\n",
+           (unsigned long long)stats.sleeps, loops.sleepUs / 1e6,
+           simSeconds > 0.0 ? loops.sleepUs / 1e4 / simSeconds : 0.0, powerManager.getWakeups(),
+           powerManager.getPulseWakeups(), powerManager.getWatchdogWakeups());
+  }
+  for (int id = 0; id < scheduler.getTaskCount(); id++) {
+    Scheduler::TaskStats task;
+    scheduler.getTaskStats(id, task);
+    printf("task %-8s %9lu runs, %lu overruns, max late %lu ms, run mean %.1f us, max %lu us\n",
+           task.name, task.runs, task.overruns, task.maxLateMillis,
+           task.runs ? (double)task.totalRunMicros / task.runs : 0.0, task.maxRunMicros);
+  }
+
+#if LATENCY_PROFILE
+  // Since the last diagnostic report, in virtual time
+  for (int id = 0; id < LatencyProfile::getProbeCount(); id++) {
+    LatencyProfile::Summary latency;
+    LatencyProfile::getSummary(id, latency);
+    printf("latency %-9s %7lu samples, min %lu us, p50 %lu us, p99 %lu us, max %lu us\n",
+           latency.name, (unsigned long)latency.count, (unsigned long)latency.minMicros,
+           (unsigned long)latency.p50Micros, (unsigned long)latency.p99Micros,
+           (unsigned long)latency.maxMicros);
+  }
+  printf("             worst %s at %lu us, longest watchdog gap %lu ms\n",
+         LatencyProfile::getWorstProbe() ? LatencyProfile::getWorstProbe() : "none",
+         (unsigned long)LatencyProfile::getWorstMicros(), (unsigned long)LatencyProfile::getMaxCheckinGapMillis());
+#endif
+
+  double firedGallons = player.pulsesFired() / options.pulsesPerGallon;
+  printf("pulses:      scheduled %llu, fired %llu (%.2f gal), lost while masked %llu\n",
+         (unsigned long long)player.pulsesScheduled(), (unsigned long long)player.pulsesFired(),
+         firedGallons, (unsigned long long)stats.edgesLost);
+  printf("             CPU pin interrupts %llu, GPIOTE/PPI events %llu, sleep wake edges %llu\n",
+         (unsigned long long)stats.interruptsServiced, (unsigned long long)sim::peripheralEvents(),
+         (unsigned long long)stats.sleepWakeEdges);
+  printf("             firmware missed %lld of the pulses fired\n",
+         (long long)player.pulsesFired() - (long long)flowSensor.getTechnicalPulseCount());
+  printf("firmware:    technical pulses %lu, lifetime %.2f gal, daily %.2f gal, events today %d\n",
+         flowSensor.getTechnicalPulseCount(), flowSensor.getLifetimeMilliGallons() / 1000.0,
+         flowSensor.getDailyMilliGallons() / 1000.0, flowSensor.getFlowEventsToday());
+  printf("flow rate:   peak %.2f gpm today, average %.2f gpm while flowing, timestamp ring overflows %lu\n",
+         flowSensor.getPeakGpm(), flowSensor.getAverageGpm(), flowSensor.getPulseRingOverflows());
+  printf("analyzer:    run %.1f min, longest today %.1f min, leak after %.1f min, "
+         "floor %.3f gpm hour / %.3f gpm day, baseline %.3f gpm\n",
+         flowAnalyzer.getContinuousSeconds() / 60.0, flowAnalyzer.getLongestContinuousSeconds() / 60.0,
+         flowAnalyzer.getLeakThresholdSeconds() / 60.0, flowAnalyzer.getHourFloorMilliGpm() / 1000.0,
+         flowAnalyzer.getDayFloorMilliGpm() / 1000.0, flowAnalyzer.getBaselineMilliGpm() / 1000.0);
+  printf("             alerts raised %lu, suppressed by holdoff %lu, implausible pulses today %lu, active:",
+         flowAnalyzer.getAlertsRaised(), flowAnalyzer.getAlertsSuppressed(), flowAnalyzer.getImplausiblePulses());
+  for (int alert = 0; alert < FlowAnalyzer::ALERT_COUNT; alert++) {
+    if (flowAnalyzer.isAlertActive(alert)) {
+      printf(" %s", FlowAnalyzer::getAlertName(alert));
+    }
+  }
+  printf("%s\n", flowAnalyzer.getAlertFlags() ? "" : " none");
+#if FLOW_CHANNELS > 1
+  const FlowSensor* others[] = {
+    &backwashSensor,
+#if FLOW_CHANNELS > 2
+    &makeupSensor,
+#endif
+  };
+  for (const FlowSensor* sensor : others) {
+    printf("channel %-4d %s: technical pulses %lu, lifetime %.2f gal, daily %.2f gal, events today %d, "
+           "peak %.2f gpm\n", sensor->getChannel(), sensor->getName(), sensor->getTechnicalPulseCount(),
+           sensor->getLifetimeMilliGallons() / 1000.0, sensor->getDailyMilliGallons() / 1000.0,
+           sensor->getFlowEventsToday(), sensor->getPeakGpm());
+  }
+#endif
+  if (flowSensor.getRecoveredMilliGallons() > 0) {
+    printf("recovered:   %.2f gal credited at boot from a flow event cut short by the reset\n",
+           flowSensor.getRecoveredMilliGallons() / 1000.0);
+  }
+
+  // The hour tier plus every open bucket is all the volume the series has seen
+  uint64_t metered = heldMilliGallons(FlowHistory::TIER_HOUR);
+  printf("history:    ");
+  for (int tier = 0; tier < FlowHistory::TIER_COUNT; tier++) {
+    metered += flowHistory.getOpenMilliGallons(tier);
+    printf(" %s %zu buckets %.2f gal%s", FlowHistory::getTierName(tier), flowHistory.getCount(tier),
+           heldMilliGallons(tier) / 1000.0, tier + 1 < FlowHistory::TIER_COUNT ? "," : "\n");
+  }
+  printf("             metered %.3f gal, %lu flash writes, %lu restarts\n",
+         metered / 1000.0, flowHistory.getFileWrites(), flowHistory.getResets());
+  if (historyEvents >= 0) {
+    printf("             %s tier exported in %d events\n", options.exportTier, historyEvents);
+  }
+
+  size_t delivered = 0;
+  size_t flowData = 0;
+  size_t diagnostics = 0;
+  size_t history = 0;
+  size_t alerts = 0;
+  size_t flowBytes = 0;
+  size_t diagnosticBytes = 0;
+  size_t decodeErrors = 0;
+  for (const sim::PublishRecord& record : sim::publishes()) {
+    delivered += record.delivered ? 1 : 0;
+    if (record.name == "flow_data") {
+      flowData++;
+      flowBytes += record.data.size();
+    } else if (record.name == "diagnostic_data") {
+      diagnostics++;
+      diagnosticBytes += record.data.size();
+    } else {
+      history += record.name == "flow_history" ? 1 : 0;
+      alerts += record.name == "alert" ? 1 : 0;
+      continue;  // Only flow and diagnostic data have a compact form
+    }
+    if (options.compactPayloads && !decodeCompactPublish(record, false)) {
+      decodeErrors++;
+    }
+  }
+  printf("publish:     %zu total (%zu delivered), flow_data %zu, diagnostic_data %zu, flow_history %zu, "
+         "alert %zu\n", sim::publishes().size(), delivered, flowData, diagnostics, history, alerts);
+  printf("payload:     %s, flow_data %.0f bytes mean, diagnostic_data %.0f bytes mean, %zu bytes total\n",
+         options.compactPayloads ? "compact" : "json",
+         flowData ? (double)flowBytes / flowData : 0.0,
+         diagnostics ? (double)diagnosticBytes / diagnostics : 0.0, flowBytes + diagnosticBytes);
+  if (options.compactPayloads) {
+    printf("             %zu compact payloads failed to decode\n", decodeErrors);
+  }
+  const ReportingPolicy::Settings& policy = reportingPolicy.getSettings();
+  printf("reporting:   %s%s, %lu mode changes, today %lu publishes of %lu, %lu bytes of %lu, "
+         "%lu reports held by the budget\n",
+         ReportingPolicy::getModeName(reportingPolicy.getMode()), reportingPolicy.isSignalWeak() ? " (weak signal)" : "",
+         reportingPolicy.getModeChanges(), reportingPolicy.getPublishesToday(), (unsigned long)policy.dailyPublishes,
+         reportingPolicy.getBytesToday(), (unsigned long)policy.dailyBytes, reportingPolicy.getDeferredToday());
+  printf("queue:       %lu pending (%lu bytes), %lu sent, %lu dropped, %lu compactions\n",
+         publishQueue.getDepth(), publishQueue.getBytes(), publishQueue.getPublished(),
+         publishQueue.getDropped(), publishQueue.getCompactions());
+
+  printf("Serial1:     %llu bytes, %zu lines, writers blocked %.1f s\n",
+         (unsigned long long)stats.serial1Bytes, sim::serial1Lines().size(),
+         stats.serial1BlockedUs / 1e6);
+  if (options.binaryDisplay) {
+    printf("display:     %llu binary frames decoded, %llu errors, %.1f bytes per frame\n",
+           (unsigned long long)frames.decoded, (unsigned long long)frames.errors,
+           frames.decoded ? (double)frames.bytes / (frames.decoded + frames.errors) : 0.0);
+  }
+  printf("display:     %lu frames sent, %lu suppressed as unchanged\n",
+         displayComm.getFramesSent(), displayComm.getFramesSuppressed());
+  printf("display:     update stall mean %lu us, max %lu us, %zu bytes queued, %lu frames dropped\n",
+         displayComm.getAverageUpdateStallMicros(), displayComm.getMaxUpdateStallMicros(),
+         displayComm.getTxQueued(), displayComm.getTxFramesDropped());
+  printf("USB serial:  %llu bytes\n", (unsigned long long)stats.usbSerialBytes);
+  printf("log:         %lu deferred entries (%s), %lu dropped, ring high water %lu of %lu words\n",
+         DeferredLog::getWritten(), DeferredLog::isBinary() ? "binary" : "text", DeferredLog::getDropped(),
+         (unsigned long)DeferredLog::getHighWaterWords(), (unsigned long)DeferredLog::CAPACITY);
+  uint32_t hottestCell = 0;
+  for (int address = 0; address < (int)EEPROM.length(); address++) {
+    if (sim::eepromCellWrites(address) > hottestCell) {
+      hottestCell = sim::eepromCellWrites(address);
+    }
+  }
+  printf("EEPROM:      %llu puts, %llu bytes written, %llu bytes changed, hottest cell %lu writes\n",
+         (unsigned long long)stats.eepromPuts, (unsigned long long)stats.eepromBytesWritten,
+         (unsigned long long)stats.eepromBytesChanged, (unsigned long)hottestCell);
+  printf("journal:     %lu records this boot, sequence %lu, ~%lu writes per slot over %d slots\n",
+         Storage::getRecordsWritten(), Storage::getSequence(), Storage::getSlotWriteCycles(),
+         Storage::getJournalSlotCount());
+  printf("write-back:  %lu saves coalesced into other records%s\n",
+         Storage::getWritesAvoided(), Storage::isDirty() ? ", changes pending" : "");
+  printf("cloud:       %llu sessions, connected %.1f s (%.1f%% of the run)\n",
+         (unsigned long long)stats.cloudConnects, sim::cloudConnectedUs() / 1e6,
+         simSeconds > 0.0 ? sim::cloudConnectedUs() / 1e4 / simSeconds : 0.0);
+  printf("clock:       %s, %lu syncs, last resync moved the clock %ld s\n",
+         Clock::isSynced() ? "synced" : "provisional", Clock::getSyncCount(), Clock::getLastCorrection());
+  printf("watchdog:    %llu checkins, max gap %.1f ms, %llu expirations\n",
+         (unsigned long long)stats.watchdogCheckins, stats.watchdogMaxGapUs / 1e3,
+         (unsigned long long)stats.watchdogExpirations);
+
+  if (options.dumpPublishes) {
+    for (const sim::PublishRecord& record : sim::publishes()) {
+      printf("publish %10.3f s %-16s %s %s\n", record.timeUs / 1e6, record.name.c_str(),
+             record.delivered ? "ok  " : "FAIL", record.data.c_str());
+      if (options.compactPayloads && (record.name == "flow_data" || record.name == "diagnostic_data")) {
+        decodeCompactPublish(record, true);
+      }
+    }
+  }
+  if (options.dumpDisplay && !options.binaryDisplay) {
+    for (const sim::SerialLine& line : sim::serial1Lines()) {
+      printf("serial1 %10.3f s %s\n", line.timeUs / 1e6, line.text.c_str());
+    }
+  }
+}
+
+void runLoop(uint64_t endUs, uint64_t tickUs, LoopStats& loops) {
+  while (sim::nowUs() < endUs && !sim::poweredOff()) {
+    uint64_t before = sim::nowUs();
+    uint64_t delayBefore = sim::stats().delayUs;
+    uint64_t sleepBefore = sim::stats().sleepUs;
+    auto hostStart = std::chrono::steady_clock::now();
+    loop();
+    auto hostEnd = std::chrono::steady_clock::now();
+
+    // The log thread runs while the application thread idles
+    DeferredLog::drain(SIZE_MAX);
+
+    double hostNs = std::chrono::duration<double, std::nano>(hostEnd - hostStart).count();
+    // delay() is the scheduler idling until the next deadline, not a stall
+    uint64_t idleUs = sim::stats().delayUs - delayBefore;
+    uint64_t sleepUs = sim::stats().sleepUs - sleepBefore;
+    uint64_t stallUs = sim::nowUs() - before - idleUs - sleepUs;
+    loops.idleUs += idleUs;
+    loops.sleepUs += sleepUs;
+    loops.calls++;
+    loops.hostNsTotal += hostNs;
+    if (hostNs > loops.hostNsMax) {
+      loops.hostNsMax = hostNs;
+    }
+    if (stallUs > 0) {
+      loops.stalledCalls++;
+      loops.stallUsTotal += stallUs;
+      if (stallUs > loops.stallUsMax) {
+        loops.stallUsMax = stallUs;
+      }
+    }
+
+    sim::advanceUs(tickUs);
+  }
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+  Options options;
+  if (!parseOptions(argc, argv, options)) {
+    return 2;
+  }
+
+  TracePlayer player(FLOW_PIN);
+  if (!buildScenario(options, player)) {
+    return 2;
+  }
+#if defined(PULSE_SOURCE_SIMULATED)
+  player.deliverTo([] { pulseSource.inject(); });
+#endif
+  sim::addEdgeSource(&player);
+#if FLOW_CHANNELS > 1
+  TracePlayer backwashPlayer(BACKWASH_PIN);
+  TracePlayer makeupPlayer(MAKEUP_PIN);
+  buildChannelScenario(options, backwashPlayer, makeupPlayer);
+#if defined(PULSE_SOURCE_SIMULATED)
+  backwashPlayer.deliverTo([] { backwashPulseSource.inject(); });
+#if FLOW_CHANNELS > 2
+  makeupPlayer.deliverTo([] { makeupPulseSource.inject(); });
+#endif
+#endif
+  sim::addEdgeSource(&backwashPlayer);
+#if FLOW_CHANNELS > 2
+  sim::addEdgeSource(&makeupPlayer);
+#endif
+#endif
+
+  sim::setSignalStrength(options.signal);
+  if (options.publishLatencyMs >= 0) {
+    sim::setPublishLatencyMs((uint32_t)options.publishLatencyMs);
+  }
+  if (options.resetReason >= 0) {
+    sim::setResetReason(options.resetReason);
+  }
+  if (options.epoch >= 0) {
+    sim::setEpochBase((time_t)options.epoch);
+  }
+  FILE* capture = nullptr;
+  if (options.usbCapture) {
+    capture = fopen(options.usbCapture, "wb");
+    if (capture == nullptr) {
+      fprintf(stderr, "cannot write %s\n", options.usbCapture);
+      return 2;
+    }
+    sim::setUsbSerialEcho(capture);
+  } else if (options.echo) {
+    sim::setUsbSerialEcho(stdout);
+  }
+  DeferredLog::setBinary(options.binaryLog);
+  scheduleCloud(options);
+
+  DisplayFrameStats frames;
+  if (options.binaryDisplay) {
+    frames.dump = options.dumpDisplay;
+    displayComm.setFrameFormat(DisplayComm::FORMAT_BINARY);
+    sim::setSerial1Tap([&frames](uint8_t byte) { receiveDisplayByte(frames, byte); });
+  }
+  if (options.compactPayloads) {
+    dataReporter.setPayloadFormat(DataReporter::FORMAT_COMPACT);
+  }
+  if (options.lowPower) {
+    powerManager.setEnabled(true);
+  }
+  if (options.reconnectMs >= 0) {
+    sim::setReconnectLatencyMs((uint32_t)options.reconnectMs);
+  }
+
+  std::string scratchDir;
+  if (!enterFlashDir(options, scratchDir)) {
+    return 2;
+  }
+  
+  // A previous run in the same directory ended in an unannounced reset
+  if (options.flashDir) {
+    sim::loadEeprom(EEPROM_IMAGE);
+    if (!options.powerCycle) {
+      sim::loadRetained(RETAINED_IMAGE);
+    }
+  }
+  if (options.powerCutPuts > 0) {
+    sim::setEepromPowerCut((uint64_t)options.powerCutPuts);
+  }
+
+  uint64_t endUs = hoursToUs(options.hours);
+  uint64_t tickUs = (uint64_t)options.tickMs * 1000;
+  LoopStats loops;
+
+  auto wallStart = std::chrono::steady_clock::now();
+  setup();
+  if (options.reporting && sim::callFunction("reporting", options.reporting) < 0) {
+    fprintf(stderr, "reporting settings rejected: %s\n", options.reporting);
+  }
+  
+  // Fill valve openings reported by the pool controller, in time order
+  std::vector<std::pair<double, double>> fills = options.fills;
+  std::sort(fills.begin(), fills.end());
+  for (const std::pair<double, double>& fill : fills) {
+    runLoop(std::min(hoursToUs(fill.first), endUs), tickUs, loops);
+    if (sim::nowUs() < endUs) {
+      sim::callFunction("fill", std::to_string((long)fill.second).c_str());
+    }
+  }
+  runLoop(endUs, tickUs, loops);
+
+  // Export requested from the console once the run is over; keep running
+  // (up to half an hour) until the publish queue has sent it
+  int historyEvents = -1;
+  if (options.exportTier) {
+    historyEvents = sim::callFunction("history", options.exportTier);
+    uint64_t drainEndUs = sim::nowUs() + 1800 * US_PER_SECOND;
+    while (publishQueue.getDepth() > 0 && sim::nowUs() < drainEndUs && !sim::poweredOff()) {
+      runLoop(sim::nowUs() + US_PER_SECOND, tickUs, loops);
+    }
+  }
+
+  DeferredLog::drain(SIZE_MAX);
+  double wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+  if (capture) {
+    sim::setUsbSerialEcho(nullptr);
+    fclose(capture);
+  }
+  report(options, player, loops, frames, wallSeconds, historyEvents);
+  if (sim::poweredOff()) {
+    printf("power:       cut during EEPROM put %lld at %.3f s\n", options.powerCutPuts, sim::nowUs() / 1e6);
+  }
+  if (options.flashDir) {
+    sim::saveEeprom(EEPROM_IMAGE);
+    // Retained RAM doesn't survive a power cut
+    if (sim::poweredOff()) {
+      remove(RETAINED_IMAGE);
+    } else {
+      sim::saveRetained(RETAINED_IMAGE);
+    }
+  }
+  removeScratchDir(scratchDir);
+  return 0;
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+// Host stand-in for the nRF5 SDK GPIO HAL (hal/nrf_gpio.h)
+
+#define NRF_GPIO_PIN_MAP(port, pin) (((port) << 5) | ((pin) & 0x1F))
+
+typedef enum {
+  NRF_GPIO_PIN_NOPULL = 0,
+  NRF_GPIO_PIN_PULLDOWN = 1,
+  NRF_GPIO_PIN_PULLUP = 3
+} nrf_gpio_pin_pull_t;
@@ -0,0 +1,29 @@
+#pragma once
+
+// Host stand-in for the nRF5 SDK GPIOTE HAL (hal/nrf_gpiote.h), event mode only
+
+#include <cstdint>
+
+typedef enum {
+  NRF_GPIOTE_POLARITY_LOTOHI = 1,
+  NRF_GPIOTE_POLARITY_HITOLO = 2,
+  NRF_GPIOTE_POLARITY_TOGGLE = 3
+} nrf_gpiote_polarity_t;
+
+// Values are the EVENTS_IN register offsets, as in the SDK
+typedef enum {
+  NRF_GPIOTE_EVENTS_IN_0 = 0x100,
+  NRF_GPIOTE_EVENTS_IN_1 = 0x104,
+  NRF_GPIOTE_EVENTS_IN_2 = 0x108,
+  NRF_GPIOTE_EVENTS_IN_3 = 0x10C,
+  NRF_GPIOTE_EVENTS_IN_4 = 0x110,
+  NRF_GPIOTE_EVENTS_IN_5 = 0x114,
+  NRF_GPIOTE_EVENTS_IN_6 = 0x118,
+  NRF_GPIOTE_EVENTS_IN_7 = 0x11C,
+  NRF_GPIOTE_EVENTS_PORT = 0x17C
+} nrf_gpiote_events_t;
+
+void nrf_gpiote_event_configure(uint32_t idx, uint32_t pin, nrf_gpiote_polarity_t polarity);
+void nrf_gpiote_event_enable(uint32_t idx);
+void nrf_gpiote_event_disable(uint32_t idx);
+uint32_t nrf_gpiote_event_addr_get(nrf_gpiote_events_t event);
@@ -0,0 +1,17 @@
+#pragma once
+
+// Host stand-in for the nRF5 SDK PPI HAL (hal/nrf_ppi.h)
+
+#include <cstdint>
+
+typedef enum {
+  NRF_PPI_CHANNEL0, NRF_PPI_CHANNEL1, NRF_PPI_CHANNEL2, NRF_PPI_CHANNEL3,
+  NRF_PPI_CHANNEL4, NRF_PPI_CHANNEL5, NRF_PPI_CHANNEL6, NRF_PPI_CHANNEL7,
+  NRF_PPI_CHANNEL8, NRF_PPI_CHANNEL9, NRF_PPI_CHANNEL10, NRF_PPI_CHANNEL11,
+  NRF_PPI_CHANNEL12, NRF_PPI_CHANNEL13, NRF_PPI_CHANNEL14, NRF_PPI_CHANNEL15,
+  NRF_PPI_CHANNEL16, NRF_PPI_CHANNEL17, NRF_PPI_CHANNEL18, NRF_PPI_CHANNEL19
+} nrf_ppi_channel_t;
+
+void nrf_ppi_channel_endpoint_setup(nrf_ppi_channel_t channel, uint32_t eep, uint32_t tep);
+void nrf_ppi_channel_enable(nrf_ppi_channel_t channel);
+void nrf_ppi_channel_disable(nrf_ppi_channel_t channel);
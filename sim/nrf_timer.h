@@ -0,0 +1,66 @@
+#pragma once
+
+// Host stand-in for the nRF5 SDK TIMER HAL (hal/nrf_timer.h). Emulates
+// counter mode: COUNT tasks (from software or PPI) advance the counter and
+// CAPTURE tasks latch it into CC registers.
+
+#include <cstdint>
+
+typedef enum {
+  NRF_TIMER_TASK_START,
+  NRF_TIMER_TASK_STOP,
+  NRF_TIMER_TASK_COUNT,
+  NRF_TIMER_TASK_CLEAR,
+  NRF_TIMER_TASK_SHUTDOWN,
+  NRF_TIMER_TASK_CAPTURE0,
+  NRF_TIMER_TASK_CAPTURE1,
+  NRF_TIMER_TASK_CAPTURE2,
+  NRF_TIMER_TASK_CAPTURE3,
+  NRF_TIMER_TASK_CAPTURE4,
+  NRF_TIMER_TASK_CAPTURE5
+} nrf_timer_task_t;
+
+typedef enum {
+  NRF_TIMER_MODE_TIMER,
+  NRF_TIMER_MODE_COUNTER,
+  NRF_TIMER_MODE_LOW_POWER_COUNTER
+} nrf_timer_mode_t;
+
+typedef enum {
+  NRF_TIMER_BIT_WIDTH_16,
+  NRF_TIMER_BIT_WIDTH_8,
+  NRF_TIMER_BIT_WIDTH_24,
+  NRF_TIMER_BIT_WIDTH_32
+} nrf_timer_bit_width_t;
+
+typedef enum {
+  NRF_TIMER_CC_CHANNEL0,
+  NRF_TIMER_CC_CHANNEL1,
+  NRF_TIMER_CC_CHANNEL2,
+  NRF_TIMER_CC_CHANNEL3,
+  NRF_TIMER_CC_CHANNEL4,
+  NRF_TIMER_CC_CHANNEL5
+} nrf_timer_cc_channel_t;
+
+typedef struct {
+  uint32_t TASKS[11];  // task "registers"; only their addresses matter
+  uint32_t CC[6];
+  nrf_timer_mode_t mode;
+  nrf_timer_bit_width_t bitWidth;
+  bool running;
+  uint32_t counter;
+} NRF_TIMER_Type;
+
+extern NRF_TIMER_Type simNrfTimers[5];
+
+#define NRF_TIMER0 (&simNrfTimers[0])
+#define NRF_TIMER1 (&simNrfTimers[1])
+#define NRF_TIMER2 (&simNrfTimers[2])
+#define NRF_TIMER3 (&simNrfTimers[3])
+#define NRF_TIMER4 (&simNrfTimers[4])
+
+void nrf_timer_task_trigger(NRF_TIMER_Type* p_reg, nrf_timer_task_t task);
+uint32_t* nrf_timer_task_address_get(NRF_TIMER_Type* p_reg, nrf_timer_task_t task);
+void nrf_timer_mode_set(NRF_TIMER_Type* p_reg, nrf_timer_mode_t mode);
+void nrf_timer_bit_width_set(NRF_TIMER_Type* p_reg, nrf_timer_bit_width_t bit_width);
+uint32_t nrf_timer_cc_read(NRF_TIMER_Type* p_reg, nrf_timer_cc_channel_t cc_channel);
@@ -0,0 +1,10 @@
+#pragma once
+
+// Host stand-in for the nrfx error codes (nrfx_errors.h)
+
+typedef enum {
+  NRFX_SUCCESS = 0x0BAD0000,
+  NRFX_ERROR_NO_MEM = 0x0BAD0004,
+  NRFX_ERROR_INVALID_PARAM = 0x0BAD0007,
+  NRFX_ERROR_INVALID_STATE = 0x0BAD0008
+} nrfx_err_t;
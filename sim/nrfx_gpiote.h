@@ -0,0 +1,31 @@
+#pragma once
+
+// Host stand-in for the nrfx GPIOTE driver (nrfx_gpiote.h), inputs only.
+// High-accuracy inputs take a GPIOTE channel from the pool attachInterrupt()
+// also draws on; low-accuracy (PORT event) inputs aren't emulated.
+
+#include "nrf_gpio.h"
+#include "nrf_gpiote.h"
+#include "nrfx_errors.h"
+
+typedef uint32_t nrfx_gpiote_pin_t;
+typedef void (*nrfx_gpiote_evt_handler_t)(nrfx_gpiote_pin_t pin, nrf_gpiote_polarity_t action);
+
+typedef struct {
+  nrf_gpiote_polarity_t sense;
+  nrf_gpio_pin_pull_t pull;
+  bool is_watcher;
+  bool hi_accuracy;
+  bool skip_gpio_setup;
+} nrfx_gpiote_in_config_t;
+
+#define NRFX_GPIOTE_CONFIG_IN_SENSE_HITOLO(hi_accu) \
+  {NRF_GPIOTE_POLARITY_HITOLO, NRF_GPIO_PIN_NOPULL, false, hi_accu, false}
+
+bool nrfx_gpiote_is_init(void);
+nrfx_err_t nrfx_gpiote_init(void);
+nrfx_err_t nrfx_gpiote_in_init(nrfx_gpiote_pin_t pin, const nrfx_gpiote_in_config_t* p_config,
+                               nrfx_gpiote_evt_handler_t evt_handler);
+void nrfx_gpiote_in_uninit(nrfx_gpiote_pin_t pin);
+void nrfx_gpiote_in_event_enable(nrfx_gpiote_pin_t pin, bool int_enable);
+uint32_t nrfx_gpiote_in_event_addr_get(nrfx_gpiote_pin_t pin);
@@ -0,0 +1,13 @@
+#pragma once
+
+// Host stand-in for the nrfx PPI driver (nrfx_ppi.h). Channels are handed
+// out from the application's range only: like Device OS's nrfx glue, the
+// allocator never returns the channels the S140 SoftDevice reserves.
+
+#include "nrf_ppi.h"
+#include "nrfx_errors.h"
+
+nrfx_err_t nrfx_ppi_channel_alloc(nrf_ppi_channel_t* p_channel);
+nrfx_err_t nrfx_ppi_channel_free(nrf_ppi_channel_t channel);
+nrfx_err_t nrfx_ppi_channel_assign(nrf_ppi_channel_t channel, uint32_t eep, uint32_t tep);
+nrfx_err_t nrfx_ppi_channel_enable(nrf_ppi_channel_t channel);
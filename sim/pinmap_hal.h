@@ -0,0 +1,13 @@
+#pragma once
+
+// Host stand-in for the Device OS pin map. Simulated pins map 1:1 onto nRF
+// port 0 pins so GPIOTE configuration can be matched against pin edges.
+
+#include <cstdint>
+
+typedef struct {
+  uint8_t gpio_port;
+  uint8_t gpio_pin;
+} hal_pin_info_t;
+
+hal_pin_info_t* hal_pin_map(void);
@@ -0,0 +1,193 @@
+// Compact payloads from the firmware encoder, for test_compact_roundtrip.py:
+// one JSON line per case with the encoder's input and its base64 output.
+//
+//   build/tests/compact_vectors
+
+#include "CompactPayload.h"
+
+#include <stdio.h>
+#include <string.h>
+
+namespace {
+
+const char* const DEVICE_ID = "e00fce68a1b2c3d4e5f60718";
+const size_t PAYLOAD_TEXT_SIZE = (CompactPayload::MAX_RECORD_SIZE + 2) / 3 * 4 + 1;
+
+bool failed = false;
+
+void printFlowBatch(const char* name, const char* const* channelNames, size_t channelCount,
+                    const FlowSample* samples, size_t count) {
+  char payload[PAYLOAD_TEXT_SIZE];
+  if (CompactPayload::encodeFlowBatch(DEVICE_ID, channelNames, channelCount, samples, count,
+                                      payload, sizeof(payload)) == 0) {
+    fprintf(stderr, "%s: encoder failed\n", name);
+    failed = true;
+    return;
+  }
+
+  printf("{\"case\": \"%s\", \"payload\": \"%s\", \"input\": {\"device_id\": \"%s\", \"channels\": [",
+         name, payload, DEVICE_ID);
+  for (size_t c = 0; c < channelCount; c++) {
+    printf("%s\"%s\"", c ? ", " : "", channelNames[c]);
+  }
+  printf("], \"samples\": [");
+  for (size_t i = 0; i < count; i++) {
+    const FlowSample& s = samples[i];
+    printf("%s{\"timestamp\": %lu, \"milli_gallons\": %lu, \"hourly_average_milli_gallons\": %lu, "
+           "\"channel_milli_gallons\": [",
+           i ? ", " : "", (unsigned long)s.timestamp, (unsigned long)s.milliGallons,
+           (unsigned long)s.hourlyAverageMilliGallons);
+    for (size_t c = 0; c < s.channelCount; c++) {
+      printf("%s%lu", c ? ", " : "", (unsigned long)s.channelMilliGallons[c]);
+    }
+    printf("]}");
+  }
+  printf("]}}\n");
+}
+
+void printDiagnostics(const char* name, const DiagnosticSample& d) {
+  char payload[PAYLOAD_TEXT_SIZE];
+  if (CompactPayload::encodeDiagnostics(DEVICE_ID, d, payload, sizeof(payload)) == 0) {
+    fprintf(stderr, "%s: encoder failed\n", name);
+    failed = true;
+    return;
+  }
+
+  printf("{\"case\": \"%s\", \"payload\": \"%s\", \"input\": {\"device_id\": \"%s\", "
+         "\"timestamp\": %lu, \"firmware\": \"%s\", \"reset_reason\": %lu, "
+         "\"lifetime_milli_gallons\": %llu, \"daily_milli_gallons\": %llu, \"hours_elapsed\": %lu, "
+         "\"total_pulses\": %lu, \"flow_events_today\": %lu, \"signal_strength\": %ld, "
+         "\"storage_records\": %lu, \"storage_writes_avoided\": %lu, \"queue_depth\": %lu, "
+         "\"queue_dropped\": %lu, \"flow_records_pending\": %lu, \"sleep_seconds\": %lu, "
+         "\"wakeups\": %lu, \"alert_flags\": %lu, \"continuous_seconds\": %lu, "
+         "\"longest_flow_seconds\": %lu, \"hour_floor_milli_gpm\": %lu, \"day_floor_milli_gpm\": %lu, "
+         "\"baseline_milli_gpm\": %lu, \"implausible_pulses\": %lu, \"peak_milli_gpm\": %lu, "
+         "\"average_milli_gpm\": %lu, \"watchdog_gap_millis\": %lu, \"worst_probe\": \"%s\", "
+         "\"worst_micros\": %lu, \"latency\": [",
+         name, payload, DEVICE_ID, (unsigned long)d.timestamp, d.firmware, (unsigned long)d.resetReason,
+         (unsigned long long)d.lifetimeMilliGallons, (unsigned long long)d.dailyMilliGallons,
+         (unsigned long)d.hoursElapsed, (unsigned long)d.totalPulses, (unsigned long)d.flowEventsToday,
+         (long)d.signalStrength, (unsigned long)d.storageRecords, (unsigned long)d.storageWritesAvoided,
+         (unsigned long)d.queueDepth, (unsigned long)d.queueDropped, (unsigned long)d.flowRecordsPending,
+         (unsigned long)d.sleepSeconds, (unsigned long)d.wakeups, (unsigned long)d.alertFlags,
+         (unsigned long)d.continuousSeconds, (unsigned long)d.longestFlowSeconds,
+         (unsigned long)d.hourFloorMilliGpm, (unsigned long)d.dayFloorMilliGpm,
+         (unsigned long)d.baselineMilliGpm, (unsigned long)d.implausiblePulses,
+         (unsigned long)d.peakMilliGpm, (unsigned long)d.averageMilliGpm,
+         (unsigned long)d.watchdogGapMillis, d.worstProbe, (unsigned long)d.worstMicros);
+  for (uint32_t i = 0; i < d.latencyCount; i++) {
+    const LatencySample& l = d.latency[i];
+    printf("%s{\"name\": \"%s\", \"micros\": [%lu, %lu, %lu, %lu]}", i ? ", " : "", l.name,
+           (unsigned long)l.minMicros, (unsigned long)l.p50Micros, (unsigned long)l.p99Micros,
+           (unsigned long)l.maxMicros);
+  }
+  printf("], \"channels\": [");
+  for (uint32_t i = 0; i < d.channelCount; i++) {
+    const ChannelSample& c = d.channels[i];
+    printf("%s{\"name\": \"%s\", \"lifetime_milli_gallons\": %llu, \"daily_milli_gallons\": %llu, "
+           "\"flow_events_today\": %lu}", i ? ", " : "", c.name,
+           (unsigned long long)c.lifetimeMilliGallons, (unsigned long long)c.dailyMilliGallons,
+           (unsigned long)c.flowEventsToday);
+  }
+  printf("]}}\n");
+}
+
+FlowSample flowSample(uint32_t timestamp, uint32_t milliGallons, uint32_t hourlyAverage) {
+  FlowSample sample = {};
+  sample.timestamp = timestamp;
+  sample.milliGallons = milliGallons;
+  sample.hourlyAverageMilliGallons = hourlyAverage;
+  return sample;
+}
+
+DiagnosticSample diagnosticSample() {
+  DiagnosticSample d = {};
+  d.timestamp = 1735776000;
+  strcpy(d.firmware, "1.4.0");
+  d.resetReason = 60;
+  d.lifetimeMilliGallons = 5000000123ULL;  // Past 32 bits
+  d.dailyMilliGallons = 1234565;            // Rounds half up to 1234.57
+  d.hoursElapsed = 2210;
+  d.totalPulses = 4000000000UL;
+  d.flowEventsToday = 12;
+  d.signalStrength = -3;                    // Zigzag of a negative value
+  d.storageRecords = 512;
+  d.storageWritesAvoided = 7;
+  d.queueDepth = 2;
+  d.queueDropped = 0;
+  d.flowRecordsPending = 5;
+  d.sleepSeconds = 30000;
+  d.wakeups = 41;
+  d.alertFlags = 0x5;
+  d.continuousSeconds = 127;                // Largest one-byte varint
+  d.longestFlowSeconds = 128;               // Smallest two-byte varint
+  d.hourFloorMilliGpm = 30;
+  d.dayFloorMilliGpm = 0;
+  d.baselineMilliGpm = 12345;
+  d.implausiblePulses = 3;
+  d.peakMilliGpm = 25005;
+  d.averageMilliGpm = 994;
+  return d;
+}
+
+} // namespace
+
+int main() {
+  // Hourly records, one out of order, with zero and multi-byte volumes
+  FlowSample single[] = {
+    flowSample(1735689600, 0, 0),
+    flowSample(1735693200, 1999, 150),
+    flowSample(1735696800, 250000, 10449),
+    flowSample(1735693300, 4294967295UL, 10450),
+  };
+  printFlowBatch("flow_single_meter", nullptr, 0, single, sizeof(single) / sizeof(single[0]));
+
+  // Three meters, including an hour recorded before two of them were added
+  const char* const names[] = {"fill", "backwash", "makeup"};
+  FlowSample metered[] = {
+    flowSample(1735689600, 1000, 1000),
+    flowSample(1735693200, 180000, 5500),
+    flowSample(1735696800, 2999, 5600),
+  };
+  metered[0].channelCount = 1;
+  metered[0].channelMilliGallons[0] = 1000;
+  for (size_t i = 1; i < 3; i++) {
+    metered[i].channelCount = 3;
+  }
+  metered[1].channelMilliGallons[0] = 0;
+  metered[1].channelMilliGallons[1] = 179000;
+  metered[1].channelMilliGallons[2] = 1000;
+  metered[2].channelMilliGallons[0] = 1999;
+  metered[2].channelMilliGallons[1] = 0;
+  metered[2].channelMilliGallons[2] = 1000;
+  printFlowBatch("flow_channels", names, 3, metered, sizeof(metered) / sizeof(metered[0]));
+
+  // Built without LATENCY_PROFILE: no probes, no worst sample
+  DiagnosticSample plain = diagnosticSample();
+  printDiagnostics("diagnostics_plain", plain);
+
+  DiagnosticSample profiled = diagnosticSample();
+  profiled.watchdogGapMillis = 1010;
+  strcpy(profiled.worstProbe, "publish");
+  profiled.worstMicros = 812345;
+  const char* const probes[] = {"publish", "display", "storage", "monitor"};
+  for (uint32_t i = 0; i < LATENCY_REPORT_PROBES; i++) {
+    LatencySample& l = profiled.latency[i];
+    strcpy(l.name, probes[i]);
+    l.minMicros = 10 * (i + 1);
+    l.p50Micros = 100 * (i + 1);
+    l.p99Micros = 1000 * (i + 1);
+    l.maxMicros = i == 0 ? 812345 : 5000 * (i + 1);
+  }
+  profiled.latencyCount = LATENCY_REPORT_PROBES;
+  profiled.channelCount = 3;
+  for (uint32_t i = 0; i < 3; i++) {
+    ChannelSample& c = profiled.channels[i];
+    strcpy(c.name, names[i]);
+    c.lifetimeMilliGallons = 1000000005ULL * (i + 1);
+    c.dailyMilliGallons = 4995 * (i + 1);
+    c.flowEventsToday = i;
+  }
+  printDiagnostics("diagnostics_profiled", profiled);
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,190 @@
+#!/usr/bin/env python3
+"""Compact payloads from the firmware encoder through the cloud decoder.
+
+compact_vectors (built from tests/compact_vectors.cpp and
+src/CompactPayload.cpp) prints what the encoder makes of a set of samples;
+every field lambda_function.decode_compact returns is checked against those
+samples. Older format versions are the same records cut short after the
+fields that version had, so each case is also decoded as versions 1 to 5.
+
+    make -C sim test
+"""
+
+import base64
+import json
+import os
+import subprocess
+import sys
+import unittest
+from decimal import Decimal, ROUND_HALF_UP
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+VECTORS = os.environ.get('COMPACT_VECTORS', os.path.join(HERE, '..', 'build', 'tests', 'compact_vectors'))
+sys.path.insert(0, os.path.join(HERE, '..', '..'))
+
+import lambda_function  # noqa: E402
+
+# Fields each diagnostics version adds, in lambda_function's names
+DIAGNOSTIC_FIELDS = {
+    1: ['device_id', 'timestamp', 'firmware', 'reset_reason', 'lifetime_gallons', 'daily_total',
+        'hours_elapsed', 'total_pulses', 'flow_events_today', 'signal_strength', 'storage_records',
+        'storage_writes_avoided', 'queue_depth', 'queue_dropped', 'flow_records_pending'],
+    2: ['sleep_seconds', 'wakeups'],
+    3: ['alert_flags', 'continuous_flow_s', 'longest_flow_s', 'hour_floor_gpm', 'day_floor_gpm',
+        'baseline_gpm', 'implausible_pulses'],
+    4: ['peak_gpm', 'average_gpm'],
+    5: ['watchdog_gap_ms', 'worst_probe', 'worst_us', 'latency_us'],
+    6: ['channels', 'channel_lifetime_gallons', 'channel_daily_total', 'channel_flow_events'],
+}
+
+
+def gallons(milli, decimals):
+    return (Decimal(milli) / 1000).quantize(Decimal(1).scaleb(-decimals), rounding=ROUND_HALF_UP)
+
+
+def load_vectors():
+    output = subprocess.run([VECTORS], stdout=subprocess.PIPE, check=True, universal_newlines=True).stdout
+    return {case['case']: case for case in map(json.loads, output.splitlines())}
+
+
+def as_version(payload, version):
+    """The record a firmware speaking an older version would have sent: the
+    shortest prefix that decodes as that version."""
+    record = base64.b64decode(payload)
+    for length in range(2, len(record) + 1):
+        text = base64.b64encode(bytes([version]) + record[1:length]).decode()
+        try:
+            return text, lambda_function.decode_compact(text)
+        except ValueError:
+            continue
+    raise AssertionError('no prefix decodes as version %d' % version)
+
+
+def expected_flow(data, version):
+    records = []
+    for sample in data['samples']:
+        record = {
+            'timestamp': sample['timestamp'],
+            'gallons_used': sample['milli_gallons'] // 1000,
+            'hourly_average': gallons(sample['hourly_average_milli_gallons'], 1),
+        }
+        if version >= 6 and data['channels']:
+            # Hours recorded before a meter was added carry zero for it
+            channel = sample['channel_milli_gallons'] + [0] * len(data['channels'])
+            record['channel_gallons'] = [m // 1000 for m in channel[:len(data['channels'])]]
+        records.append(record)
+    batch = {'device_id': data['device_id'], 'records': records}
+    if version >= 6 and data['channels']:
+        batch['channels'] = data['channels']
+    return batch
+
+
+def expected_diagnostics(data, version):
+    fields = {
+        'device_id': data['device_id'],
+        'timestamp': data['timestamp'],
+        'firmware': data['firmware'],
+        'reset_reason': {60: 'Watchdog Timer'}[data['reset_reason']],
+        'lifetime_gallons': gallons(data['lifetime_milli_gallons'], 2),
+        'daily_total': gallons(data['daily_milli_gallons'], 2),
+        'hours_elapsed': data['hours_elapsed'],
+        'total_pulses': data['total_pulses'],
+        'flow_events_today': data['flow_events_today'],
+        'signal_strength': data['signal_strength'],
+        'storage_records': data['storage_records'],
+        'storage_writes_avoided': data['storage_writes_avoided'],
+        'queue_depth': data['queue_depth'],
+        'queue_dropped': data['queue_dropped'],
+        'flow_records_pending': data['flow_records_pending'],
+        'sleep_seconds': data['sleep_seconds'],
+        'wakeups': data['wakeups'],
+        'alert_flags': data['alert_flags'],
+        'continuous_flow_s': data['continuous_seconds'],
+        'longest_flow_s': data['longest_flow_seconds'],
+        'hour_floor_gpm': gallons(data['hour_floor_milli_gpm'], 3),
+        'day_floor_gpm': gallons(data['day_floor_milli_gpm'], 3),
+        'baseline_gpm': gallons(data['baseline_milli_gpm'], 3),
+        'implausible_pulses': data['implausible_pulses'],
+        'peak_gpm': gallons(data['peak_milli_gpm'], 2),
+        'average_gpm': gallons(data['average_milli_gpm'], 2),
+    }
+    # Without probes the latency fields are left out, as in the JSON payload
+    if data['latency']:
+        fields['watchdog_gap_ms'] = data['watchdog_gap_millis']
+        fields['worst_probe'] = data['worst_probe']
+        fields['worst_us'] = data['worst_micros']
+        fields['latency_us'] = {probe['name']: probe['micros'] for probe in data['latency']}
+    if data['channels']:
+        fields['channels'] = [c['name'] for c in data['channels']]
+        fields['channel_lifetime_gallons'] = [gallons(c['lifetime_milli_gallons'], 2) for c in data['channels']]
+        fields['channel_daily_total'] = [gallons(c['daily_milli_gallons'], 2) for c in data['channels']]
+        fields['channel_flow_events'] = [c['flow_events_today'] for c in data['channels']]
+
+    present = [name for v in range(1, version + 1) for name in DIAGNOSTIC_FIELDS[v]]
+    return {name: value for name, value in fields.items() if name in present}
+
+
+class CompactRoundTripTest(unittest.TestCase):
+
+    @classmethod
+    def setUpClass(cls):
+        cls.vectors = load_vectors()
+
+    def check_flow(self, name):
+        case = self.vectors[name]
+        self.assertEqual(lambda_function.decode_compact(case['payload']),
+                         expected_flow(case['input'], lambda_function.COMPACT_PAYLOAD_VERSION))
+        for version in range(1, lambda_function.COMPACT_PAYLOAD_VERSION):
+            with self.subTest(version=version):
+                _, decoded = as_version(case['payload'], version)
+                self.assertEqual(decoded, expected_flow(case['input'], version))
+
+    def check_diagnostics(self, name):
+        case = self.vectors[name]
+        self.assertEqual(lambda_function.decode_compact(case['payload']),
+                         expected_diagnostics(case['input'], lambda_function.COMPACT_PAYLOAD_VERSION))
+        for version in range(1, lambda_function.COMPACT_PAYLOAD_VERSION):
+            with self.subTest(version=version):
+                _, decoded = as_version(case['payload'], version)
+                self.assertEqual(decoded, expected_diagnostics(case['input'], version))
+
+    def test_flow_batch_single_meter(self):
+        self.check_flow('flow_single_meter')
+
+    def test_flow_batch_with_channels(self):
+        self.check_flow('flow_channels')
+
+    def test_diagnostics_without_latency_probes(self):
+        self.check_diagnostics('diagnostics_plain')
+
+    def test_diagnostics_with_latency_probes(self):
+        self.check_diagnostics('diagnostics_profiled')
+
+    def test_every_case_covered(self):
+        self.assertEqual(set(self.vectors), {'flow_single_meter', 'flow_channels',
+                                             'diagnostics_plain', 'diagnostics_profiled'})
+
+    def test_parse_device_data(self):
+        # The webhook path tells compact payloads from JSON by the first character
+        case = self.vectors['flow_channels']
+        self.assertEqual(lambda_function.parse_device_data(case['payload'] + '\n'),
+                         lambda_function.decode_compact(case['payload']))
+
+    def test_damaged_payloads(self):
+        payload = self.vectors['diagnostics_profiled']['payload']
+        record = base64.b64decode(payload)
+        for length in range(len(record) - 1):
+            truncated = base64.b64encode(record[:length]).decode()
+            with self.subTest(length=length), self.assertRaises(ValueError):
+                lambda_function.decode_compact(truncated)
+        for version in (0, lambda_function.COMPACT_PAYLOAD_VERSION + 1):
+            with self.subTest(version=version), self.assertRaises(ValueError):
+                lambda_function.decode_compact(base64.b64encode(bytes([version]) + record[1:]).decode())
+        with self.assertRaises(ValueError):
+            lambda_function.decode_compact(base64.b64encode(record[:1] + b'\x07' + record[2:]).decode())
+        with self.assertRaises(ValueError):
+            lambda_function.decode_compact(payload[:-2] + '*=')
+
+
+if __name__ == '__main__':
+    unittest.main()
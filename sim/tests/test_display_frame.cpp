@@ -0,0 +1,225 @@
+// DisplayFrame decoder against damaged and foreign frames: everything the
+// display could see on a noisy or mismatched link must be rejected, and
+// payloads full of zeros must survive the COBS round trip.
+//
+//   make -C sim test
+
+#include "DisplayFrame.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+namespace {
+
+int failures = 0;
+
+#define CHECK(condition) check((condition), #condition, __LINE__)
+
+void check(bool ok, const char* what, int line) {
+  if (!ok) {
+    printf("FAIL line %d: %s\n", line, what);
+    failures++;
+  }
+}
+
+DisplayStatus sampleStatus() {
+  DisplayStatus status = {};
+  status.flags = DISPLAY_FLAG_FLOW_ACTIVE | DISPLAY_FLAG_TIME_VALID;
+  status.gpmCenti = 1234;
+  status.peakGpmCenti = 2500;
+  status.lifetimeMilliGallons = 123456789012ULL;
+  status.dailyMilliGallons = 456789;
+  status.flowEventsToday = 17;
+  status.signalPercent = 62;
+  status.hour = 13;
+  status.minute = 45;
+  status.second = 9;
+  return status;
+}
+
+bool sameStatus(const DisplayStatus& a, const DisplayStatus& b) {
+  return a.flags == b.flags && a.gpmCenti == b.gpmCenti && a.peakGpmCenti == b.peakGpmCenti &&
+         a.lifetimeMilliGallons == b.lifetimeMilliGallons && a.dailyMilliGallons == b.dailyMilliGallons &&
+         a.flowEventsToday == b.flowEventsToday && a.signalPercent == b.signalPercent &&
+         a.hour == b.hour && a.minute == b.minute && a.second == b.second;
+}
+
+std::vector<uint8_t> encode(const DisplayStatus& status) {
+  std::vector<uint8_t> frame(DisplayFrame::MAX_FRAME_SIZE);
+  frame.resize(DisplayFrame::encode(status, frame.data(), frame.size()));
+  return frame;
+}
+
+// A raw frame with a valid CRC, framed the way encode() would
+std::vector<uint8_t> frameRaw(uint8_t* raw) {
+  uint16_t crc = DisplayFrame::crc16(raw, DisplayFrame::PAYLOAD_SIZE);
+  raw[DisplayFrame::PAYLOAD_SIZE] = (uint8_t)crc;
+  raw[DisplayFrame::PAYLOAD_SIZE + 1] = (uint8_t)(crc >> 8);
+  std::vector<uint8_t> frame(DisplayFrame::MAX_FRAME_SIZE);
+  size_t length = DisplayFrame::cobsEncode(raw, DisplayFrame::RAW_SIZE, frame.data());
+  frame[length++] = 0x00;
+  frame.resize(length);
+  return frame;
+}
+
+DisplayFrame::DecodeResult decode(const std::vector<uint8_t>& frame) {
+  DisplayStatus status = {};
+  return DisplayFrame::decode(frame.data(), frame.size(), status);
+}
+
+void testRoundTrip() {
+  DisplayStatus decoded = {};
+  std::vector<uint8_t> frame = encode(sampleStatus());
+  CHECK(frame.size() == 29);
+  CHECK(DisplayFrame::decode(frame.data(), frame.size(), decoded) == DisplayFrame::DECODE_OK);
+  CHECK(sameStatus(decoded, sampleStatus()));
+
+  // The trailing delimiter is optional
+  CHECK(DisplayFrame::decode(frame.data(), frame.size() - 1, decoded) == DisplayFrame::DECODE_OK);
+}
+
+void testZeroPayload() {
+  // Mostly zero bytes: each one becomes a COBS code, none may reach the wire
+  DisplayStatus zeros = {};
+  std::vector<uint8_t> frame = encode(zeros);
+  CHECK(memchr(frame.data(), 0x00, frame.size() - 1) == nullptr);
+  CHECK(frame.back() == 0x00);
+
+  DisplayStatus decoded = sampleStatus();
+  CHECK(DisplayFrame::decode(frame.data(), frame.size(), decoded) == DisplayFrame::DECODE_OK);
+  CHECK(sameStatus(decoded, zeros));
+
+  // Zeros inside multi-byte fields
+  DisplayStatus sparse = sampleStatus();
+  sparse.lifetimeMilliGallons = 0x0100000000000001ULL;
+  sparse.dailyMilliGallons = 0x00010000;
+  sparse.gpmCenti = 0x0100;
+  frame = encode(sparse);
+  CHECK(memchr(frame.data(), 0x00, frame.size() - 1) == nullptr);
+  CHECK(DisplayFrame::decode(frame.data(), frame.size(), decoded) == DisplayFrame::DECODE_OK);
+  CHECK(sameStatus(decoded, sparse));
+}
+
+void testCrcMismatch() {
+  std::vector<uint8_t> frame = encode(sampleStatus());
+  // Flip a bit in every data byte in turn; the COBS code bytes are checked below
+  for (size_t i = 1; i + 1 < frame.size(); i++) {
+    std::vector<uint8_t> damaged = frame;
+    damaged[i] ^= 0x10;
+    if (damaged[i] == 0x00) {
+      continue;
+    }
+    DisplayFrame::DecodeResult result = decode(damaged);
+    CHECK(result == DisplayFrame::DECODE_BAD_CRC || result == DisplayFrame::DECODE_BAD_FRAMING);
+  }
+
+  // A value change that keeps the framing intact is a CRC failure
+  std::vector<uint8_t> damaged = frame;
+  damaged[5] ^= 0x01;
+  CHECK(decode(damaged) == DisplayFrame::DECODE_BAD_CRC);
+
+  // CRC-16/CCITT-FALSE check value
+  CHECK(DisplayFrame::crc16((const uint8_t*)"123456789", 9) == 0x29B1);
+}
+
+void testBadFraming() {
+  std::vector<uint8_t> frame = encode(sampleStatus());
+
+  // Truncated at every length
+  for (size_t length = 0; length + 1 < frame.size(); length++) {
+    std::vector<uint8_t> truncated(frame.begin(), frame.begin() + length);
+    CHECK(decode(truncated) == DisplayFrame::DECODE_BAD_FRAMING);
+  }
+
+  // Two frames run together when a delimiter is lost
+  std::vector<uint8_t> joined(frame.begin(), frame.end() - 1);
+  joined.insert(joined.end(), frame.begin(), frame.end());
+  CHECK(decode(joined) == DisplayFrame::DECODE_BAD_FRAMING);
+
+  // A code byte pointing past the end of the frame
+  std::vector<uint8_t> overrun = frame;
+  overrun[0] = 0xFE;
+  CHECK(decode(overrun) == DisplayFrame::DECODE_BAD_FRAMING);
+
+  // A zero inside the frame is never valid COBS
+  std::vector<uint8_t> embedded = frame;
+  embedded[3] = 0x00;
+  CHECK(decode(embedded) == DisplayFrame::DECODE_BAD_FRAMING);
+
+  // An extra byte
+  std::vector<uint8_t> longer(frame.begin(), frame.end() - 1);
+  longer.push_back(0x01);
+  longer.push_back(0x00);
+  CHECK(decode(longer) == DisplayFrame::DECODE_BAD_FRAMING);
+}
+
+void testCobs() {
+  uint8_t out[8];
+  const uint8_t empty[] = {0x01};
+  CHECK(DisplayFrame::cobsDecode(empty, sizeof(empty), out, sizeof(out)) == 0);
+
+  const uint8_t zero[] = {0x01, 0x01};
+  CHECK(DisplayFrame::cobsDecode(zero, sizeof(zero), out, sizeof(out)) == 1 && out[0] == 0x00);
+
+  const uint8_t zeroCode[] = {0x02, 0x11, 0x00, 0x22};
+  CHECK(DisplayFrame::cobsDecode(zeroCode, sizeof(zeroCode), out, sizeof(out)) == 0);
+
+  const uint8_t overrun[] = {0x05, 0x11, 0x22};
+  CHECK(DisplayFrame::cobsDecode(overrun, sizeof(overrun), out, sizeof(out)) == 0);
+
+  // Output that doesn't fit the caller's buffer
+  const uint8_t tooLong[] = {0x04, 0x11, 0x22, 0x33, 0x04, 0x44, 0x55, 0x66};
+  CHECK(DisplayFrame::cobsDecode(tooLong, sizeof(tooLong), out, 6) == 0);
+  CHECK(DisplayFrame::cobsDecode(tooLong, sizeof(tooLong), out, 7) == 7);
+
+  // 254 non-zero bytes fill a block without an implied zero
+  uint8_t run[300];
+  uint8_t encoded[310];
+  uint8_t decoded[300];
+  for (size_t i = 0; i < sizeof(run); i++) {
+    run[i] = (uint8_t)(i % 255 + 1);
+  }
+  size_t length = DisplayFrame::cobsEncode(run, sizeof(run), encoded);
+  CHECK(memchr(encoded, 0x00, length) == nullptr);
+  CHECK(DisplayFrame::cobsDecode(encoded, length, decoded, sizeof(decoded)) == sizeof(run));
+  CHECK(memcmp(run, decoded, sizeof(run)) == 0);
+}
+
+void testWrongVersionAndType() {
+  uint8_t raw[DisplayFrame::RAW_SIZE] = {};
+  raw[0] = DISPLAY_FRAME_VERSION + 1;
+  raw[1] = DISPLAY_FRAME_STATUS;
+  CHECK(decode(frameRaw(raw)) == DisplayFrame::DECODE_BAD_VERSION);
+
+  raw[0] = 0x00;
+  CHECK(decode(frameRaw(raw)) == DisplayFrame::DECODE_BAD_VERSION);
+
+  raw[0] = DISPLAY_FRAME_VERSION;
+  raw[1] = DISPLAY_FRAME_STATUS + 1;
+  CHECK(decode(frameRaw(raw)) == DisplayFrame::DECODE_UNKNOWN_TYPE);
+
+  raw[1] = DISPLAY_FRAME_STATUS;
+  CHECK(decode(frameRaw(raw)) == DisplayFrame::DECODE_OK);
+}
+
+void testSmallBuffer() {
+  uint8_t out[DisplayFrame::MAX_FRAME_SIZE];
+  CHECK(DisplayFrame::encode(sampleStatus(), out, sizeof(out) - 1) == 0);
+  CHECK(DisplayFrame::encode(sampleStatus(), out, sizeof(out)) > 0);
+}
+
+} // namespace
+
+int main() {
+  testRoundTrip();
+  testZeroPayload();
+  testCrcMismatch();
+  testBadFraming();
+  testCobs();
+  testWrongVersionAndType();
+  testSmallBuffer();
+
+  printf("test_display_frame: %s\n", failures == 0 ? "OK" : "FAILED");
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,116 @@
+// FlowRate's daily average against flows it used to get wrong: a trickle
+// whose pulses leave most slots empty, and the idle wait before flow is
+// declared over.
+//
+//   make -C sim test
+
+#include "FlowRate.h"
+
+#include <math.h>
+#include <stdio.h>
+
+namespace {
+
+int failures = 0;
+
+#define CHECK(condition) check((condition), #condition, __LINE__)
+#define CHECK_NEAR(value, expected, tolerance) \
+  check(fabsf((value) - (expected)) <= (tolerance), #value " near " #expected, __LINE__)
+
+void check(bool ok, const char* what, int line) {
+  if (!ok) {
+    printf("FAIL line %d: %s\n", line, what);
+    failures++;
+  }
+}
+
+const float PULSES_PER_GALLON = 1700.0f;
+const uint32_t MICROS_PER_MINUTE = 60000000UL;
+
+// Evenly spaced single pulses at gpm for minutes, drained every 100 ms the
+// way FlowSensor does; returns the time after the last drain
+uint32_t flow(FlowRate& rate, uint32_t start, float gpm, float minutes) {
+  uint32_t end = start + (uint32_t)(minutes * MICROS_PER_MINUTE);
+  float interval = 60.0e6f / (gpm * PULSES_PER_GALLON);
+  float next = 0.0f;
+  for (uint32_t now = start; now < end; now += 100000) {
+    while (start + (uint32_t)next <= now) {
+      rate.addPulses(start + (uint32_t)next, 1);
+      next += interval;
+    }
+    rate.advance(now);
+  }
+  return end;
+}
+
+uint32_t idle(FlowRate& rate, uint32_t start, float minutes) {
+  return flow(rate, start, 0.0001f, minutes);
+}
+
+void testTrickle() {
+  // One pulse every 1.2 s: four of five slots are empty
+  FlowRate rate(PULSES_PER_GALLON);
+  rate.setFlowing(true);
+  flow(rate, 0, 0.03f, 60.0f);
+  CHECK_NEAR(rate.getAverageGpm(), 0.03f, 0.001f);
+}
+
+void testFlowTimeout() {
+  // The idle wait before flow ends doesn't dilute the average
+  FlowRate rate(PULSES_PER_GALLON);
+  rate.setFlowing(true);
+  uint32_t now = flow(rate, 0, 8.0f, 15.0f);
+  now = idle(rate, now, 0.5f);
+  rate.setFlowing(false);
+  CHECK_NEAR(rate.getAverageGpm(), 8.0f, 0.02f);
+
+  // Nor does time between events
+  now = idle(rate, now, 30.0f);
+  rate.setFlowing(true);
+  now = flow(rate, now, 4.0f, 15.0f);
+  rate.setFlowing(false);
+  CHECK_NEAR(rate.getAverageGpm(), 6.0f, 0.02f);
+}
+
+void testNotFlowing() {
+  // Pulses before flow is declared don't count
+  FlowRate rate(PULSES_PER_GALLON);
+  flow(rate, 0, 5.0f, 1.0f);
+  CHECK(rate.getAverageGpm() == 0.0f);
+}
+
+void testLongGap() {
+  // A gap past the whole window (a late pass, a sleep) is still flowing time
+  FlowRate rate(PULSES_PER_GALLON);
+  rate.setFlowing(true);
+  uint32_t now = flow(rate, 0, 2.0f, 1.0f);
+  rate.addPulses(now + 10000000UL, 567);
+  rate.advance(now + 10000000UL);
+  flow(rate, now + 10000000UL, 2.0f, 1.0f);
+  CHECK_NEAR(rate.getAverageGpm(), 2.0f, 0.05f);
+}
+
+void testDailyReset() {
+  FlowRate rate(PULSES_PER_GALLON);
+  rate.setFlowing(true);
+  uint32_t now = flow(rate, 0, 8.0f, 5.0f);
+  rate.resetDaily();
+  CHECK(rate.getAverageGpm() == 0.0f);
+
+  // Flow running through the reset carries on from there
+  flow(rate, now, 3.0f, 5.0f);
+  CHECK_NEAR(rate.getAverageGpm(), 3.0f, 0.02f);
+}
+
+} // namespace
+
+int main() {
+  testTrickle();
+  testFlowTimeout();
+  testNotFlowing();
+  testLongGap();
+  testDailyReset();
+
+  printf("test_flow_rate: %s\n", failures == 0 ? "OK" : "FAILED");
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,237 @@
+#!/usr/bin/env python3
+"""flow_data ingestion in lambda_function.py against the DynamoDB stand-in
+from tools/ingest_local.py: what is rejected with 400, what a redelivered
+payload leaves in the table, and what happens when writes keep coming back
+unprocessed.
+
+    make -C sim test
+"""
+
+import base64
+import json
+import os
+import subprocess
+import sys
+import unittest
+from decimal import Decimal
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+SIM = os.environ.get('BORON_SIM', os.path.join(HERE, '..', 'build', 'boron_sim'))
+sys.path.insert(0, os.path.join(HERE, '..', '..'))
+sys.path.insert(0, os.path.join(HERE, '..', '..', 'tools'))
+
+import lambda_function  # noqa: E402
+import ingest_local  # noqa: E402
+
+DEVICE = 'pool_1'
+
+
+def batch(*records, **extra):
+    payload = {'device_id': DEVICE, 'records': list(records)}
+    payload.update(extra)
+    return json.dumps(payload)
+
+
+def record(timestamp, gallons, average=None, channels=None):
+    entry = {'timestamp': timestamp, 'gallons_used': gallons}
+    if average is not None:
+        entry['hourly_average'] = average
+    if channels is not None:
+        entry['channel_gallons'] = channels
+    return entry
+
+
+def simulated_payloads(*options):
+    output = subprocess.run([SIM, '--dump-publishes'] + list(options), stdout=subprocess.PIPE,
+                            check=True, universal_newlines=True).stdout
+    return list(ingest_local.flow_data_payloads(output.splitlines()))
+
+
+class IngestTest(unittest.TestCase):
+    def stand_in(self, sort_key='recordKey', unprocessed=0.0):
+        self.fake = ingest_local.FakeDynamoDB(sort_key, unprocessed)
+        ingest_local.use_stand_in(self.fake)
+        return self.fake
+
+    def table(self):
+        return {self.fake.key(item): item for item in self.fake.items()}
+
+    def tearDown(self):
+        lambda_function.TABLE_SORT_KEY = 'recordKey'
+        lambda_function.dynamodb = None
+
+
+class RejectionTest(IngestTest):
+    """Payloads no retry can fix get 400 and write nothing."""
+
+    def assertRejected(self, payload, event_name='flow_data'):
+        status, body = ingest_local.deliver(payload, event_name)
+        self.assertEqual(status, 400, body)
+        self.assertFalse(body['success'])
+        self.assertEqual(self.fake.requests, 0)
+
+    def setUp(self):
+        self.stand_in()
+
+    def test_not_json(self):
+        self.assertRejected('{"device_id": "pool_1", "records": [')
+
+    def test_bad_compact(self):
+        self.assertRejected('AQE=')                      # Truncated record
+        self.assertRejected('not base64!')
+        self.assertRejected(base64.b64encode(bytes([99, 1, 0])).decode())  # Unknown version
+
+    def test_diagnostic_payload(self):
+        self.assertRejected(json.dumps({'device_id': DEVICE, 'timestamp': 1735693201,
+                                        'lifetime_gallons': 10.5}), 'diagnostic_data')
+
+    def test_missing_device(self):
+        self.assertRejected(json.dumps({'records': [record(1735693201, 6)]}))
+        self.assertRejected(json.dumps({'device_id': '', 'records': [record(1735693201, 6)]}))
+
+    def test_bad_records(self):
+        self.assertRejected(batch())
+        self.assertRejected(json.dumps({'device_id': DEVICE, 'records': {}}))
+        self.assertRejected(batch('hourly'))
+        self.assertRejected(batch(record(0, 6)))
+        self.assertRejected(batch(record(2 ** 32, 6)))
+        self.assertRejected(batch(record('1735693201', 6)))
+        self.assertRejected(batch(record(1735693201, -1)))
+        self.assertRejected(batch(record(1735693201, True)))
+        self.assertRejected(batch(record(1735693201, 6, average='2.5')))
+
+    def test_bad_channels(self):
+        self.assertRejected(batch(record(1735693201, 6, channels=[6, 0])))
+        self.assertRejected(batch(record(1735693201, 6, channels=[6]), channels=['fill', 'backwash']))
+        self.assertRejected(batch(record(1735693201, 6, channels=[6, -1]), channels=['fill', 'backwash']))
+        self.assertRejected(batch(record(1735693201, 6, channels=[6]), channels=['']))
+
+    def test_one_bad_record_rejects_the_batch(self):
+        self.assertRejected(batch(record(1735693201, 6), record(1735696801, -2)))
+
+    def test_older_firmware_accepted(self):
+        # A single record, with the signal_strength older firmware sent
+        status, body = ingest_local.deliver(json.dumps({'device_id': DEVICE, 'timestamp': 1735693201,
+                                                        'gallons_used': 25.75, 'signal_strength': 40}))
+        self.assertEqual(status, 200, body)
+        item = self.table()[(DEVICE, '1735693201#0')]
+        self.assertEqual(item['gallonsUsed'], Decimal('25.75'))
+        self.assertNotIn('signalStrength', item)
+
+
+class RedeliveryTest(IngestTest):
+    """A payload delivered again overwrites its own items."""
+
+    def deliver_all(self, payloads, times):
+        for payload in payloads:
+            for _ in range(times):
+                status, body = ingest_local.deliver(payload)
+                self.assertEqual(status, 200, body)
+        return self.table()
+
+    def check_simulated(self, *options):
+        payloads = simulated_payloads('--days', '2', '--scenario', 'bursts', *options)
+        self.assertGreater(len(payloads), 10)
+        records = [r for p in payloads for r in lambda_function.parse_device_data(p)['records']]
+        gallons = sum(Decimal(str(r['gallons_used'])) for r in records)
+        self.assertGreater(gallons, 0)
+
+        for sort_key in lambda_function.SORT_KEYS:
+            self.stand_in(sort_key)
+            once = self.deliver_all(payloads, 1)
+            self.stand_in(sort_key, unprocessed=0.3)
+            thrice = self.deliver_all(payloads, 3)
+            self.assertGreater(self.fake.held, 0)
+            self.assertEqual(once, thrice)
+            if sort_key == 'recordKey':
+                self.assertEqual(len(once), len(records))
+            self.assertEqual(sum(item['gallonsUsed'] for item in once.values()), gallons)
+
+    def test_simulated_json(self):
+        self.check_simulated()
+
+    def test_simulated_compact(self):
+        self.check_simulated('--payload-format', 'compact')
+
+    def test_same_second_record_key(self):
+        # Out-of-order records can share a second; the sequence tells them apart
+        self.stand_in('recordKey')
+        table = self.deliver_all([batch(record(1735693201, 6, 2.5), record(1735693201, 3, 2.0),
+                                        record(1735696801, 1, 1.5))], 2)
+        self.assertEqual(sorted(table), [(DEVICE, '1735693201#0'), (DEVICE, '1735693201#1'),
+                                         (DEVICE, '1735696801#0')])
+        self.assertEqual(table[(DEVICE, '1735693201#1')]['gallonsUsed'], 3)
+
+    def test_same_second_timestamp_key(self):
+        # A timestamp table holds one item per second: the records are merged
+        # rather than sent as duplicate keys, which BatchWriteItem refuses
+        self.stand_in('timestamp')
+        table = self.deliver_all([batch(record(1735693201, 6, 2.5, [6, 0]),
+                                        record(1735693201, 3, 2.0, [1, 2]),
+                                        record(1735696801, 1, 1.5, [1, 0]),
+                                        channels=['fill', 'backwash'])], 2)
+        self.assertEqual(sorted(table), [(DEVICE, 1735693201), (DEVICE, 1735696801)])
+        merged = table[(DEVICE, 1735693201)]
+        self.assertEqual(merged['gallonsUsed'], 9)
+        self.assertEqual(merged['hourlyAverage'], Decimal('2.0'))
+        self.assertEqual(merged['channelGallons'], {'fill': 7, 'backwash': 2})
+        self.assertEqual(merged['mergedRecords'], 2)
+        self.assertNotIn('mergedRecords', table[(DEVICE, 1735696801)])
+
+    def test_batches_split_at_the_write_limit(self):
+        self.stand_in()
+        records = [record(1735693201 + 3600 * i, i % 7) for i in range(2 * lambda_function.BATCH_WRITE_LIMIT + 3)]
+        table = self.deliver_all([batch(*records)], 2)
+        self.assertEqual(len(table), len(records))
+        self.assertEqual(self.fake.requests, 6)
+
+
+class RetryExhaustionTest(IngestTest):
+    """Writes that stay unprocessed fail the payload so the webhook retries."""
+
+    def test_unprocessed_until_the_last_attempt(self):
+        self.stand_in(unprocessed=1.0)
+        payload = batch(record(1735693201, 6), record(1735696801, 2))
+        status, body = ingest_local.deliver(payload)
+        self.assertEqual(status, 500, body)
+        self.assertFalse(body['success'])
+        self.assertIn('unprocessed', body['error'])
+        self.assertEqual(self.fake.requests, lambda_function.MAX_WRITE_ATTEMPTS)
+        self.assertEqual(self.table(), {})
+
+        # The webhook's retry lands the payload once DynamoDB catches up
+        self.fake.unprocessed = 0.0
+        status, body = ingest_local.deliver(payload)
+        self.assertEqual(status, 200, body)
+        self.assertEqual(len(self.table()), 2)
+
+    def test_partial_write_then_retry(self):
+        # Some items of a failed payload may have landed; the retry rewrites
+        # them under the same keys
+        self.stand_in(unprocessed=0.5)
+        lambda_function.MAX_WRITE_ATTEMPTS, attempts = 1, lambda_function.MAX_WRITE_ATTEMPTS
+        try:
+            records = [record(1735693201 + 3600 * i, 1) for i in range(20)]
+            status, _ = ingest_local.deliver(batch(*records))
+            self.assertEqual(status, 500)
+            self.assertLess(len(self.table()), 20)
+        finally:
+            lambda_function.MAX_WRITE_ATTEMPTS = attempts
+
+        self.fake.unprocessed = 0.0
+        status, _ = ingest_local.deliver(batch(*records))
+        self.assertEqual(status, 200)
+        self.assertEqual(len(self.table()), 20)
+        self.assertEqual(sum(item['gallonsUsed'] for item in self.table().values()), 20)
+
+    def test_unknown_sort_key(self):
+        # A misconfigured table is a server error, retried once it is fixed
+        self.stand_in()
+        lambda_function.TABLE_SORT_KEY = 'sequence'
+        status, body = ingest_local.deliver(batch(record(1735693201, 6)))
+        self.assertEqual(status, 500, body)
+        self.assertIn('TABLE_SORT_KEY', body['error'])
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -0,0 +1,129 @@
+#!/usr/bin/env python3
+"""Power cuts during the version 3 -> 4 EEPROM migration.
+
+Seeds a version 3 journal, boots the simulator with the power cut during each
+EEPROM put of the migration in turn, then boots again normally. Every image
+left behind must still hold the counters, in one layout or the other, and the
+second boot must come up on version 4 with them.
+
+    make -C sim test
+    BORON_SIM=sim/build/boron_sim python3 sim/tests/test_storage_migration.py
+"""
+
+import os
+import struct
+import subprocess
+import tempfile
+import unittest
+import zlib
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+SIM = os.environ.get('BORON_SIM', os.path.join(HERE, '..', 'build', 'boron_sim'))
+
+EEPROM_SIZE = 4096
+MAGIC = 0xA753B912
+JOURNAL_START = 64
+CHANNELS = 3
+
+# Storage::RecordV3 and Storage::Record (MAX_FLOW_CHANNELS = 3)
+RECORD_V3 = struct.Struct('<IiQQiiI')
+RECORD_V4 = struct.Struct('<IiiI%dQ%dQ%di' % (CHANNELS, CHANNELS, CHANNELS))
+
+LIFETIME = 123456789  # milli-gallons
+DAILY = 4321
+FLOW_EVENTS = 17
+SEQUENCE = 500
+V3_RECORDS = 31       # records before the newest; the newest one's CRC sits
+                      # where version 4 slot 15 keeps its own
+
+
+def seal(layout, fields):
+    body = layout.pack(*fields)
+    return body + struct.pack('<I', zlib.crc32(body))
+
+
+def v3_image():
+    """A version 3 EEPROM whose newest record sits mid-journal, with older
+    records in the slots around it."""
+    image = bytearray(b'\xff' * EEPROM_SIZE)
+    image[0:8] = struct.pack('<II', MAGIC, 3)
+    size = RECORD_V3.size + 4
+    for slot in range(V3_RECORDS + 1):
+        age = V3_RECORDS - slot
+        record = seal(RECORD_V3, (SEQUENCE - age, FLOW_EVENTS - age, LIFETIME - 1000 * age,
+                                  DAILY, 10, 2, 1735689600))
+        image[JOURNAL_START + slot * size:JOURNAL_START + (slot + 1) * size] = record
+    return bytes(image)
+
+
+def newest(image, layout):
+    size = layout.size + 4
+    found = None
+    for address in range(JOURNAL_START, EEPROM_SIZE - size + 1, size):
+        body = image[address:address + layout.size]
+        crc, = struct.unpack_from('<I', image, address + layout.size)
+        if crc != zlib.crc32(body):
+            continue
+        fields = layout.unpack(body)
+        if found is None or ((fields[0] - found[0]) & 0xFFFFFFFF) < 0x80000000:
+            found = fields
+    return found
+
+
+def counters(image):
+    """(version, lifetime, daily, events) the firmware would recover."""
+    magic, version = struct.unpack_from('<II', image, 0)
+    if magic != MAGIC:
+        return None
+    if version == 3:
+        record = newest(image, RECORD_V3)
+        return record and (3, record[2], record[3], record[1])
+    if version == 4:
+        record = newest(image, RECORD_V4)
+        return record and (4, record[4], record[4 + CHANNELS], record[4 + 2 * CHANNELS])
+    return None
+
+
+def boot(directory, *extra):
+    result = subprocess.run([SIM, '--hours', '0.01', '--scenario', 'idle', '--connect-ms', '-1',
+                             '--flash-dir', directory, '--power-cycle'] + list(extra),
+                            stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+                            universal_newlines=True, check=True)
+    return result.stdout
+
+
+def eeprom(directory):
+    with open(os.path.join(directory, 'sim_eeprom.bin'), 'rb') as f:
+        return f.read()
+
+
+class MigrationPowerCutTest(unittest.TestCase):
+
+    def test_uninterrupted_migration(self):
+        with tempfile.TemporaryDirectory() as directory:
+            with open(os.path.join(directory, 'sim_eeprom.bin'), 'wb') as f:
+                f.write(v3_image())
+            boot(directory)
+            self.assertEqual(counters(eeprom(directory)), (4, LIFETIME, DAILY, FLOW_EVENTS))
+
+    def test_power_cut_during_each_put(self):
+        # The migration puts the first record, the two header words and a CRC
+        # in every other slot, and nothing else happens in an idle boot
+        slots = (EEPROM_SIZE - JOURNAL_START) // (RECORD_V4.size + 4)
+        for puts in range(1, slots + 3):
+            with self.subTest(puts=puts), tempfile.TemporaryDirectory() as directory:
+                with open(os.path.join(directory, 'sim_eeprom.bin'), 'wb') as f:
+                    f.write(v3_image())
+
+                output = boot(directory, '--power-cut-puts', str(puts))
+                self.assertIn('power:       cut during EEPROM put %d' % puts, output)
+                state = counters(eeprom(directory))
+                self.assertIsNotNone(state, 'no readable journal after the cut')
+                self.assertEqual(state[1:], (LIFETIME, DAILY, FLOW_EVENTS))
+
+                boot(directory)
+                self.assertEqual(counters(eeprom(directory)), (4, LIFETIME, DAILY, FLOW_EVENTS))
+
+
+if __name__ == '__main__':
+    unittest.main()
@@ -1,9 +1,30 @@
 #include "Particle.h"
+#include "FlowChannels.h"
 #include "FlowSensor.h"
+#include "FlowHistory.h"
+#include "FlowAnalyzer.h"
 #include "DataReporter.h"
 #include "SystemMonitor.h"
 #include "Storage.h"
 #include "DisplayComm.h"
+#include "PublishQueue.h"
+#include "Clock.h"
+#include "Scheduler.h"
+#include "PowerManager.h"
+#include "Volume.h"
+#include "LatencyProfile.h"
+#include "DeferredLog.h"
+#include "ReportingPolicy.h"
+
+// Pulse source backend, chosen at build time. The default takes one interrupt
+// per pulse; PULSE_SOURCE_COUNTER counts edges in a hardware timer instead.
+#if defined(PULSE_SOURCE_COUNTER)
+#include "CounterPulseSource.h"
+#elif defined(PULSE_SOURCE_SIMULATED)
+#include "SimulatedPulseSource.h" // Host simulation build only
+#else
+#include "InterruptPulseSource.h"
+#endif
 
 SYSTEM_MODE(AUTOMATIC);
 SYSTEM_THREAD(ENABLED);
@@ -21,21 +42,123 @@ const int LED_PIN = D7;
 // Calibration value
 const float PULSES_PER_GALLON = 1700.0;
 
+// Meters on this device: the fill line, then the filter backwash line and the
+// makeup (auto-fill) line when fitted. Each has its own pin and calibration
+// from the meter's data sheet. FLOW_CHANNELS (FlowChannels.h) says how many.
+const int BACKWASH_SENSOR_PIN = D3;
+const int MAKEUP_SENSOR_PIN = D4;
+const float BACKWASH_PULSES_PER_GALLON = 330.0;
+const float MAKEUP_PULSES_PER_GALLON = 1700.0;
+
+// Flash file system directory for data that must survive a reboot
+#ifndef USER_FILE_DIR
+#define USER_FILE_DIR "/usr"
+#endif
+
+// Pending publishes kept while the cloud is unreachable
+const size_t PUBLISH_QUEUE_BYTES = 65536;
+
 // Component instances
-FlowSensor flowSensor(FLOW_SENSOR_PIN, LED_PIN, PULSES_PER_GALLON);
-DataReporter dataReporter(&flowSensor, "pool_1");
+#if defined(PULSE_SOURCE_COUNTER)
+typedef CounterPulseSource MeterPulseSource;
+#elif defined(PULSE_SOURCE_SIMULATED)
+typedef SimulatedPulseSource MeterPulseSource;
+#else
+typedef InterruptPulseSource MeterPulseSource;
+#endif
+MeterPulseSource pulseSource(FLOW_SENSOR_PIN);
+FlowSensor flowSensor(&pulseSource, LED_PIN, PULSES_PER_GALLON);
+#if FLOW_CHANNELS > 1
+MeterPulseSource backwashPulseSource(BACKWASH_SENSOR_PIN);
+FlowSensor backwashSensor(&backwashPulseSource, -1, BACKWASH_PULSES_PER_GALLON, 1, "backwash");
+#endif
+#if FLOW_CHANNELS > 2
+MeterPulseSource makeupPulseSource(MAKEUP_SENSOR_PIN);
+FlowSensor makeupSensor(&makeupPulseSource, -1, MAKEUP_PULSES_PER_GALLON, 2, "makeup");
+#endif
+FlowHistory flowHistory(USER_FILE_DIR "/flow_history.dat");
+FlowAnalyzer flowAnalyzer(PULSES_PER_GALLON);
+PublishQueue publishQueue(USER_FILE_DIR "/publish_queue.dat", PUBLISH_QUEUE_BYTES);
+#if defined(COMPACT_PAYLOADS)
+DataReporter dataReporter(&flowSensor, &publishQueue, "pool_1", DataReporter::FORMAT_COMPACT);
+#else
+DataReporter dataReporter(&flowSensor, &publishQueue, "pool_1");
+#endif
+ReportingPolicy reportingPolicy(USER_FILE_DIR "/reporting_policy.dat");
 SystemMonitor systemMonitor;
+#if defined(DISPLAY_BINARY_FRAMES)
+DisplayComm displayComm(&flowSensor, DisplayComm::FORMAT_BINARY); // Needs a display build that decodes DisplayFrame
+#else
 DisplayComm displayComm(&flowSensor);
+#endif
+PowerManager powerManager(&flowSensor, &pulseSource, &publishQueue, &systemMonitor, FLOW_SENSOR_PIN);
 
 // Daily reset tracking
 unsigned long dailyResetTime;
 const unsigned long DAILY_RESET_INTERVAL = 86400000; // 24 hours in milliseconds
 
+// Task deadlines. Tasks whose module keeps its own timers (report cadence,
+// publish spacing, display checks and pacing, storage flushes, clock syncs)
+// reschedule themselves for the module's next deadline after every run; the
+// periods below only bound the wait for things no timer predicts, like the
+// cloud coming back. The pulse task wakes the display and report tasks when
+// flow starts or stops or an alert changes.
+//
+// Pulses are counted by the ISR or timer while loop() sleeps; the pulse task
+// only has to drain timestamps before the ring fills (512 entries, about a
+// second at the meter's maximum rate).
+Scheduler scheduler;
+const unsigned long BOOT_POLL_PERIOD = 1000;   // Until the boot sequence completes
+const unsigned long WATCHDOG_PERIOD = 10000;   // Checkins, well inside the 60 s timeout
+const unsigned long PULSE_PERIOD = 500;
+const unsigned long REPORT_PERIOD = 60000;
+const unsigned long REPORT_MIN_PERIOD = 1000;  // A report held back isn't retried sooner
+const unsigned long PUBLISH_PERIOD = 5000;
+const unsigned long DISPLAY_PERIOD = 60000;
+const unsigned long STORAGE_PERIOD = 60000;    // New unsaved changes start their timer
+const unsigned long CLOCK_PERIOD = 3600000;
+const unsigned long STATS_PERIOD = 3600000;
+const unsigned long POWER_PERIOD = 1000;
+const unsigned long MAX_IDLE = 1000;           // Backstop; the pulse task is always sooner
+int monitorTaskId = -1;
+int clockTaskId = -1;
+int displayTaskId = -1;
+int storageTaskId = -1;
+int reportTaskId = -1;
+int publishTaskId = -1;
+int dailyTaskId = -1;
+
+// Scheduled tasks
+void monitorTask(void* context, unsigned long currentTime);
+void clockTask(void* context, unsigned long currentTime);
+void displayTask(void* context, unsigned long currentTime);
+void storageTask(void* context, unsigned long currentTime);
+void statsTask(void* context, unsigned long currentTime);
+void pulseTask(void* context, unsigned long currentTime);
+void reportTask(void* context, unsigned long currentTime);
+void publishTask(void* context, unsigned long currentTime);
+void powerTask(void* context, unsigned long currentTime);
+void dailyResetTask(void* context, unsigned long currentTime);
+void startOperation();
+void runAgainIn(int id, unsigned long untilMs, unsigned long minMs, unsigned long maxMs);
+
+// Cloud functions
+int historyFunction(String tier);
+int fillFunction(String minutes);
+int reportingFunction(String settings);
+
 void setup() {
   delay(1000); // Brief delay for stability
   
   Log.info("Pool Flow Monitor Starting");
   
+  // Module logs are formatted and printed by a background thread; binary
+  // frames need tools/decode_log.py on the host
+#if defined(DLOG_BINARY)
+  DeferredLog::setBinary(true);
+#endif
+  DeferredLog::begin();
+  
   // Initialize Storage system
   Storage::begin();
   
@@ -48,56 +171,248 @@ void setup() {
     Storage::saveDailyResetTime(dailyResetTime);
   }
   
-  // Wait for time synchronization
-  Particle.syncTime();
-  waitFor(Time.isValid, 30000); // Wait up to 30 seconds for time sync
+  // Time syncs in the background; reports made before then are corrected
+  Clock::begin();
   
   // Initialize all system components
   systemMonitor.begin();
   flowSensor.begin();
+  flowHistory.begin();
+  flowSensor.setHistory(&flowHistory);
+  flowSensor.setAnalyzer(&flowAnalyzer);
+  publishQueue.begin();
+  reportingPolicy.begin();
   dataReporter.begin();
+  dataReporter.setPowerManager(&powerManager);
+  dataReporter.setPolicy(&reportingPolicy);
   displayComm.begin();
   
+  // The other meters are reported alongside the fill line and wake the
+  // device like it does; the display and analyzer follow the fill line
+#if FLOW_CHANNELS > 1
+  backwashSensor.begin();
+  dataReporter.addChannel(&backwashSensor);
+  powerManager.addChannel(&backwashSensor, &backwashPulseSource, BACKWASH_SENSOR_PIN);
+#endif
+#if FLOW_CHANNELS > 2
+  makeupSensor.begin();
+  dataReporter.addChannel(&makeupSensor);
+  powerManager.addChannel(&makeupSensor, &makeupPulseSource, MAKEUP_SENSOR_PIN);
+#endif
+  
+  // Export the flow time series on demand
+  Particle.function("history", historyFunction);
+  
+  // The pool controller reports fill valve openings, so a silent meter shows
+  Particle.function("fill", fillFunction);
+  
+  // Reporting cadence and daily budget, e.g. "batch_idle=1440,publishes=40"
+  Particle.function("reporting", reportingFunction);
+  
+  // Sleep between reports while no water flows
+#if defined(LOW_POWER_IDLE)
+  powerManager.setEnabled(true);
+#endif
+  
+  // Tasks that run from boot; the display runs during boot too so frames
+  // queued in begin() go out straight away
+  monitorTaskId = scheduler.every("monitor", BOOT_POLL_PERIOD, monitorTask);
+  clockTaskId = scheduler.every("clock", CLOCK_PERIOD, clockTask);
+  displayTaskId = scheduler.every("display", DISPLAY_PERIOD, displayTask);
+  storageTaskId = scheduler.every("storage", STORAGE_PERIOD, storageTask);
+  scheduler.every("stats", STATS_PERIOD, statsTask, nullptr, STATS_PERIOD);
+  
   Log.info("System initialized");
 }
 
 void loop() {
-  unsigned long currentTime = millis();
+  // Run whatever is due, then sleep until the next deadline
+  scheduler.runAndIdle(MAX_IDLE);
   
+  // With no flow and nothing to send, power down until a pulse or the next
+  // report (or the daily reset)
+  unsigned long currentTime = millis();
+  if (powerManager.readyToSleep(currentTime)) {
+    unsigned long duration = dataReporter.getMillisUntilNextReport(currentTime);
+    unsigned long untilReset = scheduler.getMillisUntil(dailyTaskId);
+    powerManager.sleep(untilReset < duration ? untilReset : duration);
+    scheduler.resume();
+  }
+}
+
+void monitorTask(void*, unsigned long) {
   // Update system monitor (handles watchdog and boot sequence)
+  static bool operating = false;
   systemMonitor.update();
   
-  // Only process flow and data if boot sequence is complete
-  if (systemMonitor.isBootComplete()) {
-    // Update flow sensor (processes pulse counts and flow detection)
-    flowSensor.update();
-    
-    // Update data reporter (handles publishing based on intervals)
-    dataReporter.update(currentTime);
-    
-    // Update display with current data
-    displayComm.update(currentTime);
-    
-    // Time sync check once per hour (aligned with data publishing)
-    static unsigned long lastTimeSync = 0;
-    if (currentTime - lastTimeSync >= 3600000) { // 1 hour in milliseconds
-      Particle.syncTime();
-      lastTimeSync = currentTime;
-    }
-    
-    // Check if it's time for daily reset (24 hours)
-    if (currentTime - dailyResetTime >= DAILY_RESET_INTERVAL) {
-      Log.info("Daily reset - Total gallons: %.2f", flowSensor.getDailyGallonsTotal());
-      
-      // Reset the flow sensor's daily counters
-      flowSensor.performDailyReset();
-      
-      // Update daily reset time
-      dailyResetTime = currentTime;
-      Storage::saveDailyResetTime(dailyResetTime);
-      
-      // Publish diagnostic data after reset
-      dataReporter.publishDiagnosticData();
-    }
+  // Only process flow and data once the boot sequence is complete
+  if (!operating && systemMonitor.isBootComplete()) {
+    operating = true;
+    startOperation();
+  }
+  
+  // Polled through the boot sequence, then only woken for checkins
+  scheduler.reschedule(monitorTaskId, operating ? WATCHDOG_PERIOD : BOOT_POLL_PERIOD);
+}
+
+void clockTask(void*, unsigned long currentTime) {
+  // Request time syncs while the cloud is connected
+  bool wasSynced = Clock::isSynced();
+  Clock::update(currentTime);
+  
+  // Batches held for real timestamps can go once the clock is set
+  if (Clock::isSynced() && !wasSynced) {
+    scheduler.reschedule(reportTaskId, 0);
+  }
+  runAgainIn(clockTaskId, Clock::getMillisUntilUpdate(currentTime), 1, CLOCK_PERIOD);
+}
+
+void displayTask(void*, unsigned long currentTime) {
+  // Runs for the next change check, or when the pacing lets queued bytes out
+  displayComm.update(currentTime);
+  runAgainIn(displayTaskId, displayComm.getMillisUntilUpdate(currentTime), 1, DISPLAY_PERIOD);
+}
+
+void storageTask(void*, unsigned long currentTime) {
+  // Write cached counters to EEPROM when due
+  Storage::update(currentTime);
+  runAgainIn(storageTaskId, Storage::getMillisUntilFlush(currentTime), 1, STORAGE_PERIOD);
+}
+
+void statsTask(void*, unsigned long) {
+  scheduler.logStats();
+#if LATENCY_PROFILE
+  LatencyProfile::logSummary();
+#endif
+}
+
+void startOperation() {
+  // Update flow sensor (processes pulse counts and flow detection)
+  scheduler.every("pulses", PULSE_PERIOD, pulseTask);
+  
+  // Update data reporter (handles publishing based on intervals)
+  reportTaskId = scheduler.every("report", REPORT_PERIOD, reportTask);
+  
+  // Send queued publishes while the cloud is connected
+  publishTaskId = scheduler.every("publish", PUBLISH_PERIOD, publishTask);
+  
+  // Connect on demand when low-power idle is enabled
+  if (powerManager.isEnabled()) {
+    scheduler.every("power", POWER_PERIOD, powerTask);
+  }
+  
+  // Daily reset 24 hours after the last one
+  unsigned long sinceReset = millis() - dailyResetTime;
+  unsigned long untilReset = (sinceReset < DAILY_RESET_INTERVAL) ? DAILY_RESET_INTERVAL - sinceReset : 0;
+  dailyTaskId = scheduler.every("daily", DAILY_RESET_INTERVAL, dailyResetTask, nullptr, untilReset);
+}
+
+void pulseTask(void*, unsigned long currentTime) {
+  static bool wasFlowing = false;
+  static uint32_t lastAlerts = 0;
+  
+  flowSensor.update();
+#if FLOW_CHANNELS > 1
+  backwashSensor.update();
+#endif
+#if FLOW_CHANNELS > 2
+  makeupSensor.update();
+#endif
+  
+  // Flow starting or stopping changes the display's cadence and the
+  // report's; alerts are published as soon as they change
+  bool flowing = flowSensor.isFlowActive();
+  uint32_t alerts = flowAnalyzer.getAlertFlags();
+  if (flowing != wasFlowing || alerts != lastAlerts) {
+    wasFlowing = flowing;
+    lastAlerts = alerts;
+    scheduler.reschedule(displayTaskId, 0);
+    scheduler.reschedule(reportTaskId, 0);
+  }
+  
+  // A large volume is saved without waiting for the flush timer
+  if (Storage::getMillisUntilFlush(currentTime) == 0) {
+    scheduler.reschedule(storageTaskId, 0);
+  }
+}
+
+void reportTask(void*, unsigned long currentTime) {
+  unsigned long queued = publishQueue.getDepth();
+  dataReporter.update(currentTime);
+  
+  // New events go out without waiting for the publish task's next poll
+  if (publishQueue.getDepth() > queued) {
+    scheduler.reschedule(publishTaskId, 0);
+  }
+  runAgainIn(reportTaskId, dataReporter.getMillisUntilNextReport(currentTime), REPORT_MIN_PERIOD, REPORT_PERIOD);
+}
+
+void publishTask(void*, unsigned long currentTime) {
+  publishQueue.update(currentTime);
+  runAgainIn(publishTaskId, publishQueue.getMillisUntilUpdate(currentTime), 1, PUBLISH_PERIOD);
+}
+
+void powerTask(void*, unsigned long currentTime) {
+  powerManager.update(currentTime);
+}
+
+void dailyResetTask(void*, unsigned long currentTime) {
+  char dailyTotal[24];
+  Log.info("Daily reset - Total gallons: %s", 
+           Volume::format(dailyTotal, sizeof(dailyTotal), flowSensor.getDailyMilliGallons(), 2));
+  
+  // Reset the flow sensors' daily counters
+  flowSensor.performDailyReset();
+#if FLOW_CHANNELS > 1
+  backwashSensor.performDailyReset();
+#endif
+#if FLOW_CHANNELS > 2
+  makeupSensor.performDailyReset();
+#endif
+  
+  // Update daily reset time
+  dailyResetTime = currentTime;
+  Storage::saveDailyResetTime(dailyResetTime);
+  Storage::flush();
+  
+  // A new day's report budget, then publish diagnostic data after reset
+  reportingPolicy.resetBudget();
+  dataReporter.publishDiagnosticData();
+  scheduler.reschedule(reportTaskId, 0);
+  scheduler.reschedule(publishTaskId, 0);
+}
+
+void runAgainIn(int id, unsigned long untilMs, unsigned long minMs, unsigned long maxMs) {
+  // A module's next deadline, kept out of this pass and within the task's period
+  if (untilMs < minMs) {
+    untilMs = minMs;
+  } else if (untilMs > maxMs) {
+    untilMs = maxMs;
   }
-}
\ No newline at end of file
+  scheduler.reschedule(id, untilMs);
+}
+
+int historyFunction(String tier) {
+  // "minute", "quarter" or "hour"; the events go out through the publish queue
+  int events = dataReporter.publishHistory(tier.c_str());
+  scheduler.reschedule(publishTaskId, 0);
+  return events;
+}
+
+int fillFunction(String minutes) {
+  // Minutes the fill valve stays open; 0 when it closes early
+  int duration = minutes.toInt();
+  if (duration < 0 || duration > 1440) {
+    return -1;
+  }
+  flowAnalyzer.commandFill((unsigned long)duration * 60000UL);
+  return duration;
+}
+
+int reportingFunction(String settings) {
+  // Settings applied, or -1 when the command was rejected; a new cadence
+  // takes effect from the next report check
+  int applied = reportingPolicy.configure(settings.c_str());
+  scheduler.reschedule(reportTaskId, 0);
+  return applied;
+}
@@ -0,0 +1,14 @@
+#include "Checksum.h"
+
+uint32_t Checksum::crc32(const uint8_t* data, size_t length, uint32_t crc) {
+  // Bitwise, records are small so no table is needed. Passing a previous
+  // result as crc continues the checksum over another block.
+  crc = ~crc;
+  for (size_t i = 0; i < length; i++) {
+    crc ^= data[i];
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+    }
+  }
+  return ~crc;
+}
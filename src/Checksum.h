@@ -0,0 +1,10 @@
+#pragma once
+
+#include "Particle.h"
+
+// CRC used to validate records persisted to EEPROM and flash
+class Checksum {
+public:
+  // CRC-32 (IEEE 802.3)
+  static uint32_t crc32(const uint8_t* data, size_t length, uint32_t crc = 0);
+};
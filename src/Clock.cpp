@@ -0,0 +1,120 @@
+#include "Clock.h"
+
+bool Clock::_synced = false;
+bool Clock::_syncRequested = false;
+uint32_t Clock::_bootTime = 0;
+unsigned long Clock::_lastRequestTime = 0;
+unsigned long Clock::_lastSyncTime = 0;
+unsigned long Clock::_syncCount = 0;
+long Clock::_lastCorrection = 0;
+
+void Clock::begin() {
+  // Device OS keeps the RTC across a warm reset
+  unsigned long currentTime = millis();
+  if (Time.isValid()) {
+    learnTime(currentTime);
+  }
+  if (Particle.connected()) {
+    requestSync(currentTime);
+  }
+  Serial.printlnf("Clock started, %s", _synced ? "time valid" : "provisional timestamps until sync");
+}
+
+void Clock::update(unsigned long currentTime) {
+  if (_syncRequested) {
+    if (Particle.syncTimePending()) {
+      if (currentTime - _lastRequestTime >= SYNC_TIMEOUT) {
+        _syncRequested = false;
+      }
+      return;
+    }
+    _syncRequested = false;
+    if (Time.isValid()) {
+      learnTime(currentTime);
+    }
+    return;
+  }
+
+  // Device OS also syncs on every cloud handshake
+  if (!_synced && Time.isValid()) {
+    learnTime(currentTime);
+  }
+
+  unsigned long interval = _synced ? RESYNC_INTERVAL : RETRY_INTERVAL;
+  unsigned long since = _synced ? _lastSyncTime : _lastRequestTime;
+  if (currentTime - since >= interval && currentTime - _lastRequestTime >= RETRY_INTERVAL &&
+      Particle.connected()) {
+    requestSync(currentTime);
+  }
+}
+
+unsigned long Clock::getMillisUntilUpdate(unsigned long currentTime) {
+  if (_syncRequested || !_synced) {
+    return POLL_INTERVAL;
+  }
+  // A due resync waits for the cloud, and for the retry spacing
+  unsigned long elapsed = currentTime - _lastSyncTime;
+  if (elapsed < RESYNC_INTERVAL) {
+    return RESYNC_INTERVAL - elapsed;
+  }
+  unsigned long sinceRequest = currentTime - _lastRequestTime;
+  return sinceRequest < RETRY_INTERVAL ? RETRY_INTERVAL - sinceRequest : POLL_INTERVAL;
+}
+
+uint64_t Clock::uptimeMillis() {
+  return System.millis();
+}
+
+uint32_t Clock::uptimeSeconds() {
+  return (uint32_t)(System.millis() / 1000);
+}
+
+uint32_t Clock::now() {
+  if (_synced) {
+    return (uint32_t)Time.now();
+  }
+  return PROVISIONAL_BASE + uptimeSeconds();
+}
+
+bool Clock::isSynced() {
+  return _synced;
+}
+
+bool Clock::isProvisional(uint32_t timestamp) {
+  return timestamp < PROVISIONAL_LIMIT;
+}
+
+uint32_t Clock::resolve(uint32_t timestamp) {
+  if (!_synced || !isProvisional(timestamp)) {
+    return timestamp;
+  }
+  return _bootTime + (timestamp - PROVISIONAL_BASE);
+}
+
+unsigned long Clock::getSyncCount() {
+  return _syncCount;
+}
+
+long Clock::getLastCorrection() {
+  return _lastCorrection;
+}
+
+void Clock::learnTime(unsigned long currentTime) {
+  uint32_t bootTime = (uint32_t)Time.now() - uptimeSeconds();
+  if (_synced) {
+    _lastCorrection = (long)(bootTime - _bootTime);
+  } else {
+    Serial.printlnf("Clock synced after %lu s of uptime", (unsigned long)uptimeSeconds());
+  }
+  _bootTime = bootTime;
+  _synced = true;
+  _lastSyncTime = currentTime;
+  _syncCount++;
+}
+
+void Clock::requestSync(unsigned long currentTime) {
+  if (Particle.syncTime()) {
+    _syncRequested = true;
+  }
+  _lastRequestTime = currentTime;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "Particle.h"
+
+// Non-blocking time service. Uptime comes from the 64-bit system millisecond
+// counter, which never wraps or jumps. Wall-clock time is learned from cloud
+// time syncs, requested in the background whenever the cloud is connected.
+//
+// Until the first sync, now() returns a provisional timestamp:
+// PROVISIONAL_BASE plus seconds of uptime. Provisional values sort before any
+// real date, so isProvisional() can spot them. resolve() turns them into real
+// timestamps once the clock is synced.
+class Clock {
+public:
+  // Request the first sync if the cloud is already up
+  static void begin();
+
+  // Drive sync requests; never waits for a response
+  static void update(unsigned long currentTime);
+
+  // Milliseconds until update() has something to do: polled while a response
+  // or the first handshake is awaited, then at the next resync
+  static unsigned long getMillisUntilUpdate(unsigned long currentTime);
+
+  // Monotonic uptime
+  static uint64_t uptimeMillis();
+  static uint32_t uptimeSeconds();
+
+  // Unix time if synced, otherwise a provisional timestamp
+  static uint32_t now();
+
+  static bool isSynced();
+  static bool isProvisional(uint32_t timestamp);
+
+  // Real timestamp for a provisional one from this boot (unchanged if the
+  // clock isn't synced yet or the timestamp is already real)
+  static uint32_t resolve(uint32_t timestamp);
+
+  // Statistics
+  static unsigned long getSyncCount();
+  static long getLastCorrection();  // Seconds the clock moved at the last resync
+
+  static const uint32_t PROVISIONAL_BASE = 0x20000000;   // 1987, plus uptime
+  static const uint32_t PROVISIONAL_LIMIT = 0x40000000;  // 2004, nothing earlier is real
+
+private:
+  static bool _synced;
+  static bool _syncRequested;
+  static uint32_t _bootTime;           // Unix time at uptime zero
+  static unsigned long _lastRequestTime;
+  static unsigned long _lastSyncTime;
+  static unsigned long _syncCount;
+  static long _lastCorrection;
+
+  static const unsigned long RETRY_INTERVAL = 60000;      // Until the first sync
+  static const unsigned long RESYNC_INTERVAL = 3600000;   // Hourly drift correction
+  static const unsigned long SYNC_TIMEOUT = 30000;        // Give up on a lost response
+  static const unsigned long POLL_INTERVAL = 1000;        // While waiting on the cloud
+
+  static void learnTime(unsigned long currentTime);
+  static void requestSync(unsigned long currentTime);
+};
@@ -0,0 +1,398 @@
+#include "CompactPayload.h"
+
+#include <string.h>
+
+namespace {
+
+const char BASE64_ALPHABET[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// Appends fields to a fixed buffer; remembers if anything didn't fit
+class RecordWriter {
+public:
+  RecordWriter(uint8_t* buffer, size_t size) : _buffer(buffer), _size(size), _length(0), _overflow(false) {}
+
+  void putByte(uint8_t value) {
+    if (_length < _size) {
+      _buffer[_length++] = value;
+    } else {
+      _overflow = true;
+    }
+  }
+
+  void putUnsigned(uint64_t value) {
+    while (value >= 0x80) {
+      putByte((uint8_t)(value | 0x80));
+      value >>= 7;
+    }
+    putByte((uint8_t)value);
+  }
+
+  void putSigned(int64_t value) {
+    putUnsigned(((uint64_t)value << 1) ^ (uint64_t)(value >> 63));
+  }
+
+  void putString(const char* value) {
+    size_t length = strlen(value);
+    putUnsigned(length);
+    for (size_t i = 0; i < length; i++) {
+      putByte((uint8_t)value[i]);
+    }
+  }
+
+  size_t length() const { return _length; }
+  bool overflowed() const { return _overflow; }
+
+private:
+  uint8_t* _buffer;
+  size_t _size;
+  size_t _length;
+  bool _overflow;
+};
+
+// Reads fields back; any read past the end marks the record truncated
+class RecordReader {
+public:
+  RecordReader(const uint8_t* buffer, size_t length) : _buffer(buffer), _length(length), _offset(0), _truncated(false) {}
+
+  uint8_t getByte() {
+    if (_offset < _length) {
+      return _buffer[_offset++];
+    }
+    _truncated = true;
+    return 0;
+  }
+
+  uint64_t getUnsigned() {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      uint8_t byte = getByte();
+      value |= (uint64_t)(byte & 0x7F) << shift;
+      if (!(byte & 0x80)) {
+        return value;
+      }
+    }
+    _truncated = true;
+    return value;
+  }
+
+  int64_t getSigned() {
+    uint64_t value = getUnsigned();
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+  }
+
+  // Returns false if the string doesn't fit in out (including its NUL)
+  bool getString(char* out, size_t outSize) {
+    uint64_t length = getUnsigned();
+    if (length >= outSize) {
+      return false;
+    }
+    for (size_t i = 0; i < length; i++) {
+      out[i] = (char)getByte();
+    }
+    out[length] = '\0';
+    return true;
+  }
+
+  bool truncated() const { return _truncated; }
+
+private:
+  const uint8_t* _buffer;
+  size_t _length;
+  size_t _offset;
+  bool _truncated;
+};
+
+void putHeader(RecordWriter& writer, uint8_t type, const char* deviceId) {
+  writer.putByte(COMPACT_PAYLOAD_VERSION);
+  writer.putByte(type);
+  writer.putString(deviceId);
+}
+
+size_t finish(const RecordWriter& writer, const uint8_t* record, char* out, size_t outSize) {
+  if (writer.overflowed()) {
+    return 0;
+  }
+  return CompactPayload::base64Encode(record, writer.length(), out, outSize);
+}
+
+int base64Value(char c) {
+  const char* match = (c != '\0') ? strchr(BASE64_ALPHABET, c) : nullptr;
+  return match ? (int)(match - BASE64_ALPHABET) : -1;
+}
+
+} // namespace
+
+size_t CompactPayload::encodeFlowBatch(const char* deviceId, const char* const* channelNames, size_t channelCount,
+                                       const FlowSample* samples, size_t count, char* out, size_t outSize) {
+  uint8_t record[MAX_RECORD_SIZE];
+  RecordWriter writer(record, sizeof(record));
+  putHeader(writer, COMPACT_TYPE_FLOW_BATCH, deviceId);
+
+  writer.putUnsigned(count);
+  uint32_t previous = 0;
+  for (size_t i = 0; i < count; i++) {
+    // Hourly records turn a 5-byte timestamp into a 2-byte delta
+    writer.putSigned((int64_t)samples[i].timestamp - (int64_t)previous);
+    writer.putUnsigned(samples[i].milliGallons);
+    writer.putUnsigned(samples[i].hourlyAverageMilliGallons);
+    previous = samples[i].timestamp;
+  }
+
+  // Per-meter volumes follow the records, so older decoders stop before them
+  if (channelCount > MAX_FLOW_CHANNELS) {
+    channelCount = MAX_FLOW_CHANNELS;
+  }
+  writer.putUnsigned(channelCount);
+  for (size_t channel = 0; channel < channelCount; channel++) {
+    writer.putString(channelNames[channel]);
+  }
+  for (size_t i = 0; i < count && channelCount > 0; i++) {
+    for (size_t channel = 0; channel < channelCount; channel++) {
+      // Hours recorded before a meter was added have nothing for it
+      writer.putUnsigned(channel < samples[i].channelCount ? samples[i].channelMilliGallons[channel] : 0);
+    }
+  }
+  return finish(writer, record, out, outSize);
+}
+
+size_t CompactPayload::encodeDiagnostics(const char* deviceId, const DiagnosticSample& sample,
+                                         char* out, size_t outSize) {
+  uint8_t record[MAX_RECORD_SIZE];
+  RecordWriter writer(record, sizeof(record));
+  putHeader(writer, COMPACT_TYPE_DIAGNOSTICS, deviceId);
+
+  writer.putUnsigned(sample.timestamp);
+  writer.putString(sample.firmware);
+  writer.putUnsigned(sample.resetReason);
+  writer.putUnsigned(sample.lifetimeMilliGallons);
+  writer.putUnsigned(sample.dailyMilliGallons);
+  writer.putUnsigned(sample.hoursElapsed);
+  writer.putUnsigned(sample.totalPulses);
+  writer.putUnsigned(sample.flowEventsToday);
+  writer.putSigned(sample.signalStrength);
+  writer.putUnsigned(sample.storageRecords);
+  writer.putUnsigned(sample.storageWritesAvoided);
+  writer.putUnsigned(sample.queueDepth);
+  writer.putUnsigned(sample.queueDropped);
+  writer.putUnsigned(sample.flowRecordsPending);
+  writer.putUnsigned(sample.sleepSeconds);
+  writer.putUnsigned(sample.wakeups);
+  writer.putUnsigned(sample.alertFlags);
+  writer.putUnsigned(sample.continuousSeconds);
+  writer.putUnsigned(sample.longestFlowSeconds);
+  writer.putUnsigned(sample.hourFloorMilliGpm);
+  writer.putUnsigned(sample.dayFloorMilliGpm);
+  writer.putUnsigned(sample.baselineMilliGpm);
+  writer.putUnsigned(sample.implausiblePulses);
+  writer.putUnsigned(sample.peakMilliGpm);
+  writer.putUnsigned(sample.averageMilliGpm);
+  writer.putUnsigned(sample.watchdogGapMillis);
+  writer.putString(sample.worstProbe);
+  writer.putUnsigned(sample.worstMicros);
+  uint32_t latencyCount = sample.latencyCount < LATENCY_REPORT_PROBES ? sample.latencyCount : LATENCY_REPORT_PROBES;
+  writer.putUnsigned(latencyCount);
+  for (uint32_t i = 0; i < latencyCount; i++) {
+    const LatencySample& latency = sample.latency[i];
+    writer.putString(latency.name);
+    writer.putUnsigned(latency.minMicros);
+    writer.putUnsigned(latency.p50Micros);
+    writer.putUnsigned(latency.p99Micros);
+    writer.putUnsigned(latency.maxMicros);
+  }
+  uint32_t channelCount = sample.channelCount < MAX_FLOW_CHANNELS ? sample.channelCount : MAX_FLOW_CHANNELS;
+  writer.putUnsigned(channelCount);
+  for (uint32_t i = 0; i < channelCount; i++) {
+    const ChannelSample& channel = sample.channels[i];
+    writer.putString(channel.name);
+    writer.putUnsigned(channel.lifetimeMilliGallons);
+    writer.putUnsigned(channel.dailyMilliGallons);
+    writer.putUnsigned(channel.flowEventsToday);
+  }
+  return finish(writer, record, out, outSize);
+}
+
+CompactPayload::DecodeResult CompactPayload::decode(const char* text, CompactEvent& event) {
+  uint8_t record[MAX_RECORD_SIZE];
+  size_t length = base64Decode(text, record, sizeof(record));
+  if (length == 0) {
+    return DECODE_BAD_ENCODING;
+  }
+
+  RecordReader reader(record, length);
+  uint8_t version = reader.getByte();
+  if (version < 1 || version > COMPACT_PAYLOAD_VERSION) {
+    return DECODE_BAD_VERSION;
+  }
+  event.type = reader.getByte();
+  if (!reader.getString(event.deviceId, sizeof(event.deviceId))) {
+    return DECODE_TOO_LONG;
+  }
+
+  event.channelCount = 0;
+  if (event.type == COMPACT_TYPE_FLOW_BATCH) {
+    uint64_t count = reader.getUnsigned();
+    if (count > sizeof(event.flow) / sizeof(event.flow[0])) {
+      return DECODE_TOO_LONG;
+    }
+    event.flowCount = (size_t)count;
+    int64_t timestamp = 0;
+    for (size_t i = 0; i < event.flowCount; i++) {
+      timestamp += reader.getSigned();
+      event.flow[i].timestamp = (uint32_t)timestamp;
+      event.flow[i].milliGallons = (uint32_t)reader.getUnsigned();
+      event.flow[i].hourlyAverageMilliGallons = (uint32_t)reader.getUnsigned();
+      event.flow[i].channelCount = 0;
+    }
+    if (version >= 6) {
+      uint64_t channelCount = reader.getUnsigned();
+      if (channelCount > FLOW_CHANNELS) {
+        return DECODE_TOO_LONG;
+      }
+      event.channelCount = (size_t)channelCount;
+      for (size_t channel = 0; channel < event.channelCount; channel++) {
+        if (!reader.getString(event.channelNames[channel], sizeof(event.channelNames[channel]))) {
+          return DECODE_TOO_LONG;
+        }
+      }
+      for (size_t i = 0; i < event.flowCount && event.channelCount > 0; i++) {
+        event.flow[i].channelCount = (uint32_t)event.channelCount;
+        for (size_t channel = 0; channel < event.channelCount; channel++) {
+          event.flow[i].channelMilliGallons[channel] = (uint32_t)reader.getUnsigned();
+        }
+      }
+    }
+  } else if (event.type == COMPACT_TYPE_DIAGNOSTICS) {
+    DiagnosticSample& sample = event.diagnostics;
+    sample.timestamp = (uint32_t)reader.getUnsigned();
+    if (!reader.getString(sample.firmware, sizeof(sample.firmware))) {
+      return DECODE_TOO_LONG;
+    }
+    sample.resetReason = (uint32_t)reader.getUnsigned();
+    sample.lifetimeMilliGallons = reader.getUnsigned();
+    sample.dailyMilliGallons = reader.getUnsigned();
+    sample.hoursElapsed = (uint32_t)reader.getUnsigned();
+    sample.totalPulses = (uint32_t)reader.getUnsigned();
+    sample.flowEventsToday = (uint32_t)reader.getUnsigned();
+    sample.signalStrength = (int32_t)reader.getSigned();
+    sample.storageRecords = (uint32_t)reader.getUnsigned();
+    sample.storageWritesAvoided = (uint32_t)reader.getUnsigned();
+    sample.queueDepth = (uint32_t)reader.getUnsigned();
+    sample.queueDropped = (uint32_t)reader.getUnsigned();
+    sample.flowRecordsPending = (uint32_t)reader.getUnsigned();
+    sample.sleepSeconds = (version >= 2) ? (uint32_t)reader.getUnsigned() : 0;
+    sample.wakeups = (version >= 2) ? (uint32_t)reader.getUnsigned() : 0;
+    sample.alertFlags = (version >= 3) ? (uint32_t)reader.getUnsigned() : 0;
+    sample.continuousSeconds = (version >= 3) ? (uint32_t)reader.getUnsigned() : 0;
+    sample.longestFlowSeconds = (version >= 3) ? (uint32_t)reader.getUnsigned() : 0;
+    sample.hourFloorMilliGpm = (version >= 3) ? (uint32_t)reader.getUnsigned() : 0;
+    sample.dayFloorMilliGpm = (version >= 3) ? (uint32_t)reader.getUnsigned() : 0;
+    sample.baselineMilliGpm = (version >= 3) ? (uint32_t)reader.getUnsigned() : 0;
+    sample.implausiblePulses = (version >= 3) ? (uint32_t)reader.getUnsigned() : 0;
+    sample.peakMilliGpm = (version >= 4) ? (uint32_t)reader.getUnsigned() : 0;
+    sample.averageMilliGpm = (version >= 4) ? (uint32_t)reader.getUnsigned() : 0;
+    sample.watchdogGapMillis = 0;
+    sample.worstProbe[0] = '\0';
+    sample.worstMicros = 0;
+    sample.latencyCount = 0;
+    if (version >= 5) {
+      sample.watchdogGapMillis = (uint32_t)reader.getUnsigned();
+      if (!reader.getString(sample.worstProbe, sizeof(sample.worstProbe))) {
+        return DECODE_TOO_LONG;
+      }
+      sample.worstMicros = (uint32_t)reader.getUnsigned();
+      uint64_t count = reader.getUnsigned();
+      if (count > LATENCY_REPORT_PROBES) {
+        return DECODE_TOO_LONG;
+      }
+      sample.latencyCount = (uint32_t)count;
+      for (uint32_t i = 0; i < sample.latencyCount; i++) {
+        LatencySample& latency = sample.latency[i];
+        if (!reader.getString(latency.name, sizeof(latency.name))) {
+          return DECODE_TOO_LONG;
+        }
+        latency.minMicros = (uint32_t)reader.getUnsigned();
+        latency.p50Micros = (uint32_t)reader.getUnsigned();
+        latency.p99Micros = (uint32_t)reader.getUnsigned();
+        latency.maxMicros = (uint32_t)reader.getUnsigned();
+      }
+    }
+    sample.channelCount = 0;
+    if (version >= 6) {
+      uint64_t count = reader.getUnsigned();
+      if (count > MAX_FLOW_CHANNELS) {
+        return DECODE_TOO_LONG;
+      }
+      sample.channelCount = (uint32_t)count;
+      for (uint32_t i = 0; i < sample.channelCount; i++) {
+        ChannelSample& channel = sample.channels[i];
+        if (!reader.getString(channel.name, sizeof(channel.name))) {
+          return DECODE_TOO_LONG;
+        }
+        channel.lifetimeMilliGallons = reader.getUnsigned();
+        channel.dailyMilliGallons = reader.getUnsigned();
+        channel.flowEventsToday = (uint32_t)reader.getUnsigned();
+      }
+    }
+  } else {
+    return DECODE_UNKNOWN_TYPE;
+  }
+
+  return reader.truncated() ? DECODE_TRUNCATED : DECODE_OK;
+}
+
+size_t CompactPayload::base64Encode(const uint8_t* in, size_t length, char* out, size_t outSize) {
+  size_t textLength = (length + 2) / 3 * 4;
+  if (textLength + 1 > outSize) {
+    return 0;
+  }
+
+  char* p = out;
+  for (size_t i = 0; i < length; i += 3) {
+    uint32_t group = (uint32_t)in[i] << 16;
+    if (i + 1 < length) group |= (uint32_t)in[i + 1] << 8;
+    if (i + 2 < length) group |= in[i + 2];
+
+    *p++ = BASE64_ALPHABET[(group >> 18) & 0x3F];
+    *p++ = BASE64_ALPHABET[(group >> 12) & 0x3F];
+    *p++ = (i + 1 < length) ? BASE64_ALPHABET[(group >> 6) & 0x3F] : '=';
+    *p++ = (i + 2 < length) ? BASE64_ALPHABET[group & 0x3F] : '=';
+  }
+  *p = '\0';
+  return textLength;
+}
+
+size_t CompactPayload::base64Decode(const char* in, uint8_t* out, size_t outSize) {
+  size_t textLength = strlen(in);
+  if (textLength == 0 || textLength % 4 != 0) {
+    return 0;
+  }
+
+  size_t length = 0;
+  for (size_t i = 0; i < textLength; i += 4) {
+    int values[4];
+    int bytes = 3;
+    for (int j = 0; j < 4; j++) {
+      values[j] = base64Value(in[i + j]);
+      if (values[j] < 0) {
+        // Padding is only allowed at the very end
+        bool padding = in[i + j] == '=' && i + 4 == textLength && j >= 2 &&
+                       (j == 3 || in[i + 3] == '=');
+        if (!padding) {
+          return 0;
+        }
+        values[j] = 0;
+        bytes = (bytes < j - 1) ? bytes : j - 1;
+      }
+    }
+
+    uint32_t group = ((uint32_t)values[0] << 18) | ((uint32_t)values[1] << 12) |
+                     ((uint32_t)values[2] << 6) | (uint32_t)values[3];
+    if (length + bytes > outSize) {
+      return 0;
+    }
+    for (int j = 0; j < bytes; j++) {
+      out[length++] = (uint8_t)(group >> (16 - 8 * j));
+    }
+  }
+  return length;
+}
@@ -0,0 +1,201 @@
+#pragma once
+
+// Compact encoding for the flow_data and diagnostic_data cloud events, an
+// opt-in alternative to the JSON payloads. Kept free of Particle APIs so the
+// encoder builds on Linux; lambda_function.py holds the Python decoder.
+//
+// Event data is the standard base64 (with padding) of a binary record. JSON
+// payloads always start with '{', which is not in the base64 alphabet, so a
+// receiver can tell the two apart from the first character.
+//
+// Binary record (version 6):
+//
+//   u8      version            COMPACT_PAYLOAD_VERSION
+//   u8      type               COMPACT_TYPE_FLOW_BATCH or COMPACT_TYPE_DIAGNOSTICS
+//   string  device_id
+//   ...     body by type
+//
+// uvar is an unsigned LEB128 varint (7 bits per byte, low bits first, high
+// bit set on all but the last byte). svar is a zigzag-mapped uvar
+// ((n << 1) ^ (n >> 63)). string is a uvar length followed by the bytes.
+//
+// Flow batch body:
+//
+//   uvar    count
+//   count x {
+//     svar  timestamp          Unix seconds; the first record is absolute,
+//                              the rest are deltas from the previous record
+//     uvar  milliGallons       Used during the hour
+//     uvar  hourlyAverageMilliGallons
+//   }
+//   uvar    channelCount       Version 6: meters on the device, or 0 for a
+//                              single meter (nothing more follows)
+//   channelCount x string name
+//   count x channelCount x uvar milliGallons
+//                              Version 6: each meter's use during each
+//                              record's hour, channel 0 first
+//
+// Diagnostics body:
+//
+//   uvar    timestamp          Unix seconds
+//   string  firmware
+//   uvar    resetReason        System.resetReason() code
+//   uvar    lifetimeMilliGallons
+//   uvar    dailyMilliGallons
+//   uvar    hoursElapsed
+//   uvar    totalPulses
+//   uvar    flowEventsToday
+//   svar    signalStrength     Percent
+//   uvar    storageRecords
+//   uvar    storageWritesAvoided
+//   uvar    queueDepth
+//   uvar    queueDropped
+//   uvar    flowRecordsPending
+//   uvar    sleepSeconds       Version 2: time spent in low-power sleep since boot
+//   uvar    wakeups            Version 2: sleeps ended by a pulse or a report
+//   uvar    alertFlags         Version 3: bit per active FlowAnalyzer::Alert
+//   uvar    continuousSeconds  Version 3: current run of continuous flow
+//   uvar    longestFlowSeconds Version 3: longest run since the daily reset
+//   uvar    hourFloorMilliGpm  Version 3: lowest minute of flow in the last hour
+//   uvar    dayFloorMilliGpm   Version 3: lowest minute of flow in the last day
+//   uvar    baselineMilliGpm   Version 3: typical rate while water flows
+//   uvar    implausiblePulses  Version 3: pulses too close together, today
+//   uvar    peakMilliGpm       Version 4: highest flow rate today
+//   uvar    averageMilliGpm    Version 4: mean flow rate while flowing, today
+//   uvar    watchdogGapMillis  Version 5: longest time between watchdog checkins
+//   string  worstProbe         Version 5: latency probe with the slowest sample
+//   uvar    worstMicros        Version 5: that sample
+//   uvar    latencyCount       Version 5: up to LATENCY_REPORT_PROBES, slowest p99 first
+//   latencyCount x {
+//     string name
+//     uvar  minMicros
+//     uvar  p50Micros
+//     uvar  p99Micros
+//     uvar  maxMicros
+//   }
+//   uvar    channelCount       Version 6: meters on the device, or 0 for one
+//   channelCount x {
+//     string name
+//     uvar  lifetimeMilliGallons
+//     uvar  dailyMilliGallons
+//     uvar  flowEventsToday
+//   }
+//
+// Channel 0 is the meter the single-meter fields describe.
+//
+// Latency figures cover the time since the previous diagnostic report, and
+// are all zero when the firmware is built without LATENCY_PROFILE.
+//
+// Volumes travel as exact milli-gallons. The JSON payloads round them for
+// display: gallons_used is whole gallons rounded down, hourly_average is
+// rounded half up to 0.1 gallon, lifetime_gallons and daily_total to 0.01.
+// New fields are only ever added at the end of a body, with a new version;
+// decoders accept every version up to their own.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "FlowChannels.h"
+
+#define COMPACT_PAYLOAD_VERSION     6
+#define COMPACT_TYPE_FLOW_BATCH     1
+#define COMPACT_TYPE_DIAGNOSTICS    2
+#define LATENCY_REPORT_PROBES       4
+
+struct FlowSample {
+  uint32_t timestamp;
+  uint32_t milliGallons;               // Used during the hour
+  uint32_t hourlyAverageMilliGallons;  // Daily average per hour at the time
+  uint32_t channelCount;               // Meters recorded below; 0 for one
+  uint32_t channelMilliGallons[FLOW_CHANNELS];  // Only this build's meters: held in retained RAM
+};
+
+struct LatencySample {
+  char name[12];
+  uint32_t minMicros;
+  uint32_t p50Micros;
+  uint32_t p99Micros;
+  uint32_t maxMicros;
+};
+
+struct ChannelSample {
+  char name[12];
+  uint64_t lifetimeMilliGallons;
+  uint64_t dailyMilliGallons;
+  uint32_t flowEventsToday;
+};
+
+struct DiagnosticSample {
+  uint32_t timestamp;
+  char firmware[16];
+  uint32_t resetReason;
+  uint64_t lifetimeMilliGallons;
+  uint64_t dailyMilliGallons;
+  uint32_t hoursElapsed;
+  uint32_t totalPulses;
+  uint32_t flowEventsToday;
+  int32_t signalStrength;
+  uint32_t storageRecords;
+  uint32_t storageWritesAvoided;
+  uint32_t queueDepth;
+  uint32_t queueDropped;
+  uint32_t flowRecordsPending;
+  uint32_t sleepSeconds;
+  uint32_t wakeups;
+  uint32_t alertFlags;
+  uint32_t continuousSeconds;
+  uint32_t longestFlowSeconds;
+  uint32_t hourFloorMilliGpm;
+  uint32_t dayFloorMilliGpm;
+  uint32_t baselineMilliGpm;
+  uint32_t implausiblePulses;
+  uint32_t peakMilliGpm;
+  uint32_t averageMilliGpm;
+  uint32_t watchdogGapMillis;
+  char worstProbe[12];
+  uint32_t worstMicros;
+  uint32_t latencyCount;
+  LatencySample latency[LATENCY_REPORT_PROBES];
+  uint32_t channelCount;
+  ChannelSample channels[MAX_FLOW_CHANNELS];
+};
+
+// A decoded event, for the reference tools
+struct CompactEvent {
+  uint8_t type;
+  char deviceId[32];
+  size_t channelCount;
+  char channelNames[MAX_FLOW_CHANNELS][12];
+  size_t flowCount;
+  FlowSample flow[64];
+  DiagnosticSample diagnostics;
+};
+
+class CompactPayload {
+public:
+  enum DecodeResult {
+    DECODE_OK = 0,
+    DECODE_BAD_ENCODING,  // Not base64, or longer than MAX_RECORD_SIZE
+    DECODE_TRUNCATED,     // Record ends inside a field
+    DECODE_BAD_VERSION,
+    DECODE_UNKNOWN_TYPE,
+    DECODE_TOO_LONG       // A string, the flow batch or its meters exceed CompactEvent
+  };
+
+  static const size_t MAX_RECORD_SIZE = 512;  // Binary, before base64
+
+  // Encode an event as NUL-terminated base64 text; returns its length, or 0
+  // if the record or its text doesn't fit. A flow batch names the meters its
+  // samples' channelMilliGallons cover (none for a single meter).
+  static size_t encodeFlowBatch(const char* deviceId, const char* const* channelNames, size_t channelCount,
+                                const FlowSample* samples, size_t count, char* out, size_t outSize);
+  static size_t encodeDiagnostics(const char* deviceId, const DiagnosticSample& sample,
+                                  char* out, size_t outSize);
+
+  // Decode the text of either event type
+  static DecodeResult decode(const char* text, CompactEvent& event);
+
+  // Building blocks, exposed for the reference tools
+  static size_t base64Encode(const uint8_t* in, size_t length, char* out, size_t outSize);
+  static size_t base64Decode(const char* in, uint8_t* out, size_t outSize);
+};
@@ -0,0 +1,110 @@
+#include "CounterPulseSource.h"
+
+#if HAL_PLATFORM_NRF52840
+#include "nrf_gpio.h"
+#include "nrf_timer.h"
+#include "nrfx_gpiote.h"
+#include "nrfx_ppi.h"
+#include "pinmap_hal.h"
+
+namespace {
+
+// TIMER2 to TIMER4 are not used by Device OS on Gen 3 devices; one per channel
+NRF_TIMER_Type* const COUNTER_TIMERS[CounterPulseSource::MAX_CHANNELS] = {NRF_TIMER4, NRF_TIMER3, NRF_TIMER2};
+
+} // namespace
+#endif
+
+int CounterPulseSource::_channelCount = 0;
+
+CounterPulseSource::CounterPulseSource(int sensorPin) :
+  _sensorPin(sensorPin),
+  _channel(_channelCount < MAX_CHANNELS ? _channelCount++ : -1),
+  _started(false),
+  _lastSeenCount(0),
+  _wakePulses(0)
+{
+}
+
+void CounterPulseSource::begin() {
+  pinMode(_sensorPin, INPUT_PULLUP);
+  
+#if HAL_PLATFORM_NRF52840
+  if (_channel < 0) {
+    Log.error("No pulse counter left for pin %d", _sensorPin);
+    return;
+  }
+  NRF_TIMER_Type* timer = COUNTER_TIMERS[_channel];
+  
+  // Translate the Particle pin to the nRF port/pin number
+  const hal_pin_info_t* pinMap = hal_pin_map();
+  uint32_t nrfPin = NRF_GPIO_PIN_MAP(pinMap[_sensorPin].gpio_port, pinMap[_sensorPin].gpio_pin);
+  
+  // Falling edge on the pin raises a GPIOTE event (no interrupt enabled).
+  // The driver picks the channel, so attachInterrupt() can't be given it too.
+  if (!nrfx_gpiote_is_init()) {
+    nrfx_gpiote_init();
+  }
+  nrfx_gpiote_in_config_t config = NRFX_GPIOTE_CONFIG_IN_SENSE_HITOLO(true);
+  config.pull = NRF_GPIO_PIN_PULLUP;
+  if (nrfx_gpiote_in_init(nrfPin, &config, nullptr) != NRFX_SUCCESS) {
+    Log.error("No GPIOTE channel left for pin %d", _sensorPin);
+    return;
+  }
+  
+  // A PPI channel from the application's range; the SoftDevice owns 17-19
+  nrf_ppi_channel_t ppiChannel;
+  if (nrfx_ppi_channel_alloc(&ppiChannel) != NRFX_SUCCESS) {
+    Log.error("No PPI channel left for pin %d", _sensorPin);
+    nrfx_gpiote_in_uninit(nrfPin);
+    return;
+  }
+  
+  // 32-bit counter, cleared and started
+  nrf_timer_task_trigger(timer, NRF_TIMER_TASK_STOP);
+  nrf_timer_mode_set(timer, NRF_TIMER_MODE_LOW_POWER_COUNTER);
+  nrf_timer_bit_width_set(timer, NRF_TIMER_BIT_WIDTH_32);
+  nrf_timer_task_trigger(timer, NRF_TIMER_TASK_CLEAR);
+  nrf_timer_task_trigger(timer, NRF_TIMER_TASK_START);
+  
+  // PPI routes each event straight into the timer's COUNT task
+  uint32_t taskAddress = (uint32_t)(uintptr_t)nrf_timer_task_address_get(timer, NRF_TIMER_TASK_COUNT);
+  nrfx_ppi_channel_assign(ppiChannel, nrfx_gpiote_in_event_addr_get(nrfPin), taskAddress);
+  nrfx_ppi_channel_enable(ppiChannel);
+  nrfx_gpiote_in_event_enable(nrfPin, false);
+  
+  _started = true;
+#else
+  Log.error("Hardware pulse counter not supported on this platform");
+#endif
+}
+
+unsigned long CounterPulseSource::readPulseCount() const {
+  if (!_started) {
+    return 0;
+  }
+  
+#if HAL_PLATFORM_NRF52840
+  // Latch the running count into CC[0]; one register read, no interrupt masking
+  NRF_TIMER_Type* timer = COUNTER_TIMERS[_channel];
+  nrf_timer_task_trigger(timer, NRF_TIMER_TASK_CAPTURE0);
+  return nrf_timer_cc_read(timer, NRF_TIMER_CC_CHANNEL0) + _wakePulses;
+#else
+  return 0;
+#endif
+}
+
+bool CounterPulseSource::takePulseDetected() {
+  unsigned long pulseCount = readPulseCount();
+  bool detected = (pulseCount != _lastSeenCount);
+  _lastSeenCount = pulseCount;
+  return detected;
+}
+
+void CounterPulseSource::creditWakePulse() {
+  _wakePulses++;
+}
+
+const char* CounterPulseSource::getName() const {
+  return "counter";
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "Particle.h"
+#include "PulseSource.h"
+
+// Counts falling edges in a hardware timer instead of taking an interrupt per
+// pulse. On the nRF52840 a GPIOTE event on the sensor pin is wired through PPI
+// to the COUNT task of a TIMER in counter mode, so pulses never wake the CPU;
+// the main loop reads the total in one batch with a CAPTURE task.
+// No per-pulse timestamps are available, so FlowSensor derives the flow rate
+// from count deltas instead. Each instance claims its own timer, up to
+// MAX_CHANNELS meters; GPIOTE and PPI channels come from the nrfx allocators,
+// which share them with attachInterrupt() and sleep wake pins and keep the
+// SoftDevice's reserved PPI channels out of reach.
+class CounterPulseSource : public PulseSource {
+public:
+  CounterPulseSource(int sensorPin);
+  
+  void begin() override;
+  unsigned long readPulseCount() const override;
+  bool takePulseDetected() override;
+  void creditWakePulse() override;
+  const char* getName() const override;
+  
+  static const int MAX_CHANNELS = 3;
+  
+private:
+  int _sensorPin;
+  int _channel;  // Index into the counter timers, or -1 when all are taken
+  bool _started;
+  unsigned long _lastSeenCount;
+  unsigned long _wakePulses;  // Edges that woke the CPU instead of reaching the timer
+  
+  static int _channelCount;
+};
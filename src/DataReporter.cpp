@@ -1,198 +1,811 @@
-#include "DataReporter.h"
-#include "FlowSensor.h"
-
-DataReporter::DataReporter(FlowSensor* flowSensor, const char* deviceId) :
-  _flowSensor(flowSensor),
-  _deviceId(deviceId),
-  _firmwareVersion("1.0.0"),
-  _lastPublishTime(0),
-  _lastDiagnosticPublishTime(0)
-{
-  memset(_resetReasonStr, 0, sizeof(_resetReasonStr));
-  strcpy(_resetReasonStr, "Unknown");
-}
-
-void DataReporter::begin() {
-  // Translate reset reason for initial diagnostics
-  translateResetReason();
-  
-  // Initialize publish times to avoid immediate publishing
-  _lastPublishTime = millis();
-  _lastDiagnosticPublishTime = millis();
-  
-  Serial.println("Data reporter initialized");
-}
-
-void DataReporter::update(unsigned long currentTime) {
-  // Check if it's time for regular flow data publish
-  if (currentTime - _lastPublishTime >= HOURLY_PUBLISH) {
-    publishFlowData();
-  }
-  
-  // Check if it's time for diagnostic publish
-  if (currentTime - _lastDiagnosticPublishTime >= DIAGNOSTIC_PUBLISH_INTERVAL) {
-    publishDiagnosticData();
-  }
-}
-
-void DataReporter::publishFlowData() {
-  // Calculate hourly average
-  float hourlyAverage = calculateHourlyAverage();
-  
-  // Get accumulated gallons and convert to whole number for customer display
-  float accumulatedGallons = _flowSensor->getAccumulatedGallons();
-  int wholeGallons = (int)accumulatedGallons;
-  
-  // Get current timestamp, ensure it's valid
-  unsigned long timestamp = getValidTimestamp();
-  
-  // Create JSON payload
-  char jsonBuffer[256];
-  snprintf(jsonBuffer, sizeof(jsonBuffer), 
-           "{\"device_id\":\"%s\",\"timestamp\":%lu,\"gallons_used\":%.0f,\"hourly_average\":%.1f}",
-           _deviceId, timestamp, (float)wholeGallons, hourlyAverage);
-  
-  Serial.printlnf("Publishing flow data: %s", jsonBuffer);
-  Particle.publish("flow_data", jsonBuffer, PRIVATE);
-  
-  // Log the publish event
-  Serial.printlnf("Flow publish: %d gallons this interval, %.1f gallons average per hour", 
-                 wholeGallons, hourlyAverage);
-  Serial.printlnf("Daily total: %.2f gallons over %d hours", 
-                 _flowSensor->getDailyGallonsTotal(), _flowSensor->getHoursElapsed());
-  
-  // Reset accumulated gallons for next interval
-  _flowSensor->resetAccumulatedGallons();
-  
-  // Increment hours elapsed
-  _flowSensor->incrementHoursElapsed();
-  
-  // Update last publish time
-  _lastPublishTime = millis();
-}
-
-void DataReporter::publishDiagnosticData() {
-  // Update reset reason
-  translateResetReason();
-  
-  // Get cellular signal strength
-  CellularSignal sig = Cellular.RSSI();
-  int signalStrength = sig.getStrength();
-  
-  // Get current timestamp, ensure it's valid
-  unsigned long timestamp = getValidTimestamp();
-  
-  // Create JSON payload with detailed device info
-  char jsonBuffer[256];
-  snprintf(jsonBuffer, sizeof(jsonBuffer), 
-           "{\"device_id\":\"%s\",\"timestamp\":%lu,\"firmware\":\"%s\",\"reset_reason\":\"%s\","
-           "\"lifetime_gallons\":%.2f,\"daily_total\":%.2f,\"hours_elapsed\":%d,\"total_pulses\":%lu,"
-           "\"flow_events_today\":%d,\"signal_strength\":%d}",
-           _deviceId, timestamp, _firmwareVersion.c_str(), _resetReasonStr, 
-           _flowSensor->getLifetimeGallons(), _flowSensor->getDailyGallonsTotal(), 
-           _flowSensor->getHoursElapsed(), _flowSensor->getTechnicalPulseCount(), 
-           _flowSensor->getFlowEventsToday(), signalStrength);
-  
-  Serial.printlnf("Publishing diagnostic data: %s", jsonBuffer);
-  bool success = Particle.publish("diagnostic_data", jsonBuffer, PRIVATE);
-  
-  if (success) {
-    Serial.printlnf("Diagnostic data published successfully");
-  } else {
-    Serial.printlnf("Failed to publish diagnostic data");
-  }
-  
-  // Update last diagnostic publish time
-  _lastDiagnosticPublishTime = millis();
-}
-
-float DataReporter::calculateHourlyAverage() const {
-  float hourlyAverage = 0.0;
-  int hoursElapsed = _flowSensor->getHoursElapsed();
-  
-  if (hoursElapsed > 0) {
-    hourlyAverage = _flowSensor->getDailyGallonsTotal() / hoursElapsed;
-  }
-  
-  return hourlyAverage;
-}
-
-void DataReporter::translateResetReason() {
-  int reason = System.resetReason();
-  
-  switch (reason) {
-    case RESET_REASON_PIN_RESET:
-      strcpy(_resetReasonStr, "Pin Reset");
-      break;
-    case RESET_REASON_POWER_MANAGEMENT:
-      strcpy(_resetReasonStr, "Power Management");
-      break;
-    case RESET_REASON_WATCHDOG:
-      strcpy(_resetReasonStr, "Watchdog Timer");
-      break;
-    case RESET_REASON_UPDATE:
-      strcpy(_resetReasonStr, "Firmware Update");
-      break;
-    case RESET_REASON_UPDATE_TIMEOUT:
-      strcpy(_resetReasonStr, "Firmware Update Timeout");
-      break;
-    case RESET_REASON_FACTORY_RESET:
-      strcpy(_resetReasonStr, "Factory Reset");
-      break;
-    case RESET_REASON_SAFE_MODE:
-      strcpy(_resetReasonStr, "Safe Mode");
-      break;
-    case RESET_REASON_DFU_MODE:
-      strcpy(_resetReasonStr, "DFU Mode");
-      break;
-    case RESET_REASON_PANIC:
-      strcpy(_resetReasonStr, "System Panic");
-      break;
-    case RESET_REASON_USER:
-      strcpy(_resetReasonStr, "User Requested");
-      break;
-    case RESET_REASON_UNKNOWN:
-    default:
-      strcpy(_resetReasonStr, "Unknown");
-      break;
-  }
-  
-  Serial.printlnf("Reset reason: %s (code: %d)", _resetReasonStr, reason);
-}
-
-unsigned long DataReporter::getLastPublishTime() const {
-  return _lastPublishTime;
-}
-
-unsigned long DataReporter::getLastDiagnosticPublishTime() const {
-  return _lastDiagnosticPublishTime;
-}
-
-// Helper method to get a valid timestamp
-unsigned long DataReporter::getValidTimestamp() {
-  // First try to get the current time
-  if (Time.isValid()) {
-    return Time.now();
-  }
-  
-  // If time sync hasn't happened yet, try to sync
-  Particle.syncTime();
-  
-  // Wait a bit for the sync to complete (max 3 seconds)
-  unsigned long start = millis();
-  while (!Time.isValid() && millis() - start < 3000) {
-    Particle.process();
-    delay(100);
-  }
-  
-  // Return the time or a fallback if still not valid
-  if (Time.isValid()) {
-    Serial.println("Time synchronized successfully");
-    return Time.now();
-  } else {
-    // If we can't get a valid time, use millis/1000 + a base time
-    // This isn't accurate but better than using an obviously wrong time
-    Serial.println("Warning: Using fallback timestamp, time sync failed");
-    return millis()/1000 + 1711302000; // March 24, 2024 as base
-  }
-} 
\ No newline at end of file
+#include "DataReporter.h"
+#include "FlowSensor.h"
+#include "PublishQueue.h"
+#include "PowerManager.h"
+#include "FlowHistory.h"
+#include "FlowAnalyzer.h"
+#include "Storage.h"
+#include "Volume.h"
+#include "Checksum.h"
+#include "CompactPayload.h"
+#include "RetainedRam.h"
+#include "Clock.h"
+#include "LatencyProfile.h"
+#include "DeferredLog.h"
+#include "ReportingPolicy.h"
+#include "JsonWriter.h"
+
+// Hourly flow records waiting for the next batch publish. Kept in retained
+// RAM (checked by CRC) so a watchdog or firmware-update reset doesn't lose
+// the hours not yet queued.
+namespace {
+
+const uint32_t FLOW_BATCH_MAGIC = 0x464C4F30 + FLOW_CHANNELS;  // "FLO1" to "FLO3": the record layout
+const int MAX_FLOW_RECORDS = 48;
+
+struct FlowBatch {
+  uint32_t magic;
+  uint32_t count;
+  FlowSample records[MAX_FLOW_RECORDS];
+  uint32_t crc;
+};
+
+retained FlowBatch flowBatch;
+static_assert(sizeof(FlowBatch) <= RETAINED_FLOW_BATCH_BYTES, "Retained flow batch is over its RetainedRam.h budget");
+
+// Snapshot held until the clock can stamp it (one slot; a newer one wins)
+DiagnosticSample pendingDiagnostic;
+
+// Time series buckets read per pass while exporting
+const size_t HISTORY_READ_BATCH = 64;
+
+// Payload keys
+constexpr JsonKey KEY_DEVICE_ID = JSON_KEY("device_id");
+constexpr JsonKey KEY_TIMESTAMP = JSON_KEY("timestamp");
+
+constexpr JsonKey KEY_CHANNELS = JSON_KEY("channels");
+constexpr JsonKey KEY_RECORDS = JSON_KEY("records");
+constexpr JsonKey KEY_GALLONS_USED = JSON_KEY("gallons_used");
+constexpr JsonKey KEY_HOURLY_AVERAGE = JSON_KEY("hourly_average");
+constexpr JsonKey KEY_CHANNEL_GALLONS = JSON_KEY("channel_gallons");
+
+constexpr JsonKey KEY_TIER = JSON_KEY("tier");
+constexpr JsonKey KEY_START = JSON_KEY("start");
+constexpr JsonKey KEY_INTERVAL = JSON_KEY("interval");
+constexpr JsonKey KEY_UNIT_MGAL = JSON_KEY("unit_mgal");
+constexpr JsonKey KEY_VALUES = JSON_KEY("values");
+
+constexpr JsonKey KEY_ALERT = JSON_KEY("alert");
+constexpr JsonKey KEY_ACTIVE = JSON_KEY("active");
+
+constexpr JsonKey KEY_FIRMWARE = JSON_KEY("firmware");
+constexpr JsonKey KEY_RESET_REASON = JSON_KEY("reset_reason");
+constexpr JsonKey KEY_LIFETIME_GALLONS = JSON_KEY("lifetime_gallons");
+constexpr JsonKey KEY_DAILY_TOTAL = JSON_KEY("daily_total");
+constexpr JsonKey KEY_HOURS_ELAPSED = JSON_KEY("hours_elapsed");
+constexpr JsonKey KEY_TOTAL_PULSES = JSON_KEY("total_pulses");
+constexpr JsonKey KEY_FLOW_EVENTS_TODAY = JSON_KEY("flow_events_today");
+constexpr JsonKey KEY_PEAK_GPM = JSON_KEY("peak_gpm");
+constexpr JsonKey KEY_AVERAGE_GPM = JSON_KEY("average_gpm");
+constexpr JsonKey KEY_SIGNAL_STRENGTH = JSON_KEY("signal_strength");
+constexpr JsonKey KEY_STORAGE_RECORDS = JSON_KEY("storage_records");
+constexpr JsonKey KEY_STORAGE_WRITES_AVOIDED = JSON_KEY("storage_writes_avoided");
+constexpr JsonKey KEY_QUEUE_DEPTH = JSON_KEY("queue_depth");
+constexpr JsonKey KEY_QUEUE_DROPPED = JSON_KEY("queue_dropped");
+constexpr JsonKey KEY_FLOW_RECORDS_PENDING = JSON_KEY("flow_records_pending");
+constexpr JsonKey KEY_SLEEP_SECONDS = JSON_KEY("sleep_seconds");
+constexpr JsonKey KEY_WAKEUPS = JSON_KEY("wakeups");
+constexpr JsonKey KEY_ALERT_FLAGS = JSON_KEY("alert_flags");
+constexpr JsonKey KEY_CONTINUOUS_FLOW = JSON_KEY("continuous_flow_s");
+constexpr JsonKey KEY_LONGEST_FLOW = JSON_KEY("longest_flow_s");
+constexpr JsonKey KEY_HOUR_FLOOR_GPM = JSON_KEY("hour_floor_gpm");
+constexpr JsonKey KEY_DAY_FLOOR_GPM = JSON_KEY("day_floor_gpm");
+constexpr JsonKey KEY_BASELINE_GPM = JSON_KEY("baseline_gpm");
+constexpr JsonKey KEY_IMPLAUSIBLE_PULSES = JSON_KEY("implausible_pulses");
+constexpr JsonKey KEY_CHANNEL_LIFETIME_GALLONS = JSON_KEY("channel_lifetime_gallons");
+constexpr JsonKey KEY_CHANNEL_DAILY_TOTAL = JSON_KEY("channel_daily_total");
+constexpr JsonKey KEY_CHANNEL_FLOW_EVENTS = JSON_KEY("channel_flow_events");
+constexpr JsonKey KEY_WATCHDOG_GAP = JSON_KEY("watchdog_gap_ms");
+constexpr JsonKey KEY_WORST_PROBE = JSON_KEY("worst_probe");
+constexpr JsonKey KEY_WORST_US = JSON_KEY("worst_us");
+constexpr JsonKey KEY_LATENCY_US = JSON_KEY("latency_us");
+
+// Milliseconds left of an interval
+unsigned long timeLeft(unsigned long elapsed, unsigned long interval) {
+  return elapsed < interval ? interval - elapsed : 0;
+}
+
+uint32_t flowBatchCrc() {
+  return Checksum::crc32(reinterpret_cast<const uint8_t*>(&flowBatch), offsetof(FlowBatch, crc));
+}
+
+void sealFlowBatch() {
+  flowBatch.magic = FLOW_BATCH_MAGIC;
+  flowBatch.crc = flowBatchCrc();
+}
+
+} // namespace
+
+DataReporter::DataReporter(FlowSensor* flowSensor, PublishQueue* publishQueue, const char* deviceId, 
+                           PayloadFormat format) :
+  _flowSensor(flowSensor),
+  _channels{flowSensor},
+  _channelCount(1),
+  _publishQueue(publishQueue),
+  _powerManager(nullptr),
+  _policy(nullptr),
+  _deviceId(deviceId),
+  _format(format),
+  _firmwareVersion("1.0.0"),
+  _lastPublishTime(0),
+  _lastBatchPublishTime(0),
+  _lastDiagnosticPublishTime(0),
+  _provisionalRecords(false),
+  _diagnosticPending(false),
+  _batchDeferred(false),
+  _diagnosticDeferred(false)
+{
+  memset(_resetReasonStr, 0, sizeof(_resetReasonStr));
+  strcpy(_resetReasonStr, "Unknown");
+}
+
+void DataReporter::begin() {
+  // Translate reset reason for initial diagnostics
+  translateResetReason();
+  
+  // Recover flow records left pending by a reset
+  if (flowBatch.magic != FLOW_BATCH_MAGIC || flowBatch.count > MAX_FLOW_RECORDS ||
+      flowBatch.crc != flowBatchCrc()) {
+    flowBatch.count = 0;
+    sealFlowBatch();
+  } else if (flowBatch.count > 0) {
+    Serial.printlnf("Recovered %lu pending flow records", (unsigned long)flowBatch.count);
+    
+    // Provisional timestamps count uptime from a boot that has ended. Place
+    // them just before this boot, keeping their spacing, so the next sync
+    // still gives them a close estimate.
+    uint32_t newest = 0;
+    for (uint32_t i = 0; i < flowBatch.count; i++) {
+      if (Clock::isProvisional(flowBatch.records[i].timestamp) && flowBatch.records[i].timestamp > newest) {
+        newest = flowBatch.records[i].timestamp;
+      }
+    }
+    for (uint32_t i = 0; i < flowBatch.count; i++) {
+      if (Clock::isProvisional(flowBatch.records[i].timestamp)) {
+        flowBatch.records[i].timestamp = Clock::PROVISIONAL_BASE - (newest - flowBatch.records[i].timestamp);
+        _provisionalRecords = true;
+      }
+    }
+    sealFlowBatch();
+  }
+  
+  // Initialize publish times to avoid immediate publishing
+  _lastPublishTime = millis();
+  _lastBatchPublishTime = millis();
+  _lastDiagnosticPublishTime = millis();
+  
+  Serial.println("Data reporter initialized");
+}
+
+bool DataReporter::addChannel(FlowSensor* flowSensor) {
+  if (_channelCount >= FLOW_CHANNELS) {
+    return false;
+  }
+  _channels[_channelCount++] = flowSensor;
+  return true;
+}
+
+int DataReporter::getChannelCount() const {
+  return _channelCount;
+}
+
+void DataReporter::update(unsigned long currentTime) {
+  // Faster reports while water flows, until its volume has been published,
+  // and while an alert is raised
+  if (_policy) {
+    FlowAnalyzer* analyzer = _flowSensor->getAnalyzer();
+    _policy->update(currentTime, hasUnreportedFlow(), analyzer && analyzer->getAlertFlags() != 0);
+  }
+  
+  // Check if it's time to close the hourly flow record
+  if (currentTime - _lastPublishTime >= HOURLY_PUBLISH) {
+    recordFlowData();
+  }
+  
+  if (Clock::isSynced()) {
+    resolveTimestamps();
+    publishAlerts(currentTime);
+  }
+  
+  // Records go out together once the batch is due or the buffer fills. A
+  // batch with provisional timestamps waits for the clock unless it's full,
+  // and one over the daily budget waits for the reset unless it's full.
+  bool batchDue = currentTime - _lastBatchPublishTime >= getBatchInterval() && !_provisionalRecords;
+  if (flowBatch.count > 0 && 
+      ((batchDue && allowReport(_batchDeferred)) || flowBatch.count == MAX_FLOW_RECORDS)) {
+    publishFlowData();
+  }
+  
+  // Check if it's time for diagnostic publish
+  if (currentTime - _lastDiagnosticPublishTime >= getDiagnosticInterval() && allowReport(_diagnosticDeferred)) {
+    publishDiagnosticData();
+  }
+}
+
+void DataReporter::recordFlowData() {
+  // Calculate hourly average
+  uint64_t hourlyAverage = calculateHourlyAverage();
+  
+  // Get accumulated gallons and convert to whole number for customer display
+  uint64_t milliGallons = _flowSensor->getAccumulatedMilliGallons();
+  unsigned long wholeGallons = Volume::wholeGallons(milliGallons);
+  
+  // The buffer is only full if the cloud has been unreachable for days;
+  // the oldest hour makes room
+  if (flowBatch.count == MAX_FLOW_RECORDS) {
+    memmove(&flowBatch.records[0], &flowBatch.records[1], 
+            (MAX_FLOW_RECORDS - 1) * sizeof(FlowSample));
+    flowBatch.count--;
+    DLOG_WARN("Flow record buffer full, oldest hour dropped");
+  }
+  
+  // An hour can't come near 4 billion milli-gallons, so 32 bits per record
+  FlowSample& record = flowBatch.records[flowBatch.count++];
+  record.timestamp = Clock::now();
+  _provisionalRecords |= Clock::isProvisional(record.timestamp);
+  record.milliGallons = (uint32_t)milliGallons;
+  record.hourlyAverageMilliGallons = (uint32_t)hourlyAverage;
+  
+  // Every meter's hour goes in the same record; a single meter adds nothing
+  record.channelCount = _channelCount > 1 ? _channelCount : 0;
+  for (int channel = 0; channel < _channelCount; channel++) {
+    record.channelMilliGallons[channel] = (uint32_t)_channels[channel]->getAccumulatedMilliGallons();
+  }
+  sealFlowBatch();
+  
+  // Log the hourly record
+  DLOG_INFO("Flow record: %lu gallons this interval, %.1V gallons average per hour, %lu pending", 
+            wholeGallons, DeferredLog::gallons(hourlyAverage), (unsigned long)flowBatch.count);
+  DLOG_INFO("Daily total: %.2V gallons over %d hours", 
+            DeferredLog::gallons(_flowSensor->getDailyMilliGallons()), _flowSensor->getHoursElapsed());
+  
+  for (int channel = 1; channel < _channelCount; channel++) {
+    DLOG_INFO("Flow record %s: %.2V gallons this interval", _channels[channel]->getName(), 
+              DeferredLog::gallons(record.channelMilliGallons[channel]));
+  }
+  
+  // Reset accumulated gallons for next interval
+  for (int channel = 0; channel < _channelCount; channel++) {
+    _channels[channel]->resetAccumulatedGallons();
+  }
+  
+  // Increment hours elapsed
+  _flowSensor->incrementHoursElapsed();
+  
+  // Update last publish time
+  _lastPublishTime = millis();
+}
+
+void DataReporter::publishFlowData() {
+  if (flowBatch.count == 0) {
+    return;
+  }
+  
+  // One publish carries as many hourly records as fit in an event
+  char payload[PublishQueue::MAX_DATA_LENGTH + 1];
+  int sent = (_format == FORMAT_COMPACT) ? encodeFlowBatch(payload, sizeof(payload), flowBatch.count)
+                                         : formatFlowBatch(payload, sizeof(payload), flowBatch.count);
+  if (sent == 0) {
+    DLOG_ERROR("Failed to encode flow data");
+    return;
+  }
+  
+  // Queued in flash, so the batch survives an outage or a reboot
+  if (!enqueue("flow_data", payload)) {
+    DLOG_ERROR("Failed to queue flow data (%d records)", sent);
+    return;
+  }
+  DLOG_INFO("Queued flow data: %d records, %u bytes", sent, (unsigned)strlen(payload));
+  
+  // Anything left over goes out with the next batch
+  flowBatch.count -= sent;
+  memmove(&flowBatch.records[0], &flowBatch.records[sent], flowBatch.count * sizeof(FlowSample));
+  sealFlowBatch();
+  
+  _lastBatchPublishTime = millis();
+  _batchDeferred = false;
+}
+
+int DataReporter::formatFlowBatch(char* buffer, size_t size, int count) {
+  JsonWriter json(buffer, size);
+  json.beginObject().key(KEY_DEVICE_ID).string(_deviceId);
+  
+  // Several meters are named once, then listed in that order in each record
+  if (_channelCount > 1) {
+    json.key(KEY_CHANNELS).beginArray();
+    for (int channel = 0; channel < _channelCount; channel++) {
+      json.string(_channels[channel]->getName());
+    }
+    json.endArray();
+  }
+  json.key(KEY_RECORDS).beginArray();
+  if (json.overflowed()) {
+    return 0;
+  }
+  
+  int records = 0;
+  for (; records < count; records++) {
+    const FlowSample& record = flowBatch.records[records];
+    JsonWriter::Mark mark = json.mark();
+    json.beginObject()
+        .key(KEY_TIMESTAMP).number(record.timestamp)
+        .key(KEY_GALLONS_USED).number(Volume::wholeGallons(record.milliGallons))
+        .key(KEY_HOURLY_AVERAGE).milli(record.hourlyAverageMilliGallons, 1);
+    if (_channelCount > 1) {
+      // Hours recorded before a meter was added have nothing for it
+      json.key(KEY_CHANNEL_GALLONS).beginArray();
+      for (int channel = 0; channel < _channelCount; channel++) {
+        uint32_t milliGallons = (uint32_t)channel < record.channelCount ? record.channelMilliGallons[channel] : 0;
+        json.number(Volume::wholeGallons(milliGallons));
+      }
+      json.endArray();
+    }
+    json.endObject();
+    
+    // Records that don't fit wait for the next batch
+    if (json.overflowed()) {
+      json.rewind(mark);
+      break;
+    }
+  }
+  
+  json.endArray().endObject();
+  return records;
+}
+
+int DataReporter::encodeFlowBatch(char* buffer, size_t size, int count) {
+  const char* names[FLOW_CHANNELS];
+  size_t channels = _channelCount > 1 ? (size_t)_channelCount : 0;
+  for (size_t channel = 0; channel < channels; channel++) {
+    names[channel] = _channels[channel]->getName();
+  }
+  
+  // Records are a few bytes each, so this only shrinks after a long outage
+  while (count > 0 && 
+         CompactPayload::encodeFlowBatch(_deviceId, names, channels, flowBatch.records, count, buffer, size) == 0) {
+    count--;
+  }
+  return count;
+}
+
+int DataReporter::publishHistory(const char* tierName) {
+  FlowHistory* history = _flowSensor->getHistory();
+  int tier = FlowHistory::findTier(tierName);
+  if (history == nullptr || tier < 0) {
+    return -1;
+  }
+  
+  // Values are in stored counts of unit_mgal, one bucket per interval from start
+  char payload[PublishQueue::MAX_DATA_LENGTH + 1];
+  uint16_t values[HISTORY_READ_BATCH];
+  size_t count = history->getCount(tier);
+  size_t next = 0;
+  int events = 0;
+  while (next < count) {
+    JsonWriter json(payload, sizeof(payload));
+    json.beginObject()
+        .key(KEY_DEVICE_ID).string(_deviceId)
+        .key(KEY_TIER).string(FlowHistory::getTierName(tier))
+        .key(KEY_START).number(history->getBucketTime(tier, next))
+        .key(KEY_INTERVAL).number(FlowHistory::getInterval(tier))
+        .key(KEY_UNIT_MGAL).number(FlowHistory::getUnitMilliGallons(tier))
+        .key(KEY_VALUES).beginArray();
+    size_t first = next;
+    bool full = json.overflowed();
+    while (!full && next < count) {
+      size_t read = history->readBuckets(tier, next, values, HISTORY_READ_BATCH);
+      if (read == 0) {
+        DLOG_ERROR("Failed to read the %s flow history", tierName);
+        return events;
+      }
+      for (size_t i = 0; i < read; i++) {
+        JsonWriter::Mark mark = json.mark();
+        json.number(values[i]);
+        if (json.overflowed()) {
+          json.rewind(mark);
+          full = true;
+          break;
+        }
+        next++;
+      }
+    }
+    json.endArray().endObject();
+    if (next == first) {
+      DLOG_ERROR("Flow history event too small for a bucket");
+      return events;
+    }
+    
+    if (!enqueue("flow_history", payload)) {
+      DLOG_ERROR("Failed to queue flow history");
+      return events;
+    }
+    events++;
+  }
+  
+  DLOG_INFO("Queued %s flow history: %u buckets in %d events", tierName, (unsigned)count, events);
+  return events;
+}
+
+void DataReporter::publishAlerts(unsigned long currentTime) {
+  FlowAnalyzer* analyzer = _flowSensor->getAnalyzer();
+  if (analyzer == nullptr) {
+    return;
+  }
+  
+  // The analyzer rate-limits each type, so this only sees fresh raises
+  int alert;
+  while ((alert = analyzer->takeAlert(currentTime)) >= 0) {
+    queueAlert(alert);
+  }
+}
+
+void DataReporter::queueAlert(int alert) {
+  FlowAnalyzer* analyzer = _flowSensor->getAnalyzer();
+  
+  // Rare and urgent, so always JSON
+  char payload[256];
+  JsonWriter json(payload, sizeof(payload));
+  json.beginObject()
+      .key(KEY_DEVICE_ID).string(_deviceId)
+      .key(KEY_TIMESTAMP).number(Clock::now())
+      .key(KEY_ALERT).string(FlowAnalyzer::getAlertName(alert))
+      .key(KEY_ACTIVE).boolean(analyzer->isAlertActive(alert))
+      .key(KEY_CONTINUOUS_FLOW).number(analyzer->getContinuousSeconds())
+      .key(KEY_HOUR_FLOOR_GPM).milli(analyzer->getHourFloorMilliGpm(), 3)
+      .key(KEY_BASELINE_GPM).milli(analyzer->getBaselineMilliGpm(), 3)
+      .key(KEY_IMPLAUSIBLE_PULSES).number(analyzer->getImplausiblePulses())
+      .endObject();
+  if (json.overflowed()) {
+    DLOG_ERROR("Alert payload too long");
+    return;
+  }
+  
+  if (enqueue("alert", payload)) {
+    DLOG_INFO("Queued alert: %s (%s)", FlowAnalyzer::getAlertName(alert), 
+              analyzer->isAlertActive(alert) ? "active" : "cleared");
+  } else {
+    DLOG_ERROR("Failed to queue alert");
+  }
+}
+
+void DataReporter::publishDiagnosticData() {
+  // Update reset reason
+  translateResetReason();
+  
+  DiagnosticSample sample;
+  collectDiagnostics(sample);
+  
+#if LATENCY_PROFILE
+  // Each report covers the latency since the previous one
+  LatencyProfile::logSummary();
+  LatencyProfile::reset();
+#endif
+  
+  if (Clock::isProvisional(sample.timestamp)) {
+    pendingDiagnostic = sample;
+    _diagnosticPending = true;
+    DLOG_INFO("Diagnostic data held until the clock syncs");
+  } else {
+    queueDiagnostics(sample);
+  }
+  
+  // Update last diagnostic publish time
+  _lastDiagnosticPublishTime = millis();
+  _diagnosticDeferred = false;
+}
+
+void DataReporter::queueDiagnostics(DiagnosticSample& sample) {
+  char payload[PublishQueue::MAX_DATA_LENGTH + 1];
+  if (_format == FORMAT_COMPACT) {
+    if (CompactPayload::encodeDiagnostics(_deviceId, sample, payload, sizeof(payload)) == 0) {
+      DLOG_ERROR("Failed to encode diagnostic data");
+      return;
+    }
+  } else if (!formatDiagnostics(payload, sizeof(payload), sample)) {
+    DLOG_ERROR("Diagnostic payload too long");
+    return;
+  }
+  
+  if (enqueue("diagnostic_data", payload)) {
+    DLOG_INFO("Queued diagnostic data: %u bytes", (unsigned)strlen(payload));
+  } else {
+    DLOG_ERROR("Failed to queue diagnostic data");
+  }
+}
+
+void DataReporter::resolveTimestamps() {
+  if (_provisionalRecords) {
+    for (uint32_t i = 0; i < flowBatch.count; i++) {
+      flowBatch.records[i].timestamp = Clock::resolve(flowBatch.records[i].timestamp);
+    }
+    sealFlowBatch();
+    _provisionalRecords = false;
+    DLOG_INFO("Flow record timestamps corrected after clock sync");
+  }
+  
+  if (_diagnosticPending) {
+    _diagnosticPending = false;
+    pendingDiagnostic.timestamp = Clock::resolve(pendingDiagnostic.timestamp);
+    queueDiagnostics(pendingDiagnostic);
+  }
+}
+
+void DataReporter::collectDiagnostics(DiagnosticSample& sample) {
+  // Get cellular signal strength
+  CellularSignal sig;
+  {
+    LATENCY_SCOPE("rssi");
+    sig = Cellular.RSSI();
+  }
+  
+  // Provisional until the clock syncs
+  sample.timestamp = Clock::now();
+  snprintf(sample.firmware, sizeof(sample.firmware), "%s", _firmwareVersion.c_str());
+  sample.resetReason = System.resetReason();
+  sample.lifetimeMilliGallons = _flowSensor->getLifetimeMilliGallons();
+  sample.dailyMilliGallons = _flowSensor->getDailyMilliGallons();
+  sample.hoursElapsed = _flowSensor->getHoursElapsed();
+  sample.totalPulses = _flowSensor->getTechnicalPulseCount();
+  sample.flowEventsToday = _flowSensor->getFlowEventsToday();
+  sample.peakMilliGpm = (uint32_t)lroundf(_flowSensor->getPeakGpm() * 1000.0f);
+  sample.averageMilliGpm = (uint32_t)lroundf(_flowSensor->getAverageGpm() * 1000.0f);
+  sample.signalStrength = (int)sig.getStrength();
+  if (_policy && Particle.connected()) {
+    // Asleep or between sessions there's no reading, just a zero
+    _policy->setSignalStrength(sample.signalStrength);
+  }
+  sample.storageRecords = Storage::getRecordsWritten();
+  sample.storageWritesAvoided = Storage::getWritesAvoided();
+  sample.queueDepth = _publishQueue->getDepth();
+  sample.queueDropped = _publishQueue->getDropped();
+  sample.flowRecordsPending = flowBatch.count;
+  sample.sleepSeconds = _powerManager ? (uint32_t)(_powerManager->getSleepMillis() / 1000) : 0;
+  sample.wakeups = _powerManager ? _powerManager->getWakeups() : 0;
+  
+  FlowAnalyzer* analyzer = _flowSensor->getAnalyzer();
+  sample.alertFlags = analyzer ? analyzer->getAlertFlags() : 0;
+  sample.continuousSeconds = analyzer ? analyzer->getContinuousSeconds() : 0;
+  sample.longestFlowSeconds = analyzer ? analyzer->getLongestContinuousSeconds() : 0;
+  sample.hourFloorMilliGpm = analyzer ? analyzer->getHourFloorMilliGpm() : 0;
+  sample.dayFloorMilliGpm = analyzer ? analyzer->getDayFloorMilliGpm() : 0;
+  sample.baselineMilliGpm = analyzer ? analyzer->getBaselineMilliGpm() : 0;
+  sample.implausiblePulses = analyzer ? analyzer->getImplausiblePulses() : 0;
+  
+  // Each meter's totals, when there is more than one
+  sample.channelCount = _channelCount > 1 ? _channelCount : 0;
+  for (uint32_t i = 0; i < sample.channelCount; i++) {
+    FlowSensor* sensor = _channels[i];
+    ChannelSample& channel = sample.channels[i];
+    snprintf(channel.name, sizeof(channel.name), "%s", sensor->getName());
+    channel.lifetimeMilliGallons = sensor->getLifetimeMilliGallons();
+    channel.dailyMilliGallons = sensor->getDailyMilliGallons();
+    channel.flowEventsToday = sensor->getFlowEventsToday();
+  }
+  
+#if LATENCY_PROFILE
+  LatencyProfile::fillDiagnostics(sample);
+#else
+  sample.watchdogGapMillis = 0;
+  sample.worstProbe[0] = '\0';
+  sample.worstMicros = 0;
+  sample.latencyCount = 0;
+#endif
+}
+
+bool DataReporter::formatDiagnostics(char* buffer, size_t size, const DiagnosticSample& sample) {
+  // Volumes are converted to gallons only for the payload
+  JsonWriter json(buffer, size);
+  json.beginObject()
+      .key(KEY_DEVICE_ID).string(_deviceId)
+      .key(KEY_TIMESTAMP).number(sample.timestamp)
+      .key(KEY_FIRMWARE).string(sample.firmware)
+      .key(KEY_RESET_REASON).string(_resetReasonStr)
+      .key(KEY_LIFETIME_GALLONS).milli(sample.lifetimeMilliGallons, 2)
+      .key(KEY_DAILY_TOTAL).milli(sample.dailyMilliGallons, 2)
+      .key(KEY_HOURS_ELAPSED).number(sample.hoursElapsed)
+      .key(KEY_TOTAL_PULSES).number(sample.totalPulses)
+      .key(KEY_FLOW_EVENTS_TODAY).number(sample.flowEventsToday)
+      .key(KEY_PEAK_GPM).milli(sample.peakMilliGpm, 2)
+      .key(KEY_AVERAGE_GPM).milli(sample.averageMilliGpm, 2)
+      .key(KEY_SIGNAL_STRENGTH).signedNumber(sample.signalStrength)
+      .key(KEY_STORAGE_RECORDS).number(sample.storageRecords)
+      .key(KEY_STORAGE_WRITES_AVOIDED).number(sample.storageWritesAvoided)
+      .key(KEY_QUEUE_DEPTH).number(sample.queueDepth)
+      .key(KEY_QUEUE_DROPPED).number(sample.queueDropped)
+      .key(KEY_FLOW_RECORDS_PENDING).number(sample.flowRecordsPending)
+      .key(KEY_SLEEP_SECONDS).number(sample.sleepSeconds)
+      .key(KEY_WAKEUPS).number(sample.wakeups)
+      .key(KEY_ALERT_FLAGS).number(sample.alertFlags)
+      .key(KEY_CONTINUOUS_FLOW).number(sample.continuousSeconds)
+      .key(KEY_LONGEST_FLOW).number(sample.longestFlowSeconds)
+      .key(KEY_HOUR_FLOOR_GPM).milli(sample.hourFloorMilliGpm, 3)
+      .key(KEY_DAY_FLOOR_GPM).milli(sample.dayFloorMilliGpm, 3)
+      .key(KEY_BASELINE_GPM).milli(sample.baselineMilliGpm, 3)
+      .key(KEY_IMPLAUSIBLE_PULSES).number(sample.implausiblePulses);
+  
+  // Per-meter totals as arrays in channel order
+  if (sample.channelCount > 0) {
+    json.key(KEY_CHANNELS).beginArray();
+    for (uint32_t i = 0; i < sample.channelCount; i++) {
+      json.string(sample.channels[i].name);
+    }
+    json.endArray().key(KEY_CHANNEL_LIFETIME_GALLONS).beginArray();
+    for (uint32_t i = 0; i < sample.channelCount; i++) {
+      json.milli(sample.channels[i].lifetimeMilliGallons, 2);
+    }
+    json.endArray().key(KEY_CHANNEL_DAILY_TOTAL).beginArray();
+    for (uint32_t i = 0; i < sample.channelCount; i++) {
+      json.milli(sample.channels[i].dailyMilliGallons, 2);
+    }
+    json.endArray().key(KEY_CHANNEL_FLOW_EVENTS).beginArray();
+    for (uint32_t i = 0; i < sample.channelCount; i++) {
+      json.number(sample.channels[i].flowEventsToday);
+    }
+    json.endArray();
+  }
+  
+  // Slowest probes as "name":[min,p50,p99,max] in microseconds, when the
+  // firmware is built with them. Left out rather than the whole report when
+  // they don't fit.
+  if (sample.latencyCount > 0 && !json.overflowed()) {
+    JsonWriter::Mark mark = json.mark();
+    json.key(KEY_WATCHDOG_GAP).number(sample.watchdogGapMillis)
+        .key(KEY_WORST_PROBE).string(sample.worstProbe)
+        .key(KEY_WORST_US).number(sample.worstMicros)
+        .key(KEY_LATENCY_US).beginObject();
+    for (uint32_t i = 0; i < sample.latencyCount; i++) {
+      const LatencySample& latency = sample.latency[i];
+      json.key(latency.name).beginArray()
+          .number(latency.minMicros).number(latency.p50Micros)
+          .number(latency.p99Micros).number(latency.maxMicros)
+          .endArray();
+    }
+    json.endObject();
+    if (json.overflowed()) {
+      json.rewind(mark);
+      DLOG_WARN("Latency left out of diagnostic data");
+    }
+  }
+  
+  json.endObject();
+  return !json.overflowed();
+}
+
+uint64_t DataReporter::calculateHourlyAverage() const {
+  uint64_t hourlyAverage = 0;
+  int hoursElapsed = _flowSensor->getHoursElapsed();
+  
+  if (hoursElapsed > 0) {
+    hourlyAverage = _flowSensor->getDailyMilliGallons() / hoursElapsed;
+  }
+  
+  return hourlyAverage;
+}
+
+void DataReporter::translateResetReason() {
+  int reason = System.resetReason();
+  
+  switch (reason) {
+    case RESET_REASON_PIN_RESET:
+      strcpy(_resetReasonStr, "Pin Reset");
+      break;
+    case RESET_REASON_POWER_MANAGEMENT:
+      strcpy(_resetReasonStr, "Power Management");
+      break;
+    case RESET_REASON_WATCHDOG:
+      strcpy(_resetReasonStr, "Watchdog Timer");
+      break;
+    case RESET_REASON_UPDATE:
+      strcpy(_resetReasonStr, "Firmware Update");
+      break;
+    case RESET_REASON_UPDATE_TIMEOUT:
+      strcpy(_resetReasonStr, "Firmware Update Timeout");
+      break;
+    case RESET_REASON_FACTORY_RESET:
+      strcpy(_resetReasonStr, "Factory Reset");
+      break;
+    case RESET_REASON_SAFE_MODE:
+      strcpy(_resetReasonStr, "Safe Mode");
+      break;
+    case RESET_REASON_DFU_MODE:
+      strcpy(_resetReasonStr, "DFU Mode");
+      break;
+    case RESET_REASON_PANIC:
+      strcpy(_resetReasonStr, "System Panic");
+      break;
+    case RESET_REASON_USER:
+      strcpy(_resetReasonStr, "User Requested");
+      break;
+    case RESET_REASON_UNKNOWN:
+    default:
+      strcpy(_resetReasonStr, "Unknown");
+      break;
+  }
+  
+  Serial.printlnf("Reset reason: %s (code: %d)", _resetReasonStr, reason);
+}
+
+unsigned long DataReporter::getLastPublishTime() const {
+  return _lastPublishTime;
+}
+
+unsigned long DataReporter::getLastDiagnosticPublishTime() const {
+  return _lastDiagnosticPublishTime;
+}
+
+void DataReporter::setPayloadFormat(PayloadFormat format) {
+  _format = format;
+}
+
+void DataReporter::setPowerManager(PowerManager* powerManager) {
+  _powerManager = powerManager;
+}
+
+void DataReporter::setPolicy(ReportingPolicy* policy) {
+  _policy = policy;
+}
+
+unsigned long DataReporter::getBatchInterval() const {
+  return _policy ? _policy->getBatchInterval() : BATCH_PUBLISH_INTERVAL;
+}
+
+unsigned long DataReporter::getDiagnosticInterval() const {
+  return _policy ? _policy->getDiagnosticInterval() : DIAGNOSTIC_PUBLISH_INTERVAL;
+}
+
+bool DataReporter::allowReport(bool& deferred) {
+  if (!_policy || _policy->withinBudget()) {
+    return true;
+  }
+  if (!deferred) {
+    deferred = true;
+    _policy->recordDeferred();
+  }
+  return false;
+}
+
+bool DataReporter::hasUnreportedFlow() const {
+  for (int channel = 0; channel < _channelCount; channel++) {
+    if (_channels[channel]->isFlowActive() || _channels[channel]->getAccumulatedMilliGallons() > 0) {
+      return true;
+    }
+  }
+  for (uint32_t i = 0; i < flowBatch.count; i++) {
+    const FlowSample& record = flowBatch.records[i];
+    if (record.milliGallons > 0) {
+      return true;
+    }
+    for (uint32_t channel = 0; channel < record.channelCount; channel++) {
+      if (record.channelMilliGallons[channel] > 0) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+bool DataReporter::enqueue(const char* eventName, const char* payload) {
+  if (!_publishQueue->enqueue(eventName, payload)) {
+    return false;
+  }
+  if (_policy) {
+    _policy->recordPublish(strlen(payload));
+  }
+  return true;
+}
+
+unsigned long DataReporter::getMillisUntilNextReport(unsigned long currentTime) const {
+  unsigned long untilReport = timeLeft(currentTime - _lastPublishTime, HOURLY_PUBLISH);
+  
+  // Reports over the daily budget wait for the daily reset, not a timer
+  if (_policy && !_policy->withinBudget()) {
+    return untilReport;
+  }
+  unsigned long untilDiagnostic = timeLeft(currentTime - _lastDiagnosticPublishTime, getDiagnosticInterval());
+  if (untilDiagnostic < untilReport) {
+    untilReport = untilDiagnostic;
+  }
+  
+  // A batch only goes out with records to send and real timestamps
+  if (flowBatch.count > 0 && !_provisionalRecords) {
+    unsigned long untilBatch = timeLeft(currentTime - _lastBatchPublishTime, getBatchInterval());
+    if (untilBatch < untilReport) {
+      untilReport = untilBatch;
+    }
+  }
+  return untilReport;
+}
+
+int DataReporter::getPendingFlowRecords() const {
+  return flowBatch.count;
+}
\ No newline at end of file
@@ -1,51 +1,130 @@
-#pragma once
-
-#include "Particle.h"
-
-class FlowSensor; // Forward declaration
-
-class DataReporter {
-public:
-  DataReporter(FlowSensor* flowSensor, const char* deviceId);
-  
-  // Initialize reporter
-  void begin();
-  
-  // Check and publish data as needed
-  void update(unsigned long currentTime);
-  
-  // Publish flow data immediately
-  void publishFlowData();
-  
-  // Publish diagnostic data immediately
-  void publishDiagnosticData();
-  
-  // Getters
-  unsigned long getLastPublishTime() const;
-  unsigned long getLastDiagnosticPublishTime() const;
-  
-  // New method declaration
-  unsigned long getValidTimestamp();
-  
-private:
-  FlowSensor* _flowSensor;
-  const char* _deviceId;
-  String _firmwareVersion;
-  
-  unsigned long _lastPublishTime;
-  unsigned long _lastDiagnosticPublishTime;
-  
-  // Reset reason tracking
-  char _resetReasonStr[32];
-  
-  // Publishing intervals (in milliseconds)
-  const unsigned long HOURLY_PUBLISH = 3600000;           // 1 hour (for demo)
-  const unsigned long DIAGNOSTIC_PUBLISH_INTERVAL = 3600000; // 1 hour (heartbeat)
-  // TODO: For production, adjust HOURLY_PUBLISH to 21600000 (6 hours) or 43200000 (12 hours)
-  
-  // Calculate hourly average water usage
-  float calculateHourlyAverage() const;
-  
-  // Generate reset reason string
-  void translateResetReason();
+#pragma once
+
+#include "Particle.h"
+#include "FlowChannels.h"
+
+class FlowSensor; // Forward declaration
+class PublishQueue;
+class PowerManager;
+class ReportingPolicy;
+struct DiagnosticSample;
+
+class DataReporter {
+public:
+  enum PayloadFormat {
+    FORMAT_JSON,
+    FORMAT_COMPACT  // base64 binary records, see CompactPayload.h
+  };
+  
+  DataReporter(FlowSensor* flowSensor, PublishQueue* publishQueue, const char* deviceId, 
+               PayloadFormat format = FORMAT_JSON);
+  
+  // Initialize reporter
+  void begin();
+  
+  // Report another meter in the same events as the first; false when
+  // FLOW_CHANNELS are already reported
+  bool addChannel(FlowSensor* flowSensor);
+  int getChannelCount() const;
+  
+  // Check and publish data as needed
+  void update(unsigned long currentTime);
+  
+  // Close the current hour into a flow record held until the next batch
+  void recordFlowData();
+  
+  // Queue the pending flow records as one flow_data publish (sent as soon
+  // as the cloud is reachable); records that don't fit stay pending
+  void publishFlowData();
+  
+  // Queue diagnostic data for publishing
+  void publishDiagnosticData();
+  
+  // Queue one tier of the flow time series ("minute", "quarter" or "hour")
+  // as flow_history events, oldest bucket first. Returns the number of
+  // events queued, or -1 for an unknown tier.
+  int publishHistory(const char* tierName);
+  
+  // Select the event encoding (the cloud decoder accepts both)
+  void setPayloadFormat(PayloadFormat format);
+  
+  // Report sleep time and wakeups in diagnostics
+  void setPowerManager(PowerManager* powerManager);
+  
+  // Take the batch and diagnostic intervals, and the daily budget, from a
+  // policy instead of the fixed defaults
+  void setPolicy(ReportingPolicy* policy);
+  
+  // Time until update() next has a record or publish to make
+  unsigned long getMillisUntilNextReport(unsigned long currentTime) const;
+  
+  // Getters
+  unsigned long getLastPublishTime() const;
+  unsigned long getLastDiagnosticPublishTime() const;
+  int getPendingFlowRecords() const;
+  
+private:
+  FlowSensor* _flowSensor;  // Channel 0, which the single-meter fields describe
+  FlowSensor* _channels[FLOW_CHANNELS];
+  int _channelCount;
+  PublishQueue* _publishQueue;
+  PowerManager* _powerManager;
+  ReportingPolicy* _policy;
+  const char* _deviceId;
+  PayloadFormat _format;
+  String _firmwareVersion;
+  
+  unsigned long _lastPublishTime;
+  unsigned long _lastBatchPublishTime;
+  unsigned long _lastDiagnosticPublishTime;
+  
+  // Reports taken before the clock synced wait for their real timestamps
+  bool _provisionalRecords;
+  bool _diagnosticPending;
+  
+  // Reports held back by the policy's daily budget, counted once each
+  bool _batchDeferred;
+  bool _diagnosticDeferred;
+  
+  // Reset reason tracking
+  char _resetReasonStr[32];
+  
+  // Publishing intervals (in milliseconds); a policy replaces the last two
+  const unsigned long HOURLY_PUBLISH = 3600000;           // 1 hour flow record resolution
+  const unsigned long BATCH_PUBLISH_INTERVAL = 21600000;  // 6 hours of records per publish
+  const unsigned long DIAGNOSTIC_PUBLISH_INTERVAL = 3600000; // 1 hour (heartbeat)
+  
+  unsigned long getBatchInterval() const;
+  unsigned long getDiagnosticInterval() const;
+  
+  // Water flowing now, or volume not yet in a published record
+  bool hasUnreportedFlow() const;
+  
+  // Whether a routine report may go out under the daily budget
+  bool allowReport(bool& deferred);
+  
+  // Queue an event and charge it to the policy's budget
+  bool enqueue(const char* eventName, const char* payload);
+  
+  // Write the batch payload; returns the number of records that fit
+  int formatFlowBatch(char* buffer, size_t size, int count);
+  int encodeFlowBatch(char* buffer, size_t size, int count);
+  
+  // Rewrite provisional timestamps once the clock has synced
+  void resolveTimestamps();
+  
+  // Raised leak and sensor-fault alerts, as alert events
+  void publishAlerts(unsigned long currentTime);
+  void queueAlert(int alert);
+  
+  // Diagnostic payloads built from one snapshot
+  void queueDiagnostics(DiagnosticSample& sample);
+  void collectDiagnostics(DiagnosticSample& sample);
+  bool formatDiagnostics(char* buffer, size_t size, const DiagnosticSample& sample);  // False if it overflows
+  
+  // Calculate hourly average water usage
+  uint64_t calculateHourlyAverage() const;  // Milli-gallons per hour
+  
+  // Generate reset reason string
+  void translateResetReason();
 }; 
\ No newline at end of file
@@ -0,0 +1,352 @@
+#include "DeferredLog.h"
+#include "Checksum.h"
+#include "Volume.h"
+
+#include <atomic>
+
+uint32_t DeferredLog::_ring[DeferredLog::CAPACITY];
+volatile uint32_t DeferredLog::_head = 0;
+volatile uint32_t DeferredLog::_tail = 0;
+const char* DeferredLog::_formats[DeferredLog::MAX_FORMATS];
+uint8_t DeferredLog::_levels[DeferredLog::MAX_FORMATS];
+int DeferredLog::_formatCount = 0;
+uint64_t DeferredLog::_announced = 0;
+bool DeferredLog::_binary = false;
+volatile unsigned long DeferredLog::_written = 0;
+volatile unsigned long DeferredLog::_dropped = 0;
+unsigned long DeferredLog::_droppedReported = 0;
+uint32_t DeferredLog::_highWater = 0;
+
+namespace {
+
+// Entries printed per pass of the drain thread before it yields, and its
+// wait while the ring is empty
+const size_t DRAIN_BATCH = 8;
+const unsigned long DRAIN_IDLE_MS = 20;
+const size_t DRAIN_STACK_SIZE = 2048;
+
+const size_t LINE_LENGTH = 256;
+
+const char* levelName(uint8_t level) {
+  if (level >= DLOG_LEVEL_ERROR) {
+    return "ERROR";
+  }
+  if (level >= DLOG_LEVEL_WARN) {
+    return "WARN";
+  }
+  return level >= DLOG_LEVEL_INFO ? "INFO" : "TRACE";
+}
+
+void putU16(uint8_t* out, uint16_t value) {
+  out[0] = (uint8_t)value;
+  out[1] = (uint8_t)(value >> 8);
+}
+
+void putU32(uint8_t* out, uint32_t value) {
+  for (int i = 0; i < 4; i++) {
+    out[i] = (uint8_t)(value >> (8 * i));
+  }
+}
+
+// Argument words taken by a tag (strings: a length word and the bytes)
+size_t argWords(uint32_t tag, const uint32_t* words, size_t left) {
+  switch (tag) {
+    case DeferredLog::TAG_INT64:
+    case DeferredLog::TAG_UINT64:
+    case DeferredLog::TAG_GALLONS:
+      return 2;
+    case DeferredLog::TAG_STRING:
+      return left > 0 ? 1 + (words[0] + 3) / 4 : 1;
+    default:
+      return 1;
+  }
+}
+
+} // namespace
+
+void DeferredLog::Entry::add(const char* value) {
+  if (value == nullptr) {
+    value = "(null)";
+  }
+
+  // Leave room for the widest possible arguments still to come
+  tag(TAG_STRING);
+  size_t room = (MAX_ENTRY_WORDS - size - 1 - 2 * (MAX_ARGS - argc)) * 4;
+  if (room > MAX_STRING_LENGTH) {
+    room = MAX_STRING_LENGTH;
+  }
+  size_t length = strnlen(value, room + 1);
+  bool cut = length > room;
+  if (cut) {
+    length = room;
+  }
+
+  words[size] = (uint32_t)length;
+  char* text = reinterpret_cast<char*>(&words[size + 1]);
+  memcpy(text, value, length);
+  if (cut && length >= 3) {
+    memcpy(text + length - 3, "...", 3);
+  }
+  size += 1 + (length + 3) / 4;
+}
+
+void DeferredLog::begin() {
+#if PLATFORM_THREADING
+  // Below the application thread, so the drain only runs while it idles
+  new Thread("log", drainThread, nullptr, OS_THREAD_PRIORITY_DEFAULT - 1, DRAIN_STACK_SIZE);
+#endif
+}
+
+int DeferredLog::define(int level, const char* format) {
+  if (_formatCount >= MAX_FORMATS) {
+    Serial.printlnf("Log: no room for format \"%s\"", format);
+    return -1;
+  }
+  _formats[_formatCount] = format;
+  _levels[_formatCount] = (uint8_t)level;
+  return _formatCount++;
+}
+
+void DeferredLog::commit(int format, const Entry& entry) {
+  uint32_t head = _head;
+  uint32_t used = head - _tail;
+  if (used + entry.size > CAPACITY) {
+    _dropped++;
+    return;
+  }
+
+  _ring[head & (CAPACITY - 1)] = (uint32_t)format | (uint32_t)entry.size << 16;
+  _ring[(head + 1) & (CAPACITY - 1)] = entry.tags;
+  _ring[(head + 2) & (CAPACITY - 1)] = millis();
+  for (size_t i = HEADER_WORDS; i < entry.size; i++) {
+    _ring[(head + i) & (CAPACITY - 1)] = entry.words[i];
+  }
+  std::atomic_signal_fence(std::memory_order_release);
+  _head = head + entry.size;
+
+  _written++;
+  if (used + entry.size > _highWater) {
+    _highWater = used + entry.size;
+  }
+}
+
+size_t DeferredLog::drain(size_t maxEntries) {
+  size_t printed = 0;
+  while (printed < maxEntries) {
+    if (_dropped != _droppedReported) {
+      unsigned long dropped = _dropped;
+      _droppedReported = dropped;
+      if (_binary) {
+        uint8_t payload[4];
+        putU32(payload, dropped);
+        sendFrame(FRAME_DROPPED, payload, sizeof(payload));
+      } else {
+        WITH_LOCK(Serial) {
+          Serial.printlnf("%010lu [app] WARN: %lu log entries dropped", (unsigned long)millis(), dropped);
+        }
+      }
+    }
+
+    uint32_t tail = _tail;
+    if (_head == tail) {
+      break;
+    }
+    std::atomic_signal_fence(std::memory_order_acquire);
+
+    // Copy the entry out so the writer can reuse its space while it prints
+    uint32_t words[MAX_ENTRY_WORDS];
+    size_t size = _ring[tail & (CAPACITY - 1)] >> 16;
+    if (size < HEADER_WORDS || size > MAX_ENTRY_WORDS) {
+      size = HEADER_WORDS;
+    }
+    for (size_t i = 0; i < size; i++) {
+      words[i] = _ring[(tail + i) & (CAPACITY - 1)];
+    }
+    std::atomic_signal_fence(std::memory_order_release);
+    _tail = tail + size;
+
+    print(words, size);
+    printed++;
+  }
+  return printed;
+}
+
+void DeferredLog::setBinary(bool binary) {
+  // Formats go out again, for a decoder that starts now
+  _binary = binary;
+  _announced = 0;
+}
+
+bool DeferredLog::isBinary() {
+  return _binary;
+}
+
+unsigned long DeferredLog::getWritten() {
+  return _written;
+}
+
+unsigned long DeferredLog::getDropped() {
+  return _dropped;
+}
+
+uint32_t DeferredLog::getHighWaterWords() {
+  return _highWater;
+}
+
+void DeferredLog::print(const uint32_t* words, size_t size) {
+  int id = words[0] & 0xFFFF;
+  if (id >= _formatCount) {
+    return;
+  }
+
+  if (!_binary) {
+    char line[LINE_LENGTH];
+    format(line, sizeof(line), _formats[id], words[1], words + HEADER_WORDS, size - HEADER_WORDS);
+    WITH_LOCK(Serial) {
+      Serial.printlnf("%010lu [app] %s: %s", (unsigned long)words[2], levelName(_levels[id]), line);
+    }
+    return;
+  }
+
+  uint8_t payload[8 + MAX_ENTRY_WORDS * 4];
+  if (!(_announced & (1ULL << id))) {
+    size_t length = strnlen(_formats[id], sizeof(payload) - 3);
+    putU16(payload, (uint16_t)id);
+    payload[2] = _levels[id];
+    memcpy(payload + 3, _formats[id], length);
+    sendFrame(FRAME_FORMAT, payload, 3 + length);
+    _announced |= 1ULL << id;
+  }
+
+  putU16(payload, (uint16_t)id);
+  putU32(payload + 2, words[2]);
+  putU32(payload + 6, words[1]);
+  for (size_t i = HEADER_WORDS; i < size; i++) {
+    putU32(payload + 10 + (i - HEADER_WORDS) * 4, words[i]);
+  }
+  sendFrame(FRAME_ENTRY, payload, 10 + (size - HEADER_WORDS) * 4);
+}
+
+void DeferredLog::format(char* out, size_t outSize, const char* format, uint32_t tags, const uint32_t* args,
+                         size_t size) {
+  size_t used = 0;
+  size_t arg = 0;
+  size_t next = 0;
+
+  while (*format && used + 1 < outSize) {
+    if (*format != '%') {
+      out[used++] = *format++;
+      continue;
+    }
+    if (format[1] == '%') {
+      out[used++] = '%';
+      format += 2;
+      continue;
+    }
+
+    // Flags, width and precision are kept; length modifiers are replaced by
+    // the one for the stored type
+    char spec[16];
+    size_t specLength = 0;
+    spec[specLength++] = *format++;
+    int precision = -1;
+    while (*format && strchr("-+ #0123456789.", *format) && specLength < sizeof(spec) - 4) {
+      if (*format == '.') {
+        precision = atoi(format + 1);
+      }
+      spec[specLength++] = *format++;
+    }
+    while (*format && strchr("hljzt", *format)) {
+      format++;
+    }
+    char conversion = *format ? *format++ : 's';
+
+    uint32_t tag = arg < MAX_ARGS ? (tags >> (4 * arg)) & 0xF : (uint32_t)TAG_NONE;
+    arg++;
+    if (tag == TAG_NONE || next >= size) {
+      used += snprintf(out + used, outSize - used, "<missing>");
+    } else {
+      const uint32_t* value = args + next;
+      next += argWords(tag, value, size - next);
+      bool floating = strchr("fFeEgGaA", conversion) != nullptr;
+      int64_t integer = 0;
+      if (tag == TAG_INT) {
+        integer = (int32_t)value[0];
+      } else if (tag == TAG_UINT) {
+        integer = value[0];
+      } else if (tag == TAG_INT64 || tag == TAG_UINT64) {
+        integer = (int64_t)((uint64_t)value[0] | (uint64_t)value[1] << 32);
+      }
+
+      if (tag == TAG_GALLONS) {
+        char gallons[24];
+        Volume::format(gallons, sizeof(gallons), (uint64_t)value[0] | (uint64_t)value[1] << 32,
+                       precision < 0 ? 2 : precision);
+        used += snprintf(out + used, outSize - used, "%s", gallons);
+      } else if (tag == TAG_STRING) {
+        char text[MAX_STRING_LENGTH + 1];
+        size_t length = value[0] < MAX_STRING_LENGTH ? value[0] : MAX_STRING_LENGTH;
+        memcpy(text, &value[1], length);
+        text[length] = '\0';
+        spec[specLength++] = 's';
+        spec[specLength] = '\0';
+        used += snprintf(out + used, outSize - used, spec, text);
+      } else if (tag == TAG_FLOAT || floating) {
+        float number = (float)integer;
+        if (tag == TAG_FLOAT) {
+          memcpy(&number, value, sizeof(number));
+        }
+        spec[specLength++] = floating ? conversion : 'f';
+        spec[specLength] = '\0';
+        used += snprintf(out + used, outSize - used, spec, (double)number);
+      } else {
+        // Integers print as signed or unsigned by their stored type
+        bool isSigned = tag == TAG_INT || tag == TAG_INT64;
+        if (!strchr("dicuxXo", conversion)) {
+          conversion = isSigned ? 'd' : 'u';
+        }
+        if (conversion == 'c') {
+          spec[specLength++] = 'c';
+          spec[specLength] = '\0';
+          used += snprintf(out + used, outSize - used, spec, (int)integer);
+        } else {
+          spec[specLength++] = 'l';
+          spec[specLength++] = 'l';
+          spec[specLength++] = (isSigned && conversion == 'u') ? 'd' : conversion;
+          spec[specLength] = '\0';
+          if (isSigned) {
+            used += snprintf(out + used, outSize - used, spec, (long long)integer);
+          } else {
+            used += snprintf(out + used, outSize - used, spec, (unsigned long long)integer);
+          }
+        }
+      }
+    }
+    if (used >= outSize) {
+      used = outSize - 1;
+    }
+  }
+  out[used] = '\0';
+}
+
+void DeferredLog::sendFrame(uint8_t type, const uint8_t* payload, size_t length) {
+  uint8_t header[4] = {FRAME_MARKER, type, 0, 0};
+  putU16(header + 2, (uint16_t)length);
+  uint8_t crc[2];
+  putU16(crc, (uint16_t)Checksum::crc32(payload, length));
+
+  WITH_LOCK(Serial) {
+    Serial.write(header, sizeof(header));
+    Serial.write(payload, length);
+    Serial.write(crc, sizeof(crc));
+  }
+}
+
+void DeferredLog::drainThread(void* param) {
+  (void)param;
+  while (true) {
+    if (drain(DRAIN_BATCH) == 0) {
+      delay(DRAIN_IDLE_MS);
+    }
+  }
+}
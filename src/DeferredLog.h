@@ -0,0 +1,191 @@
+#pragma once
+
+#include "Particle.h"
+
+#include <type_traits>
+
+// Deferred logging. DLOG_INFO("Flow ended, %.2V gallons", ...) costs the
+// caller a copy of the format id, a timestamp and the raw arguments into a RAM
+// ring; formatting and the USB serial write happen later, in a low-priority
+// thread (or wherever drain() is called from).
+//
+// Formats are ordinary printf strings. Arguments are stored with a type tag
+// and formatted by their stored type, so a mismatched length modifier can't
+// misread the ring. %V prints DeferredLog::gallons(milliGallons) the way
+// Volume::format does, with the precision as the number of decimals. Strings
+// are copied (up to MAX_STRING_LENGTH, and what is left of MAX_ENTRY_WORDS),
+// so they needn't outlive the call.
+//
+// The ring has a single writer (the application thread) and a single reader
+// (the drain). Entries that don't fit are dropped and counted.
+//
+// Output is text lines like the Device OS serial log handler, or binary
+// frames for tools/decode_log.py: a format is sent once before its first
+// entry, then each entry is a few bytes of raw arguments.
+//
+// Levels below DLOG_LEVEL are compiled out, arguments and format included.
+#define DLOG_LEVEL_TRACE 1
+#define DLOG_LEVEL_INFO  30
+#define DLOG_LEVEL_WARN  40
+#define DLOG_LEVEL_ERROR 50
+
+#ifndef DLOG_LEVEL
+#define DLOG_LEVEL DLOG_LEVEL_INFO
+#endif
+
+class DeferredLog {
+public:
+  struct Gallons {
+    uint64_t milliGallons;
+  };
+
+  // Argument types, four bits each in an entry's tag word
+  enum Tag {
+    TAG_NONE,
+    TAG_INT,
+    TAG_UINT,
+    TAG_INT64,
+    TAG_UINT64,
+    TAG_FLOAT,
+    TAG_STRING,
+    TAG_GALLONS
+  };
+
+  // Binary frames: FRAME_MARKER, type, u16 length, payload, u16 CRC (low
+  // half of the CRC-32 of the payload); multi-byte fields are little endian.
+  // Text output is ASCII, so the marker never appears in it.
+  enum FrameType {
+    FRAME_FORMAT = 'F',   // u16 id, u8 level, format text
+    FRAME_ENTRY = 'E',    // u16 id, u32 millis, u32 tags, argument words
+    FRAME_DROPPED = 'D'   // u32 entries dropped since boot
+  };
+
+  // Start the drain thread (on platforms with threads)
+  static void begin();
+
+  // Register a call site's format; returns its id, or -1 if the table is full
+  static int define(int level, const char* format);
+
+  template <typename... Args>
+  static void write(int format, const Args&... args) {
+    static_assert(sizeof...(Args) <= MAX_ARGS, "too many log arguments");
+    if (format < 0) {
+      _dropped++;
+      return;
+    }
+    Entry entry;
+    entry.size = HEADER_WORDS;
+    entry.tags = 0;
+    entry.argc = 0;
+    int unpack[] = {0, (entry.add(args), 0)...};
+    (void)unpack;
+    commit(format, entry);
+  }
+
+  static Gallons gallons(uint64_t milliGallons) { return Gallons{milliGallons}; }
+
+  // Format and print up to maxEntries; returns how many were printed
+  static size_t drain(size_t maxEntries);
+
+  // Text lines (the default) or binary frames for the host decoder
+  static void setBinary(bool binary);
+  static bool isBinary();
+
+  // Statistics
+  static unsigned long getWritten();
+  static unsigned long getDropped();
+  static uint32_t getHighWaterWords();  // Most of the ring ever in use
+
+  static const uint32_t CAPACITY = 1024;         // Words; must be a power of two
+  static const int MAX_FORMATS = 64;
+  static const size_t MAX_ARGS = 8;
+  static const size_t MAX_STRING_LENGTH = 60;    // Longer strings are cut short
+  static const size_t HEADER_WORDS = 3;          // Id and size, tags, millis
+  static const size_t MAX_ENTRY_WORDS = 40;
+  static const uint8_t FRAME_MARKER = 0xA5;
+
+private:
+  struct Entry {
+    uint32_t words[MAX_ENTRY_WORDS];
+    size_t size;
+    uint32_t tags;
+    size_t argc;
+
+    void tag(Tag type) { tags |= (uint32_t)type << (4 * argc++); }
+
+    template <typename T>
+    typename std::enable_if<std::is_integral<T>::value>::type add(T value) {
+      if (sizeof(T) > 4) {
+        tag(std::is_signed<T>::value ? TAG_INT64 : TAG_UINT64);
+        add64((uint64_t)value);
+      } else {
+        tag(std::is_signed<T>::value ? TAG_INT : TAG_UINT);
+        words[size++] = (uint32_t)value;
+      }
+    }
+
+    template <typename T>
+    typename std::enable_if<std::is_floating_point<T>::value>::type add(T value) {
+      float narrowed = (float)value;
+      tag(TAG_FLOAT);
+      memcpy(&words[size++], &narrowed, sizeof(narrowed));
+    }
+
+    void add(const char* value);
+    void add(char* value) { add((const char*)value); }
+    void add(const Gallons& value) {
+      tag(TAG_GALLONS);
+      add64(value.milliGallons);
+    }
+    void add64(uint64_t value) {
+      words[size++] = (uint32_t)value;
+      words[size++] = (uint32_t)(value >> 32);
+    }
+  };
+
+  static uint32_t _ring[CAPACITY];
+  static volatile uint32_t _head;       // Written by the producer only
+  static volatile uint32_t _tail;       // Written by the drain only
+  static const char* _formats[MAX_FORMATS];
+  static uint8_t _levels[MAX_FORMATS];
+  static int _formatCount;
+  static uint64_t _announced;           // Formats already sent as binary frames
+  static bool _binary;
+  static volatile unsigned long _written;
+  static volatile unsigned long _dropped;
+  static unsigned long _droppedReported;
+  static uint32_t _highWater;
+
+  static void commit(int format, const Entry& entry);
+  static void print(const uint32_t* words, size_t size);
+  static void format(char* out, size_t outSize, const char* format, uint32_t tags, const uint32_t* args,
+                     size_t size);
+  static void sendFrame(uint8_t type, const uint8_t* payload, size_t length);
+  static void drainThread(void* param);
+};
+
+#define DLOG_WRITE(level, format, ...) \
+  do { \
+    static const int dlogFormat = DeferredLog::define(level, format); \
+    DeferredLog::write(dlogFormat, ##__VA_ARGS__); \
+  } while (0)
+
+#if DLOG_LEVEL <= DLOG_LEVEL_TRACE
+#define DLOG_TRACE(format, ...) DLOG_WRITE(DLOG_LEVEL_TRACE, format, ##__VA_ARGS__)
+#else
+#define DLOG_TRACE(format, ...) do {} while (0)
+#endif
+
+#if DLOG_LEVEL <= DLOG_LEVEL_INFO
+#define DLOG_INFO(format, ...) DLOG_WRITE(DLOG_LEVEL_INFO, format, ##__VA_ARGS__)
+#else
+#define DLOG_INFO(format, ...) do {} while (0)
+#endif
+
+#if DLOG_LEVEL <= DLOG_LEVEL_WARN
+#define DLOG_WARN(format, ...) DLOG_WRITE(DLOG_LEVEL_WARN, format, ##__VA_ARGS__)
+#else
+#define DLOG_WARN(format, ...) do {} while (0)
+#endif
+
+#define DLOG_ERROR(format, ...) DLOG_WRITE(DLOG_LEVEL_ERROR, format, ##__VA_ARGS__)
@@ -1,132 +1,354 @@
-#include "DisplayComm.h"
-#include "FlowSensor.h"
-
-// Constructor
-DisplayComm::DisplayComm(FlowSensor* flowSensor) :
-  _flowSensor(flowSensor),
-  _lastDisplayUpdateTime(0)
-{
-}
-
-// Initialize UART and other settings
-void DisplayComm::begin() {
-  // Initialize UART for communication with display
-  initializeUART();
-  
-  Log.info("Display communication module initialized");
-  
-  // Test serial connection with slow character-by-character communication
-  Log.info("Sending test pattern character by character");
-  const char* testStr = "TEST-PATTERN-123";
-  for (size_t i = 0; i < strlen(testStr); i++) {
-    Serial1.write(testStr[i]);
-    delay(100); // Delay 100ms between characters
-  }
-  Serial1.write('\n');
-  delay(500);
-  
-  // Send an initial test pattern to verify communication - keep this simple
-  Serial1.println("{\"init\":true}");
-  Log.info("Sent initialization JSON to CYD");
-  
-  // Short delay to let display process
-  delay(500);
-  
-  // Send initial data
-  sendDisplayData();
-  
-  Log.info("Initial display data sent");
-}
-
-// Initialize UART
-void DisplayComm::initializeUART() {
-  // Initialize UART1 for communication with display - explicitly set to 115200 baud
-  Serial1.begin(115200);
-  
-  // Allow time for UART to initialize
-  delay(100);
-  
-  Log.info("UART1 initialized at 115200 baud for display communication");
-}
-
-// Update method to be called in main loop
-void DisplayComm::update(unsigned long currentTime) {
-  // Check if it's time to update the display
-  if (currentTime - _lastDisplayUpdateTime >= DISPLAY_UPDATE_INTERVAL) {
-    sendDisplayData();
-  }
-}
-
-// Send data to display
-void DisplayComm::sendDisplayData() {
-  // Format the data as JSON
-  String jsonData = formatDisplayData();
-  
-  // Option 1: Normal send (single write)
-  // Serial1.println(jsonData);
-  
-  // Option 2: Slow character-by-character send
-  for (size_t i = 0; i < jsonData.length(); i++) {
-    Serial1.write(jsonData.charAt(i));
-    delay(5); // Small delay between characters
-  }
-  Serial1.write('\n');
-  
-  // Debug output
-  Log.info("Sent JSON to display: %s", jsonData.c_str());
-  
-  // Update last send time
-  _lastDisplayUpdateTime = millis();
-}
-
-// Format JSON data to send to display
-String DisplayComm::formatDisplayData() {
-  // Calculate GPM from pulse counts over time
-  float gpm = 0.0;
-  
-  // Check if flow is active
-  if (_flowSensor->isFlowActive()) {
-    // Get customer pulse count for gallons per minute calculation
-    unsigned long customerPulseCount = _flowSensor->getCustomerPulseCount();
-    
-    // Calculate GPM based on recent flow
-    // This is a simple way to calculate it; may need refinement based on how your flow sensor works
-    static unsigned long lastPulseCount = 0;
-    static unsigned long lastGpmCalcTime = 0;
-    unsigned long currentTime = millis();
-    
-    // Calculate GPM every 5 seconds for a smooth reading
-    if (currentTime - lastGpmCalcTime >= 5000) {
-      unsigned long pulseDiff = customerPulseCount - lastPulseCount;
-      float gallonsDiff = pulseDiff / 1700.0; // Using same calibration value as in main code
-      float minutesFraction = (currentTime - lastGpmCalcTime) / 60000.0; // Convert ms to minutes
-      
-      if (minutesFraction > 0) {
-        gpm = gallonsDiff / minutesFraction;
-      }
-      
-      lastPulseCount = customerPulseCount;
-      lastGpmCalcTime = currentTime;
-    }
-  }
-  
-  // Get total gallons
-  float totalGallons = _flowSensor->getLifetimeGallons();
-  
-  // Get cellular signal strength (0-100%)
-  CellularSignal sig = Cellular.RSSI();
-  int signalStrength = sig.getStrength();
-  
-  // Get current time
-  char timeStr[9]; // HH:MM:SS + null terminator
-  snprintf(timeStr, sizeof(timeStr), "%02d:%02d:%02d", 
-           Time.hour(), Time.minute(), Time.second());
-  
-  // Format JSON string - match the exact format used by the C3 simulator
-  char jsonBuffer[128];
-  snprintf(jsonBuffer, sizeof(jsonBuffer), 
-           "{\"gpm\": %.1f, \"gallons\": %.1f, \"signal\": %d, \"time\": \"%s\"}",
-           gpm, totalGallons, signalStrength, timeStr);
-  
-  return String(jsonBuffer);
-} 
\ No newline at end of file
+#include "DisplayComm.h"
+#include "FlowSensor.h"
+#include "LatencyProfile.h"
+#include "DeferredLog.h"
+#include "JsonWriter.h"
+
+namespace {
+
+// Display frame keys
+constexpr JsonKey KEY_GPM = JSON_KEY("gpm");
+constexpr JsonKey KEY_GALLONS = JSON_KEY("gallons");
+constexpr JsonKey KEY_SIGNAL = JSON_KEY("signal");
+constexpr JsonKey KEY_TIME = JSON_KEY("time");
+
+// Longest JSON frame, with room to spare
+const size_t DISPLAY_JSON_SIZE = 128;
+
+} // namespace
+
+// Constructor
+DisplayComm::DisplayComm(FlowSensor* flowSensor, FrameFormat format) :
+  _flowSensor(flowSensor),
+  _format(format),
+  _lastDisplayUpdateTime(0),
+  _lastChangeCheckTime(0),
+  _sentGpm(0.0),
+  _sentMilliGallons(0),
+  _sentSignal(0),
+  _sentMinute(-1),
+  _framesSent(0),
+  _framesSuppressed(0),
+  _gpmDeadband(GPM_DEADBAND),
+  _milliGallonsDeadband(MILLIGALLONS_DEADBAND),
+  _signalDeadband(SIGNAL_DEADBAND),
+  _activeInterval(ACTIVE_UPDATE_INTERVAL),
+  _idleInterval(IDLE_UPDATE_INTERVAL),
+  _keepaliveInterval(KEEPALIVE_INTERVAL),
+  _signal(0),
+  _signalValid(false),
+  _lastSignalTime(0),
+  _txHead(0),
+  _txCount(0),
+  _txFramesDropped(0),
+  _txBytesPerMs(DEFAULT_TX_BYTES_PER_MS),
+  _txCredit(0.0),
+  _lastTxTime(0),
+  _lastUpdateStallMicros(0),
+  _maxUpdateStallMicros(0),
+  _totalUpdateStallMicros(0),
+  _updateCount(0)
+{
+}
+
+// Initialize UART and other settings
+void DisplayComm::begin() {
+  // Initialize UART for communication with display
+  initializeUART();
+  
+  Log.info("Display communication module initialized");
+  
+  // Queue the initialization frame and the first data frame; update() sends
+  // them behind each other at the configured pace
+  _lastTxTime = millis();
+  if (_format == FORMAT_JSON) {
+    queueLine("{\"init\":true}");
+    Log.info("Queued initialization JSON for CYD");
+  } else {
+    Log.info("Display link using binary frames v%d", DISPLAY_FRAME_VERSION);
+  }
+  
+  sendDisplayData();
+  
+  Log.info("Initial display data queued");
+}
+
+// Initialize UART
+void DisplayComm::initializeUART() {
+  // Initialize UART1 for communication with display - explicitly set to 115200 baud
+  Serial1.begin(115200);
+  
+  Log.info("UART1 initialized at 115200 baud for display communication");
+}
+
+// Update method to be called in main loop
+void DisplayComm::update(unsigned long currentTime) {
+  uint32_t startMicros = micros();
+  
+  // Check for changes quickly while water is flowing, slowly when idle
+  unsigned long checkInterval = _flowSensor->isFlowActive() ? _activeInterval : _idleInterval;
+  if (currentTime - _lastChangeCheckTime >= checkInterval) {
+    _lastChangeCheckTime = currentTime;
+    
+    if (hasDisplayChanged() || currentTime - _lastDisplayUpdateTime >= _keepaliveInterval) {
+      sendDisplayData();
+    } else {
+      _framesSuppressed++;
+    }
+  }
+  
+  drainTxQueue(currentTime);
+  
+  // Track how long the display link held up the loop
+  _lastUpdateStallMicros = micros() - startMicros;
+  if (_lastUpdateStallMicros > _maxUpdateStallMicros) {
+    _maxUpdateStallMicros = _lastUpdateStallMicros;
+  }
+  _totalUpdateStallMicros += _lastUpdateStallMicros;
+  _updateCount++;
+}
+
+unsigned long DisplayComm::getMillisUntilUpdate(unsigned long currentTime) const {
+  if (_txCount > 0) {
+    // Without pacing, or with the credit already there, the FIFO is the limit
+    if (_txBytesPerMs <= 0.0) {
+      return TX_FIFO_WAIT;
+    }
+    float wanted = (_txCount < MAX_TX_CREDIT) ? (float)_txCount : MAX_TX_CREDIT;
+    float credit = _txCredit + (currentTime - _lastTxTime) * _txBytesPerMs;
+    if (credit >= wanted) {
+      return TX_FIFO_WAIT;
+    }
+    return (unsigned long)((wanted - credit) / _txBytesPerMs) + 1;
+  }
+  
+  unsigned long checkInterval = _flowSensor->isFlowActive() ? _activeInterval : _idleInterval;
+  unsigned long elapsed = currentTime - _lastChangeCheckTime;
+  return elapsed < checkInterval ? checkInterval - elapsed : 0;
+}
+
+void DisplayComm::setFrameFormat(FrameFormat format) {
+  _format = format;
+}
+
+DisplayComm::FrameFormat DisplayComm::getFrameFormat() const {
+  return _format;
+}
+
+void DisplayComm::setDeadbands(float gpm, uint32_t milliGallons, int signalPercent) {
+  _gpmDeadband = gpm;
+  _milliGallonsDeadband = milliGallons;
+  _signalDeadband = signalPercent;
+}
+
+void DisplayComm::setUpdateIntervals(unsigned long activeMs, unsigned long idleMs, unsigned long keepaliveMs) {
+  _activeInterval = activeMs;
+  _idleInterval = idleMs;
+  _keepaliveInterval = keepaliveMs;
+}
+
+unsigned long DisplayComm::getFramesSent() const {
+  return _framesSent;
+}
+
+unsigned long DisplayComm::getFramesSuppressed() const {
+  return _framesSuppressed;
+}
+
+bool DisplayComm::hasDisplayChanged() {
+  float gpm = _flowSensor->getCurrentGpm();
+  uint64_t milliGallons = _flowSensor->getLifetimeMilliGallons();
+  int signal = readSignalStrength();
+  int minute = Time.isValid() ? Time.minute() : -1;
+  
+  return fabsf(gpm - _sentGpm) >= _gpmDeadband ||
+         milliGallons - _sentMilliGallons >= _milliGallonsDeadband ||
+         abs(signal - _sentSignal) >= _signalDeadband ||
+         minute != _sentMinute;
+}
+
+int DisplayComm::readSignalStrength() {
+  // Querying the modem is slow, so the reading is refreshed once a minute
+  unsigned long now = millis();
+  if (!_signalValid || now - _lastSignalTime >= SIGNAL_REFRESH_INTERVAL) {
+    LATENCY_SCOPE("rssi");
+    CellularSignal sig = Cellular.RSSI();
+    _signal = (int)sig.getStrength();
+    _lastSignalTime = now;
+    _signalValid = true;
+  }
+  return _signal;
+}
+
+void DisplayComm::setTxPacing(float bytesPerMs) {
+  _txBytesPerMs = bytesPerMs;
+}
+
+// Send data to display
+void DisplayComm::sendDisplayData() {
+  // Remember what the display will be showing
+  _sentGpm = _flowSensor->getCurrentGpm();
+  _sentMilliGallons = _flowSensor->getLifetimeMilliGallons();
+  _sentSignal = readSignalStrength();
+  _sentMinute = Time.isValid() ? Time.minute() : -1;
+  _framesSent++;
+  
+  if (_format == FORMAT_BINARY) {
+    DisplayStatus status;
+    buildDisplayStatus(status);
+    
+    uint8_t frame[DisplayFrame::MAX_FRAME_SIZE];
+    size_t length = DisplayFrame::encode(status, frame, sizeof(frame));
+    if (!queueFrame(frame, length, false)) {
+      DLOG_WARN("Display TX queue full, frame dropped");
+    }
+    
+    _lastDisplayUpdateTime = millis();
+    return;
+  }
+  
+  // Format the data as JSON
+  char jsonData[DISPLAY_JSON_SIZE];
+  if (!formatDisplayData(jsonData, sizeof(jsonData))) {
+    DLOG_ERROR("Display frame too long");
+    return;
+  }
+  
+  // Queue for paced transmission; a full queue drops the frame rather than
+  // sending part of it
+  if (queueLine(jsonData)) {
+    DLOG_TRACE("Queued JSON for display: %s", jsonData);
+  } else {
+    DLOG_WARN("Display TX queue full, frame dropped");
+  }
+  
+  // Update last send time
+  _lastDisplayUpdateTime = millis();
+}
+
+bool DisplayComm::queueFrame(const uint8_t* data, size_t length, bool newline) {
+  size_t total = length + (newline ? 1 : 0);
+  if (_txCount + total > TX_QUEUE_SIZE) {
+    _txFramesDropped++;
+    return false;
+  }
+  
+  for (size_t i = 0; i < total; i++) {
+    uint8_t c = (i < length) ? data[i] : (uint8_t)'\n';
+    _txQueue[(_txHead + _txCount) % TX_QUEUE_SIZE] = c;
+    _txCount++;
+  }
+  return true;
+}
+
+bool DisplayComm::queueLine(const char* line) {
+  return queueFrame(reinterpret_cast<const uint8_t*>(line), strlen(line), true);
+}
+
+void DisplayComm::drainTxQueue(unsigned long currentTime) {
+  // Refill pacing credit for the time since the last pass
+  if (_txBytesPerMs > 0.0) {
+    _txCredit += (currentTime - _lastTxTime) * _txBytesPerMs;
+    if (_txCredit > MAX_TX_CREDIT) {
+      _txCredit = MAX_TX_CREDIT;
+    }
+  }
+  _lastTxTime = currentTime;
+  
+  if (_txCount == 0) {
+    return;
+  }
+  
+  // Never write more than the UART FIFO can take without blocking
+  int room = Serial1.availableForWrite();
+  size_t budget = (room > 0) ? (size_t)room : 0;
+  if (_txBytesPerMs > 0.0 && budget > (size_t)_txCredit) {
+    budget = (size_t)_txCredit;
+  }
+  if (budget > _txCount) {
+    budget = _txCount;
+  }
+  
+  // Write in at most two contiguous runs of the ring
+  size_t sent = 0;
+  while (sent < budget) {
+    size_t run = TX_QUEUE_SIZE - _txHead;
+    if (run > budget - sent) {
+      run = budget - sent;
+    }
+    Serial1.write(&_txQueue[_txHead], run);
+    _txHead = (_txHead + run) % TX_QUEUE_SIZE;
+    sent += run;
+  }
+  _txCount -= sent;
+  
+  if (_txBytesPerMs > 0.0) {
+    _txCredit -= sent;
+  }
+}
+
+// Statistics
+size_t DisplayComm::getTxQueued() const {
+  return _txCount;
+}
+
+unsigned long DisplayComm::getTxFramesDropped() const {
+  return _txFramesDropped;
+}
+
+unsigned long DisplayComm::getLastUpdateStallMicros() const {
+  return _lastUpdateStallMicros;
+}
+
+unsigned long DisplayComm::getMaxUpdateStallMicros() const {
+  return _maxUpdateStallMicros;
+}
+
+unsigned long DisplayComm::getAverageUpdateStallMicros() const {
+  return _updateCount > 0 ? (unsigned long)(_totalUpdateStallMicros / _updateCount) : 0;
+}
+
+// Format JSON data to send to display
+bool DisplayComm::formatDisplayData(char* buffer, size_t size) {
+  // Current flow rate from the flow sensor's rate estimator, so frames sent
+  // at any cadence show the same reading
+  uint32_t gpmTenths = _sentGpm > 0.0f ? (uint32_t)lroundf(_sentGpm * 10.0f) : 0;
+  
+  // Get current time
+  int hour = Time.hour();
+  int minute = Time.minute();
+  int second = Time.second();
+  char timeStr[9] = {
+    (char)('0' + hour / 10), (char)('0' + hour % 10), ':', 
+    (char)('0' + minute / 10), (char)('0' + minute % 10), ':', 
+    (char)('0' + second / 10), (char)('0' + second % 10), '\0'
+  };
+  
+  // Match the exact format used by the C3 simulator, spaces included
+  JsonWriter json(buffer, size, true);
+  json.beginObject()
+      .key(KEY_GPM).fixed(gpmTenths, 1)
+      .key(KEY_GALLONS).milli(_flowSensor->getLifetimeMilliGallons(), 1)
+      .key(KEY_SIGNAL).signedNumber(_sentSignal)
+      .key(KEY_TIME).string(timeStr)
+      .endObject();
+  return !json.overflowed();
+}
+
+void DisplayComm::buildDisplayStatus(DisplayStatus& status) {
+  bool timeValid = Time.isValid();
+  
+  status.flags = (_flowSensor->isFlowActive() ? DISPLAY_FLAG_FLOW_ACTIVE : 0) |
+                 (timeValid ? DISPLAY_FLAG_TIME_VALID : 0);
+  status.gpmCenti = (uint16_t)lroundf(_flowSensor->getCurrentGpm() * 100.0f);
+  status.peakGpmCenti = (uint16_t)lroundf(_flowSensor->getPeakGpm() * 100.0f);
+  status.lifetimeMilliGallons = _flowSensor->getLifetimeMilliGallons();
+  status.dailyMilliGallons = (uint32_t)_flowSensor->getDailyMilliGallons();
+  status.flowEventsToday = (uint16_t)_flowSensor->getFlowEventsToday();
+  
+  status.signalPercent = (uint8_t)constrain(_sentSignal, 0, 100);
+  
+  status.hour = timeValid ? (uint8_t)Time.hour() : 0;
+  status.minute = timeValid ? (uint8_t)Time.minute() : 0;
+  status.second = timeValid ? (uint8_t)Time.second() : 0;
+}
\ No newline at end of file
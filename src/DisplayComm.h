@@ -1,34 +1,136 @@
-#pragma once
-
-#include "Particle.h"
-#include "FlowSensor.h"
-
-class DisplayComm {
-public:
-  DisplayComm(FlowSensor* flowSensor);
-  
-  // Initialize UART and other settings
-  void begin();
-  
-  // Update method to be called in main loop
-  void update(unsigned long currentTime);
-  
-  // Manually send data to display
-  void sendDisplayData();
-  
-private:
-  // Component references
-  FlowSensor* _flowSensor;
-  
-  // Last update tracking
-  unsigned long _lastDisplayUpdateTime;
-  
-  // UART initialization
-  void initializeUART();
-  
-  // Format JSON data to send to display
-  String formatDisplayData();
-  
-  // Update interval in milliseconds (5 seconds for testing)
-  const unsigned long DISPLAY_UPDATE_INTERVAL = 5000;
-}; 
\ No newline at end of file
+#pragma once
+
+#include "Particle.h"
+#include "FlowSensor.h"
+#include "DisplayFrame.h"
+
+class DisplayComm {
+public:
+  // Wire format: JSON text lines, or COBS-framed binary frames (DisplayFrame.h)
+  enum FrameFormat {
+    FORMAT_JSON,
+    FORMAT_BINARY
+  };
+  
+  DisplayComm(FlowSensor* flowSensor, FrameFormat format = FORMAT_JSON);
+  
+  // Initialize UART and other settings
+  void begin();
+  
+  // Check for changes and move queued bytes to the UART
+  void update(unsigned long currentTime);
+  
+  // Milliseconds until update() has work: the pacing credit or UART room for
+  // queued bytes, otherwise the next change check
+  unsigned long getMillisUntilUpdate(unsigned long currentTime) const;
+  
+  // Manually send data to display (queued, sent by update())
+  void sendDisplayData();
+  
+  // Select the wire format (takes effect from the next frame)
+  void setFrameFormat(FrameFormat format);
+  FrameFormat getFrameFormat() const;
+  
+  // Change detection: a frame is sent when any value moves past its deadband
+  // (or the minute of the clock changes), checked every activeMs while water
+  // is flowing and every idleMs otherwise. keepaliveMs bounds the silence.
+  void setDeadbands(float gpm, uint32_t milliGallons, int signalPercent);
+  void setUpdateIntervals(unsigned long activeMs, unsigned long idleMs, unsigned long keepaliveMs);
+  unsigned long getFramesSent() const;
+  unsigned long getFramesSuppressed() const;
+  
+  // Transmit pacing in bytes per millisecond; 0 sends as fast as the UART allows
+  void setTxPacing(float bytesPerMs);
+  
+  // Transmit queue and loop-stall statistics
+  size_t getTxQueued() const;
+  unsigned long getTxFramesDropped() const;
+  unsigned long getLastUpdateStallMicros() const;
+  unsigned long getMaxUpdateStallMicros() const;
+  unsigned long getAverageUpdateStallMicros() const;
+  
+private:
+  // Component references
+  FlowSensor* _flowSensor;
+  FrameFormat _format;
+  
+  // Last update tracking
+  unsigned long _lastDisplayUpdateTime;
+  unsigned long _lastChangeCheckTime;
+  
+  // Values the display is currently showing
+  float _sentGpm;
+  uint64_t _sentMilliGallons;
+  int _sentSignal;
+  int _sentMinute;
+  unsigned long _framesSent;
+  unsigned long _framesSuppressed;
+  
+  // Deadbands and cadence
+  float _gpmDeadband;
+  uint32_t _milliGallonsDeadband;
+  int _signalDeadband;
+  unsigned long _activeInterval;
+  unsigned long _idleInterval;
+  unsigned long _keepaliveInterval;
+  
+  // Cached cellular signal strength
+  int _signal;
+  bool _signalValid;
+  unsigned long _lastSignalTime;
+  
+  // TX queue - frames are queued whole and drained a few bytes per loop pass,
+  // never blocking on the UART
+  static const size_t TX_QUEUE_SIZE = 256;
+  uint8_t _txQueue[TX_QUEUE_SIZE];
+  size_t _txHead;
+  size_t _txCount;
+  unsigned long _txFramesDropped;
+  
+  // Pacing as a token bucket refilled at _txBytesPerMs
+  float _txBytesPerMs;
+  float _txCredit;
+  unsigned long _lastTxTime;
+  
+  // Time update() spends before returning to the loop
+  unsigned long _lastUpdateStallMicros;
+  unsigned long _maxUpdateStallMicros;
+  uint64_t _totalUpdateStallMicros;
+  unsigned long _updateCount;
+  
+  // UART initialization
+  void initializeUART();
+  
+  // Queue a complete frame for transmission, optionally ending in a newline
+  bool queueFrame(const uint8_t* data, size_t length, bool newline);
+  bool queueLine(const char* line);
+  
+  // Move queued bytes into the UART FIFO
+  void drainTxQueue(unsigned long currentTime);
+  
+  // True if the display is out of date by more than the deadbands
+  bool hasDisplayChanged();
+  
+  // Signal strength in percent, refreshed at most every SIGNAL_REFRESH_INTERVAL
+  int readSignalStrength();
+  
+  // Format JSON data to send to display; false if it doesn't fit
+  bool formatDisplayData(char* buffer, size_t size);
+  
+  // Fill the fixed-width status used by binary frames
+  void buildDisplayStatus(DisplayStatus& status);
+  
+  // Default cadence and deadbands
+  static const unsigned long ACTIVE_UPDATE_INTERVAL = 1000;   // 1 second while flowing
+  static const unsigned long IDLE_UPDATE_INTERVAL = 5000;     // 5 seconds
+  static const unsigned long KEEPALIVE_INTERVAL = 60000;      // 1 minute without changes
+  static constexpr float GPM_DEADBAND = 0.1;                  // Display shows 0.1 gpm
+  static const uint32_t MILLIGALLONS_DEADBAND = 100;          // Display shows 0.1 gal
+  static const int SIGNAL_DEADBAND = 5;                       // Percent
+  static const unsigned long SIGNAL_REFRESH_INTERVAL = 60000; // 1 minute
+  static const unsigned long TX_FIFO_WAIT = 5;                 // 64-byte FIFO at 115200 baud
+  
+  // Default pacing keeps the display's receiver comfortably ahead
+  static constexpr float DEFAULT_TX_BYTES_PER_MS = 1.0;
+  static constexpr float MAX_TX_CREDIT = 64.0;  // Largest burst after an idle period
+};
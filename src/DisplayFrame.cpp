@@ -0,0 +1,141 @@
+#include "DisplayFrame.h"
+
+namespace {
+
+void putLe(uint8_t* out, uint64_t value, size_t bytes) {
+  for (size_t i = 0; i < bytes; i++) {
+    out[i] = (uint8_t)(value >> (8 * i));
+  }
+}
+
+uint64_t getLe(const uint8_t* in, size_t bytes) {
+  uint64_t value = 0;
+  for (size_t i = 0; i < bytes; i++) {
+    value |= (uint64_t)in[i] << (8 * i);
+  }
+  return value;
+}
+
+} // namespace
+
+size_t DisplayFrame::encode(const DisplayStatus& status, uint8_t* out, size_t outSize) {
+  if (outSize < MAX_FRAME_SIZE) {
+    return 0;
+  }
+  
+  uint8_t raw[RAW_SIZE];
+  raw[0] = DISPLAY_FRAME_VERSION;
+  raw[1] = DISPLAY_FRAME_STATUS;
+  raw[2] = status.flags;
+  putLe(&raw[3], status.gpmCenti, 2);
+  putLe(&raw[5], status.peakGpmCenti, 2);
+  putLe(&raw[7], status.lifetimeMilliGallons, 8);
+  putLe(&raw[15], status.dailyMilliGallons, 4);
+  putLe(&raw[19], status.flowEventsToday, 2);
+  raw[21] = status.signalPercent;
+  raw[22] = status.hour;
+  raw[23] = status.minute;
+  raw[24] = status.second;
+  putLe(&raw[PAYLOAD_SIZE], crc16(raw, PAYLOAD_SIZE), 2);
+  
+  size_t length = cobsEncode(raw, RAW_SIZE, out);
+  out[length++] = 0x00;
+  return length;
+}
+
+DisplayFrame::DecodeResult DisplayFrame::decode(const uint8_t* frame, size_t length, DisplayStatus& status) {
+  if (length > 0 && frame[length - 1] == 0x00) {
+    length--;
+  }
+  
+  uint8_t raw[RAW_SIZE];
+  if (cobsDecode(frame, length, raw, sizeof(raw)) != RAW_SIZE) {
+    return DECODE_BAD_FRAMING;
+  }
+  if ((uint16_t)getLe(&raw[PAYLOAD_SIZE], 2) != crc16(raw, PAYLOAD_SIZE)) {
+    return DECODE_BAD_CRC;
+  }
+  if (raw[0] != DISPLAY_FRAME_VERSION) {
+    return DECODE_BAD_VERSION;
+  }
+  if (raw[1] != DISPLAY_FRAME_STATUS) {
+    return DECODE_UNKNOWN_TYPE;
+  }
+  
+  status.flags = raw[2];
+  status.gpmCenti = (uint16_t)getLe(&raw[3], 2);
+  status.peakGpmCenti = (uint16_t)getLe(&raw[5], 2);
+  status.lifetimeMilliGallons = getLe(&raw[7], 8);
+  status.dailyMilliGallons = (uint32_t)getLe(&raw[15], 4);
+  status.flowEventsToday = (uint16_t)getLe(&raw[19], 2);
+  status.signalPercent = raw[21];
+  status.hour = raw[22];
+  status.minute = raw[23];
+  status.second = raw[24];
+  return DECODE_OK;
+}
+
+size_t DisplayFrame::cobsEncode(const uint8_t* in, size_t length, uint8_t* out) {
+  // Consistent Overhead Byte Stuffing: every zero is replaced by the distance
+  // to the next zero, so 0x00 only ever appears as the frame delimiter
+  size_t codeIndex = 0;
+  size_t written = 1;
+  uint8_t code = 1;
+  
+  for (size_t i = 0; i < length; i++) {
+    if (in[i] == 0x00) {
+      out[codeIndex] = code;
+      codeIndex = written++;
+      code = 1;
+    } else {
+      out[written++] = in[i];
+      code++;
+      if (code == 0xFF) {
+        out[codeIndex] = code;
+        codeIndex = written++;
+        code = 1;
+      }
+    }
+  }
+  out[codeIndex] = code;
+  return written;
+}
+
+size_t DisplayFrame::cobsDecode(const uint8_t* in, size_t length, uint8_t* out, size_t outSize) {
+  size_t written = 0;
+  size_t i = 0;
+  
+  while (i < length) {
+    uint8_t code = in[i++];
+    if (code == 0x00 || i + code - 1 > length) {
+      return 0;
+    }
+    for (uint8_t j = 1; j < code; j++) {
+      // A zero is only ever the delimiter, never block data
+      if (written >= outSize || in[i] == 0x00) {
+        return 0;
+      }
+      out[written++] = in[i++];
+    }
+    // A block shorter than 254 bytes stands for a zero, except at the end
+    if (code != 0xFF && i < length) {
+      if (written >= outSize) {
+        return 0;
+      }
+      out[written++] = 0x00;
+    }
+  }
+  return written;
+}
+
+uint16_t DisplayFrame::crc16(const uint8_t* data, size_t length) {
+  // CRC-16/CCITT-FALSE: poly 0x1021, init 0xFFFF
+  uint16_t crc = 0xFFFF;
+  for (size_t i = 0; i < length; i++) {
+    crc ^= (uint16_t)data[i] << 8;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+    }
+  }
+  return crc;
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+// Binary frame format for the Boron -> CYD display link, an alternative to the
+// JSON lines. Kept free of Particle APIs so the same encoder/decoder builds on
+// the ESP32 display and on Linux.
+//
+// Frame on the wire: COBS(payload + CRC16) followed by a 0x00 delimiter.
+// Payload (version 1, little-endian, 27 bytes before COBS):
+//
+//   offset size field
+//        0    1 version            DISPLAY_FRAME_VERSION
+//        1    1 type               DISPLAY_FRAME_STATUS
+//        2    1 flags              bit 0 flow active, bit 1 time valid
+//        3    2 gpmCenti           current flow, 0.01 gpm
+//        5    2 peakGpmCenti       peak flow today, 0.01 gpm
+//        7    8 lifetimeMilliGallons
+//       15    4 dailyMilliGallons
+//       19    2 flowEventsToday
+//       21    1 signalPercent      0-100
+//       22    1 hour
+//       23    1 minute
+//       24    1 second
+//       25    2 crc                CRC-16/CCITT-FALSE of bytes 0-24
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DISPLAY_FRAME_VERSION     1
+#define DISPLAY_FRAME_STATUS      1
+
+#define DISPLAY_FLAG_FLOW_ACTIVE  0x01
+#define DISPLAY_FLAG_TIME_VALID   0x02
+
+struct DisplayStatus {
+  uint8_t flags;
+  uint16_t gpmCenti;
+  uint16_t peakGpmCenti;
+  uint64_t lifetimeMilliGallons;
+  uint32_t dailyMilliGallons;
+  uint16_t flowEventsToday;
+  uint8_t signalPercent;
+  uint8_t hour;
+  uint8_t minute;
+  uint8_t second;
+};
+
+class DisplayFrame {
+public:
+  enum DecodeResult {
+    DECODE_OK = 0,
+    DECODE_BAD_FRAMING,   // COBS error or wrong length
+    DECODE_BAD_CRC,
+    DECODE_BAD_VERSION,
+    DECODE_UNKNOWN_TYPE
+  };
+  
+  static const size_t PAYLOAD_SIZE = 25;                  // Without CRC
+  static const size_t RAW_SIZE = PAYLOAD_SIZE + 2;        // With CRC
+  static const size_t MAX_FRAME_SIZE = RAW_SIZE + RAW_SIZE / 254 + 2;  // COBS + delimiter
+  
+  // Encode a status frame including the trailing 0x00; returns bytes written,
+  // or 0 if the buffer is too small
+  static size_t encode(const DisplayStatus& status, uint8_t* out, size_t outSize);
+  
+  // Decode one frame (with or without its trailing 0x00)
+  static DecodeResult decode(const uint8_t* frame, size_t length, DisplayStatus& status);
+  
+  // Building blocks, exposed for the reference tools
+  static size_t cobsEncode(const uint8_t* in, size_t length, uint8_t* out);
+  static size_t cobsDecode(const uint8_t* in, size_t length, uint8_t* out, size_t outSize);
+  static uint16_t crc16(const uint8_t* data, size_t length);
+};
@@ -0,0 +1,323 @@
+#include "FlowAnalyzer.h"
+#include "DeferredLog.h"
+
+#include <limits.h>
+
+namespace {
+
+const char* const ALERT_NAMES[FlowAnalyzer::ALERT_COUNT] = {
+  "leak",
+  "stuck_sensor",
+  "implausible_rate"
+};
+
+} // namespace
+
+template <size_t N>
+void FlowAnalyzer::MinWindow<N>::clear() {
+  front = 0;
+  size = 0;
+}
+
+template <size_t N>
+void FlowAnalyzer::MinWindow<N>::push(uint32_t at, uint32_t pulses) {
+  // Entries older than the window leave from the front
+  while (size > 0 && at - index[front] >= N) {
+    front = (front + 1) % N;
+    size--;
+  }
+
+  // Entries no lower than the new value can never be the minimum again
+  while (size > 0 && value[(front + size - 1) % N] >= pulses) {
+    size--;
+  }
+
+  size_t slot = (front + size) % N;
+  index[slot] = at;
+  value[slot] = pulses;
+  size++;
+}
+
+template <size_t N>
+uint32_t FlowAnalyzer::MinWindow<N>::min() const {
+  return size > 0 ? value[front] : 0;
+}
+
+FlowAnalyzer::FlowAnalyzer(float pulsesPerGallon) :
+  _pulsesPerKiloGallon((uint32_t)lroundf(pulsesPerGallon * 1000.0f)),
+  _running(false),
+  _runStart(0),
+  _lastPulseTime(0),
+  _lastPulseMicros(0),
+  _havePulseMicros(false),
+  _longestRunSeconds(0),
+  _runBaselineSeconds(0),
+  _minuteStart(0),
+  _minuteIndex(0),
+  _minutePulses(0),
+  _minuteGlitches(0),
+  _hourMin(UINT32_MAX),
+  _baselineMilliGpm(0),
+  _fillCommanded(false),
+  _fillStart(0),
+  _fillDuration(0),
+  _implausiblePulses(0),
+  _alertsRaised(0),
+  _alertsSuppressed(0)
+{
+  // Pulses per minute at the rated maximum, and half the interval between
+  // pulses there (anything shorter is not water)
+  _maxMinutePulses = MAX_PLAUSIBLE_GPM * _pulsesPerKiloGallon / 1000;
+  _minIntervalMicros = 30000000UL / (_maxMinutePulses > 0 ? _maxMinutePulses : 1);
+
+  _hourWindow.clear();
+  _dayWindow.clear();
+  memset(_alerts, 0, sizeof(_alerts));
+}
+
+void FlowAnalyzer::addPulses(uint32_t timestamp, unsigned long pulses) {
+  if (pulses == 0) {
+    return;
+  }
+  unsigned long currentTime = millis();
+
+  if (_running && currentTime - _lastPulseTime >= FLOW_GAP) {
+    endRun(_lastPulseTime);
+  }
+
+  if (!_running) {
+    _running = true;
+    _runStart = currentTime;
+  } else if (_havePulseMicros) {
+    // Mean interval of this sample; within a run the micros() difference
+    // can't have wrapped
+    uint32_t interval = (timestamp - _lastPulseMicros) / pulses;
+    if (interval < _minIntervalMicros) {
+      _minuteGlitches += pulses;
+      _implausiblePulses += pulses;
+    }
+  }
+
+  _lastPulseTime = currentTime;
+  _lastPulseMicros = timestamp;
+  _havePulseMicros = true;
+  _minutePulses += pulses;
+
+  if (_alerts[ALERT_STUCK_SENSOR].active) {
+    clear(ALERT_STUCK_SENSOR);
+  }
+}
+
+void FlowAnalyzer::update(unsigned long currentTime) {
+  // Minutes the device slept through close empty
+  while (currentTime - _minuteStart >= MINUTE) {
+    closeMinute();
+    _minuteStart += MINUTE;
+  }
+
+  if (_running && currentTime - _lastPulseTime >= FLOW_GAP) {
+    endRun(_lastPulseTime);
+  }
+
+  // Water that never stops for longer than any normal fill
+  if (_running && !_alerts[ALERT_LEAK].active) {
+    uint32_t runSeconds = (currentTime - _runStart) / 1000;
+    if (runSeconds >= getLeakThresholdSeconds()) {
+      char detail[48];
+      snprintf(detail, sizeof(detail), "flowing for %lu min", (unsigned long)(runSeconds / 60));
+      raise(ALERT_LEAK, detail);
+    }
+  }
+
+  if (_fillCommanded) {
+    if (currentTime - _fillStart >= _fillDuration) {
+      _fillCommanded = false;
+      clear(ALERT_STUCK_SENSOR);
+    } else {
+      // Quiet since the valve opened, or since the last pulse after that
+      unsigned long quietSince = _fillStart;
+      if (_running && (long)(_lastPulseTime - _fillStart) > 0) {
+        quietSince = _lastPulseTime;
+      }
+      if (currentTime - quietSince >= STUCK_TIMEOUT && !_alerts[ALERT_STUCK_SENSOR].active) {
+        raise(ALERT_STUCK_SENSOR, "no pulses from a commanded fill");
+      }
+    }
+  }
+}
+
+void FlowAnalyzer::commandFill(unsigned long durationMs) {
+  _fillCommanded = durationMs > 0;
+  _fillStart = millis();
+  _fillDuration = durationMs;
+  if (!_fillCommanded) {
+    clear(ALERT_STUCK_SENSOR);
+  }
+  DLOG_INFO("Fill commanded for %lu s", durationMs / 1000);
+}
+
+bool FlowAnalyzer::isFillCommanded() const {
+  return _fillCommanded;
+}
+
+void FlowAnalyzer::performDailyReset() {
+  _longestRunSeconds = 0;
+  _implausiblePulses = 0;
+}
+
+int FlowAnalyzer::takeAlert(unsigned long currentTime) {
+  for (int alert = 0; alert < ALERT_COUNT; alert++) {
+    AlertState& state = _alerts[alert];
+    if (state.pending) {
+      state.pending = false;
+      state.published = true;
+      state.lastPublishTime = currentTime;
+      return alert;
+    }
+  }
+  return -1;
+}
+
+bool FlowAnalyzer::isAlertActive(int alert) const {
+  return alert >= 0 && alert < ALERT_COUNT && _alerts[alert].active;
+}
+
+uint32_t FlowAnalyzer::getAlertFlags() const {
+  uint32_t flags = 0;
+  for (int alert = 0; alert < ALERT_COUNT; alert++) {
+    if (_alerts[alert].active) {
+      flags |= 1UL << alert;
+    }
+  }
+  return flags;
+}
+
+const char* FlowAnalyzer::getAlertName(int alert) {
+  return (alert >= 0 && alert < ALERT_COUNT) ? ALERT_NAMES[alert] : "unknown";
+}
+
+uint32_t FlowAnalyzer::getContinuousSeconds() const {
+  return _running ? (millis() - _runStart) / 1000 : 0;
+}
+
+uint32_t FlowAnalyzer::getLongestContinuousSeconds() const {
+  uint32_t current = getContinuousSeconds();
+  return current > _longestRunSeconds ? current : _longestRunSeconds;
+}
+
+uint32_t FlowAnalyzer::getLeakThresholdSeconds() const {
+  uint32_t typical = _runBaselineSeconds * LEAK_RUN_FACTOR;
+  return typical > LEAK_MIN_SECONDS ? typical : LEAK_MIN_SECONDS;
+}
+
+uint32_t FlowAnalyzer::getHourFloorMilliGpm() const {
+  return toMilliGpm(_hourWindow.min());
+}
+
+uint32_t FlowAnalyzer::getDayFloorMilliGpm() const {
+  // Closed hours, and the hour being filled
+  uint32_t floor = _hourMin;
+  if (_dayWindow.size > 0 && _dayWindow.min() < floor) {
+    floor = _dayWindow.min();
+  }
+  return floor == UINT32_MAX ? 0 : toMilliGpm(floor);
+}
+
+uint32_t FlowAnalyzer::getBaselineMilliGpm() const {
+  return _baselineMilliGpm;
+}
+
+unsigned long FlowAnalyzer::getImplausiblePulses() const {
+  return _implausiblePulses;
+}
+
+unsigned long FlowAnalyzer::getAlertsRaised() const {
+  return _alertsRaised;
+}
+
+unsigned long FlowAnalyzer::getAlertsSuppressed() const {
+  return _alertsSuppressed;
+}
+
+void FlowAnalyzer::endRun(unsigned long endTime) {
+  uint32_t runSeconds = (endTime - _runStart) / 1000;
+  if (runSeconds > _longestRunSeconds) {
+    _longestRunSeconds = runSeconds;
+  }
+
+  // Leaks stay out of the baseline, or each one would hide the next
+  if (_alerts[ALERT_LEAK].active) {
+    clear(ALERT_LEAK);
+  } else if (_runBaselineSeconds == 0) {
+    _runBaselineSeconds = runSeconds;
+  } else {
+    _runBaselineSeconds += ((int32_t)runSeconds - (int32_t)_runBaselineSeconds) >> RUN_BASELINE_SHIFT;
+  }
+
+  _running = false;
+  _havePulseMicros = false;
+}
+
+void FlowAnalyzer::closeMinute() {
+  // Two pulses can land close together by chance; noise makes it common
+  bool noisy = _minuteGlitches > MAX_MINUTE_GLITCHES &&
+               _minuteGlitches > (_minutePulses >> GLITCH_SHARE_SHIFT);
+  bool plausible = _minutePulses <= _maxMinutePulses && !noisy;
+  if (!plausible && !_alerts[ALERT_IMPLAUSIBLE_RATE].active) {
+    char detail[48];
+    snprintf(detail, sizeof(detail), "%lu pulses, %lu too close",
+             (unsigned long)_minutePulses, (unsigned long)_minuteGlitches);
+    raise(ALERT_IMPLAUSIBLE_RATE, detail);
+  } else if (plausible && _alerts[ALERT_IMPLAUSIBLE_RATE].active) {
+    clear(ALERT_IMPLAUSIBLE_RATE);
+  }
+
+  // Rolling floors: minutes over the last hour, hourly floors over the day
+  _hourWindow.push(_minuteIndex, _minutePulses);
+  if (_minutePulses < _hourMin) {
+    _hourMin = _minutePulses;
+  }
+  if (_minuteIndex % 60 == 59) {
+    _dayWindow.push(_minuteIndex / 60, _hourMin);
+    _hourMin = UINT32_MAX;
+  }
+
+  // Typical rate while water flows
+  if (_minutePulses > 0 && plausible) {
+    int32_t rate = (int32_t)toMilliGpm(_minutePulses);
+    if (_baselineMilliGpm == 0) {
+      _baselineMilliGpm = rate;
+    } else {
+      _baselineMilliGpm += (rate - (int32_t)_baselineMilliGpm) >> BASELINE_SHIFT;
+    }
+  }
+
+  _minuteIndex++;
+  _minutePulses = 0;
+  _minuteGlitches = 0;
+}
+
+void FlowAnalyzer::raise(int alert, const char* detail) {
+  AlertState& state = _alerts[alert];
+  state.active = true;
+  _alertsRaised++;
+
+  // A flapping condition publishes once per holdoff
+  if (state.published && millis() - state.lastPublishTime < ALERT_HOLDOFF) {
+    _alertsSuppressed++;
+  } else {
+    state.pending = true;
+  }
+  DLOG_WARN("Alert raised: %s (%s)", ALERT_NAMES[alert], detail);
+}
+
+void FlowAnalyzer::clear(int alert) {
+  if (_alerts[alert].active) {
+    _alerts[alert].active = false;
+    DLOG_INFO("Alert cleared: %s", ALERT_NAMES[alert]);
+  }
+}
+
+uint32_t FlowAnalyzer::toMilliGpm(uint32_t minutePulses) const {
+  return (uint32_t)(((uint64_t)minutePulses * 1000000ULL + _pulsesPerKiloGallon / 2) / _pulsesPerKiloGallon);
+}
@@ -0,0 +1,135 @@
+#pragma once
+
+#include "Particle.h"
+
+// Streaming leak and sensor-fault detection. Every pulse (or counter sample)
+// costs O(1) work and no raw data is kept:
+//
+//   - pulse intervals extend or end the current run of continuous flow; a
+//     run that outlasts any normal fill is a leak
+//   - pulses are folded into a per-minute count, and each closed minute
+//     updates rolling minimum-flow windows over the last hour and day (a
+//     leak keeps the floor above zero) and an EWMA of the flowing rate
+//   - intervals too short for the meter, or minutes above its rated flow,
+//     are an implausible rate (electrical noise or a failing sensor)
+//   - a fill commanded through the cloud that produces no pulses is a
+//     stuck sensor
+//
+// Alerts latch while their condition holds. Each raise is offered once for
+// publishing, and a type is published at most once per ALERT_HOLDOFF.
+class FlowAnalyzer {
+public:
+  enum Alert {
+    ALERT_LEAK,
+    ALERT_STUCK_SENSOR,
+    ALERT_IMPLAUSIBLE_RATE,
+    ALERT_COUNT
+  };
+
+  explicit FlowAnalyzer(float pulsesPerGallon);
+
+  // Pulses seen at a micros() timestamp (several for a counter sample)
+  void addPulses(uint32_t timestamp, unsigned long pulses);
+
+  // Close finished minutes and check the fault timers
+  void update(unsigned long currentTime);
+
+  // A fill valve was opened for durationMs (0 = closed again)
+  void commandFill(unsigned long durationMs);
+  bool isFillCommanded() const;
+
+  // Start the daily figures again
+  void performDailyReset();
+
+  // Next raised alert due for publishing, or -1; taking it starts the holdoff
+  int takeAlert(unsigned long currentTime);
+  bool isAlertActive(int alert) const;
+  uint32_t getAlertFlags() const;  // Bit per active alert
+  static const char* getAlertName(int alert);
+
+  // Detector state (rates in milli-gallons per minute)
+  uint32_t getContinuousSeconds() const;     // Current run of flow, 0 if none
+  uint32_t getLongestContinuousSeconds() const;  // Since the daily reset
+  uint32_t getLeakThresholdSeconds() const;
+  uint32_t getHourFloorMilliGpm() const;     // Lowest minute in the last hour
+  uint32_t getDayFloorMilliGpm() const;      // Lowest minute in the last day
+  uint32_t getBaselineMilliGpm() const;      // EWMA of the flowing minutes
+  unsigned long getImplausiblePulses() const;
+  unsigned long getAlertsRaised() const;
+  unsigned long getAlertsSuppressed() const; // Raised again inside the holdoff
+
+private:
+  // Monotonic queue of (index, value) pairs, values increasing from the
+  // front: the front is the minimum of the window, and each push costs O(1)
+  // amortized
+  template <size_t N>
+  struct MinWindow {
+    uint32_t index[N];
+    uint32_t value[N];
+    size_t front;
+    size_t size;
+
+    void clear();
+    void push(uint32_t at, uint32_t pulses);
+    uint32_t min() const;
+  };
+
+  struct AlertState {
+    bool active;
+    bool pending;            // Raised and not yet taken for publishing
+    bool published;          // A publish has happened, so the holdoff applies
+    unsigned long lastPublishTime;
+  };
+
+  uint32_t _pulsesPerKiloGallon;
+  uint32_t _minIntervalMicros;     // Shorter than the meter can produce
+  uint32_t _maxMinutePulses;       // Above the meter's rated flow
+
+  // Continuous flow, timed in millis() so hour-long runs can't wrap
+  bool _running;
+  unsigned long _runStart;
+  unsigned long _lastPulseTime;
+  uint32_t _lastPulseMicros;
+  bool _havePulseMicros;
+  uint32_t _longestRunSeconds;
+  uint32_t _runBaselineSeconds;    // EWMA of runs that ended normally
+
+  // Per-minute aggregation
+  unsigned long _minuteStart;
+  uint32_t _minuteIndex;
+  uint32_t _minutePulses;
+  uint32_t _minuteGlitches;
+  uint32_t _hourMin;               // Lowest minute of the hour being filled
+  MinWindow<60> _hourWindow;       // Minute counts
+  MinWindow<24> _dayWindow;        // Hourly minimums
+  uint32_t _baselineMilliGpm;
+
+  // Commanded fill
+  bool _fillCommanded;
+  unsigned long _fillStart;
+  unsigned long _fillDuration;
+
+  AlertState _alerts[ALERT_COUNT];
+  unsigned long _implausiblePulses;
+  unsigned long _alertsRaised;
+  unsigned long _alertsSuppressed;
+
+  // Constants
+  const unsigned long FLOW_GAP = 120000;           // Longer between pulses ends a run
+  const unsigned long STUCK_TIMEOUT = 90000;       // Commanded fill with no pulses
+  const unsigned long ALERT_HOLDOFF = 21600000;    // 6 hours between publishes of a type
+  const uint32_t LEAK_MIN_SECONDS = 7200;          // Shortest run that can be a leak
+  const uint32_t LEAK_RUN_FACTOR = 4;              // Or this many typical runs
+  const uint32_t MAX_PLAUSIBLE_GPM = 15;           // Above the meter's rated range
+  const uint32_t MAX_MINUTE_GLITCHES = 10;         // Too-short intervals tolerated per minute,
+  static const uint32_t GLITCH_SHARE_SHIFT = 3;    // or up to 1/8 of the minute's pulses
+  static const unsigned long MINUTE = 60000;
+  static const uint32_t BASELINE_SHIFT = 4;        // EWMA weight 1/16 per flowing minute
+  static const uint32_t RUN_BASELINE_SHIFT = 3;    // EWMA weight 1/8 per run
+
+  void endRun(unsigned long currentTime);
+  void closeMinute();
+  void raise(int alert, const char* detail);
+  void clear(int alert);
+  uint32_t toMilliGpm(uint32_t minutePulses) const;
+};
@@ -0,0 +1,14 @@
+#pragma once
+
+// How many flow meters a build reads. FLOW_CHANNELS is set per build (compiler
+// flag, default one); MAX_FLOW_CHANNELS is the most any build can have, and
+// fixes the size of the EEPROM record and of the cloud payloads.
+#define MAX_FLOW_CHANNELS 3
+
+#ifndef FLOW_CHANNELS
+#define FLOW_CHANNELS 1
+#endif
+
+#if FLOW_CHANNELS < 1 || FLOW_CHANNELS > MAX_FLOW_CHANNELS
+#error "FLOW_CHANNELS must be between 1 and MAX_FLOW_CHANNELS"
+#endif
@@ -0,0 +1,396 @@
+#include "FlowHistory.h"
+#include "Checksum.h"
+#include "Clock.h"
+#include "RetainedRam.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+namespace {
+
+struct TierConfig {
+  const char* name;
+  uint32_t interval;   // Seconds per bucket
+  uint16_t capacity;   // Buckets held
+  uint16_t unit;       // Milli-gallons per stored count
+  uint16_t maxValue;   // Largest stored count
+};
+
+const uint16_t MINUTE_BUCKETS = 1440;
+
+const TierConfig TIERS[FlowHistory::TIER_COUNT] = {
+  {"minute", 60, MINUTE_BUCKETS, 100, 255},
+  {"quarter", 900, 672, 10, 65535},
+  {"hour", 3600, 2160, 100, 65535}
+};
+
+// About half of retained RAM (see RetainedRam.h); the CRCs are split so a flowing
+// meter only re-checks the small state block, not the whole minute ring
+const uint32_t HISTORY_MAGIC = 0x464C4849;  // "FLHI"
+
+struct RetainedHistory {
+  uint32_t magic;
+  FlowHistory::TierState tiers[FlowHistory::TIER_COUNT];
+  uint32_t stateCrc;
+  uint8_t minutes[MINUTE_BUCKETS];
+  uint32_t minutesCrc;
+};
+
+retained RetainedHistory history;
+static_assert(sizeof(RetainedHistory) <= RETAINED_HISTORY_BYTES, "Retained history is over its RetainedRam.h budget");
+
+uint32_t stateCrc() {
+  return Checksum::crc32(reinterpret_cast<const uint8_t*>(&history), offsetof(RetainedHistory, stateCrc));
+}
+
+uint32_t minutesCrc() {
+  return Checksum::crc32(history.minutes, sizeof(history.minutes));
+}
+
+bool validTier(int tier) {
+  return tier >= 0 && tier < FlowHistory::TIER_COUNT;
+}
+
+bool validState(const FlowHistory::TierState& state, int tier) {
+  return state.head < TIERS[tier].capacity && state.count <= TIERS[tier].capacity;
+}
+
+} // namespace
+
+FlowHistory::FlowHistory(const char* path) :
+  _path(path),
+  _fd(-1),
+  _headerDirty(false),
+  _minutesDirty(false),
+  _fileWrites(0),
+  _resets(0)
+{
+}
+
+void FlowHistory::begin() {
+  // Retained state survives a warm reset
+  bool retainedValid = history.magic == HISTORY_MAGIC && history.stateCrc == stateCrc() &&
+                       history.minutesCrc == minutesCrc();
+  for (int tier = 0; retainedValid && tier < TIER_COUNT; tier++) {
+    retainedValid = validState(history.tiers[tier], tier);
+  }
+  if (!retainedValid) {
+    memset(&history, 0, sizeof(history));
+    _minutesDirty = true;
+  }
+
+  // Make sure the directory exists; an error here just means it already does
+  char directory[64];
+  const char* slash = strrchr(_path, '/');
+  if (slash && slash != _path && (size_t)(slash - _path) < sizeof(directory)) {
+    memcpy(directory, _path, slash - _path);
+    directory[slash - _path] = '\0';
+    mkdir(directory, 0777);
+  }
+
+  _fd = open(_path, O_RDWR | O_CREAT, 0644);
+  FileHeader header;
+  if (_fd >= 0 && loadHeader(header)) {
+    if (!retainedValid) {
+      // Power cycle: the minute tier is gone, the coarse tiers carry on
+      memcpy(&history.tiers[TIER_QUARTER], header.tiers, sizeof(header.tiers));
+    }
+  } else if (_fd < 0 || !createFile()) {
+    Serial.printlnf("Flow history: cannot open %s, keeping the minute tier only", _path);
+    if (_fd >= 0) {
+      close(_fd);
+      _fd = -1;
+    }
+    memset(&history.tiers[TIER_QUARTER], 0, sizeof(header.tiers));
+  }
+  seal();
+
+  Serial.printlnf("Flow history initialized (%u minute, %u quarter-hour, %u hourly buckets held)",
+                 history.tiers[TIER_MINUTE].count, history.tiers[TIER_QUARTER].count,
+                 history.tiers[TIER_HOUR].count);
+}
+
+void FlowHistory::update() {
+  if (!Clock::isSynced()) {
+    return;
+  }
+
+  uint32_t now = Clock::now();
+  const TierState& minute = history.tiers[TIER_MINUTE];
+  int32_t age = (int32_t)(now - minute.bucketStart);
+  if (minute.bucketStart != 0 && age < (int32_t)TIERS[TIER_MINUTE].interval) {
+    if (age >= -(int32_t)TIERS[TIER_MINUTE].interval) {
+      return;  // Open bucket still running (or a small resync step back)
+    }
+    // Buckets dated after this would land out of order
+    Serial.println("Flow history: clock moved back, series restarted");
+    reset();
+  }
+
+  start(now);
+  roll(TIER_MINUTE, now);
+  if (_headerDirty) {
+    writeHeader();
+  }
+  seal();
+}
+
+void FlowHistory::addMilliGallons(uint32_t milliGallons) {
+  history.tiers[TIER_MINUTE].accumulator += milliGallons;
+  seal();
+}
+
+size_t FlowHistory::readBuckets(int tier, size_t first, uint16_t* values, size_t maxValues) {
+  if (!validTier(tier) || first >= history.tiers[tier].count) {
+    return 0;
+  }
+
+  // The oldest held bucket sits count slots behind the head; a read stops
+  // at the end of the ring and the caller continues from the start
+  const TierConfig& config = TIERS[tier];
+  const TierState& state = history.tiers[tier];
+  size_t slot = (state.head + config.capacity - state.count + first) % config.capacity;
+  size_t count = state.count - first;
+  if (count > maxValues) {
+    count = maxValues;
+  }
+  if (slot + count > config.capacity) {
+    count = config.capacity - slot;
+  }
+
+  if (tier == TIER_MINUTE) {
+    for (size_t i = 0; i < count; i++) {
+      values[i] = history.minutes[slot + i];
+    }
+    return count;
+  }
+  return readFile(bucketOffset(tier, slot), values, count * sizeof(uint16_t)) ? count : 0;
+}
+
+// Tier information
+size_t FlowHistory::getCount(int tier) const {
+  return validTier(tier) ? history.tiers[tier].count : 0;
+}
+
+uint32_t FlowHistory::getBucketTime(int tier, size_t index) const {
+  if (!validTier(tier)) {
+    return 0;
+  }
+  const TierState& state = history.tiers[tier];
+  return state.bucketStart - (uint32_t)(state.count - index) * TIERS[tier].interval;
+}
+
+uint32_t FlowHistory::getOpenMilliGallons(int tier) const {
+  return validTier(tier) ? history.tiers[tier].accumulator : 0;
+}
+
+int FlowHistory::findTier(const char* name) {
+  for (int tier = 0; tier < TIER_COUNT; tier++) {
+    if (strcmp(name, TIERS[tier].name) == 0) {
+      return tier;
+    }
+  }
+  return -1;
+}
+
+const char* FlowHistory::getTierName(int tier) {
+  return validTier(tier) ? TIERS[tier].name : "";
+}
+
+uint32_t FlowHistory::getInterval(int tier) {
+  return validTier(tier) ? TIERS[tier].interval : 0;
+}
+
+uint32_t FlowHistory::getUnitMilliGallons(int tier) {
+  return validTier(tier) ? TIERS[tier].unit : 0;
+}
+
+// Statistics
+unsigned long FlowHistory::getFileWrites() const {
+  return _fileWrites;
+}
+
+unsigned long FlowHistory::getResets() const {
+  return _resets;
+}
+
+void FlowHistory::start(uint32_t now) {
+  bool started = false;
+  for (int tier = 0; tier < TIER_COUNT; tier++) {
+    TierState& state = history.tiers[tier];
+    if (tier > TIER_MINUTE && state.bucketStart != 0 && 
+        (int32_t)(state.bucketStart - history.tiers[TIER_MINUTE].bucketStart) > 0) {
+      // Recovered from the file, but dated by a clock that has since moved back
+      memset(&state, 0, sizeof(state));
+      _resets++;
+    }
+    if (state.bucketStart == 0) {
+      state.bucketStart = now - now % TIERS[tier].interval;
+      started = true;
+      _headerDirty = true;
+    }
+  }
+
+  // Coarse tiers recovered from the file catch up over the time the device was off
+  if (started) {
+    roll(TIER_QUARTER, history.tiers[TIER_MINUTE].bucketStart);
+  }
+}
+
+void FlowHistory::reset() {
+  // Volume already metered into the open minute is kept
+  uint32_t pending = history.tiers[TIER_MINUTE].accumulator;
+  memset(history.tiers, 0, sizeof(history.tiers));
+  history.tiers[TIER_MINUTE].accumulator = pending;
+  _headerDirty = true;
+  _resets++;
+}
+
+void FlowHistory::roll(int tier, uint32_t time) {
+  const TierConfig& config = TIERS[tier];
+  TierState& state = history.tiers[tier];
+  while ((int32_t)(time - state.bucketStart) >= (int32_t)config.interval) {
+    closeBucket(tier);
+
+    // The next tier closes in time order, each of its buckets after the
+    // last bucket of this tier that belongs to it
+    if (tier + 1 < TIER_COUNT) {
+      roll(tier + 1, state.bucketStart);
+    }
+
+    // A gap longer than the whole ring leaves nothing but empty buckets, so
+    // skip to the present instead of writing them one by one
+    if (time - state.bucketStart >= config.interval * config.capacity) {
+      state.bucketStart = time - time % config.interval;
+      state.count = 0;
+      state.carry = 0;
+      if (tier + 1 < TIER_COUNT) {
+        roll(tier + 1, state.bucketStart);
+      }
+    }
+  }
+}
+
+void FlowHistory::closeBucket(int tier) {
+  const TierConfig& config = TIERS[tier];
+  TierState& state = history.tiers[tier];
+
+  // Round to the stored unit and carry the difference into the next bucket;
+  // a saturated bucket doesn't bank more than one unit of carry
+  int64_t total = (int64_t)state.accumulator + state.carry;
+  int64_t value = (total > 0) ? (total + config.unit / 2) / config.unit : 0;
+  if (value > config.maxValue) {
+    value = config.maxValue;
+  }
+  int64_t carry = total - value * config.unit;
+  if (carry > config.unit) {
+    carry = config.unit;
+  }
+  state.carry = (int32_t)carry;
+  writeBucket(tier, state.head, (uint16_t)value);
+
+  // The exact volume feeds the next tier's open bucket
+  if (tier + 1 < TIER_COUNT) {
+    history.tiers[tier + 1].accumulator += state.accumulator;
+  }
+  state.accumulator = 0;
+  state.head = (state.head + 1) % config.capacity;
+  if (state.count < config.capacity) {
+    state.count++;
+  }
+  state.bucketStart += config.interval;
+}
+
+bool FlowHistory::writeBucket(int tier, uint16_t slot, uint16_t value) {
+  if (tier == TIER_MINUTE) {
+    history.minutes[slot] = (uint8_t)value;
+    _minutesDirty = true;
+    return true;
+  }
+  _headerDirty = true;
+  _fileWrites++;
+  return writeFile(bucketOffset(tier, slot), &value, sizeof(value));
+}
+
+uint32_t FlowHistory::bucketOffset(int tier, uint16_t slot) {
+  // Coarse tiers follow the header in order; TIER_COUNT gives the file size
+  uint32_t offset = sizeof(FileHeader);
+  for (int previous = TIER_QUARTER; previous < tier; previous++) {
+    offset += TIERS[previous].capacity * sizeof(uint16_t);
+  }
+  return offset + slot * sizeof(uint16_t);
+}
+
+bool FlowHistory::readFile(uint32_t offset, void* data, size_t size) {
+  return _fd >= 0 &&
+         lseek(_fd, offset, SEEK_SET) == (off_t)offset &&
+         read(_fd, data, size) == (int)size;
+}
+
+bool FlowHistory::writeFile(uint32_t offset, const void* data, size_t size) {
+  return _fd >= 0 &&
+         lseek(_fd, offset, SEEK_SET) == (off_t)offset &&
+         write(_fd, data, size) == (int)size;
+}
+
+bool FlowHistory::loadHeader(FileHeader& header) {
+  if (!readFile(0, &header, sizeof(header)) || header.magic != FILE_MAGIC ||
+      header.version != FILE_VERSION ||
+      header.crc != Checksum::crc32(reinterpret_cast<const uint8_t*>(&header), offsetof(FileHeader, crc)) ||
+      lseek(_fd, 0, SEEK_END) < (off_t)bucketOffset(TIER_COUNT, 0)) {
+    return false;
+  }
+  for (int tier = TIER_QUARTER; tier < TIER_COUNT; tier++) {
+    if (!validState(header.tiers[tier - TIER_QUARTER], tier)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void FlowHistory::writeHeader() {
+  _headerDirty = false;
+  if (_fd < 0) {
+    return;
+  }
+
+  FileHeader header;
+  header.magic = FILE_MAGIC;
+  header.version = FILE_VERSION;
+  memcpy(header.tiers, &history.tiers[TIER_QUARTER], sizeof(header.tiers));
+  header.crc = Checksum::crc32(reinterpret_cast<const uint8_t*>(&header), offsetof(FileHeader, crc));
+  if (!writeFile(0, &header, sizeof(header)) || fsync(_fd) != 0) {
+    Serial.println("Flow history: file write failed");
+  }
+}
+
+bool FlowHistory::createFile() {
+  close(_fd);
+  _fd = open(_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (_fd < 0) {
+    return false;
+  }
+
+  // Empty coarse tiers, with the file at full size so bucket writes never grow it
+  memset(&history.tiers[TIER_QUARTER], 0, (TIER_COUNT - TIER_QUARTER) * sizeof(TierState));
+  writeHeader();
+  uint8_t zeros[256] = {};
+  uint32_t size = bucketOffset(TIER_COUNT, 0);
+  for (uint32_t offset = sizeof(FileHeader); offset < size; offset += sizeof(zeros)) {
+    size_t chunk = (size - offset < sizeof(zeros)) ? size - offset : sizeof(zeros);
+    if (!writeFile(offset, zeros, chunk)) {
+      return false;
+    }
+  }
+  return fsync(_fd) == 0;
+}
+
+void FlowHistory::seal() {
+  history.magic = HISTORY_MAGIC;
+  history.stateCrc = stateCrc();
+  if (_minutesDirty) {
+    history.minutesCrc = minutesCrc();
+    _minutesDirty = false;
+  }
+}
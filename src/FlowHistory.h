@@ -0,0 +1,98 @@
+#pragma once
+
+#include "Particle.h"
+
+// Fixed-footprint flow time series at three resolutions:
+//
+//   minute   1440 buckets (24 hours)   0.1 gal per count, up to 25.5 gal
+//   quarter   672 buckets (7 days)     0.01 gal per count, up to 655 gal
+//   hour     2160 buckets (90 days)    0.1 gal per count, up to 6553 gal
+//
+// Buckets are aligned to wall-clock boundaries. Each closed bucket passes its
+// exact volume up to the open bucket of the next tier, so the coarse tiers
+// are downsampled incrementally and never re-read the finer ones. Rounding
+// to the stored units is carried into the next bucket, so a tier's sum
+// matches the metered volume.
+//
+// The minute tier and every tier's ring position live in retained RAM
+// (checked by CRC), so a warm reset keeps them. The 90-day tier alone is
+// larger than retained RAM, so the two coarse tiers are kept in a fixed-size
+// flash file, one small write per closed bucket; its header mirrors their
+// ring positions, so they also survive a power cycle.
+class FlowHistory {
+public:
+  enum Tier {
+    TIER_MINUTE,
+    TIER_QUARTER,
+    TIER_HOUR,
+    TIER_COUNT
+  };
+
+  // Ring position of one tier
+  struct TierState {
+    uint32_t bucketStart;   // Unix time the open bucket began (0 = not started)
+    uint32_t accumulator;   // Milli-gallons in the open bucket
+    int32_t carry;          // Rounding owed to the next stored bucket
+    uint16_t head;          // Slot the open bucket will be stored in
+    uint16_t count;         // Closed buckets held
+  };
+
+  explicit FlowHistory(const char* path);
+
+  // Recover retained state and open the file for the coarse tiers
+  void begin();
+
+  // Close every bucket that has ended. Buckets are dated by the synced
+  // clock; until then volume waits in the open bucket.
+  void update();
+
+  // Metered volume for the open bucket
+  void addMilliGallons(uint32_t milliGallons);
+
+  // Read held buckets, oldest first, in stored counts; returns how many were read
+  size_t readBuckets(int tier, size_t first, uint16_t* values, size_t maxValues);
+
+  // Tier information
+  size_t getCount(int tier) const;
+  uint32_t getBucketTime(int tier, size_t index) const;  // Start of a held bucket
+  uint32_t getOpenMilliGallons(int tier) const;
+  static int findTier(const char* name);  // -1 if unknown
+  static const char* getTierName(int tier);
+  static uint32_t getInterval(int tier);  // Seconds per bucket
+  static uint32_t getUnitMilliGallons(int tier);
+
+  // Statistics
+  unsigned long getFileWrites() const;
+  unsigned long getResets() const;
+
+private:
+  struct FileHeader {
+    uint32_t magic;
+    uint32_t version;
+    TierState tiers[TIER_COUNT - 1];  // Quarter and hour
+    uint32_t crc;
+  };
+
+  const char* _path;
+  int _fd;
+  bool _headerDirty;
+  bool _minutesDirty;
+  unsigned long _fileWrites;
+  unsigned long _resets;
+
+  static const uint32_t FILE_MAGIC = 0x46484953;  // "FHIS"
+  static const uint32_t FILE_VERSION = 1;
+
+  void start(uint32_t now);
+  void reset();
+  void roll(int tier, uint32_t time);
+  void closeBucket(int tier);
+  bool writeBucket(int tier, uint16_t slot, uint16_t value);
+  bool readFile(uint32_t offset, void* data, size_t size);
+  bool writeFile(uint32_t offset, const void* data, size_t size);
+  bool loadHeader(FileHeader& header);
+  void writeHeader();
+  bool createFile();
+  void seal();
+  static uint32_t bucketOffset(int tier, uint16_t slot);
+};
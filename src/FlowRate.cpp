@@ -0,0 +1,165 @@
+#include "FlowRate.h"
+
+FlowRate::FlowRate(float pulsesPerGallon) :
+  _gallonsPerPulse(1.0 / pulsesPerGallon),
+  _windowSlots(8),
+  _smoothing(0.5),
+  _next(0),
+  _windowPulses(0),
+  _openPulses(0),
+  _slotStart(0),
+  _lastSampleTime(0),
+  _started(false),
+  _currentPps(0.0),
+  _peakPps(0.0),
+  _flowing(false),
+  _flowingPulses(0),
+  _flowingSlots(0),
+  _idleSlots(0)
+{
+  memset(_slots, 0, sizeof(_slots));
+}
+
+void FlowRate::configure(unsigned long windowMs, float smoothing) {
+  size_t slots = (windowMs + SLOT_MILLIS / 2) / SLOT_MILLIS;
+  _windowSlots = slots < 1 ? 1 : (slots > MAX_SLOTS ? MAX_SLOTS : slots);
+  _smoothing = smoothing < 0.0f ? 0.0f : (smoothing > 0.99f ? 0.99f : smoothing);
+  clearWindow();
+}
+
+void FlowRate::addPulses(uint32_t timestamp, unsigned long pulses) {
+  if (!_started) {
+    _started = true;
+    _slotStart = timestamp;
+    _lastSampleTime = timestamp;
+  }
+
+  uint32_t from = _lastSampleTime;
+  _lastSampleTime = timestamp;
+
+  // Timestamps drained after the last advance() can be a little older than
+  // the open slot; they count towards it
+  if ((int32_t)(timestamp - _slotStart) < 0) {
+    _openPulses += pulses;
+    return;
+  }
+  if (timestamp - _slotStart >= SLOT_MICROS * (MAX_SLOTS + 1)) {
+    advance(timestamp);
+    _openPulses += pulses;
+    return;
+  }
+
+  // A batch counted since the previous sample is spread evenly over that
+  // time, so a late sample doesn't pile into one slot
+  if ((int32_t)(from - _slotStart) < 0) {
+    from = _slotStart;
+  }
+  uint32_t span = timestamp - from;
+  unsigned long given = 0;
+  while (timestamp - _slotStart >= SLOT_MICROS) {
+    uint32_t slotEnd = _slotStart + SLOT_MICROS;
+    unsigned long due = (unsigned long)((uint64_t)pulses * (slotEnd - from) / span);
+    _openPulses += due - given;
+    given = due;
+    closeSlot();
+    _slotStart = slotEnd;
+  }
+  _openPulses += pulses - given;
+}
+
+void FlowRate::advance(uint32_t now) {
+  if (!_started) {
+    _started = true;
+    _slotStart = now;
+    return;
+  }
+
+  // After a long gap every slot in the window is empty, so skip the lot
+  if (now - _slotStart >= SLOT_MICROS * (MAX_SLOTS + 1)) {
+    uint32_t skipped = (now - _slotStart) / SLOT_MICROS - 1;
+    closeSlot();
+    addFlowingSlots(0, skipped);
+    clearWindow();
+    _slotStart = now;
+    return;
+  }
+
+  while (now - _slotStart >= SLOT_MICROS) {
+    closeSlot();
+    _slotStart += SLOT_MICROS;
+  }
+}
+
+void FlowRate::setFlowing(bool flowing) {
+  if (_flowing && !flowing) {
+    // The empty slots since the last pulse were the wait for flow to time out
+    _flowingSlots -= _idleSlots;
+  }
+  _flowing = flowing;
+  _idleSlots = 0;
+}
+
+void FlowRate::resetDaily() {
+  _peakPps = 0.0;
+  _flowingPulses = 0;
+  _flowingSlots = 0;
+  _idleSlots = 0;
+}
+
+float FlowRate::getCurrentGpm() const {
+  return toGpm(_currentPps);
+}
+
+float FlowRate::getPeakGpm() const {
+  return toGpm(_peakPps);
+}
+
+float FlowRate::getAverageGpm() const {
+  if (_flowingSlots == 0) {
+    return 0.0;
+  }
+  return toGpm(_flowingPulses * (1000.0f / SLOT_MILLIS) / _flowingSlots);
+}
+
+void FlowRate::closeSlot() {
+  uint32_t pulses = _openPulses;
+  _openPulses = 0;
+  addFlowingSlots(pulses, 1);
+
+  // Slide the window: the slot written _windowSlots closes ago leaves it
+  size_t leaving = (_next + MAX_SLOTS - _windowSlots) % MAX_SLOTS;
+  _windowPulses += pulses;
+  _windowPulses -= _slots[leaving];
+  _slots[_next] = pulses;
+  _next = (_next + 1) % MAX_SLOTS;
+
+  if (_windowPulses == 0) {
+    _currentPps = 0.0;
+    return;
+  }
+  float windowPps = _windowPulses * (1000.0f / SLOT_MILLIS) / _windowSlots;
+  _currentPps = (_currentPps == 0.0f) ? windowPps : windowPps + _smoothing * (_currentPps - windowPps);
+  if (_currentPps > _peakPps) {
+    _peakPps = _currentPps;
+  }
+}
+
+void FlowRate::addFlowingSlots(uint32_t pulses, uint32_t slots) {
+  // A trickle leaves most slots empty; they are still time spent flowing
+  if (!_flowing) {
+    return;
+  }
+  _flowingPulses += pulses;
+  _flowingSlots += slots;
+  _idleSlots = (pulses > 0) ? 0 : _idleSlots + slots;
+}
+
+void FlowRate::clearWindow() {
+  memset(_slots, 0, sizeof(_slots));
+  _windowPulses = 0;
+  _currentPps = 0.0;
+}
+
+float FlowRate::toGpm(float pulsesPerSecond) const {
+  return pulsesPerSecond * _gallonsPerPulse * 60.0f;
+}
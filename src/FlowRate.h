@@ -0,0 +1,70 @@
+#pragma once
+
+#include "Particle.h"
+
+// Flow rate from batches of pulses, O(1) per batch. Pulses are counted into
+// fixed slots of SLOT_MILLIS. As each slot closes, a sliding window over the
+// last few slots gives the raw rate and an EWMA over those raw rates gives
+// the current rate; an empty window reads 0 straight away.
+//
+// A longer window or heavier smoothing gives a steadier reading (and finer
+// resolution at low flow); a shorter window or lighter smoothing follows
+// changes sooner. The reading settles within about window / (1 - smoothing).
+class FlowRate {
+public:
+  explicit FlowRate(float pulsesPerGallon);
+
+  // Window of up to MAX_WINDOW_MILLIS, rounded to whole slots; smoothing
+  // from 0 (window rate as is) to just under 1. Restarts the estimate.
+  void configure(unsigned long windowMs, float smoothing);
+
+  // Pulses seen at a micros() timestamp
+  void addPulses(uint32_t timestamp, unsigned long pulses);
+
+  // Close the slots that have ended by now (micros())
+  void advance(uint32_t now);
+
+  // Whether the sensor considers flow active; slots closed while it is,
+  // with or without pulses, count towards the average
+  void setFlowing(bool flowing);
+
+  // Start the peak and average again
+  void resetDaily();
+
+  float getCurrentGpm() const;
+  float getPeakGpm() const;     // Highest current rate since the daily reset
+  float getAverageGpm() const;  // Volume over time flow was active since the daily reset
+
+  static const unsigned long SLOT_MILLIS = 250;
+  static const size_t MAX_SLOTS = 16;
+  static const unsigned long MAX_WINDOW_MILLIS = SLOT_MILLIS * MAX_SLOTS;
+
+private:
+  float _gallonsPerPulse;
+  size_t _windowSlots;
+  float _smoothing;
+
+  // Closed slot counts, written in a ring; the window is the newest _windowSlots
+  uint32_t _slots[MAX_SLOTS];
+  size_t _next;
+  uint32_t _windowPulses;
+  uint32_t _openPulses;
+  uint32_t _slotStart;
+  uint32_t _lastSampleTime;
+  bool _started;
+
+  // Outputs, in pulses per second until they are read
+  float _currentPps;
+  float _peakPps;
+  bool _flowing;
+  uint64_t _flowingPulses;
+  uint32_t _flowingSlots;
+  uint32_t _idleSlots;    // Empty slots since the last pulse while flowing
+
+  static const uint32_t SLOT_MICROS = SLOT_MILLIS * 1000;
+
+  void closeSlot();
+  void addFlowingSlots(uint32_t pulses, uint32_t slots);
+  void clearWindow();
+  float toGpm(float pulsesPerSecond) const;
+};
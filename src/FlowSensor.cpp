@@ -1,201 +1,412 @@
-#include "FlowSensor.h"
-#include "Storage.h"
-
-// Initialize static members
-volatile unsigned long FlowSensor::_customerPulseCount = 0;
-volatile unsigned long FlowSensor::_technicalPulseCount = 0;
-volatile bool FlowSensor::_pulseDetected = false;
-FlowSensor* FlowSensor::_instance = nullptr;
-
-FlowSensor::FlowSensor(int sensorPin, int ledPin, float pulsesPerGallon) :
-  _sensorPin(sensorPin),
-  _ledPin(ledPin),
-  _pulsesPerGallon(pulsesPerGallon),
-  _gallonsPerPulse(1.0 / pulsesPerGallon),
-  _lastCustomerPulseCount(0),
-  _lastTechnicalPulseCount(0),
-  _flowActive(false),
-  _flowStartPulse(0),
-  _inactivityTimer(0),
-  _lastCheckTime(0),
-  _accumulatedGallons(0.0),
-  _lifetimeGallons(0.0),
-  _dailyGallonsTotal(0.0),
-  _flowEventsToday(0),
-  _hoursElapsed(0)
-{
-  _instance = this; // Store instance for static callbacks
-}
-
-void FlowSensor::begin() {
-  pinMode(_sensorPin, INPUT_PULLUP);
-  pinMode(_ledPin, OUTPUT);
-  
-  // Load persistent values from EEPROM
-  _lifetimeGallons = Storage::loadLifetimeGallons();
-  _dailyGallonsTotal = Storage::loadDailyGallons();
-  _flowEventsToday = Storage::loadFlowEvents();
-  _hoursElapsed = Storage::loadHoursElapsed();
-  
-  // Set up the interrupt
-  attachInterrupt(_sensorPin, FlowSensor::pulseCounterStatic, FALLING);
-  
-  Serial.printlnf("Flow meter initialized with %.1f pulses per gallon", _pulsesPerGallon);
-  Serial.printlnf("Lifetime gallons from storage: %.2f", _lifetimeGallons);
-}
-
-void FlowSensor::update() {
-  // Handle any pending pulse indication (LED control)
-  if (_pulseDetected) {
-    digitalWrite(_ledPin, HIGH);
-    _pulseDetected = false;
-  }
-  
-  // Check flow status
-  unsigned long currentTime = millis();
-  
-  // Check flow rate at regular intervals
-  if (currentTime - _lastCheckTime >= FLOW_CHECK_INTERVAL) {
-    checkFlow(currentTime);
-    
-    // Turn off LED if no flow (LED would be turned on by interrupt if there's flow)
-    if (!_flowActive) {
-      digitalWrite(_ledPin, LOW);
-    }
-  }
-}
-
-void FlowSensor::checkFlow(unsigned long currentTime) {
-  _lastCheckTime = currentTime;
-  
-  // Calculate pulses in the last interval
-  unsigned long newCustomerPulses = _customerPulseCount - _lastCustomerPulseCount;
-  _lastCustomerPulseCount = _customerPulseCount;
-  _lastTechnicalPulseCount = _technicalPulseCount;
-  
-  // Use customer counter for flow detection
-  if (newCustomerPulses > MIN_PULSE_THRESHOLD) {
-    // Significant flow detected
-    handleFlowStart(newCustomerPulses);
-    _inactivityTimer = currentTime;
-  } else {
-    // Check if flow has stopped after being active
-    if (_flowActive && (currentTime - _inactivityTimer >= FLOW_TIMEOUT)) {
-      handleFlowEnd(currentTime);
-    }
-  }
-  
-  // Debug output - can be disabled in production for power savings
-  float customerGallons = _customerPulseCount * _gallonsPerPulse;
-  float technicalGallons = _technicalPulseCount * _gallonsPerPulse;
-  Serial.printlnf("Customer: %lu (%.2f gal), Technical: %lu (%.2f gal)", 
-                 _customerPulseCount, customerGallons, 
-                 _technicalPulseCount, technicalGallons);
-}
-
-void FlowSensor::handleFlowStart(unsigned long newCustomerPulses) {
-  if (!_flowActive) {
-    // Flow just started
-    _flowActive = true;
-    _flowStartPulse = _customerPulseCount - newCustomerPulses;
-    _flowEventsToday++;
-    Serial.println("Flow started");
-  }
-}
-
-void FlowSensor::handleFlowEnd(unsigned long currentTime) {
-  // Flow has been inactive for timeout period
-  float gallons = (_customerPulseCount - _flowStartPulse) * _gallonsPerPulse;
-  
-  if (gallons > MIN_GALLONS_THRESHOLD) {
-    // Add to accumulated total
-    _accumulatedGallons += gallons;
-    
-    // Update daily total
-    _dailyGallonsTotal += gallons;
-    
-    // Update lifetime gallons
-    _lifetimeGallons += gallons;
-    
-    // Save to EEPROM
-    Storage::saveDailyGallons(_dailyGallonsTotal);
-    Storage::saveLifetimeGallons(_lifetimeGallons);
-    Storage::saveFlowEvents(_flowEventsToday);
-    
-    Serial.printlnf("Flow ended. Added: %.2f gallons. Accumulated: %.2f gallons", 
-                   gallons, _accumulatedGallons);
-    Serial.printlnf("Daily total: %.2f gallons", _dailyGallonsTotal);
-    Serial.printlnf("Lifetime gallons: %.2f", _lifetimeGallons);
-  }
-  
-  // Reset for next flow event
-  _flowActive = false;
-  Serial.printlnf("Flow ended. Total: %.2f gallons", gallons);
-}
-
-void FlowSensor::performDailyReset() {
-  _dailyGallonsTotal = 0.0;
-  _flowEventsToday = 0;
-  _hoursElapsed = 0;
-  
-  // Save to EEPROM
-  Storage::saveDailyGallons(_dailyGallonsTotal);
-  Storage::saveFlowEvents(_flowEventsToday);
-  Storage::saveHoursElapsed(_hoursElapsed);
-  
-  // Reset customer pulse counter (technical counter keeps running)
-  _customerPulseCount = 0;
-  _lastCustomerPulseCount = 0;
-  
-  Serial.println("Flow sensor daily counters reset");
-}
-
-// Static pulse counter function for interrupt
-void FlowSensor::pulseCounterStatic() {
-  // Simply increment the counters, defer other processing to the main loop
-  _customerPulseCount++;
-  _technicalPulseCount++;
-  _pulseDetected = true;
-}
-
-// Getters
-float FlowSensor::getAccumulatedGallons() const {
-  return _accumulatedGallons;
-}
-
-float FlowSensor::getDailyGallonsTotal() const {
-  return _dailyGallonsTotal;
-}
-
-float FlowSensor::getLifetimeGallons() const {
-  return _lifetimeGallons;
-}
-
-int FlowSensor::getFlowEventsToday() const {
-  return _flowEventsToday;
-}
-
-unsigned long FlowSensor::getCustomerPulseCount() const {
-  return _customerPulseCount;
-}
-
-unsigned long FlowSensor::getTechnicalPulseCount() const {
-  return _technicalPulseCount;
-}
-
-bool FlowSensor::isFlowActive() const {
-  return _flowActive;
-}
-
-void FlowSensor::resetAccumulatedGallons() {
-  _accumulatedGallons = 0.0;
-}
-
-int FlowSensor::getHoursElapsed() const {
-  return _hoursElapsed;
-}
-
-void FlowSensor::incrementHoursElapsed() {
-  _hoursElapsed++;
-  Storage::saveHoursElapsed(_hoursElapsed);
+#include "FlowSensor.h"
+#include "FlowHistory.h"
+#include "FlowAnalyzer.h"
+#include "Storage.h"
+#include "Volume.h"
+#include "Checksum.h"
+#include "DeferredLog.h"
+#include "FlowChannels.h"
+#include "RetainedRam.h"
+
+// The flow event in progress on each meter, checkpointed to retained RAM
+// (checked by CRC) whenever its pulse count moves. Totals are only committed
+// when an event ends, so this lets a reset mid-fill still credit the water
+// measured.
+namespace {
+
+const uint32_t EVENT_CHECKPOINT_MAGIC = 0x45564E54;  // "EVNT"
+
+struct EventCheckpoint {
+  uint32_t magic;
+  uint32_t active;
+  uint32_t pulses;  // Pulses since the event started
+  uint32_t crc;
+};
+
+retained EventCheckpoint eventCheckpoints[FLOW_CHANNELS];
+static_assert(sizeof(eventCheckpoints) <= RETAINED_EVENT_CHECKPOINT_BYTES,
+              "Retained event checkpoints are over their RetainedRam.h budget");
+
+// Meters beyond the table get a checkpoint that doesn't survive a reset
+EventCheckpoint unretainedCheckpoint;
+
+EventCheckpoint& eventCheckpoint(int channel) {
+  return (channel >= 0 && channel < FLOW_CHANNELS) ? eventCheckpoints[channel] : unretainedCheckpoint;
+}
+
+uint32_t eventCheckpointCrc(const EventCheckpoint& checkpoint) {
+  return Checksum::crc32(reinterpret_cast<const uint8_t*>(&checkpoint), offsetof(EventCheckpoint, crc));
+}
+
+void sealEventCheckpoint(EventCheckpoint& checkpoint) {
+  checkpoint.magic = EVENT_CHECKPOINT_MAGIC;
+  checkpoint.crc = eventCheckpointCrc(checkpoint);
+}
+
+} // namespace
+
+FlowSensor::FlowSensor(PulseSource* pulseSource, int ledPin, float pulsesPerGallon, int channel, 
+                       const char* name) :
+  _pulseSource(pulseSource),
+  _ledPin(ledPin),
+  _pulsesPerGallon(pulsesPerGallon),
+  _channel(channel),
+  _name(name),
+  _pulsesPerKiloGallon((uint32_t)lroundf(pulsesPerGallon * 1000.0f)),
+  _customerPulseBase(0),
+  _lastTechnicalPulseCount(0),
+  _rate(pulsesPerGallon),
+  _lastRateSampleCount(0),
+  _history(nullptr),
+  _historyPulseCount(0),
+  _historyRemainder(0),
+  _analyzer(nullptr),
+  _flowActive(false),
+  _flowStartPulse(0),
+  _inactivityTimer(0),
+  _lastCheckTime(0),
+  _accumulatedMilliGallons(0),
+  _lifetimeMilliGallons(0),
+  _dailyMilliGallons(0),
+  _flowEventsToday(0),
+  _hoursElapsed(0),
+  _recoveredMilliGallons(0)
+{
+}
+
+void FlowSensor::begin() {
+  if (_ledPin >= 0) {
+    pinMode(_ledPin, OUTPUT);
+  }
+  
+  // Load persistent values from EEPROM
+  _lifetimeMilliGallons = Storage::loadLifetimeMilliGallons(_channel);
+  _dailyMilliGallons = Storage::loadDailyMilliGallons(_channel);
+  _flowEventsToday = Storage::loadFlowEvents(_channel);
+  _hoursElapsed = Storage::loadHoursElapsed();
+  
+  // Start counting pulses
+  _pulseSource->begin();
+  _lastRateSampleCount = _pulseSource->readPulseCount();
+  _historyPulseCount = _lastRateSampleCount;
+  
+  // Credit a flow event cut short by a reset
+  recoverEvent();
+  
+  Serial.printlnf("Flow meter %s (channel %d) initialized with %.1f pulses per gallon (%s pulse source)", 
+                 _name, _channel, _pulsesPerGallon, _pulseSource->getName());
+  char gallons[24];
+  Serial.printlnf("Lifetime gallons from storage: %s", 
+                 Volume::format(gallons, sizeof(gallons), _lifetimeMilliGallons, 2));
+}
+
+void FlowSensor::update() {
+  // Handle any pending pulse indication (LED control)
+  if (_pulseSource->takePulseDetected() && _ledPin >= 0) {
+    digitalWrite(_ledPin, HIGH);
+  }
+  
+  // Update the flow rate every pass so timestamps never pile up between checks
+  updateFlowRate();
+  
+  if (_history) {
+    updateHistory();
+  }
+  
+  if (_analyzer) {
+    _analyzer->update(millis());
+  }
+  
+  if (_flowActive) {
+    checkpointEvent();
+  }
+  
+  // Check flow status
+  unsigned long currentTime = millis();
+  
+  // Check flow rate at regular intervals
+  if (currentTime - _lastCheckTime >= FLOW_CHECK_INTERVAL) {
+    checkFlow(currentTime);
+    
+    // Turn off LED if no flow (LED would be turned on by interrupt if there's flow)
+    if (!_flowActive && _ledPin >= 0) {
+      digitalWrite(_ledPin, LOW);
+    }
+  }
+}
+
+void FlowSensor::checkFlow(unsigned long currentTime) {
+  _lastCheckTime = currentTime;
+  
+  // Calculate pulses in the last interval from a single snapshot
+  unsigned long pulseCount = snapshotPulseCount();
+  unsigned long newPulses = pulseCount - _lastTechnicalPulseCount;
+  _lastTechnicalPulseCount = pulseCount;
+  
+  if (newPulses > MIN_PULSE_THRESHOLD) {
+    // Significant flow detected
+    handleFlowStart(pulseCount, newPulses);
+    _inactivityTimer = currentTime;
+  } else {
+    // Check if flow has stopped after being active
+    if (_flowActive && (currentTime - _inactivityTimer >= FLOW_TIMEOUT)) {
+      handleFlowEnd();
+    }
+  }
+  
+  // Debug output, compiled in with DLOG_LEVEL at trace
+  DLOG_TRACE("%s customer: %lu (%.2V gal), technical: %lu (%.2V gal)", 
+             _name, pulseCount - _customerPulseBase, 
+             DeferredLog::gallons(pulsesToMilliGallons(pulseCount - _customerPulseBase)), 
+             pulseCount, DeferredLog::gallons(pulsesToMilliGallons(pulseCount)));
+}
+
+unsigned long FlowSensor::snapshotPulseCount() const {
+  return _pulseSource->readPulseCount();
+}
+
+uint64_t FlowSensor::pulsesToMilliGallons(uint64_t pulses) const {
+  // Rounded to the nearest milli-gallon, all in integer math
+  return (pulses * 1000000ULL + _pulsesPerKiloGallon / 2) / _pulsesPerKiloGallon;
+}
+
+void FlowSensor::updateFlowRate() {
+  if (_pulseSource->hasTimestamps()) {
+    // Drain per-pulse timestamps in batches
+    uint32_t timestamps[DRAIN_BATCH_SIZE];
+    size_t count;
+    while ((count = _pulseSource->drainTimestamps(timestamps, DRAIN_BATCH_SIZE)) > 0) {
+      for (size_t i = 0; i < count; i++) {
+        addRateSample(timestamps[i], 1);
+      }
+    }
+  } else {
+    // Hardware-counted pulses: sample the total once per pass
+    unsigned long pulseCount = snapshotPulseCount();
+    if (pulseCount != _lastRateSampleCount) {
+      addRateSample(micros(), pulseCount - _lastRateSampleCount);
+      _lastRateSampleCount = pulseCount;
+    }
+  }
+  
+  // Close finished slots, so the rate falls to zero once pulses stop
+  _rate.advance(micros());
+}
+
+void FlowSensor::updateHistory() {
+  // Close finished buckets first, so new volume lands in the current one
+  _history->update();
+  
+  unsigned long pulseCount = snapshotPulseCount();
+  unsigned long newPulses = pulseCount - _historyPulseCount;
+  if (newPulses == 0) {
+    return;
+  }
+  _historyPulseCount = pulseCount;
+  
+  uint64_t scaled = (uint64_t)newPulses * 1000000ULL + _historyRemainder;
+  _historyRemainder = (uint32_t)(scaled % _pulsesPerKiloGallon);
+  _history->addMilliGallons((uint32_t)(scaled / _pulsesPerKiloGallon));
+}
+
+void FlowSensor::addRateSample(uint32_t timestamp, unsigned long pulses) {
+  _rate.addPulses(timestamp, pulses);
+  if (_analyzer) {
+    _analyzer->addPulses(timestamp, pulses);
+  }
+}
+
+void FlowSensor::handleFlowStart(unsigned long pulseCount, unsigned long newPulses) {
+  if (!_flowActive) {
+    // Flow just started
+    _flowActive = true;
+    _rate.setFlowing(true);
+    _flowStartPulse = pulseCount - newPulses;
+    _flowEventsToday++;
+    checkpointEvent();
+    DLOG_INFO("Flow started on %s", _name);
+  }
+}
+
+void FlowSensor::handleFlowEnd() {
+  // Flow has been inactive for timeout period
+  uint64_t milliGallons = pulsesToMilliGallons(snapshotPulseCount() - _flowStartPulse);
+  
+  if (milliGallons > MIN_EVENT_MILLIGALLONS) {
+    commitEvent(milliGallons);
+    
+    DLOG_INFO("Flow ended on %s. Added: %.2V gallons. Accumulated: %.2V gallons", 
+              _name, DeferredLog::gallons(milliGallons), DeferredLog::gallons(_accumulatedMilliGallons));
+    DLOG_INFO("Daily total: %.2V gallons", DeferredLog::gallons(_dailyMilliGallons));
+    DLOG_INFO("Lifetime gallons: %.2V", DeferredLog::gallons(_lifetimeMilliGallons));
+  }
+  
+  // Reset for next flow event
+  _flowActive = false;
+  _rate.setFlowing(false);
+  EventCheckpoint& checkpoint = eventCheckpoint(_channel);
+  checkpoint.active = 0;
+  sealEventCheckpoint(checkpoint);
+  DLOG_INFO("Flow ended on %s. Total: %.2V gallons", _name, DeferredLog::gallons(milliGallons));
+}
+
+void FlowSensor::commitEvent(uint64_t milliGallons) {
+  // Add to the accumulated, daily and lifetime totals
+  _accumulatedMilliGallons += milliGallons;
+  _dailyMilliGallons += milliGallons;
+  _lifetimeMilliGallons += milliGallons;
+  
+  // Save to EEPROM
+  Storage::saveDailyMilliGallons(_dailyMilliGallons, _channel);
+  Storage::saveLifetimeMilliGallons(_lifetimeMilliGallons, _channel);
+  Storage::saveFlowEvents(_flowEventsToday, _channel);
+}
+
+void FlowSensor::checkpointEvent() {
+  // A few words of retained RAM, no EEPROM traffic
+  EventCheckpoint& checkpoint = eventCheckpoint(_channel);
+  uint32_t pulses = snapshotPulseCount() - _flowStartPulse;
+  if (checkpoint.active && checkpoint.pulses == pulses) {
+    return;
+  }
+  checkpoint.active = 1;
+  checkpoint.pulses = pulses;
+  sealEventCheckpoint(checkpoint);
+}
+
+void FlowSensor::recoverEvent() {
+  EventCheckpoint& checkpoint = eventCheckpoint(_channel);
+  if (checkpoint.magic == EVENT_CHECKPOINT_MAGIC && checkpoint.crc == eventCheckpointCrc(checkpoint) &&
+      checkpoint.active) {
+    // The pulse counter restarted at zero, so the event ends here with what
+    // it had measured; the event itself was never saved
+    uint64_t milliGallons = pulsesToMilliGallons(checkpoint.pulses);
+    if (milliGallons > MIN_EVENT_MILLIGALLONS) {
+      _flowEventsToday++;
+      commitEvent(milliGallons);
+      _recoveredMilliGallons = milliGallons;
+      
+      char recovered[24];
+      Serial.printlnf("Recovered %s gallons on %s from a flow event interrupted by a reset", 
+                     Volume::format(recovered, sizeof(recovered), milliGallons, 2), _name);
+    }
+  }
+  
+  checkpoint.active = 0;
+  checkpoint.pulses = 0;
+  sealEventCheckpoint(checkpoint);
+}
+
+void FlowSensor::performDailyReset() {
+  _dailyMilliGallons = 0;
+  _flowEventsToday = 0;
+  _hoursElapsed = 0;
+  _rate.resetDaily();
+  if (_analyzer) {
+    _analyzer->performDailyReset();
+  }
+  
+  // Save to EEPROM
+  Storage::saveDailyMilliGallons(_dailyMilliGallons, _channel);
+  Storage::saveFlowEvents(_flowEventsToday, _channel);
+  Storage::saveHoursElapsed(_hoursElapsed);
+  
+  // Rebase the customer counter; the ISR counter itself keeps running
+  _customerPulseBase = snapshotPulseCount();
+  
+  DLOG_INFO("Flow sensor %s daily counters reset", _name);
+}
+
+void FlowSensor::setRateResponse(unsigned long windowMs, float smoothing) {
+  _rate.configure(windowMs, smoothing);
+}
+
+void FlowSensor::setHistory(FlowHistory* history) {
+  _history = history;
+}
+
+FlowHistory* FlowSensor::getHistory() const {
+  return _history;
+}
+
+void FlowSensor::setAnalyzer(FlowAnalyzer* analyzer) {
+  _analyzer = analyzer;
+}
+
+FlowAnalyzer* FlowSensor::getAnalyzer() const {
+  return _analyzer;
+}
+
+int FlowSensor::getChannel() const {
+  return _channel;
+}
+
+const char* FlowSensor::getName() const {
+  return _name;
+}
+
+PulseSource* FlowSensor::getPulseSource() const {
+  return _pulseSource;
+}
+
+// Getters
+uint64_t FlowSensor::getAccumulatedMilliGallons() const {
+  return _accumulatedMilliGallons;
+}
+
+uint64_t FlowSensor::getDailyMilliGallons() const {
+  return _dailyMilliGallons;
+}
+
+uint64_t FlowSensor::getLifetimeMilliGallons() const {
+  return _lifetimeMilliGallons;
+}
+
+int FlowSensor::getFlowEventsToday() const {
+  return _flowEventsToday;
+}
+
+unsigned long FlowSensor::getCustomerPulseCount() const {
+  return snapshotPulseCount() - _customerPulseBase;
+}
+
+unsigned long FlowSensor::getTechnicalPulseCount() const {
+  return snapshotPulseCount();
+}
+
+float FlowSensor::getCurrentGpm() const {
+  return _rate.getCurrentGpm();
+}
+
+float FlowSensor::getPeakGpm() const {
+  return _rate.getPeakGpm();
+}
+
+float FlowSensor::getAverageGpm() const {
+  return _rate.getAverageGpm();
+}
+
+unsigned long FlowSensor::getPulseRingOverflows() const {
+  return _pulseSource->getOverflowCount();
+}
+
+bool FlowSensor::isFlowActive() const {
+  return _flowActive;
+}
+
+uint64_t FlowSensor::getRecoveredMilliGallons() const {
+  return _recoveredMilliGallons;
+}
+
+void FlowSensor::resetAccumulatedGallons() {
+  _accumulatedMilliGallons = 0;
+}
+
+int FlowSensor::getHoursElapsed() const {
+  return _hoursElapsed;
+}
+
+void FlowSensor::incrementHoursElapsed() {
+  _hoursElapsed++;
+  Storage::saveHoursElapsed(_hoursElapsed);
 } 
\ No newline at end of file
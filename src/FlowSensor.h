@@ -1,76 +1,124 @@
-#pragma once
-
-#include "Particle.h"
-
-class FlowSensor {
-public:
-  FlowSensor(int sensorPin, int ledPin, float pulsesPerGallon);
-  
-  // Initialization
-  void begin();
-  
-  // To be called in main loop
-  void update();
-  
-  // Check and handle flow events
-  void checkFlow(unsigned long currentTime);
-  
-  // Reset daily counters
-  void performDailyReset();
-  
-  // Getters for various counters
-  float getAccumulatedGallons() const;
-  float getDailyGallonsTotal() const;
-  float getLifetimeGallons() const;
-  int getFlowEventsToday() const;
-  unsigned long getCustomerPulseCount() const;
-  unsigned long getTechnicalPulseCount() const;
-  bool isFlowActive() const;
-  void resetAccumulatedGallons();
-  int getHoursElapsed() const;
-  void incrementHoursElapsed();
-  
-  // Static pulse counter for interrupt
-  static void pulseCounterStatic();
-  
-private:
-  // Configuration
-  int _sensorPin;
-  int _ledPin;
-  float _pulsesPerGallon;
-  float _gallonsPerPulse; // Pre-calculated inverse for optimization
-  
-  // Pulse counting
-  volatile static unsigned long _customerPulseCount;
-  volatile static unsigned long _technicalPulseCount;
-  volatile static bool _pulseDetected;
-  unsigned long _lastCustomerPulseCount;
-  unsigned long _lastTechnicalPulseCount;
-  
-  // Flow tracking
-  bool _flowActive;
-  unsigned long _flowStartPulse;
-  unsigned long _inactivityTimer;
-  unsigned long _lastCheckTime;
-  
-  // Counters
-  float _accumulatedGallons;
-  float _lifetimeGallons;
-  float _dailyGallonsTotal;
-  int _flowEventsToday;
-  int _hoursElapsed;
-  
-  // Constants
-  const unsigned long FLOW_CHECK_INTERVAL = 5000;  // 5 seconds
-  const unsigned long FLOW_TIMEOUT = 20000;        // 20 seconds
-  const unsigned int MIN_PULSE_THRESHOLD = 5;      // Min pulses to consider flow active
-  const float MIN_GALLONS_THRESHOLD = 0.05;        // Min gallons to record
-  
-  // Helper methods
-  void handleFlowStart(unsigned long newCustomerPulses);
-  void handleFlowEnd(unsigned long currentTime);
-  void updateLedStatus();
-  
-  // Static instance reference for interrupt handling
-  static FlowSensor* _instance;
+#pragma once
+
+#include "Particle.h"
+#include "PulseSource.h"
+#include "FlowRate.h"
+
+class FlowHistory;
+class FlowAnalyzer;
+
+// One meter. A device can have several (fill, backwash, makeup lines), each
+// with its own pulse source and calibration; the channel picks its slots in
+// EEPROM and retained RAM, and names it in reports. Channel 0 is the primary
+// meter that the display, leak detector and low-power logic follow.
+class FlowSensor {
+public:
+  FlowSensor(PulseSource* pulseSource, int ledPin, float pulsesPerGallon, int channel = 0, 
+             const char* name = "fill");
+  
+  // Initialization
+  void begin();
+  
+  // To be called in main loop
+  void update();
+  
+  // Check and handle flow events
+  void checkFlow(unsigned long currentTime);
+  
+  // Reset daily counters
+  void performDailyReset();
+  
+  // Flow rate responsiveness: window (up to FlowRate::MAX_WINDOW_MILLIS) and
+  // EWMA smoothing (0 to 1) over the window rates
+  void setRateResponse(unsigned long windowMs, float smoothing);
+  
+  // Meter volume into a time series as well
+  void setHistory(FlowHistory* history);
+  FlowHistory* getHistory() const;
+  
+  // Stream every pulse, including flow too small to count as an event, to
+  // the leak and sensor-fault detector
+  void setAnalyzer(FlowAnalyzer* analyzer);
+  FlowAnalyzer* getAnalyzer() const;
+  
+  // Meter identity; ledPin -1 is a meter without an activity LED
+  int getChannel() const;
+  const char* getName() const;
+  PulseSource* getPulseSource() const;
+  
+  // Getters for various counters (volumes in milli-gallons)
+  uint64_t getAccumulatedMilliGallons() const;
+  uint64_t getDailyMilliGallons() const;
+  uint64_t getLifetimeMilliGallons() const;
+  int getFlowEventsToday() const;
+  unsigned long getCustomerPulseCount() const;
+  unsigned long getTechnicalPulseCount() const;
+  float getCurrentGpm() const;
+  float getPeakGpm() const;
+  float getAverageGpm() const;  // While flowing, since the daily reset
+  unsigned long getPulseRingOverflows() const;
+  bool isFlowActive() const;
+  uint64_t getRecoveredMilliGallons() const;  // Credited at boot from an interrupted event
+  void resetAccumulatedGallons();
+  int getHoursElapsed() const;
+  void incrementHoursElapsed();
+  
+private:
+  // Configuration
+  PulseSource* _pulseSource;
+  int _ledPin;
+  float _pulsesPerGallon;
+  int _channel;
+  const char* _name;
+  uint32_t _pulsesPerKiloGallon; // Calibration in integer form for volume math
+  
+  // Pulse counting - the pulse source owns the running total; the main loop
+  // only reads it, so daily resets never race the counting hardware or ISR
+  unsigned long _customerPulseBase;   // Pulse count at the last daily reset
+  unsigned long _lastTechnicalPulseCount;
+  
+  // Flow rate from pulse timestamps (or count samples without timestamps)
+  FlowRate _rate;
+  unsigned long _lastRateSampleCount;
+  
+  // Time series fed with every pulse; the remainder keeps the conversion exact
+  FlowHistory* _history;
+  unsigned long _historyPulseCount;
+  uint32_t _historyRemainder;
+  
+  FlowAnalyzer* _analyzer;
+  
+  // Flow tracking
+  bool _flowActive;
+  unsigned long _flowStartPulse;
+  unsigned long _inactivityTimer;
+  unsigned long _lastCheckTime;
+  
+  // Counters
+  uint64_t _accumulatedMilliGallons;
+  uint64_t _lifetimeMilliGallons;
+  uint64_t _dailyMilliGallons;
+  int _flowEventsToday;
+  int _hoursElapsed;
+  uint64_t _recoveredMilliGallons;
+  
+  // Constants
+  const unsigned long FLOW_CHECK_INTERVAL = 5000;  // 5 seconds
+  const unsigned long FLOW_TIMEOUT = 20000;        // 20 seconds
+  const unsigned int MIN_PULSE_THRESHOLD = 5;      // Min pulses to consider flow active
+  const uint32_t MIN_EVENT_MILLIGALLONS = 50;      // Min volume to record (0.05 gal)
+  static const size_t DRAIN_BATCH_SIZE = 32;       // Timestamps copied per drain pass
+  
+  // Helper methods
+  unsigned long snapshotPulseCount() const;
+  uint64_t pulsesToMilliGallons(uint64_t pulses) const;
+  void updateFlowRate();
+  void updateHistory();
+  void addRateSample(uint32_t timestamp, unsigned long pulses);
+  void handleFlowStart(unsigned long pulseCount, unsigned long newPulses);
+  void handleFlowEnd();
+  void commitEvent(uint64_t milliGallons);
+  void checkpointEvent();
+  void recoverEvent();
+  void updateLedStatus();
 }; 
\ No newline at end of file
@@ -0,0 +1,80 @@
+#include "InterruptPulseSource.h"
+
+// Initialize static members
+InterruptPulseSource::Channel InterruptPulseSource::_channels[InterruptPulseSource::MAX_CHANNELS];
+int InterruptPulseSource::_channelCount = 0;
+
+static_assert(InterruptPulseSource::MAX_CHANNELS == 3, "one trampoline per channel");
+const raw_interrupt_handler_t InterruptPulseSource::TRAMPOLINES[InterruptPulseSource::MAX_CHANNELS] = {
+  InterruptPulseSource::pulseTrampoline<0>,
+  InterruptPulseSource::pulseTrampoline<1>,
+  InterruptPulseSource::pulseTrampoline<2>
+};
+
+InterruptPulseSource::InterruptPulseSource(int sensorPin) :
+  _sensorPin(sensorPin),
+  _channel(_channelCount < MAX_CHANNELS ? _channelCount++ : -1)
+{
+}
+
+void InterruptPulseSource::begin() {
+  pinMode(_sensorPin, INPUT_PULLUP);
+  if (_channel < 0) {
+    Serial.printlnf("No interrupt channel left for pin %d", _sensorPin);
+    return;
+  }
+  attachInterrupt(_sensorPin, TRAMPOLINES[_channel], FALLING);
+}
+
+unsigned long InterruptPulseSource::readPulseCount() const {
+  if (_channel < 0) {
+    return 0;
+  }
+  unsigned long pulseCount = 0;
+  ATOMIC_BLOCK() {
+    pulseCount = _channels[_channel].pulseCount;
+  }
+  return pulseCount;
+}
+
+bool InterruptPulseSource::hasTimestamps() const {
+  return true;
+}
+
+size_t InterruptPulseSource::drainTimestamps(uint32_t* out, size_t maxCount) {
+  return _channel >= 0 ? _channels[_channel].pulseRing.drain(out, maxCount) : 0;
+}
+
+bool InterruptPulseSource::takePulseDetected() {
+  if (_channel >= 0 && _channels[_channel].pulseDetected) {
+    _channels[_channel].pulseDetected = false;
+    return true;
+  }
+  return false;
+}
+
+void InterruptPulseSource::creditWakePulse() {
+  // Masked so the main loop can stand in for the ISR as the ring's producer
+  if (_channel >= 0) {
+    ATOMIC_BLOCK() {
+      countPulse(_channel);
+    }
+  }
+}
+
+unsigned long InterruptPulseSource::getOverflowCount() const {
+  return _channel >= 0 ? _channels[_channel].pulseRing.getOverflowCount() : 0;
+}
+
+const char* InterruptPulseSource::getName() const {
+  return "interrupt";
+}
+
+// Shared by every pin's interrupt
+void InterruptPulseSource::countPulse(int channel) {
+  // Count and timestamp the pulse, defer other processing to the main loop
+  Channel& state = _channels[channel];
+  state.pulseCount++;
+  state.pulseRing.push(micros());
+  state.pulseDetected = true;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "Particle.h"
+#include "PulseSource.h"
+#include "PulseRing.h"
+
+// One CPU interrupt per falling edge: counts and timestamps every pulse.
+// Each instance claims a slot in a static channel table; attachInterrupt()
+// takes a plain function, so every slot has its own trampoline that passes
+// the slot number to the shared handler.
+class InterruptPulseSource : public PulseSource {
+public:
+  InterruptPulseSource(int sensorPin);
+  
+  void begin() override;
+  unsigned long readPulseCount() const override;
+  bool hasTimestamps() const override;
+  size_t drainTimestamps(uint32_t* out, size_t maxCount) override;
+  bool takePulseDetected() override;
+  void creditWakePulse() override;
+  unsigned long getOverflowCount() const override;
+  const char* getName() const override;
+  
+  static const int MAX_CHANNELS = 3;
+  
+private:
+  // ISR-owned state; the main loop only reads the count and drains the ring
+  struct Channel {
+    volatile unsigned long pulseCount;
+    volatile bool pulseDetected;
+    PulseRing pulseRing;
+  };
+  
+  int _sensorPin;
+  int _channel;  // Slot in the table, or -1 when it was full
+  
+  static Channel _channels[MAX_CHANNELS];
+  static int _channelCount;
+  
+  // Interrupt handler for the pin of one slot
+  template <int N>
+  static void pulseTrampoline() { countPulse(N); }
+  static const raw_interrupt_handler_t TRAMPOLINES[MAX_CHANNELS];
+  
+  static void countPulse(int channel);
+};
@@ -0,0 +1,273 @@
+#include "JsonWriter.h"
+
+namespace {
+
+const uint32_t POW10[] = {1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000};
+const int MAX_DECIMALS = 9;
+
+const char HEX_DIGITS[] = "0123456789abcdef";
+
+} // namespace
+
+JsonWriter::JsonWriter(char* buffer, size_t size, bool spaced) :
+  _buffer(buffer),
+  _size(size),
+  _length(0),
+  _members(0),
+  _depth(0),
+  _afterKey(false),
+  _spaced(spaced),
+  _overflowed(size == 0)
+{
+  if (size > 0) {
+    buffer[0] = '\0';
+  }
+}
+
+JsonWriter& JsonWriter::beginObject() {
+  return open('{');
+}
+
+JsonWriter& JsonWriter::endObject() {
+  return close('}');
+}
+
+JsonWriter& JsonWriter::beginArray() {
+  return open('[');
+}
+
+JsonWriter& JsonWriter::endArray() {
+  return close(']');
+}
+
+JsonWriter& JsonWriter::key(const JsonKey& key) {
+  if (separate() && put(key.text, key.length) && put(": ", _spaced ? 2 : 1)) {
+    _afterKey = true;
+  }
+  return *this;
+}
+
+JsonWriter& JsonWriter::key(const char* name) {
+  if (separate() && putEscaped(name) && put(": ", _spaced ? 2 : 1)) {
+    _afterKey = true;
+  }
+  return *this;
+}
+
+JsonWriter& JsonWriter::string(const char* text) {
+  if (separate()) {
+    putEscaped(text);
+  }
+  return *this;
+}
+
+JsonWriter& JsonWriter::number(uint64_t value) {
+  if (separate()) {
+    putDigits(value, 1);
+  }
+  return *this;
+}
+
+JsonWriter& JsonWriter::signedNumber(int64_t value) {
+  if (separate()) {
+    if (value < 0) {
+      if (putChar('-')) {
+        putDigits(0 - (uint64_t)value, 1);
+      }
+    } else {
+      putDigits((uint64_t)value, 1);
+    }
+  }
+  return *this;
+}
+
+JsonWriter& JsonWriter::boolean(bool value) {
+  if (separate()) {
+    if (value) {
+      put("true", 4);
+    } else {
+      put("false", 5);
+    }
+  }
+  return *this;
+}
+
+JsonWriter& JsonWriter::fixed(uint64_t scaled, int decimals) {
+  if (decimals < 0) {
+    decimals = 0;
+  } else if (decimals > MAX_DECIMALS) {
+    decimals = MAX_DECIMALS;
+  }
+
+  if (separate()) {
+    uint32_t unit = POW10[decimals];
+    if (putDigits(scaled / unit, 1) && decimals > 0 && putChar('.')) {
+      putDigits(scaled % unit, decimals);
+    }
+  }
+  return *this;
+}
+
+JsonWriter& JsonWriter::milli(uint64_t thousandths, int decimals) {
+  if (decimals < 0) {
+    decimals = 0;
+  } else if (decimals > 3) {
+    decimals = 3;
+  }
+  uint32_t step = POW10[3 - decimals];
+  return fixed((thousandths + step / 2) / step, decimals);
+}
+
+JsonWriter::Mark JsonWriter::mark() const {
+  Mark mark;
+  mark.length = _length;
+  mark.members = _members;
+  mark.depth = _depth;
+  mark.afterKey = _afterKey;
+  return mark;
+}
+
+void JsonWriter::rewind(const Mark& mark) {
+  if (_size == 0) {
+    return;
+  }
+  _length = mark.length;
+  _members = mark.members;
+  _depth = mark.depth;
+  _afterKey = mark.afterKey;
+  _overflowed = false;
+  _buffer[_length] = '\0';
+}
+
+bool JsonWriter::overflowed() const {
+  return _overflowed;
+}
+
+size_t JsonWriter::length() const {
+  return _length;
+}
+
+const char* JsonWriter::c_str() const {
+  return _size > 0 ? _buffer : "";
+}
+
+bool JsonWriter::put(const char* data, size_t length) {
+  // Room for the data, a closing bracket per open container and the NUL
+  if (_overflowed || _length + length + _depth + 1 > _size) {
+    _overflowed = true;
+    return false;
+  }
+  memcpy(_buffer + _length, data, length);
+  _length += length;
+  _buffer[_length] = '\0';
+  return true;
+}
+
+bool JsonWriter::putChar(char c) {
+  return put(&c, 1);
+}
+
+bool JsonWriter::separate() {
+  if (_afterKey) {
+    _afterKey = false;
+    return !_overflowed;
+  }
+  uint32_t bit = 1UL << _depth;
+  if (_members & bit) {
+    return put(", ", _spaced ? 2 : 1);
+  }
+  _members |= bit;
+  return !_overflowed;
+}
+
+JsonWriter& JsonWriter::open(char bracket) {
+  if (_depth + 1 >= MAX_DEPTH) {
+    _overflowed = true;
+    return *this;
+  }
+  if (!separate()) {
+    return *this;
+  }
+  // The bracket and the reserve for its partner go in together
+  if (_length + 1 + (_depth + 1) + 1 > _size) {
+    _overflowed = true;
+    return *this;
+  }
+  put(&bracket, 1);
+  _depth++;
+  _members &= ~(1UL << _depth);
+  return *this;
+}
+
+JsonWriter& JsonWriter::close(char bracket) {
+  if (_overflowed || _depth == 0) {
+    _overflowed = true;
+    return *this;
+  }
+  // Always fits: the byte was reserved by open()
+  _depth--;
+  _afterKey = false;
+  _buffer[_length++] = bracket;
+  _buffer[_length] = '\0';
+  return *this;
+}
+
+bool JsonWriter::putEscaped(const char* text) {
+  if (text == nullptr) {
+    return put("null", 4);
+  }
+  if (!putChar('"')) {
+    return false;
+  }
+
+  // Runs of plain characters are copied in one go
+  const char* run = text;
+  for (const char* c = text; ; c++) {
+    unsigned char ch = (unsigned char)*c;
+    if (ch != '\0' && ch != '"' && ch != '\\' && ch >= 0x20) {
+      continue;
+    }
+    if (c > run && !put(run, c - run)) {
+      return false;
+    }
+    if (ch == '\0') {
+      break;
+    }
+    // Quotes and backslashes are escaped as such, control characters as \u00XX
+    char escape[6] = {'\\', (char)ch};
+    size_t length = 2;
+    if (ch < 0x20) {
+      escape[1] = 'u';
+      escape[2] = '0';
+      escape[3] = '0';
+      escape[4] = HEX_DIGITS[ch >> 4];
+      escape[5] = HEX_DIGITS[ch & 0xF];
+      length = 6;
+    }
+    if (!put(escape, length)) {
+      return false;
+    }
+    run = c + 1;
+  }
+  return putChar('"');
+}
+
+bool JsonWriter::putDigits(uint64_t value, int minDigits) {
+  // Written backwards into a scratch buffer; 32-bit division while the
+  // value allows, which is most of them
+  char digits[20];
+  int count = 0;
+  while (value > 0xFFFFFFFFULL) {
+    digits[sizeof(digits) - 1 - count++] = (char)('0' + value % 10);
+    value /= 10;
+  }
+  uint32_t small = (uint32_t)value;
+  do {
+    digits[sizeof(digits) - 1 - count++] = (char)('0' + small % 10);
+    small /= 10;
+  } while (small > 0);
+  while (count < minDigits && count < (int)sizeof(digits)) {
+    digits[sizeof(digits) - 1 - count++] = '0';
+  }
+  return put(digits + sizeof(digits) - count, count);
+}
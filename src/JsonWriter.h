@@ -0,0 +1,88 @@
+#pragma once
+
+#include "Particle.h"
+
+// A key name quoted at compile time, so writing it is one copy with no
+// length scan or escaping
+struct JsonKey {
+  const char* text;
+  size_t length;
+};
+
+#define JSON_KEY(name) (JsonKey{"\"" name "\"", sizeof("\"" name "\"") - 1})
+
+// Streams JSON into a caller's buffer without allocating. Commas and
+// separators are written automatically; every open object or array keeps a
+// byte reserved for its closing bracket, so the output can always be closed.
+// A write that doesn't fit sets overflowed() and turns every later write into
+// a no-op; mark() and rewind() let a caller drop the part that didn't fit (a
+// record, an optional section) and close what it has.
+//
+//   JsonWriter json(buffer, sizeof(buffer));
+//   json.beginObject().key(KEY_TIMESTAMP).number(timestamp).key(KEY_GALLONS).milli(milliGallons, 2).endObject();
+//   if (json.overflowed()) ...
+class JsonWriter {
+public:
+  struct Mark {
+    size_t length;
+    uint32_t members;
+    uint8_t depth;
+    bool afterKey;
+  };
+
+  // spaced writes ": " and ", " between members, for readers that expect it
+  JsonWriter(char* buffer, size_t size, bool spaced = false);
+
+  JsonWriter& beginObject();
+  JsonWriter& endObject();
+  JsonWriter& beginArray();
+  JsonWriter& endArray();
+
+  // Member names: from a key table, or escaped at runtime
+  JsonWriter& key(const JsonKey& key);
+  JsonWriter& key(const char* name);
+
+  // Values
+  JsonWriter& string(const char* text);
+  JsonWriter& number(uint64_t value);
+  JsonWriter& signedNumber(int64_t value);
+  JsonWriter& boolean(bool value);
+
+  // Fixed point: scaled is in units of 10^-decimals (fixed(1234, 2) is 12.34)
+  JsonWriter& fixed(uint64_t scaled, int decimals);
+
+  // Thousandths (milli-gallons, milli-gpm) with 0-3 decimals, rounded half
+  // up like Volume::format
+  JsonWriter& milli(uint64_t thousandths, int decimals);
+
+  Mark mark() const;
+  void rewind(const Mark& mark);
+
+  bool overflowed() const;
+  size_t length() const;
+  const char* c_str() const;
+
+private:
+  static const uint8_t MAX_DEPTH = 16;
+
+  char* _buffer;
+  size_t _size;
+  size_t _length;
+  uint32_t _members;  // Bit per depth: the container has an element
+  uint8_t _depth;
+  bool _afterKey;
+  bool _spaced;
+  bool _overflowed;
+
+  // Write bytes if they fit ahead of the reserved closing brackets
+  bool put(const char* data, size_t length);
+  bool putChar(char c);
+
+  // Comma before an element after the first; nothing right after a key
+  bool separate();
+
+  JsonWriter& open(char bracket);
+  JsonWriter& close(char bracket);
+  bool putEscaped(const char* text);
+  bool putDigits(uint64_t value, int minDigits);
+};
@@ -0,0 +1,186 @@
+#include "LatencyProfile.h"
+
+#if LATENCY_PROFILE
+
+#include "CompactPayload.h"
+
+#include <limits.h>
+
+LatencyProfile::Probe LatencyProfile::_probes[LatencyProfile::MAX_PROBES];
+int LatencyProfile::_probeCount = 0;
+int LatencyProfile::_worstProbe = -1;
+uint32_t LatencyProfile::_worstMicros = 0;
+uint32_t LatencyProfile::_lastCheckin = 0;
+bool LatencyProfile::_checkedIn = false;
+uint32_t LatencyProfile::_maxCheckinGap = 0;
+
+int LatencyProfile::probe(const char* name) {
+  for (int id = 0; id < _probeCount; id++) {
+    if (strcmp(_probes[id].name, name) == 0) {
+      return id;
+    }
+  }
+  if (_probeCount >= MAX_PROBES) {
+    Serial.printlnf("Latency: no room for probe %s", name);
+    return -1;
+  }
+
+  Probe& probe = _probes[_probeCount];
+  memset(&probe, 0, sizeof(probe));
+  probe.name = name;
+  probe.minMicros = UINT32_MAX;
+  return _probeCount++;
+}
+
+void LatencyProfile::record(int id, uint32_t micros, bool ranked) {
+  if (id < 0 || id >= _probeCount) {
+    return;
+  }
+  Probe& probe = _probes[id];
+
+  // Bucket by the position of the highest set bit
+  int bucket = micros ? 32 - __builtin_clz(micros) : 0;
+  probe.buckets[bucket]++;
+  probe.count++;
+  if (micros < probe.minMicros) {
+    probe.minMicros = micros;
+  }
+  if (micros > probe.maxMicros) {
+    probe.maxMicros = micros;
+  }
+  if (ranked && (_worstProbe < 0 || micros > _worstMicros)) {
+    _worstProbe = id;
+    _worstMicros = micros;
+  }
+}
+
+void LatencyProfile::checkin() {
+  uint32_t now = micros();
+  if (_checkedIn && now - _lastCheckin > _maxCheckinGap) {
+    _maxCheckinGap = now - _lastCheckin;
+  }
+  _lastCheckin = now;
+  _checkedIn = true;
+}
+
+void LatencyProfile::reset() {
+  // Probes keep their ids, since call sites cache them
+  for (int id = 0; id < _probeCount; id++) {
+    Probe& probe = _probes[id];
+    probe.count = 0;
+    probe.minMicros = UINT32_MAX;
+    probe.maxMicros = 0;
+    memset(probe.buckets, 0, sizeof(probe.buckets));
+  }
+  _worstProbe = -1;
+  _worstMicros = 0;
+  _maxCheckinGap = 0;
+}
+
+int LatencyProfile::getProbeCount() {
+  return _probeCount;
+}
+
+bool LatencyProfile::getSummary(int id, Summary& summary) {
+  if (id < 0 || id >= _probeCount) {
+    return false;
+  }
+  const Probe& probe = _probes[id];
+  summary.name = probe.name;
+  summary.count = probe.count;
+  summary.minMicros = probe.count ? probe.minMicros : 0;
+  summary.p50Micros = percentile(probe, 500);
+  summary.p99Micros = percentile(probe, 990);
+  summary.maxMicros = probe.maxMicros;
+  return true;
+}
+
+const char* LatencyProfile::getWorstProbe() {
+  return _worstProbe >= 0 ? _probes[_worstProbe].name : nullptr;
+}
+
+uint32_t LatencyProfile::getWorstMicros() {
+  return _worstMicros;
+}
+
+uint32_t LatencyProfile::getMaxCheckinGapMillis() {
+  return _maxCheckinGap / 1000;
+}
+
+void LatencyProfile::fillDiagnostics(DiagnosticSample& sample) {
+  sample.watchdogGapMillis = getMaxCheckinGapMillis();
+  snprintf(sample.worstProbe, sizeof(sample.worstProbe), "%s", _worstProbe >= 0 ? _probes[_worstProbe].name : "");
+  sample.worstMicros = _worstMicros;
+
+  // Insertion into a short list ordered by p99 then max, slowest first
+  sample.latencyCount = 0;
+  for (int id = 0; id < _probeCount; id++) {
+    Summary summary;
+    getSummary(id, summary);
+    if (summary.count == 0) {
+      continue;
+    }
+
+    size_t at = sample.latencyCount;
+    while (at > 0 && (sample.latency[at - 1].p99Micros < summary.p99Micros ||
+                      (sample.latency[at - 1].p99Micros == summary.p99Micros &&
+                       sample.latency[at - 1].maxMicros < summary.maxMicros))) {
+      at--;
+    }
+    if (at >= LATENCY_REPORT_PROBES) {
+      continue;
+    }
+    size_t last = sample.latencyCount < LATENCY_REPORT_PROBES ? sample.latencyCount : LATENCY_REPORT_PROBES - 1;
+    for (size_t i = last; i > at; i--) {
+      sample.latency[i] = sample.latency[i - 1];
+    }
+    if (sample.latencyCount < LATENCY_REPORT_PROBES) {
+      sample.latencyCount++;
+    }
+
+    LatencySample& entry = sample.latency[at];
+    snprintf(entry.name, sizeof(entry.name), "%s", summary.name);
+    entry.minMicros = summary.minMicros;
+    entry.p50Micros = summary.p50Micros;
+    entry.p99Micros = summary.p99Micros;
+    entry.maxMicros = summary.maxMicros;
+  }
+}
+
+void LatencyProfile::logSummary() {
+  for (int id = 0; id < _probeCount; id++) {
+    Summary summary;
+    getSummary(id, summary);
+    Serial.printlnf("Latency %-10s n %lu, min %lu us, p50 %lu us, p99 %lu us, max %lu us",
+                   summary.name, (unsigned long)summary.count, (unsigned long)summary.minMicros,
+                   (unsigned long)summary.p50Micros, (unsigned long)summary.p99Micros,
+                   (unsigned long)summary.maxMicros);
+  }
+  Serial.printlnf("Latency worst %s at %lu us, longest watchdog gap %lu ms",
+                 _worstProbe >= 0 ? _probes[_worstProbe].name : "none", (unsigned long)_worstMicros,
+                 (unsigned long)getMaxCheckinGapMillis());
+}
+
+uint32_t LatencyProfile::percentile(const Probe& probe, uint32_t perMille) {
+  if (probe.count == 0) {
+    return 0;
+  }
+
+  // Smallest bucket holding the rank, reported as its upper bound within the
+  // range actually seen
+  uint32_t rank = (uint32_t)(((uint64_t)probe.count * perMille + 999) / 1000);
+  uint32_t seen = 0;
+  for (int bucket = 0; bucket < BUCKETS; bucket++) {
+    seen += probe.buckets[bucket];
+    if (seen >= rank) {
+      uint32_t upper = bucket == 0 ? 0 : (bucket >= 32 ? UINT32_MAX : (1UL << bucket) - 1);
+      if (upper > probe.maxMicros) {
+        upper = probe.maxMicros;
+      }
+      return upper < probe.minMicros ? probe.minMicros : upper;
+    }
+  }
+  return probe.maxMicros;
+}
+
+#endif
@@ -0,0 +1,105 @@
+#pragma once
+
+#include "Particle.h"
+
+// Loop latency probes. LATENCY_SCOPE("name") times the rest of the enclosing
+// block with micros(), LATENCY_RECORD("name", micros) adds a value measured
+// some other way (a delay rather than a run time, so it isn't ranked).
+// Each probe keeps a log2 histogram (bucket i holds 2^(i-1) to 2^i - 1 us),
+// so recording is a few instructions and a fixed 33 words per probe; p50 and
+// p99 come from the histogram (a bucket's upper bound), min and max are
+// exact. The single slowest timed sample is kept as the worst offender.
+//
+// LATENCY_CHECKIN() marks a watchdog checkin; the longest gap between two is
+// the margin left against the watchdog timeout.
+//
+// Figures cover the time since the last reset(), which diagnostics do after
+// each report. Build with LATENCY_PROFILE=0 to compile every probe out.
+#ifndef LATENCY_PROFILE
+#define LATENCY_PROFILE 1
+#endif
+
+struct DiagnosticSample;
+
+class LatencyProfile {
+public:
+  struct Summary {
+    const char* name;
+    uint32_t count;
+    uint32_t minMicros;
+    uint32_t p50Micros;
+    uint32_t p99Micros;
+    uint32_t maxMicros;
+  };
+
+  // Id of a named probe, registered on first use; -1 if the table is full
+  static int probe(const char* name);
+
+  static void record(int probe, uint32_t micros, bool ranked = true);
+  static void checkin();
+
+  // Start a new reporting window
+  static void reset();
+
+  static int getProbeCount();
+  static bool getSummary(int probe, Summary& summary);
+  static const char* getWorstProbe();  // nullptr if nothing was recorded
+  static uint32_t getWorstMicros();
+  static uint32_t getMaxCheckinGapMillis();
+
+  // The slowest probes by p99 (then max) into a diagnostic report; all of them to serial
+  static void fillDiagnostics(DiagnosticSample& sample);
+  static void logSummary();
+
+  static const int MAX_PROBES = 16;
+  static const int BUCKETS = 33;
+
+private:
+  struct Probe {
+    const char* name;
+    uint32_t count;
+    uint32_t minMicros;
+    uint32_t maxMicros;
+    uint32_t buckets[BUCKETS];
+  };
+
+  static Probe _probes[MAX_PROBES];
+  static int _probeCount;
+  static int _worstProbe;
+  static uint32_t _worstMicros;
+  static uint32_t _lastCheckin;
+  static bool _checkedIn;
+  static uint32_t _maxCheckinGap;
+
+  static uint32_t percentile(const Probe& probe, uint32_t perMille);
+};
+
+#if LATENCY_PROFILE
+
+// Times the enclosing block
+class LatencyScope {
+public:
+  explicit LatencyScope(int probe) : _probe(probe), _start(micros()) {}
+  ~LatencyScope() { LatencyProfile::record(_probe, micros() - _start); }
+
+private:
+  int _probe;
+  uint32_t _start;
+};
+
+#define LATENCY_CONCAT_(a, b) a##b
+#define LATENCY_CONCAT(a, b) LATENCY_CONCAT_(a, b)
+#define LATENCY_SCOPE(name) \
+  static const int LATENCY_CONCAT(latencyProbe, __LINE__) = LatencyProfile::probe(name); \
+  LatencyScope LATENCY_CONCAT(latencyScope, __LINE__)(LATENCY_CONCAT(latencyProbe, __LINE__))
+#define LATENCY_RECORD(name, micros) \
+  do { \
+    static const int latencyProbe = LatencyProfile::probe(name); \
+    LatencyProfile::record(latencyProbe, micros, false); \
+  } while (0)
+#define LATENCY_CHECKIN() LatencyProfile::checkin()
+#else
+#define LATENCY_SCOPE(name) do {} while (0)
+#define LATENCY_RECORD(name, micros) do {} while (0)
+#define LATENCY_CHECKIN() do {} while (0)
+#endif
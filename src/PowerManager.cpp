@@ -0,0 +1,182 @@
+#include "PowerManager.h"
+#include "FlowSensor.h"
+#include "FlowAnalyzer.h"
+#include "PulseSource.h"
+#include "PublishQueue.h"
+#include "SystemMonitor.h"
+#include "Storage.h"
+#include "Clock.h"
+
+PowerManager::PowerManager(FlowSensor* flowSensor, PulseSource* pulseSource, PublishQueue* publishQueue,
+                           SystemMonitor* systemMonitor, int wakePin) :
+  _channels{{flowSensor, pulseSource, wakePin, 0}},
+  _channelCount(1),
+  _publishQueue(publishQueue),
+  _systemMonitor(systemMonitor),
+  _enabled(false),
+  _lastActivityTime(0),
+  _connecting(false),
+  _connectStartTime(0),
+  _sleepMillis(0),
+  _wakeups(0),
+  _pulseWakeups(0),
+  _watchdogWakeups(0)
+{
+}
+
+bool PowerManager::addChannel(FlowSensor* flowSensor, PulseSource* pulseSource, int wakePin) {
+  if (_channelCount >= MAX_FLOW_CHANNELS) {
+    return false;
+  }
+  _channels[_channelCount++] = {flowSensor, pulseSource, wakePin, 0};
+  return true;
+}
+
+void PowerManager::setEnabled(bool enabled) {
+  _enabled = enabled;
+}
+
+bool PowerManager::isEnabled() const {
+  return _enabled;
+}
+
+void PowerManager::update(unsigned long currentTime) {
+  if (!_enabled) {
+    return;
+  }
+  
+  for (int i = 0; i < _channelCount; i++) {
+    unsigned long pulseCount = _channels[i].pulseSource->readPulseCount();
+    if (pulseCount != _channels[i].lastPulseCount) {
+      _channels[i].lastPulseCount = pulseCount;
+      _lastActivityTime = currentTime;
+    }
+  }
+  
+  // Connect on demand; Device OS retries on its own until it succeeds
+  if (Particle.connected()) {
+    _connecting = false;
+  } else if (cloudNeeded() && !_connecting) {
+    Particle.connect();
+    _connecting = true;
+    _connectStartTime = currentTime;
+  }
+}
+
+bool PowerManager::readyToSleep(unsigned long currentTime) const {
+  if (!_enabled || !_systemMonitor->isBootComplete()) {
+    return false;
+  }
+  for (int i = 0; i < _channelCount; i++) {
+    if (_channels[i].flowSensor->isFlowActive()) {
+      return false;
+    }
+  }
+  
+  // A commanded fill is watched for pulses until the valve closes
+  FlowAnalyzer* analyzer = _channels[0].flowSensor->getAnalyzer();
+  if (analyzer && analyzer->isFillCommanded()) {
+    return false;
+  }
+  if (currentTime - _lastActivityTime < IDLE_BEFORE_SLEEP) {
+    return false;
+  }
+  
+  // Stay up to send, unless the cloud has been unreachable for too long
+  if (cloudNeeded()) {
+    return _connecting && currentTime - _connectStartTime >= CONNECT_TIMEOUT;
+  }
+  return true;
+}
+
+void PowerManager::sleep(unsigned long durationMs) {
+  if (durationMs < MIN_SLEEP) {
+    return;
+  }
+  
+  // Nothing cached may be lost if power fails while asleep
+  Storage::flush();
+  
+  // The modem powers down for the sleep; update() reconnects when needed
+  if (Particle.connected() || _connecting) {
+    Particle.disconnect();
+  }
+  _connecting = false;
+  
+  Serial.printlnf("Sleeping for up to %lu s", durationMs / 1000);
+  unsigned long start = millis();
+  bool wokeByPulse = false;
+  while (true) {
+    unsigned long elapsed = millis() - start;
+    if (elapsed >= durationMs) {
+      break;
+    }
+    unsigned long slice = durationMs - elapsed;
+    if (slice > MAX_SLEEP_SLICE) {
+      slice = MAX_SLEEP_SLICE;
+    }
+    
+    _systemMonitor->checkin();
+    SystemSleepConfiguration config;
+    config.mode(SystemSleepMode::ULTRA_LOW_POWER)
+          .duration(slice);
+    for (int i = 0; i < _channelCount; i++) {
+      config.gpio(_channels[i].wakePin, FALLING);
+    }
+    SystemSleepResult result = System.sleep(config);
+    
+    if (result.wakeupReason() == SystemSleepWakeupReason::BY_GPIO) {
+      // The pulse belongs to the meter on the pin that woke us
+      int woke = 0;
+      for (int i = 0; i < _channelCount; i++) {
+        if (_channels[i].wakePin == (int)result.wakeupPin()) {
+          woke = i;
+        }
+      }
+      _channels[woke].pulseSource->creditWakePulse();
+      wokeByPulse = true;
+      break;
+    }
+    if (millis() - start < durationMs) {
+      _watchdogWakeups++;
+    }
+  }
+  _systemMonitor->checkin();
+  
+  unsigned long slept = millis() - start;
+  _sleepMillis += slept;
+  _wakeups++;
+  if (wokeByPulse) {
+    _pulseWakeups++;
+  }
+  
+  // A pulse counts as activity; stay awake to see whether water is flowing
+  for (int i = 0; i < _channelCount; i++) {
+    _channels[i].lastPulseCount = _channels[i].pulseSource->readPulseCount();
+  }
+  if (wokeByPulse) {
+    _lastActivityTime = millis();
+  }
+  Serial.printlnf("Woke after %lu s (%s)", slept / 1000, wokeByPulse ? "pulse" : "report due");
+}
+
+bool PowerManager::cloudNeeded() const {
+  // Something to send, or reports held until the clock syncs
+  return _publishQueue->getDepth() > 0 || !Clock::isSynced() || Particle.syncTimePending();
+}
+
+uint64_t PowerManager::getSleepMillis() const {
+  return _sleepMillis;
+}
+
+unsigned long PowerManager::getWakeups() const {
+  return _wakeups;
+}
+
+unsigned long PowerManager::getPulseWakeups() const {
+  return _pulseWakeups;
+}
+
+unsigned long PowerManager::getWatchdogWakeups() const {
+  return _watchdogWakeups;
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "Particle.h"
+#include "FlowChannels.h"
+
+class FlowSensor; // Forward declarations
+class PulseSource;
+class PublishQueue;
+class SystemMonitor;
+
+// Low-power idle. While no water flows and nothing is waiting for the cloud,
+// the device drops the cloud connection and enters ultra-low-power sleep
+// until the next report is due or a flow meter pin sees an edge. The cloud
+// is only reconnected when the publish queue has something to send.
+//
+// Pulses are counted by the ISR or timer while awake. The edge that wakes
+// the CPU is consumed by the wake logic instead, so it is credited to the
+// pulse source of the pin that woke it, and the totals stay exact.
+class PowerManager {
+public:
+  PowerManager(FlowSensor* flowSensor, PulseSource* pulseSource, PublishQueue* publishQueue,
+               SystemMonitor* systemMonitor, int wakePin);
+  
+  // Watch another meter for activity and wake on its pin too; false when
+  // MAX_FLOW_CHANNELS are already watched
+  bool addChannel(FlowSensor* flowSensor, PulseSource* pulseSource, int wakePin);
+  
+  // Off by default; build with LOW_POWER_IDLE to turn it on
+  void setEnabled(bool enabled);
+  bool isEnabled() const;
+  
+  // Track pulse activity and bring the cloud up when there is data to send
+  void update(unsigned long currentTime);
+  
+  // True when nothing would be lost by sleeping now
+  bool readyToSleep(unsigned long currentTime) const;
+  
+  // Sleep for up to durationMs; returns early on a pulse
+  void sleep(unsigned long durationMs);
+  
+  // Statistics
+  uint64_t getSleepMillis() const;
+  unsigned long getWakeups() const;        // Sleeps ended by a pulse or a due report
+  unsigned long getPulseWakeups() const;
+  unsigned long getWatchdogWakeups() const; // Brief wakes to check in mid-sleep
+  
+private:
+  // One per meter; channel 0 is the meter given to the constructor
+  struct Channel {
+    FlowSensor* flowSensor;
+    PulseSource* pulseSource;
+    int wakePin;
+    unsigned long lastPulseCount;
+  };
+  
+  Channel _channels[MAX_FLOW_CHANNELS];
+  int _channelCount;
+  PublishQueue* _publishQueue;
+  SystemMonitor* _systemMonitor;
+  bool _enabled;
+  
+  // Activity and connection state
+  unsigned long _lastActivityTime;
+  bool _connecting;
+  unsigned long _connectStartTime;
+  
+  // Statistics
+  uint64_t _sleepMillis;
+  unsigned long _wakeups;
+  unsigned long _pulseWakeups;
+  unsigned long _watchdogWakeups;
+  
+  // Constants
+  const unsigned long IDLE_BEFORE_SLEEP = 60000;   // No pulses for a minute
+  const unsigned long CONNECT_TIMEOUT = 300000;    // Give up on an unreachable cloud until the next wake
+  const unsigned long MIN_SLEEP = 5000;            // Not worth powering down for less
+  const unsigned long MAX_SLEEP_SLICE = 45000;     // Inside the 60 second application watchdog
+  
+  bool cloudNeeded() const;
+};
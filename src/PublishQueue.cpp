@@ -0,0 +1,337 @@
+#include "PublishQueue.h"
+#include "Checksum.h"
+#include "LatencyProfile.h"
+#include "DeferredLog.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+PublishQueue::PublishQueue(const char* path, size_t maxBytes) :
+  _path(path),
+  _maxBytes(maxBytes),
+  _fd(-1),
+  _head(sizeof(Header)),
+  _tail(sizeof(Header)),
+  _depth(0),
+  _dropped(0),
+  _published(0),
+  _compactions(0),
+  _lastPublishTime(0),
+  _lastFailureTime(0),
+  _backingOff(false),
+  _batchCount(0)
+{
+}
+
+void PublishQueue::begin() {
+  // Make sure the directory exists; an error here just means it already does
+  char directory[64];
+  const char* slash = strrchr(_path, '/');
+  if (slash && slash != _path && (size_t)(slash - _path) < sizeof(directory)) {
+    memcpy(directory, _path, slash - _path);
+    directory[slash - _path] = '\0';
+    mkdir(directory, 0777);
+  }
+
+  if (!openFile()) {
+    Serial.printlnf("Publish queue: cannot open %s, publishing without a queue", _path);
+    return;
+  }
+
+  Header header;
+  if (lseek(_fd, 0, SEEK_SET) != 0 || read(_fd, &header, sizeof(header)) != (int)sizeof(header) ||
+      header.magic != MAGIC || header.version != VERSION) {
+    resetFile();
+  } else {
+    _head = header.head;
+    recover();
+  }
+
+  Serial.printlnf("Publish queue initialized (%lu pending, %lu bytes)", _depth, getBytes());
+}
+
+void PublishQueue::update(unsigned long currentTime) {
+  if (_depth == 0 || _fd < 0 || !Particle.connected()) {
+    return;
+  }
+
+  // Hold off after a failure, between publishes, and after a full batch
+  if (_backingOff) {
+    if (currentTime - _lastFailureTime < RETRY_INTERVAL) {
+      return;
+    }
+    _backingOff = false;
+  }
+  unsigned long spacing = (_batchCount >= BATCH_SIZE) ? BATCH_INTERVAL : PUBLISH_SPACING;
+  if (currentTime - _lastPublishTime < spacing) {
+    return;
+  }
+  if (_batchCount >= BATCH_SIZE) {
+    _batchCount = 0;
+  }
+
+  RecordHeader header;
+  char name[MAX_NAME_LENGTH + 1];
+  char data[MAX_DATA_LENGTH + 1];
+  if (!readRecord(_head, header, name, data)) {
+    // Recovery validated every record, so this is flash corruption
+    DLOG_ERROR("Publish queue: unreadable record, %lu pending events discarded", _depth);
+    _dropped += _depth;
+    resetFile();
+    return;
+  }
+
+  _lastPublishTime = currentTime;
+  bool sent;
+  {
+    LATENCY_SCOPE("cloud_pub");
+    sent = Particle.publish(name, data, PRIVATE);
+  }
+  if (!sent) {
+    DLOG_WARN("Publish queue: %s publish failed, retrying later", name);
+    _lastFailureTime = currentTime;
+    _backingOff = true;
+    commitBatch();
+    return;
+  }
+
+  // Sent records are only forgotten once the head is committed, so a reboot
+  // mid-batch may send up to BATCH_SIZE - 1 events twice, never lose them
+  _head += recordSize(header);
+  _depth--;
+  _published++;
+  _batchCount++;
+  if (_batchCount >= BATCH_SIZE || _depth == 0) {
+    commitBatch();
+  }
+}
+
+bool PublishQueue::enqueue(const char* eventName, const char* data) {
+  size_t nameLength = strlen(eventName);
+  size_t dataLength = strlen(data);
+  if (nameLength == 0 || nameLength > MAX_NAME_LENGTH || dataLength > MAX_DATA_LENGTH) {
+    DLOG_ERROR("Publish queue: %s event too large, not queued", eventName);
+    return false;
+  }
+
+  if (_fd < 0) {
+    // No flash file: fall back to a direct publish
+    return Particle.publish(eventName, data, PRIVATE);
+  }
+
+  RecordHeader header;
+  header.marker = RECORD_MARKER;
+  header.nameLength = (uint8_t)nameLength;
+  header.dataLength = (uint16_t)dataLength;
+  header.crc = recordCrc(eventName, nameLength, data, dataLength);
+  uint32_t size = recordSize(header);
+
+  if (_tail + size > _maxBytes) {
+    // Out of room: drop the oldest records down to three quarters full so a
+    // long outage doesn't rewrite the file for every new event
+    while (_depth > 0 && (_tail - _head) + size > _maxBytes * 3 / 4) {
+      dropOldest();
+    }
+    compact();
+    if (_tail + size > _maxBytes) {
+      return false;
+    }
+  }
+
+  bool written = lseek(_fd, _tail, SEEK_SET) == (off_t)_tail &&
+                 write(_fd, &header, sizeof(header)) == (int)sizeof(header) &&
+                 write(_fd, eventName, nameLength) == (int)nameLength &&
+                 write(_fd, data, dataLength) == (int)dataLength &&
+                 fsync(_fd) == 0;
+  if (!written) {
+    DLOG_ERROR("Publish queue: write failed, %s not queued", eventName);
+    return false;
+  }
+
+  _tail += size;
+  _depth++;
+  return true;
+}
+
+// Statistics
+unsigned long PublishQueue::getMillisUntilUpdate(unsigned long currentTime) const {
+  if (_depth == 0 || _fd < 0 || !Particle.connected()) {
+    return ULONG_MAX;
+  }
+  unsigned long wait = 0;
+  if (_backingOff && currentTime - _lastFailureTime < RETRY_INTERVAL) {
+    wait = RETRY_INTERVAL - (currentTime - _lastFailureTime);
+  }
+  unsigned long spacing = (_batchCount >= BATCH_SIZE) ? BATCH_INTERVAL : PUBLISH_SPACING;
+  if (currentTime - _lastPublishTime < spacing && spacing - (currentTime - _lastPublishTime) > wait) {
+    wait = spacing - (currentTime - _lastPublishTime);
+  }
+  return wait;
+}
+
+unsigned long PublishQueue::getDepth() const {
+  return _depth;
+}
+
+unsigned long PublishQueue::getBytes() const {
+  return _tail - _head;
+}
+
+unsigned long PublishQueue::getDropped() const {
+  return _dropped;
+}
+
+unsigned long PublishQueue::getPublished() const {
+  return _published;
+}
+
+unsigned long PublishQueue::getCompactions() const {
+  return _compactions;
+}
+
+// File operations
+bool PublishQueue::openFile() {
+  _fd = open(_path, O_RDWR | O_CREAT, 0644);
+  return _fd >= 0;
+}
+
+void PublishQueue::resetFile() {
+  close(_fd);
+  _fd = open(_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  _head = sizeof(Header);
+  _tail = sizeof(Header);
+  _depth = 0;
+  writeHead();
+}
+
+void PublishQueue::recover() {
+  off_t fileSize = lseek(_fd, 0, SEEK_END);
+  if (_head < sizeof(Header) || (off_t)_head > fileSize) {
+    resetFile();
+    return;
+  }
+
+  // Count the valid records; the first bad one marks a torn append
+  RecordHeader header;
+  char name[MAX_NAME_LENGTH + 1];
+  char data[MAX_DATA_LENGTH + 1];
+  _tail = _head;
+  _depth = 0;
+  while ((off_t)_tail < fileSize && readRecord(_tail, header, name, data)) {
+    _tail += recordSize(header);
+    _depth++;
+  }
+
+  if ((off_t)_tail < fileSize) {
+    Serial.printlnf("Publish queue: discarded %lu bytes of torn data", (unsigned long)(fileSize - _tail));
+  }
+}
+
+bool PublishQueue::readRecord(uint32_t offset, RecordHeader& header, char* name, char* data) {
+  if (lseek(_fd, offset, SEEK_SET) != (off_t)offset ||
+      read(_fd, &header, sizeof(header)) != (int)sizeof(header)) {
+    return false;
+  }
+  if (header.marker != RECORD_MARKER || header.nameLength == 0 ||
+      header.nameLength > MAX_NAME_LENGTH || header.dataLength > MAX_DATA_LENGTH) {
+    return false;
+  }
+  if (read(_fd, name, header.nameLength) != header.nameLength ||
+      read(_fd, data, header.dataLength) != header.dataLength) {
+    return false;
+  }
+  name[header.nameLength] = '\0';
+  data[header.dataLength] = '\0';
+  return header.crc == recordCrc(name, header.nameLength, data, header.dataLength);
+}
+
+bool PublishQueue::writeHead() {
+  Header header = {MAGIC, VERSION, _head, 0};
+  return _fd >= 0 &&
+         lseek(_fd, 0, SEEK_SET) == 0 &&
+         write(_fd, &header, sizeof(header)) == (int)sizeof(header) &&
+         fsync(_fd) == 0;
+}
+
+void PublishQueue::dropOldest() {
+  RecordHeader header;
+  if (lseek(_fd, _head, SEEK_SET) != (off_t)_head ||
+      read(_fd, &header, sizeof(header)) != (int)sizeof(header)) {
+    _dropped += _depth;
+    _head = _tail;
+    _depth = 0;
+    return;
+  }
+  _head += recordSize(header);
+  _depth--;
+  _dropped++;
+}
+
+void PublishQueue::compact() {
+  if (_depth == 0) {
+    resetFile();
+    return;
+  }
+  if (_head == sizeof(Header)) {
+    return;
+  }
+
+  // Copy the pending records into a fresh file and swap it in; rename is
+  // atomic, so a reset leaves either the old or the new file intact
+  char tempPath[72];
+  snprintf(tempPath, sizeof(tempPath), "%s.tmp", _path);
+  int tempFd = open(tempPath, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (tempFd < 0) {
+    writeHead();
+    return;
+  }
+
+  Header header = {MAGIC, VERSION, sizeof(Header), 0};
+  bool ok = write(tempFd, &header, sizeof(header)) == (int)sizeof(header);
+  uint8_t buffer[256];
+  uint32_t offset = _head;
+  while (ok && offset < _tail) {
+    size_t chunk = (_tail - offset < sizeof(buffer)) ? _tail - offset : sizeof(buffer);
+    ok = lseek(_fd, offset, SEEK_SET) == (off_t)offset &&
+         read(_fd, buffer, chunk) == (int)chunk &&
+         write(tempFd, buffer, chunk) == (int)chunk;
+    offset += chunk;
+  }
+  ok = ok && fsync(tempFd) == 0;
+  close(tempFd);
+
+  if (!ok || rename(tempPath, _path) != 0) {
+    unlink(tempPath);
+    writeHead();
+    return;
+  }
+
+  close(_fd);
+  openFile();
+  _tail = sizeof(Header) + (_tail - _head);
+  _head = sizeof(Header);
+  _compactions++;
+}
+
+void PublishQueue::commitBatch() {
+  _batchCount = (_batchCount >= BATCH_SIZE) ? BATCH_SIZE : 0;
+
+  if (_depth == 0) {
+    resetFile();
+  } else if (_head - sizeof(Header) >= COMPACT_THRESHOLD) {
+    compact();
+  } else {
+    writeHead();
+  }
+}
+
+uint32_t PublishQueue::recordSize(const RecordHeader& header) const {
+  return sizeof(RecordHeader) + header.nameLength + header.dataLength;
+}
+
+uint32_t PublishQueue::recordCrc(const char* name, size_t nameLength, const char* data, size_t dataLength) const {
+  uint32_t crc = Checksum::crc32(reinterpret_cast<const uint8_t*>(name), nameLength);
+  return Checksum::crc32(reinterpret_cast<const uint8_t*>(data), dataLength, crc);
+}
@@ -0,0 +1,102 @@
+#pragma once
+
+#include "Particle.h"
+
+// Store-and-forward queue for cloud publishes. Every event is appended to a
+// file on the flash file system before it is sent, so reports made while the
+// cellular link is down (or across a reboot) go out oldest first once the
+// cloud is reachable again.
+//
+// File layout: a 16-byte header holding the offset of the oldest unsent
+// record, followed by records appended in order:
+//
+//   marker (0xA5), name length, data length (2), CRC-32 (4), name, data
+//
+// A torn append at the tail fails its CRC and is cut off at startup. Sent
+// records are skipped by moving the head; the file is rewritten without them
+// (compaction) once enough space has been consumed, and truncated whenever
+// the queue drains completely.
+class PublishQueue {
+public:
+  PublishQueue(const char* path, size_t maxBytes);
+
+  // Open the queue file and recover pending records
+  void begin();
+
+  // Publish queued events while the cloud is connected
+  void update(unsigned long currentTime);
+
+  // Milliseconds until update() would publish: the spacing or back-off left,
+  // or ULONG_MAX with nothing queued or no cloud to send it to
+  unsigned long getMillisUntilUpdate(unsigned long currentTime) const;
+
+  // Queue an event; the oldest records are dropped if the queue is full
+  bool enqueue(const char* eventName, const char* data);
+
+  // Statistics
+  unsigned long getDepth() const;          // Records waiting to be sent
+  unsigned long getBytes() const;          // Bytes of pending records
+  unsigned long getDropped() const;        // Records discarded to make room
+  unsigned long getPublished() const;      // Records delivered since boot
+  unsigned long getCompactions() const;
+
+  // Largest accepted event, matching the cloud's publish limits
+  static const size_t MAX_NAME_LENGTH = 64;
+  static const size_t MAX_DATA_LENGTH = 1024;
+
+private:
+  struct Header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t head;        // Offset of the oldest unsent record
+    uint32_t reserved;
+  };
+
+  struct RecordHeader {
+    uint8_t marker;
+    uint8_t nameLength;
+    uint16_t dataLength;
+    uint32_t crc;         // CRC-32 of name and data
+  };
+
+  const char* _path;
+  size_t _maxBytes;
+  int _fd;
+
+  // Offsets into the file
+  uint32_t _head;
+  uint32_t _tail;
+
+  unsigned long _depth;
+  unsigned long _dropped;
+  unsigned long _published;
+  unsigned long _compactions;
+
+  // Drain state
+  unsigned long _lastPublishTime;
+  unsigned long _lastFailureTime;
+  bool _backingOff;
+  int _batchCount;
+
+  // Constants
+  static const uint32_t MAGIC = 0x51425550;      // "PUBQ"
+  static const uint32_t VERSION = 1;
+  static const uint8_t RECORD_MARKER = 0xA5;
+  static const int BATCH_SIZE = 4;                           // Events per burst; head committed per batch
+  const unsigned long PUBLISH_SPACING = 1000;                // 1 second between publishes
+  const unsigned long BATCH_INTERVAL = 4000;                 // Pause after a full batch (1/s average)
+  const unsigned long RETRY_INTERVAL = 30000;                // Back off after a failed publish
+  const uint32_t COMPACT_THRESHOLD = 8192;                   // Consumed bytes worth rewriting
+
+  // File operations
+  bool openFile();
+  void resetFile();
+  void recover();
+  bool readRecord(uint32_t offset, RecordHeader& header, char* name, char* data);
+  bool writeHead();
+  void dropOldest();
+  void compact();
+  void commitBatch();
+  uint32_t recordSize(const RecordHeader& header) const;
+  uint32_t recordCrc(const char* name, size_t nameLength, const char* data, size_t dataLength) const;
+};
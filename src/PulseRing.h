@@ -0,0 +1,61 @@
+#pragma once
+
+#include "Particle.h"
+#include <atomic>
+
+// Single-producer/single-consumer ring of pulse timestamps (micros()).
+// The flow ISR is the only writer of _head and the main loop the only writer
+// of _tail, so no locking is needed: aligned 32-bit loads and stores are atomic
+// on Cortex-M and the signal fences keep the compiler from reordering the slot
+// write past the index update.
+class PulseRing {
+public:
+  static const uint32_t CAPACITY = 512; // Must be a power of two
+
+  PulseRing() :
+    _head(0),
+    _tail(0),
+    _overflowCount(0)
+  {
+  }
+
+  // Producer side - ISR only
+  bool push(uint32_t timestamp) {
+    uint32_t head = _head;
+    if (head - _tail >= CAPACITY) {
+      // Ring full: the pulse is still counted, only its timestamp is dropped
+      _overflowCount++;
+      return false;
+    }
+    _buffer[head & (CAPACITY - 1)] = timestamp;
+    std::atomic_signal_fence(std::memory_order_release);
+    _head = head + 1;
+    return true;
+  }
+
+  // Consumer side - main loop only. Copies up to maxCount timestamps, oldest first.
+  size_t drain(uint32_t* out, size_t maxCount) {
+    uint32_t tail = _tail;
+    uint32_t available = _head - tail;
+    std::atomic_signal_fence(std::memory_order_acquire);
+
+    size_t count = available < maxCount ? available : maxCount;
+    for (size_t i = 0; i < count; i++) {
+      out[i] = _buffer[(tail + i) & (CAPACITY - 1)];
+    }
+
+    std::atomic_signal_fence(std::memory_order_release);
+    _tail = tail + count;
+    return count;
+  }
+
+  uint32_t getOverflowCount() const {
+    return _overflowCount;
+  }
+
+private:
+  uint32_t _buffer[CAPACITY];
+  volatile uint32_t _head;
+  volatile uint32_t _tail;
+  volatile uint32_t _overflowCount;
+};
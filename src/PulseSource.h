@@ -0,0 +1,40 @@
+#pragma once
+
+#include "Particle.h"
+
+// Where FlowSensor gets its pulses from. Backends own the sensor pin and
+// whatever hardware counts edges on it; FlowSensor only ever reads totals
+// (and timestamps, when the backend has them) from the main loop.
+class PulseSource {
+public:
+  virtual ~PulseSource() {}
+  
+  // Configure the pin and start counting
+  virtual void begin() = 0;
+  
+  // Free-running count of pulses since begin(); wraps at 2^32
+  virtual unsigned long readPulseCount() const = 0;
+  
+  // True when per-pulse timestamps are available through drainTimestamps()
+  virtual bool hasTimestamps() const { return false; }
+  
+  // Copy micros() timestamps captured since the last call, oldest first
+  virtual size_t drainTimestamps(uint32_t* out, size_t maxCount) {
+    (void)out;
+    (void)maxCount;
+    return 0;
+  }
+  
+  // True if any pulse arrived since the last call (drives the activity LED)
+  virtual bool takePulseDetected() = 0;
+  
+  // Count a pulse the pin consumed as a sleep wakeup; it never reached the
+  // interrupt or counter
+  virtual void creditWakePulse() = 0;
+  
+  // Pulses that were counted but could not be timestamped
+  virtual unsigned long getOverflowCount() const { return 0; }
+  
+  // Short backend name for logs and diagnostics
+  virtual const char* getName() const = 0;
+};
@@ -0,0 +1,276 @@
+#include "ReportingPolicy.h"
+#include "Checksum.h"
+#include "DeferredLog.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <stddef.h>
+
+namespace {
+
+const unsigned long MS_PER_MINUTE = 60000;
+const unsigned long MS_PER_HOUR = 3600000;
+
+// Settings the cloud function can change, with their accepted range
+struct Key {
+  const char* name;
+  size_t offset;
+  uint32_t min;
+  uint32_t max;
+};
+
+const Key KEYS[] = {
+  {"batch_active", offsetof(ReportingPolicy::Settings, batchMinutes[ReportingPolicy::MODE_ACTIVE]), 1, 2880},
+  {"batch_normal", offsetof(ReportingPolicy::Settings, batchMinutes[ReportingPolicy::MODE_NORMAL]), 1, 2880},
+  {"batch_idle", offsetof(ReportingPolicy::Settings, batchMinutes[ReportingPolicy::MODE_IDLE]), 1, 2880},
+  {"diag_active", offsetof(ReportingPolicy::Settings, diagnosticMinutes[ReportingPolicy::MODE_ACTIVE]), 1, 2880},
+  {"diag_normal", offsetof(ReportingPolicy::Settings, diagnosticMinutes[ReportingPolicy::MODE_NORMAL]), 1, 2880},
+  {"diag_idle", offsetof(ReportingPolicy::Settings, diagnosticMinutes[ReportingPolicy::MODE_IDLE]), 1, 2880},
+  {"idle_hours", offsetof(ReportingPolicy::Settings, idleHours), 1, 168},
+  {"weak_signal", offsetof(ReportingPolicy::Settings, weakSignalPercent), 0, 100},
+  {"publishes", offsetof(ReportingPolicy::Settings, dailyPublishes), 0, 100000},
+  {"bytes", offsetof(ReportingPolicy::Settings, dailyBytes), 0, 10000000}
+};
+
+const char* const MODE_NAMES[ReportingPolicy::MODE_COUNT] = {"idle", "normal", "active"};
+
+const Key* findKey(const char* name) {
+  for (const Key& key : KEYS) {
+    if (strcmp(key.name, name) == 0) {
+      return &key;
+    }
+  }
+  return nullptr;
+}
+
+} // namespace
+
+ReportingPolicy::ReportingPolicy(const char* path) :
+  _path(path),
+  _mode(MODE_NORMAL),
+  _signalPercent(-1),
+  _alerting(false),
+  _lastFlowTime(0),
+  _publishesToday(0),
+  _bytesToday(0),
+  _deferredToday(0),
+  _modeChanges(0),
+  _budgetLogged(false)
+{
+  setDefaults(_settings);
+}
+
+void ReportingPolicy::begin() {
+  bool loaded = load();
+  if (!loaded) {
+    setDefaults(_settings);
+  }
+  _lastFlowTime = millis();
+
+  Serial.printlnf("Reporting policy %s: records every %lu/%lu/%lu min, diagnostics every %lu/%lu/%lu min "
+                  "(active/normal/idle), budget %lu publishes, %lu bytes a day",
+                  loaded ? "loaded" : "defaults",
+                  (unsigned long)_settings.batchMinutes[MODE_ACTIVE], (unsigned long)_settings.batchMinutes[MODE_NORMAL],
+                  (unsigned long)_settings.batchMinutes[MODE_IDLE], (unsigned long)_settings.diagnosticMinutes[MODE_ACTIVE],
+                  (unsigned long)_settings.diagnosticMinutes[MODE_NORMAL],
+                  (unsigned long)_settings.diagnosticMinutes[MODE_IDLE], (unsigned long)_settings.dailyPublishes,
+                  (unsigned long)_settings.dailyBytes);
+}
+
+void ReportingPolicy::update(unsigned long currentTime, bool flowing, bool alerting) {
+  if (flowing) {
+    _lastFlowTime = currentTime;
+  }
+  _alerting = alerting;
+
+  Mode mode = MODE_NORMAL;
+  if (flowing || alerting) {
+    mode = MODE_ACTIVE;
+  } else if (currentTime - _lastFlowTime >= _settings.idleHours * MS_PER_HOUR) {
+    mode = MODE_IDLE;
+  }
+
+  if (mode != _mode) {
+    _mode = mode;
+    _modeChanges++;
+    logCadence();
+  }
+}
+
+void ReportingPolicy::setSignalStrength(int percent) {
+  bool wasWeak = isSignalWeak();
+  _signalPercent = percent;
+  if (isSignalWeak() != wasWeak) {
+    logCadence();
+  }
+}
+
+unsigned long ReportingPolicy::getBatchInterval() const {
+  return stretch(_settings.batchMinutes[_mode]);
+}
+
+unsigned long ReportingPolicy::getDiagnosticInterval() const {
+  return stretch(_settings.diagnosticMinutes[_mode]);
+}
+
+bool ReportingPolicy::withinBudget() const {
+  return (_settings.dailyPublishes == 0 || _publishesToday < _settings.dailyPublishes) &&
+         (_settings.dailyBytes == 0 || _bytesToday < _settings.dailyBytes);
+}
+
+void ReportingPolicy::recordPublish(size_t bytes) {
+  _publishesToday++;
+  _bytesToday += bytes;
+}
+
+void ReportingPolicy::recordDeferred() {
+  _deferredToday++;
+  if (!_budgetLogged) {
+    _budgetLogged = true;
+    DLOG_WARN("Daily report budget spent (%lu publishes, %lu bytes), routine reports held",
+              _publishesToday, _bytesToday);
+  }
+}
+
+void ReportingPolicy::resetBudget() {
+  _publishesToday = 0;
+  _bytesToday = 0;
+  _deferredToday = 0;
+  _budgetLogged = false;
+}
+
+int ReportingPolicy::configure(const char* command) {
+  Settings settings = _settings;
+  int applied = 0;
+
+  char buffer[256];
+  snprintf(buffer, sizeof(buffer), "%s", command);
+  char* saveptr = nullptr;
+  for (char* item = strtok_r(buffer, ", ", &saveptr); item; item = strtok_r(nullptr, ", ", &saveptr)) {
+    if (strcmp(item, "defaults") == 0) {
+      setDefaults(settings);
+      applied++;
+      continue;
+    }
+
+    char* equals = strchr(item, '=');
+    if (equals == nullptr) {
+      return -1;
+    }
+    *equals = '\0';
+    const Key* key = findKey(item);
+    char* end = nullptr;
+    unsigned long value = strtoul(equals + 1, &end, 10);
+    if (key == nullptr || end == equals + 1 || *end != '\0' || value < key->min || value > key->max) {
+      return -1;
+    }
+    *reinterpret_cast<uint32_t*>(reinterpret_cast<uint8_t*>(&settings) + key->offset) = (uint32_t)value;
+    applied++;
+  }
+
+  _settings = settings;
+  if (!save()) {
+    DLOG_ERROR("Failed to save reporting policy");
+  }
+  logCadence();
+  return applied;
+}
+
+ReportingPolicy::Mode ReportingPolicy::getMode() const {
+  return _mode;
+}
+
+const char* ReportingPolicy::getModeName(int mode) {
+  return (mode >= 0 && mode < MODE_COUNT) ? MODE_NAMES[mode] : "unknown";
+}
+
+bool ReportingPolicy::isSignalWeak() const {
+  return _signalPercent >= 0 && (uint32_t)_signalPercent < _settings.weakSignalPercent;
+}
+
+const ReportingPolicy::Settings& ReportingPolicy::getSettings() const {
+  return _settings;
+}
+
+unsigned long ReportingPolicy::getPublishesToday() const {
+  return _publishesToday;
+}
+
+unsigned long ReportingPolicy::getBytesToday() const {
+  return _bytesToday;
+}
+
+unsigned long ReportingPolicy::getDeferredToday() const {
+  return _deferredToday;
+}
+
+unsigned long ReportingPolicy::getModeChanges() const {
+  return _modeChanges;
+}
+
+void ReportingPolicy::setDefaults(Settings& settings) {
+  // Normal matches the fixed cadence the reporter used before: a batch every
+  // 6 hours and an hourly heartbeat. A day stays near 30 publishes.
+  settings.batchMinutes[MODE_ACTIVE] = 60;
+  settings.batchMinutes[MODE_NORMAL] = 360;
+  settings.batchMinutes[MODE_IDLE] = 720;
+  settings.diagnosticMinutes[MODE_ACTIVE] = 30;
+  settings.diagnosticMinutes[MODE_NORMAL] = 60;
+  settings.diagnosticMinutes[MODE_IDLE] = 360;
+  settings.idleHours = 6;
+  settings.weakSignalPercent = 20;
+  settings.dailyPublishes = 60;
+  settings.dailyBytes = 49152;
+}
+
+bool ReportingPolicy::load() {
+  int fd = open(_path, O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  File file;
+  bool ok = read(fd, &file, sizeof(file)) == (int)sizeof(file);
+  close(fd);
+
+  if (!ok || file.magic != MAGIC || file.version != VERSION ||
+      file.crc != Checksum::crc32(reinterpret_cast<const uint8_t*>(&file), offsetof(File, crc))) {
+    return false;
+  }
+  _settings = file.settings;
+  return true;
+}
+
+bool ReportingPolicy::save() const {
+  File file;
+  memset(&file, 0, sizeof(file));
+  file.magic = MAGIC;
+  file.version = VERSION;
+  file.settings = _settings;
+  file.crc = Checksum::crc32(reinterpret_cast<const uint8_t*>(&file), offsetof(File, crc));
+
+  // Written aside and renamed over the old file, so a reset keeps one of them
+  char tempPath[72];
+  snprintf(tempPath, sizeof(tempPath), "%s.tmp", _path);
+  int fd = open(tempPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    return false;
+  }
+  bool ok = write(fd, &file, sizeof(file)) == (int)sizeof(file) && fsync(fd) == 0;
+  close(fd);
+  if (!ok || rename(tempPath, _path) != 0) {
+    unlink(tempPath);
+    return false;
+  }
+  return true;
+}
+
+unsigned long ReportingPolicy::stretch(uint32_t minutes) const {
+  unsigned long interval = minutes * MS_PER_MINUTE;
+  return (isSignalWeak() && !_alerting) ? interval * 2 : interval;
+}
+
+void ReportingPolicy::logCadence() const {
+  DLOG_INFO("Reporting cadence %s: records published every %lu min, diagnostics every %lu min%s",
+            MODE_NAMES[_mode], getBatchInterval() / MS_PER_MINUTE, getDiagnosticInterval() / MS_PER_MINUTE,
+            isSignalWeak() ? " (weak signal)" : "");
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include "Particle.h"
+
+// Reporting cadence. Flow records are always closed hourly; the policy sets
+// how soon they are published and how often diagnostics go out:
+//
+//   - active while water flows and until its volume has been published, or
+//     while an alert is raised, so fills and leaks reach the cloud within
+//     the hour
+//   - idle once no water has flowed for idleHours, stretching both intervals
+//   - normal otherwise
+//
+// A weak cellular signal doubles the intervals (fewer, fuller publishes)
+// unless an alert is raised. A daily budget of publishes and bytes holds back
+// routine reports once it is spent; alerts, exports and a full record buffer
+// still go out and count against it.
+//
+// Settings change at runtime through configure() (the "reporting" cloud
+// function) and are kept in a flash file, so they survive a reset.
+class ReportingPolicy {
+public:
+  enum Mode {
+    MODE_IDLE,
+    MODE_NORMAL,
+    MODE_ACTIVE,
+    MODE_COUNT
+  };
+
+  struct Settings {
+    uint32_t batchMinutes[MODE_COUNT];       // Flow records held before publishing
+    uint32_t diagnosticMinutes[MODE_COUNT];  // Heartbeat interval
+    uint32_t idleHours;                      // Without flow before the idle cadence
+    uint32_t weakSignalPercent;              // Below this the intervals double
+    uint32_t dailyPublishes;                 // 0 = no limit
+    uint32_t dailyBytes;                     // 0 = no limit
+  };
+
+  explicit ReportingPolicy(const char* path);
+
+  // Load the saved settings, or start from the defaults
+  void begin();
+
+  // Pick the mode: flowing covers water not yet reported, as well as water
+  // running now
+  void update(unsigned long currentTime, bool flowing, bool alerting);
+
+  // Latest signal strength in percent; negative when unknown
+  void setSignalStrength(int percent);
+
+  // Intervals for the current mode, in milliseconds
+  unsigned long getBatchInterval() const;
+  unsigned long getDiagnosticInterval() const;
+
+  // Budget: whether routine reports may still be queued today, and the
+  // accounting for everything that was
+  bool withinBudget() const;
+  void recordPublish(size_t bytes);
+  void recordDeferred();
+  void resetBudget();
+
+  // Apply "key=value,..." settings and save them; "defaults" restores the
+  // built-in values. Returns the number of settings applied, or -1 (and
+  // changes nothing) for an unknown key or a value out of range.
+  int configure(const char* command);
+
+  Mode getMode() const;
+  static const char* getModeName(int mode);
+  bool isSignalWeak() const;
+  const Settings& getSettings() const;
+  unsigned long getPublishesToday() const;
+  unsigned long getBytesToday() const;
+  unsigned long getDeferredToday() const;
+  unsigned long getModeChanges() const;
+
+private:
+  struct File {
+    uint32_t magic;
+    uint32_t version;
+    Settings settings;
+    uint32_t crc;
+  };
+
+  static const uint32_t MAGIC = 0x52505450;  // "RPTP"
+  static const uint32_t VERSION = 1;
+
+  const char* _path;
+  Settings _settings;
+  Mode _mode;
+  int _signalPercent;
+  bool _alerting;
+  unsigned long _lastFlowTime;
+  unsigned long _publishesToday;
+  unsigned long _bytesToday;
+  unsigned long _deferredToday;
+  unsigned long _modeChanges;
+  bool _budgetLogged;
+
+  static void setDefaults(Settings& settings);
+  bool load();
+  bool save() const;
+  unsigned long stretch(uint32_t minutes) const;
+  void logCadence() const;
+};
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stddef.h>
+
+// Budget for retained (backup) RAM, which survives resets but not power loss.
+// The Boron leaves 3068 bytes of it to the application, and the linker only
+// complains once it is full, so each module that keeps data there checks its
+// share here at compile time. Shares are sized for a MAX_FLOW_CHANNELS build.
+const size_t RETAINED_RAM_BYTES = 3068;
+
+const size_t RETAINED_FLOW_BATCH_BYTES = 1356;        // DataReporter: hourly records not yet queued
+const size_t RETAINED_HISTORY_BYTES = 1500;           // FlowHistory: minute ring and tier positions
+const size_t RETAINED_EVENT_CHECKPOINT_BYTES = 48;    // FlowSensor: flow event in progress per meter
+const size_t RETAINED_STORAGE_BYTES = 80;             // Storage: counters not yet in EEPROM
+
+static_assert(RETAINED_FLOW_BATCH_BYTES + RETAINED_HISTORY_BYTES + RETAINED_EVENT_CHECKPOINT_BYTES +
+              RETAINED_STORAGE_BYTES <= RETAINED_RAM_BYTES, "Retained RAM budget is over what the Boron has");
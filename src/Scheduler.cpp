@@ -0,0 +1,275 @@
+#include "Scheduler.h"
+
+#include <limits.h>
+
+Scheduler::Scheduler() :
+  _heapSize(0),
+  _taskCount(0),
+  _runningId(-1),
+  _runningRescheduled(false),
+  _idleMillis(0)
+{
+  memset(_tasks, 0, sizeof(_tasks));
+}
+
+int Scheduler::every(const char* name, unsigned long periodMs, TaskFunction function, void* context,
+                     unsigned long firstDelayMs) {
+  return addTask(name, periodMs > 0 ? periodMs : 1, firstDelayMs, function, context);
+}
+
+int Scheduler::after(const char* name, unsigned long delayMs, TaskFunction function, void* context) {
+  return addTask(name, 0, delayMs, function, context);
+}
+
+void Scheduler::cancel(int id) {
+  if (id < 0 || id >= _taskCount || !_tasks[id].active) {
+    return;
+  }
+  _tasks[id].active = false;
+
+  // Drop it from the heap (if it is running it has already been popped)
+  for (int i = 0; i < _heapSize; i++) {
+    if (_heap[i] == id) {
+      _heap[i] = _heap[--_heapSize];
+      if (i < _heapSize) {
+        siftDown(i);
+        siftUp(i);
+      }
+      break;
+    }
+  }
+}
+
+void Scheduler::reschedule(int id, unsigned long delayMs) {
+  if (id < 0 || id >= _taskCount || !_tasks[id].active) {
+    return;
+  }
+  // Deadlines are compared as signed differences, so keep within half the range
+  if (delayMs > (unsigned long)LONG_MAX) {
+    delayMs = LONG_MAX;
+  }
+  _tasks[id].deadline = millis() + delayMs;
+
+  // The running task is pushed back by run() once it returns
+  if (id == _runningId) {
+    _runningRescheduled = true;
+    return;
+  }
+  for (int i = 0; i < _heapSize; i++) {
+    if (_heap[i] == id) {
+      siftDown(i);
+      siftUp(i);
+      break;
+    }
+  }
+}
+
+unsigned long Scheduler::run() {
+  // Time is re-read after every task, since a task may block (publishing)
+  unsigned long currentTime = millis();
+  while (_heapSize > 0 && (long)(currentTime - _tasks[_heap[0]].deadline) >= 0) {
+    int id = pop();
+    Task& task = _tasks[id];
+
+    unsigned long late = currentTime - task.deadline;
+    if (late > task.stats.maxLateMillis) {
+      task.stats.maxLateMillis = late;
+    }
+
+    uint32_t start = micros();
+    _runningId = id;
+    _runningRescheduled = false;
+    task.function(task.context, currentTime);
+    _runningId = -1;
+    uint32_t elapsed = micros() - start;
+    currentTime = millis();
+#if LATENCY_PROFILE
+    LatencyProfile::record(task.latencyProbe, elapsed);
+    LATENCY_RECORD("late", late * 1000);
+#endif
+
+    task.stats.runs++;
+    task.stats.totalRunMicros += elapsed;
+    if (elapsed > task.stats.maxRunMicros) {
+      task.stats.maxRunMicros = elapsed;
+    }
+
+    if (!task.active) {
+      continue;  // Cancelled itself
+    }
+    if (_runningRescheduled) {
+      push(id);  // Chose its own next deadline
+      continue;
+    }
+    if (task.stats.period == 0) {
+      task.active = false;
+      continue;
+    }
+
+    // Next deadline in phase, skipping any that have already passed
+    task.deadline += task.stats.period;
+    if ((long)(currentTime - task.deadline) >= 0) {
+      unsigned long missed = (currentTime - task.deadline) / task.stats.period + 1;
+      task.stats.overruns += missed;
+      task.deadline += missed * task.stats.period;
+    }
+    push(id);
+  }
+
+  if (_heapSize == 0) {
+    return ULONG_MAX;
+  }
+  long wait = (long)(_tasks[_heap[0]].deadline - currentTime);
+  return wait > 0 ? (unsigned long)wait : 0;
+}
+
+void Scheduler::runAndIdle(unsigned long maxIdleMs) {
+  unsigned long wait = run();
+  if (wait > maxIdleMs) {
+    wait = maxIdleMs;
+  }
+  if (wait > 0) {
+    // delay() parks the application thread, so the CPU idles until then
+    delay(wait);
+    _idleMillis += wait;
+  }
+}
+
+unsigned long Scheduler::getMillisUntil(int id) const {
+  if (id < 0 || id >= _taskCount || !_tasks[id].active) {
+    return ULONG_MAX;
+  }
+  long wait = (long)(_tasks[id].deadline - millis());
+  return wait > 0 ? (unsigned long)wait : 0;
+}
+
+void Scheduler::resume() {
+  unsigned long currentTime = millis();
+  for (int i = 0; i < _heapSize; i++) {
+    Task& task = _tasks[_heap[i]];
+    if (task.stats.period > 0 && (long)(currentTime - task.deadline) > 0) {
+      task.deadline += (currentTime - task.deadline) / task.stats.period * task.stats.period;
+    }
+  }
+  
+  // Deadlines moved by different amounts, so rebuild the heap
+  for (int i = _heapSize / 2 - 1; i >= 0; i--) {
+    siftDown(i);
+  }
+}
+
+int Scheduler::getTaskCount() const {
+  return _taskCount;
+}
+
+bool Scheduler::getTaskStats(int id, TaskStats& stats) const {
+  if (id < 0 || id >= _taskCount) {
+    return false;
+  }
+  stats = _tasks[id].stats;
+  return true;
+}
+
+uint64_t Scheduler::getIdleMillis() const {
+  return _idleMillis;
+}
+
+void Scheduler::logStats() const {
+  for (int id = 0; id < _taskCount; id++) {
+    const TaskStats& stats = _tasks[id].stats;
+    Serial.printlnf("Task %-10s runs %lu, overruns %lu, max late %lu ms, run mean %lu us, max %lu us",
+                   stats.name, stats.runs, stats.overruns, stats.maxLateMillis,
+                   stats.runs ? (unsigned long)(stats.totalRunMicros / stats.runs) : 0UL,
+                   stats.maxRunMicros);
+  }
+}
+
+int Scheduler::addTask(const char* name, unsigned long periodMs, unsigned long delayMs,
+                       TaskFunction function, void* context) {
+  if (function == nullptr) {
+    return -1;
+  }
+
+  // Reuse a finished slot unless its task is the one running right now
+  int id = -1;
+  for (int i = 0; i < _taskCount; i++) {
+    if (!_tasks[i].active && i != _runningId) {
+      id = i;
+      break;
+    }
+  }
+  if (id < 0) {
+    if (_taskCount >= MAX_TASKS) {
+      Serial.printlnf("Scheduler: no room for task %s", name);
+      return -1;
+    }
+    id = _taskCount++;
+  }
+
+  Task& task = _tasks[id];
+  memset(&task.stats, 0, sizeof(task.stats));
+  task.function = function;
+  task.context = context;
+  task.deadline = millis() + delayMs;
+  task.active = true;
+  task.stats.name = name;
+  task.stats.period = periodMs;
+#if LATENCY_PROFILE
+  task.latencyProbe = LatencyProfile::probe(name);
+#endif
+  push(id);
+  return id;
+}
+
+bool Scheduler::earlier(int a, int b) const {
+  // Wrap-safe comparison of millis() deadlines
+  return (long)(_tasks[a].deadline - _tasks[b].deadline) < 0;
+}
+
+void Scheduler::push(int id) {
+  _heap[_heapSize] = id;
+  siftUp(_heapSize++);
+}
+
+int Scheduler::pop() {
+  int id = _heap[0];
+  _heap[0] = _heap[--_heapSize];
+  if (_heapSize > 0) {
+    siftDown(0);
+  }
+  return id;
+}
+
+void Scheduler::siftUp(int index) {
+  while (index > 0) {
+    int parent = (index - 1) / 2;
+    if (!earlier(_heap[index], _heap[parent])) {
+      break;
+    }
+    int swap = _heap[index];
+    _heap[index] = _heap[parent];
+    _heap[parent] = swap;
+    index = parent;
+  }
+}
+
+void Scheduler::siftDown(int index) {
+  while (true) {
+    int smallest = index;
+    int left = 2 * index + 1;
+    int right = left + 1;
+    if (left < _heapSize && earlier(_heap[left], _heap[smallest])) {
+      smallest = left;
+    }
+    if (right < _heapSize && earlier(_heap[right], _heap[smallest])) {
+      smallest = right;
+    }
+    if (smallest == index) {
+      break;
+    }
+    int swap = _heap[index];
+    _heap[index] = _heap[smallest];
+    _heap[smallest] = swap;
+    index = smallest;
+  }
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include "Particle.h"
+#include "LatencyProfile.h"
+
+// Cooperative deadline scheduler. Tasks are kept in a min-heap ordered by
+// their next deadline, so run() only ever looks at the earliest one and
+// loop() can sleep until it is due instead of polling every module.
+//
+// Periodic tasks keep their phase: the next deadline is the previous one plus
+// the period, and a task that falls a whole period or more behind skips the
+// missed deadlines and counts them as overruns.
+//
+// Tasks whose work has its own timing (a module's next interval, a queue's
+// pacing) move their next deadline with reschedule(), and other tasks use it
+// to wake them when something they watch changes.
+//
+// Each run is also recorded in a LatencyProfile probe named after the task,
+// and each start delay in the "late" probe.
+typedef void (*TaskFunction)(void* context, unsigned long currentTime);
+
+class Scheduler {
+public:
+  struct TaskStats {
+    const char* name;
+    unsigned long period;        // 0 for a one-shot task
+    unsigned long runs;
+    unsigned long overruns;      // Deadlines skipped because the task ran late
+    unsigned long maxLateMillis; // Worst start delay after the deadline
+    unsigned long maxRunMicros;  // Longest single run
+    uint64_t totalRunMicros;
+  };
+
+  Scheduler();
+
+  // Register a task; returns its id, or -1 if the table is full. Slots of
+  // finished one-shot and cancelled tasks are reused.
+  int every(const char* name, unsigned long periodMs, TaskFunction function, void* context = nullptr,
+            unsigned long firstDelayMs = 0);
+  int after(const char* name, unsigned long delayMs, TaskFunction function, void* context = nullptr);
+
+  // Stop a task (a task may cancel itself)
+  void cancel(int id);
+
+  // Move a task's next deadline to delayMs from now (0 runs it on the next
+  // pass); a periodic task carries on in phase from there. A running task
+  // may reschedule itself.
+  void reschedule(int id, unsigned long delayMs);
+
+  // Run every task that is due; returns milliseconds until the next deadline
+  unsigned long run();
+
+  // Run due tasks, then sleep until the next deadline (at most maxIdleMs)
+  void runAndIdle(unsigned long maxIdleMs);
+  
+  // Milliseconds until a task's next deadline (ULONG_MAX if it isn't active)
+  unsigned long getMillisUntil(int id) const;
+  
+  // After the CPU slept through deadlines: each overdue periodic task runs
+  // once and carries on in phase, without counting the sleep as overruns
+  void resume();
+
+  // Statistics
+  int getTaskCount() const;
+  bool getTaskStats(int id, TaskStats& stats) const;
+  uint64_t getIdleMillis() const;
+  void logStats() const;
+
+  static const int MAX_TASKS = 16;
+
+private:
+  struct Task {
+    TaskFunction function;
+    void* context;
+    unsigned long deadline;
+    bool active;
+    TaskStats stats;
+#if LATENCY_PROFILE
+    int latencyProbe;   // Run time histogram, named after the task
+#endif
+  };
+
+  Task _tasks[MAX_TASKS];
+  int _heap[MAX_TASKS];  // Task ids, earliest deadline first
+  int _heapSize;
+  int _taskCount;
+  int _runningId;
+  bool _runningRescheduled;  // The running task set its own next deadline
+  uint64_t _idleMillis;
+
+  int addTask(const char* name, unsigned long periodMs, unsigned long delayMs,
+              TaskFunction function, void* context);
+  bool earlier(int a, int b) const;
+  void push(int id);
+  int pop();
+  void siftUp(int index);
+  void siftDown(int index);
+};
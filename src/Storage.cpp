@@ -1,97 +1,439 @@
-#include "Storage.h"
-
-void Storage::begin() {
-  if (!checkInitialized()) {
-    initializeEEPROM();
-  }
-  
-  Serial.println("Storage system initialized");
-}
-
-bool Storage::checkInitialized() {
-  uint32_t magicNumber = readValue<uint32_t>(ADDR_MAGIC_NUMBER);
-  uint32_t version = readValue<uint32_t>(ADDR_VERSION);
-  
-  return (magicNumber == STORAGE_MAGIC_NUMBER && version == STORAGE_VERSION);
-}
-
-void Storage::initializeEEPROM() {
-  Serial.println("Initializing EEPROM storage...");
-  
-  // Write magic number and version
-  writeValue<uint32_t>(ADDR_MAGIC_NUMBER, STORAGE_MAGIC_NUMBER);
-  writeValue<uint32_t>(ADDR_VERSION, STORAGE_VERSION);
-  
-  // Initialize counters to 0
-  writeValue<float>(ADDR_LIFETIME_GALLONS, 0.0f);
-  writeValue<float>(ADDR_DAILY_GALLONS, 0.0f);
-  writeValue<int>(ADDR_FLOW_EVENTS, 0);
-  writeValue<int>(ADDR_HOURS_ELAPSED, 0);
-  writeValue<int>(ADDR_WATCHDOG_RESETS, 0);
-  writeValue<unsigned long>(ADDR_DAILY_RESET_TIME, 0);
-  
-  Serial.println("EEPROM storage initialized");
-}
-
-// Load functions
-float Storage::loadLifetimeGallons() {
-  return readValue<float>(ADDR_LIFETIME_GALLONS);
-}
-
-float Storage::loadDailyGallons() {
-  return readValue<float>(ADDR_DAILY_GALLONS);
-}
-
-int Storage::loadFlowEvents() {
-  return readValue<int>(ADDR_FLOW_EVENTS);
-}
-
-int Storage::loadHoursElapsed() {
-  return readValue<int>(ADDR_HOURS_ELAPSED);
-}
-
-int Storage::loadWatchdogResetCount() {
-  return readValue<int>(ADDR_WATCHDOG_RESETS);
-}
-
-unsigned long Storage::loadDailyResetTime() {
-  return readValue<unsigned long>(ADDR_DAILY_RESET_TIME);
-}
-
-// Save functions
-void Storage::saveLifetimeGallons(float value) {
-  writeValue<float>(ADDR_LIFETIME_GALLONS, value);
-}
-
-void Storage::saveDailyGallons(float value) {
-  writeValue<float>(ADDR_DAILY_GALLONS, value);
-}
-
-void Storage::saveFlowEvents(int value) {
-  writeValue<int>(ADDR_FLOW_EVENTS, value);
-}
-
-void Storage::saveHoursElapsed(int value) {
-  writeValue<int>(ADDR_HOURS_ELAPSED, value);
-}
-
-void Storage::saveWatchdogResetCount(int value) {
-  writeValue<int>(ADDR_WATCHDOG_RESETS, value);
-}
-
-void Storage::saveDailyResetTime(unsigned long value) {
-  writeValue<unsigned long>(ADDR_DAILY_RESET_TIME, value);
-}
-
-// Template implementations
-template<typename T>
-T Storage::readValue(int address) {
-  T value;
-  EEPROM.get(address, value);
-  return value;
-}
-
-template<typename T>
-void Storage::writeValue(int address, T value) {
-  EEPROM.put(address, value);
-} 
\ No newline at end of file
+#include "Storage.h"
+#include "Checksum.h"
+
+#include <limits.h>
+
+// Initialize static members
+Storage::Record Storage::_current = {};
+retained Storage::Record Storage::_retainedCopy;
+int Storage::_nextSlot = 0;
+unsigned long Storage::_recordsWritten = 0;
+Storage::Record Storage::_flushed = {};
+unsigned long Storage::_pendingChanges = 0;
+unsigned long Storage::_firstDirtyTime = 0;
+bool Storage::_dirtyTimerStarted = false;
+unsigned long Storage::_writesAvoided = 0;
+unsigned long Storage::_flushInterval = Storage::DEFAULT_FLUSH_INTERVAL;
+uint32_t Storage::_flushMilliGallonsDelta = Storage::DEFAULT_FLUSH_MILLIGALLONS_DELTA;
+
+void Storage::begin() {
+  bool journalRecovered = false;
+  uint32_t magicNumber = readValue<uint32_t>(ADDR_MAGIC_NUMBER);
+  uint32_t version = readValue<uint32_t>(ADDR_VERSION);
+
+  if (magicNumber == STORAGE_MAGIC_NUMBER && version == 1) {
+    migrateVersion1();
+  } else if (magicNumber == STORAGE_MAGIC_NUMBER && version == 2) {
+    migrateVersion2();
+  } else if (magicNumber == STORAGE_MAGIC_NUMBER && version == 3) {
+    migrateVersion3();
+  } else if (!checkInitialized()) {
+    initializeEEPROM();
+  } else if (recoverJournal()) {
+    journalRecovered = true;
+  } else {
+    // Header is valid but no record survived; start from zero
+    Serial.println("No valid storage record found, counters reset");
+    _current = {};
+    _nextSlot = 0;
+  }
+  
+  _flushed = _current;
+  _pendingChanges = 0;
+  if (journalRecovered && recoverCheckpoint()) {
+    // Persist straight away; the next reset might be a power cut
+    Serial.println("Storage: recovered unsaved counters from retained RAM");
+    flush();
+  }
+  checkpoint();
+  
+  // Don't lose cached values on a requested reset (OTA, System.reset())
+  System.on(reset, Storage::systemEventHandler);
+
+  Serial.printlnf("Storage system initialized (record %lu, %d journal slots)",
+                 (unsigned long)_current.sequence, getJournalSlotCount());
+}
+
+bool Storage::checkInitialized() {
+  uint32_t magicNumber = readValue<uint32_t>(ADDR_MAGIC_NUMBER);
+  uint32_t version = readValue<uint32_t>(ADDR_VERSION);
+
+  return (magicNumber == STORAGE_MAGIC_NUMBER && version == STORAGE_VERSION);
+}
+
+bool Storage::recoverJournal() {
+  Record newest = {};
+  int newestSlot = 0;
+
+  if (!findNewestRecord(newest, newestSlot)) {
+    return false;
+  }
+
+  _current = newest;
+  _nextSlot = (newestSlot + 1) % getJournalSlotCount();
+  return true;
+}
+
+void Storage::migrateVersion1() {
+  Serial.println("Migrating EEPROM storage from version 1...");
+
+  // Carry the fixed-slot values over into the first journal record
+  _current = {};
+  _current.lifetimeMilliGallons[0] = gallonsToMilliGallons(readValue<float>(ADDR_V1_LIFETIME_GALLONS));
+  _current.dailyMilliGallons[0] = gallonsToMilliGallons(readValue<float>(ADDR_V1_DAILY_GALLONS));
+  _current.flowEvents[0] = readValue<int32_t>(ADDR_V1_FLOW_EVENTS);
+  _current.hoursElapsed = readValue<int32_t>(ADDR_V1_HOURS_ELAPSED);
+  _current.watchdogResets = readValue<int32_t>(ADDR_V1_WATCHDOG_RESETS);
+  _current.dailyResetTime = readValue<uint32_t>(ADDR_V1_DAILY_RESET_TIME);
+
+  startJournal();
+
+  Serial.println("EEPROM storage migrated");
+}
+
+void Storage::migrateVersion2() {
+  Serial.println("Migrating EEPROM storage from version 2...");
+
+  // Convert the newest float record; the sequence carries on from it
+  RecordV2 newest = {};
+  int newestSlot = -1;
+  _current = {};
+  if (findNewestRecord(newest, newestSlot)) {
+    _current.sequence = newest.sequence;
+    _current.lifetimeMilliGallons[0] = gallonsToMilliGallons(newest.lifetimeGallons);
+    _current.dailyMilliGallons[0] = gallonsToMilliGallons(newest.dailyGallons);
+    _current.flowEvents[0] = newest.flowEvents;
+    _current.hoursElapsed = newest.hoursElapsed;
+    _current.watchdogResets = newest.watchdogResets;
+    _current.dailyResetTime = newest.dailyResetTime;
+  }
+
+  // The old record stays readable until the new one and the header are down
+  if (newestSlot >= 0) {
+    startJournal(ADDR_JOURNAL_START + newestSlot * (int)sizeof(RecordV2), sizeof(RecordV2));
+  } else {
+    startJournal();
+  }
+
+  Serial.println("EEPROM storage migrated");
+}
+
+void Storage::migrateVersion3() {
+  Serial.println("Migrating EEPROM storage from version 3...");
+
+  // The single meter becomes channel 0; the sequence carries on
+  RecordV3 newest = {};
+  int newestSlot = -1;
+  _current = {};
+  if (findNewestRecord(newest, newestSlot)) {
+    _current.sequence = newest.sequence;
+    _current.lifetimeMilliGallons[0] = newest.lifetimeMilliGallons;
+    _current.dailyMilliGallons[0] = newest.dailyMilliGallons;
+    _current.flowEvents[0] = newest.flowEvents;
+    _current.hoursElapsed = newest.hoursElapsed;
+    _current.watchdogResets = newest.watchdogResets;
+    _current.dailyResetTime = newest.dailyResetTime;
+  }
+
+  if (newestSlot >= 0) {
+    startJournal(ADDR_JOURNAL_START + newestSlot * (int)sizeof(RecordV3), sizeof(RecordV3));
+  } else {
+    startJournal();
+  }
+
+  Serial.println("EEPROM storage migrated");
+}
+
+void Storage::initializeEEPROM() {
+  Serial.println("Initializing EEPROM storage...");
+
+  // Start with all counters at 0
+  _current = {};
+  startJournal();
+
+  Serial.println("EEPROM storage initialized");
+}
+
+void Storage::startJournal(int keepAddress, int keepLength) {
+  // First record goes in the first slot clear of the old newest record, so a
+  // power cut before the header is written leaves the old journal intact and
+  // the migration simply runs again
+  int first = 0;
+  while (first + 1 < getJournalSlotCount() &&
+         slotAddress(first) < keepAddress + keepLength &&
+         keepAddress < slotAddress(first) + (int)sizeof(Record)) {
+    first++;
+  }
+  _nextSlot = first;
+  appendRecord();
+  writeHeader();
+
+  // Only then invalidate anything else left in the journal area by older
+  // firmware; a cut part way through leaves stale bytes that fail the CRC
+  for (int slot = 0; slot < getJournalSlotCount(); slot++) {
+    if (slot != first) {
+      writeValue<uint32_t>(slotAddress(slot) + offsetof(Record, crc), 0);
+    }
+  }
+}
+
+void Storage::update(unsigned long currentTime) {
+  if (_pendingChanges == 0) {
+    return;
+  }
+  
+  // Age changes from the first update that sees them, on the caller's clock
+  if (!_dirtyTimerStarted) {
+    _firstDirtyTime = currentTime;
+    _dirtyTimerStarted = true;
+  }
+  
+  if (significantChange() || currentTime - _firstDirtyTime >= _flushInterval) {
+    flush();
+  }
+}
+
+unsigned long Storage::getMillisUntilFlush(unsigned long currentTime) {
+  if (_pendingChanges == 0) {
+    return ULONG_MAX;
+  }
+  if (significantChange()) {
+    return 0;
+  }
+  if (!_dirtyTimerStarted) {
+    return _flushInterval;
+  }
+  unsigned long age = currentTime - _firstDirtyTime;
+  return age < _flushInterval ? _flushInterval - age : 0;
+}
+
+bool Storage::significantChange() {
+  // Large movements in any meter's gallon totals are worth a write on their
+  // own. Lifetime only grows; daily also drops back to zero at the daily reset.
+  for (int channel = 0; channel < MAX_FLOW_CHANNELS; channel++) {
+    uint64_t lifetimeDelta = _current.lifetimeMilliGallons[channel] - _flushed.lifetimeMilliGallons[channel];
+    uint64_t daily = _current.dailyMilliGallons[channel];
+    uint64_t flushedDaily = _flushed.dailyMilliGallons[channel];
+    uint64_t dailyDelta = daily > flushedDaily ? daily - flushedDaily : flushedDaily - daily;
+    if (lifetimeDelta >= _flushMilliGallonsDelta || dailyDelta >= _flushMilliGallonsDelta) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void Storage::flush() {
+  if (_pendingChanges == 0) {
+    return;
+  }
+  
+  // Every change beyond the first rode along in this one record
+  _writesAvoided += _pendingChanges - 1;
+  _pendingChanges = 0;
+  _dirtyTimerStarted = false;
+  
+  appendRecord();
+  _flushed = _current;
+}
+
+void Storage::setFlushPolicy(unsigned long intervalMs, uint32_t milliGallonsDelta) {
+  _flushInterval = intervalMs;
+  _flushMilliGallonsDelta = milliGallonsDelta;
+}
+
+void Storage::systemEventHandler(system_event_t event, int param) {
+  (void)param;
+  if (event == reset) {
+    flush();
+  }
+}
+
+void Storage::markDirty() {
+  _pendingChanges++;
+  checkpoint();
+}
+
+void Storage::checkpoint() {
+  _retainedCopy = _current;
+  _retainedCopy.crc = recordCrc(_retainedCopy);
+}
+
+bool Storage::recoverCheckpoint() {
+  // Only a copy taken on top of the newest journal record can be newer than it
+  if (_retainedCopy.crc != recordCrc(_retainedCopy) ||
+      _retainedCopy.sequence != _current.sequence ||
+      memcmp(&_retainedCopy, &_current, offsetof(Record, crc)) == 0) {
+    return false;
+  }
+  _current = _retainedCopy;
+  _pendingChanges = 1;
+  return true;
+}
+
+uint64_t Storage::gallonsToMilliGallons(float gallons) {
+  // Erased or corrupt floats (NaN, negative) migrate as zero
+  if (!(gallons > 0.0f)) {
+    return 0;
+  }
+  return (uint64_t)llroundf(gallons * 1000.0f);
+}
+
+bool Storage::validChannel(int channel) {
+  return channel >= 0 && channel < MAX_FLOW_CHANNELS;
+}
+
+void Storage::writeHeader() {
+  // Written after the first record: until the version changes, the next boot
+  // reads the old layout again and repeats the migration or initialization
+  writeValue<uint32_t>(ADDR_MAGIC_NUMBER, STORAGE_MAGIC_NUMBER);
+  writeValue<uint32_t>(ADDR_VERSION, STORAGE_VERSION);
+}
+
+// Load functions
+uint64_t Storage::loadLifetimeMilliGallons(int channel) {
+  return validChannel(channel) ? _current.lifetimeMilliGallons[channel] : 0;
+}
+
+uint64_t Storage::loadDailyMilliGallons(int channel) {
+  return validChannel(channel) ? _current.dailyMilliGallons[channel] : 0;
+}
+
+int Storage::loadFlowEvents(int channel) {
+  return validChannel(channel) ? _current.flowEvents[channel] : 0;
+}
+
+int Storage::loadHoursElapsed() {
+  return _current.hoursElapsed;
+}
+
+int Storage::loadWatchdogResetCount() {
+  return _current.watchdogResets;
+}
+
+unsigned long Storage::loadDailyResetTime() {
+  return _current.dailyResetTime;
+}
+
+// Save functions - unchanged values are ignored, changed ones wait for a flush
+void Storage::saveLifetimeMilliGallons(uint64_t value, int channel) {
+  if (validChannel(channel) && _current.lifetimeMilliGallons[channel] != value) {
+    _current.lifetimeMilliGallons[channel] = value;
+    markDirty();
+  }
+}
+
+void Storage::saveDailyMilliGallons(uint64_t value, int channel) {
+  if (validChannel(channel) && _current.dailyMilliGallons[channel] != value) {
+    _current.dailyMilliGallons[channel] = value;
+    markDirty();
+  }
+}
+
+void Storage::saveFlowEvents(int value, int channel) {
+  if (validChannel(channel) && _current.flowEvents[channel] != value) {
+    _current.flowEvents[channel] = value;
+    markDirty();
+  }
+}
+
+void Storage::saveHoursElapsed(int value) {
+  if (_current.hoursElapsed != value) {
+    _current.hoursElapsed = value;
+    markDirty();
+  }
+}
+
+void Storage::saveWatchdogResetCount(int value) {
+  if (_current.watchdogResets != value) {
+    _current.watchdogResets = value;
+    markDirty();
+  }
+}
+
+void Storage::saveDailyResetTime(unsigned long value) {
+  if (_current.dailyResetTime != (uint32_t)value) {
+    _current.dailyResetTime = (uint32_t)value;
+    markDirty();
+  }
+}
+
+// Journal statistics
+int Storage::getJournalSlotCount() {
+  return (int)((EEPROM.length() - ADDR_JOURNAL_START) / sizeof(Record));
+}
+
+unsigned long Storage::getRecordsWritten() {
+  return _recordsWritten;
+}
+
+unsigned long Storage::getSequence() {
+  return _current.sequence;
+}
+
+unsigned long Storage::getSlotWriteCycles() {
+  // Slots are written round-robin, so each has seen sequence / slots writes
+  int slots = getJournalSlotCount();
+  return (_current.sequence + slots - 1) / slots;
+}
+
+unsigned long Storage::getWritesAvoided() {
+  return _writesAvoided;
+}
+
+bool Storage::isDirty() {
+  return _pendingChanges > 0;
+}
+
+// Journal operations
+void Storage::appendRecord() {
+  _current.sequence++;
+  _current.crc = recordCrc(_current);
+
+  writeValue<Record>(slotAddress(_nextSlot), _current);
+  checkpoint();
+
+  _nextSlot = (_nextSlot + 1) % getJournalSlotCount();
+  _recordsWritten++;
+}
+
+int Storage::slotAddress(int slot) {
+  return ADDR_JOURNAL_START + slot * (int)sizeof(Record);
+}
+
+template<typename R>
+bool Storage::findNewestRecord(R& newest, int& newestSlot) {
+  bool found = false;
+  int slots = (int)((EEPROM.length() - ADDR_JOURNAL_START) / sizeof(R));
+
+  // The newest record is the valid one with the highest sequence number
+  for (int slot = 0; slot < slots; slot++) {
+    R record = readValue<R>(ADDR_JOURNAL_START + slot * (int)sizeof(R));
+    if (record.crc != recordCrc(record)) {
+      continue; // Erased, torn or never written
+    }
+    if (!found || (int32_t)(record.sequence - newest.sequence) > 0) {
+      newest = record;
+      newestSlot = slot;
+      found = true;
+    }
+  }
+  return found;
+}
+
+template<typename R>
+uint32_t Storage::recordCrc(const R& record) {
+  return Checksum::crc32(reinterpret_cast<const uint8_t*>(&record), offsetof(R, crc));
+}
+
+// Template implementations
+template<typename T>
+T Storage::readValue(int address) {
+  T value;
+  EEPROM.get(address, value);
+  return value;
+}
+
+template<typename T>
+void Storage::writeValue(int address, T value) {
+  EEPROM.put(address, value);
+}
\ No newline at end of file
@@ -1,51 +1,174 @@
-#pragma once
-
-#include "Particle.h"
-
-// EEPROM address definitions
-#define ADDR_MAGIC_NUMBER      0   // 4 bytes
-#define ADDR_VERSION           4   // 4 bytes
-#define ADDR_LIFETIME_GALLONS  8   // 4 bytes
-#define ADDR_DAILY_GALLONS     12  // 4 bytes
-#define ADDR_FLOW_EVENTS       16  // 4 bytes
-#define ADDR_HOURS_ELAPSED     20  // 4 bytes
-#define ADDR_WATCHDOG_RESETS   24  // 4 bytes
-#define ADDR_DAILY_RESET_TIME  28  // 4 bytes
-
-// Magic number to check if EEPROM is initialized
-#define STORAGE_MAGIC_NUMBER   0xA753B912
-#define STORAGE_VERSION        1
-
-class Storage {
-public:
-  // Initialize storage
-  static void begin();
-  
-  // Load values from EEPROM
-  static float loadLifetimeGallons();
-  static float loadDailyGallons();
-  static int loadFlowEvents();
-  static int loadHoursElapsed();
-  static int loadWatchdogResetCount();
-  static unsigned long loadDailyResetTime();
-  
-  // Save values to EEPROM
-  static void saveLifetimeGallons(float value);
-  static void saveDailyGallons(float value);
-  static void saveFlowEvents(int value);
-  static void saveHoursElapsed(int value);
-  static void saveWatchdogResetCount(int value);
-  static void saveDailyResetTime(unsigned long value);
-  
-private:
-  // Check if EEPROM is initialized, initialize if not
-  static bool checkInitialized();
-  static void initializeEEPROM();
-  
-  // Template functions for EEPROM operations
-  template<typename T>
-  static T readValue(int address);
-  
-  template<typename T>
-  static void writeValue(int address, T value);
-}; 
\ No newline at end of file
+#pragma once
+
+#include "Particle.h"
+#include "FlowChannels.h"
+#include "RetainedRam.h"
+
+// EEPROM layout: a small header followed by a journal of fixed-size records.
+// Every flush appends a complete, sequenced and CRC-protected snapshot of all
+// counters to the next slot, so writes rotate across the whole journal and a
+// torn write can only lose the record that was being written.
+//
+// Saves only update a RAM copy and mark it dirty. update() coalesces them into
+// a single record on a timer or when the gallon totals move significantly, and
+// flush() writes immediately (reset, sleep, or anything that must not be lost).
+// The RAM copy is mirrored in retained RAM, so a crash that skips the reset
+// handler (watchdog, panic) still finds unflushed changes at the next boot.
+//
+// Volumes are stored as integer milli-gallons (version 3), with a slot for
+// each meter's totals (version 4). Versions 1 and 2 stored float gallons and
+// version 3 a single meter; all are migrated on first boot into channel 0.
+#define ADDR_MAGIC_NUMBER      0   // 4 bytes
+#define ADDR_VERSION           4   // 4 bytes
+#define ADDR_JOURNAL_START     64  // Journal slots run to the end of EEPROM
+
+// Version 1 fixed-slot addresses, only read when migrating
+#define ADDR_V1_LIFETIME_GALLONS  8   // 4 bytes
+#define ADDR_V1_DAILY_GALLONS     12  // 4 bytes
+#define ADDR_V1_FLOW_EVENTS       16  // 4 bytes
+#define ADDR_V1_HOURS_ELAPSED     20  // 4 bytes
+#define ADDR_V1_WATCHDOG_RESETS   24  // 4 bytes
+#define ADDR_V1_DAILY_RESET_TIME  28  // 4 bytes
+
+// Magic number to check if EEPROM is initialized
+#define STORAGE_MAGIC_NUMBER   0xA753B912
+#define STORAGE_VERSION        4
+
+class Storage {
+public:
+  // Initialize storage and recover the newest valid journal record
+  static void begin();
+  
+  // Flush dirty values when the interval or gallon delta is reached
+  static void update(unsigned long currentTime);
+  
+  // Write any dirty values now
+  static void flush();
+  
+  // Milliseconds until update() would flush: 0 once the changes are
+  // significant, ULONG_MAX with nothing to write
+  static unsigned long getMillisUntilFlush(unsigned long currentTime);
+  
+  // Flush policy: maximum age of unsaved changes, and the change in lifetime
+  // or daily milli-gallons that is worth persisting straight away
+  static void setFlushPolicy(unsigned long intervalMs, uint32_t milliGallonsDelta);
+
+  // Load values (served from the recovered record, no EEPROM access). Meter
+  // totals take the FlowSensor channel; other channels read as zero.
+  static uint64_t loadLifetimeMilliGallons(int channel = 0);
+  static uint64_t loadDailyMilliGallons(int channel = 0);
+  static int loadFlowEvents(int channel = 0);
+  static int loadHoursElapsed();
+  static int loadWatchdogResetCount();
+  static unsigned long loadDailyResetTime();
+
+  // Save values - changes are cached until the next flush
+  static void saveLifetimeMilliGallons(uint64_t value, int channel = 0);
+  static void saveDailyMilliGallons(uint64_t value, int channel = 0);
+  static void saveFlowEvents(int value, int channel = 0);
+  static void saveHoursElapsed(int value);
+  static void saveWatchdogResetCount(int value);
+  static void saveDailyResetTime(unsigned long value);
+
+  // Journal statistics for diagnostics and wear tests
+  static int getJournalSlotCount();
+  static unsigned long getRecordsWritten();     // Records appended since boot
+  static unsigned long getSequence();           // Records appended over the device lifetime
+  static unsigned long getSlotWriteCycles();    // Writes each slot has absorbed so far
+  static unsigned long getWritesAvoided();      // Changed-value saves merged into other records
+  static bool isDirty();
+
+private:
+  // One journal slot. Fixed-width fields so the layout is the same on every build.
+  // 64-bit fields sit on 8-byte offsets so the record has no padding.
+  struct Record {
+    uint32_t sequence;
+    int32_t hoursElapsed;
+    int32_t watchdogResets;
+    uint32_t dailyResetTime;
+    uint64_t lifetimeMilliGallons[MAX_FLOW_CHANNELS];
+    uint64_t dailyMilliGallons[MAX_FLOW_CHANNELS];
+    int32_t flowEvents[MAX_FLOW_CHANNELS];
+    uint32_t crc;             // CRC-32 of all preceding fields, written last
+  };
+  static_assert(sizeof(Record) == offsetof(Record, crc) + sizeof(uint32_t),
+                "Record has padding; MAX_FLOW_CHANNELS must be odd");
+  static_assert(sizeof(Record) <= RETAINED_STORAGE_BYTES, "Record is over its RetainedRam.h budget");
+  
+  // Version 3 journal record, only read when migrating
+  struct RecordV3 {
+    uint32_t sequence;
+    int32_t flowEvents;
+    uint64_t lifetimeMilliGallons;
+    uint64_t dailyMilliGallons;
+    int32_t hoursElapsed;
+    int32_t watchdogResets;
+    uint32_t dailyResetTime;
+    uint32_t crc;
+  };
+  
+  // Version 2 journal record, only read when migrating
+  struct RecordV2 {
+    uint32_t sequence;
+    float lifetimeGallons;
+    float dailyGallons;
+    int32_t flowEvents;
+    int32_t hoursElapsed;
+    int32_t watchdogResets;
+    uint32_t dailyResetTime;
+    uint32_t crc;
+  };
+
+  static Record _current;
+  static Record _retainedCopy;            // _current with its CRC, kept in retained RAM
+  static int _nextSlot;
+  static unsigned long _recordsWritten;
+  
+  // Write-back cache state
+  static Record _flushed;                 // Last record written to EEPROM
+  static unsigned long _pendingChanges;   // Changed-value saves since the last flush
+  static unsigned long _firstDirtyTime;
+  static bool _dirtyTimerStarted;
+  static unsigned long _writesAvoided;
+  static unsigned long _flushInterval;
+  static uint32_t _flushMilliGallonsDelta;
+  
+  static const unsigned long DEFAULT_FLUSH_INTERVAL = 7200000; // 2 hours
+  static const uint32_t DEFAULT_FLUSH_MILLIGALLONS_DELTA = 10000; // 10 gallons
+
+  // Startup paths
+  static bool checkInitialized();
+  static bool recoverJournal();
+  static void migrateVersion1();
+  static void migrateVersion2();
+  static void migrateVersion3();
+  static void initializeEEPROM();
+  static void startJournal(int keepAddress = -1, int keepLength = 0);
+  static void writeHeader();
+  static uint64_t gallonsToMilliGallons(float gallons);
+  static bool validChannel(int channel);
+
+  // Cache and journal operations
+  static void markDirty();
+  static bool significantChange();
+  static void checkpoint();
+  static bool recoverCheckpoint();
+  static void systemEventHandler(system_event_t event, int param);
+  static void appendRecord();
+  static int slotAddress(int slot);
+  
+  // Journal scanning, shared by recovery and the version 2 migration
+  template<typename R>
+  static bool findNewestRecord(R& newest, int& newestSlot);
+  
+  template<typename R>
+  static uint32_t recordCrc(const R& record);
+
+
+  // Template functions for EEPROM operations
+  template<typename T>
+  static T readValue(int address);
+
+  template<typename T>
+  static void writeValue(int address, T value);
+};
\ No newline at end of file
@@ -0,0 +1,29 @@
+#include "Volume.h"
+
+unsigned long Volume::wholeGallons(uint64_t milliGallons) {
+  return (unsigned long)(milliGallons / MILLIGALLONS_PER_GALLON);
+}
+
+const char* Volume::format(char* buffer, size_t size, uint64_t milliGallons, int decimals) {
+  // Milli-gallons represented by one step of the last printed digit
+  static const uint32_t STEP[] = {1000, 100, 10, 1};
+  
+  if (decimals < 0) {
+    decimals = 0;
+  } else if (decimals > 3) {
+    decimals = 3;
+  }
+  
+  uint32_t step = STEP[decimals];
+  uint32_t stepsPerGallon = MILLIGALLONS_PER_GALLON / step;
+  uint64_t steps = (milliGallons + step / 2) / step;
+  unsigned long whole = (unsigned long)(steps / stepsPerGallon);
+  unsigned long fraction = (unsigned long)(steps % stepsPerGallon);
+  
+  if (decimals == 0) {
+    snprintf(buffer, size, "%lu", whole);
+  } else {
+    snprintf(buffer, size, "%lu.%0*lu", whole, decimals, fraction);
+  }
+  return buffer;
+}
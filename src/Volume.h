@@ -0,0 +1,17 @@
+#pragma once
+
+#include "Particle.h"
+
+// Volumes are carried as integer milli-gallons everywhere so totals keep full
+// precision however large they grow. Only the output edges (cloud payloads,
+// the display, serial logs) turn them into gallons, using integer formatting.
+class Volume {
+public:
+  static const uint32_t MILLIGALLONS_PER_GALLON = 1000;
+  
+  // Whole gallons, truncated
+  static unsigned long wholeGallons(uint64_t milliGallons);
+  
+  // Gallons with 0-3 decimals, rounded, written into buffer
+  static const char* format(char* buffer, size_t size, uint64_t milliGallons, int decimals);
+};
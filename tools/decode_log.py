@@ -0,0 +1,180 @@
+#!/usr/bin/env python3
+"""Decode the firmware's binary deferred log (see src/DeferredLog.h).
+
+Reads a USB serial capture (a file, or stdin) and prints the log as the text
+the firmware would have printed: each entry is formatted from the format
+frame the device sent before it. Text between frames (lines printed directly
+with Serial) passes through unchanged.
+
+    particle serial monitor --raw > capture.bin; decode_log.py capture.bin
+    sim/build/boron_sim --log-format binary --usb-capture capture.bin
+"""
+
+import re
+import struct
+import sys
+import zlib
+
+FRAME_MARKER = 0xA5
+FRAME_FORMAT = ord('F')
+FRAME_ENTRY = ord('E')
+FRAME_DROPPED = ord('D')
+
+TAG_INT, TAG_UINT, TAG_INT64, TAG_UINT64, TAG_FLOAT, TAG_STRING, TAG_GALLONS = range(1, 8)
+MAX_ARGS = 8
+
+SPEC = re.compile(r'%([-+ #0]*)(\d*)(?:\.(\d*))?[hljzt]*([a-zA-Z%])')
+
+
+def level_name(level):
+    if level >= 50:
+        return 'ERROR'
+    if level >= 40:
+        return 'WARN'
+    return 'INFO' if level >= 30 else 'TRACE'
+
+
+def gallons(milli_gallons, decimals):
+    # Volume::format: rounded half up to the last printed digit
+    decimals = max(0, min(3, decimals))
+    step = 10 ** (3 - decimals)
+    steps = (milli_gallons + step // 2) // step
+    if decimals == 0:
+        return '%d' % steps
+    per_gallon = 1000 // step
+    return '%d.%0*d' % (steps // per_gallon, decimals, steps % per_gallon)
+
+
+def unpack_args(tags, data):
+    """Typed argument values of an entry, in order."""
+    args = []
+    offset = 0
+    for index in range(MAX_ARGS):
+        tag = (tags >> (4 * index)) & 0xF
+        if tag == 0 or offset + 4 > len(data):
+            break
+        word, = struct.unpack_from('<I', data, offset)
+        if tag in (TAG_INT64, TAG_UINT64, TAG_GALLONS):
+            value, = struct.unpack_from('<q' if tag == TAG_INT64 else '<Q', data, offset)
+            offset += 8
+        elif tag == TAG_STRING:
+            value = data[offset + 4:offset + 4 + word].decode('ascii', 'replace')
+            offset += 4 + (word + 3) // 4 * 4
+        elif tag == TAG_FLOAT:
+            value, = struct.unpack_from('<f', data, offset)
+            offset += 4
+        elif tag == TAG_INT:
+            value, = struct.unpack_from('<i', data, offset)
+            offset += 4
+        else:
+            value = word
+            offset += 4
+        args.append((tag, value))
+    return args
+
+
+def format_entry(fmt, args):
+    """printf with each value rendered by its stored type, as the firmware does."""
+    remaining = list(args)
+
+    def convert(match):
+        flags, width, precision, conversion = match.groups()
+        if conversion == '%':
+            return '%'
+        if not remaining:
+            return '<missing>'
+        tag, value = remaining.pop(0)
+        spec = '%' + flags + width + ('.' + precision if precision is not None else '')
+        if tag == TAG_GALLONS:
+            return gallons(value, int(precision) if precision else 2)
+        if tag == TAG_STRING:
+            return (spec + 's') % value
+        if tag == TAG_FLOAT or conversion in 'fFeEgGaA':
+            return (spec + (conversion if conversion in 'fFeEgG' else 'f')) % float(value)
+        if conversion == 'c':
+            return (spec + 'c') % chr(value & 0xFF)
+        if conversion not in 'dixXo':
+            conversion = 'd'
+        return (spec + conversion) % value
+
+    return SPEC.sub(convert, fmt)
+
+
+class Decoder:
+    def __init__(self, out):
+        self.out = out
+        self.formats = {}
+        self.text = bytearray()
+        self.errors = 0
+
+    def feed(self, data):
+        i = 0
+        while i < len(data):
+            if data[i] != FRAME_MARKER:
+                self.text.append(data[i])
+                if data[i] == ord('\n'):
+                    self.flush_text()
+                i += 1
+                continue
+            if i + 4 > len(data):
+                return data[i:]
+            length, = struct.unpack_from('<H', data, i + 2)
+            end = i + 4 + length + 2
+            if end > len(data):
+                return data[i:]
+            payload = data[i + 4:i + 4 + length]
+            crc, = struct.unpack_from('<H', data, i + 4 + length)
+            if zlib.crc32(payload) & 0xFFFF != crc:
+                # Not a frame after all (or a damaged one): resync on the next byte
+                self.errors += 1
+                i += 1
+                continue
+            self.frame(data[i + 1], payload)
+            i = end
+        return b''
+
+    def frame(self, frame_type, payload):
+        if frame_type == FRAME_FORMAT:
+            format_id, level = struct.unpack_from('<HB', payload)
+            self.formats[format_id] = (level, payload[3:].decode('ascii', 'replace'))
+        elif frame_type == FRAME_ENTRY:
+            format_id, millis, tags = struct.unpack_from('<HII', payload)
+            args = unpack_args(tags, payload[10:])
+            if format_id in self.formats:
+                level, fmt = self.formats[format_id]
+                message = format_entry(fmt, args)
+            else:
+                level = 30
+                message = 'format %d (not seen yet): %s' % (format_id, [value for _, value in args])
+            self.line('%010d [app] %s: %s' % (millis, level_name(level), message))
+        elif frame_type == FRAME_DROPPED:
+            dropped, = struct.unpack_from('<I', payload)
+            self.line('[log] %d entries dropped since boot' % dropped)
+
+    def line(self, text):
+        self.flush_text()
+        self.out.write(text + '\n')
+
+    def flush_text(self):
+        if self.text:
+            self.out.write(self.text.decode('ascii', 'replace'))
+            self.text.clear()
+
+
+def main(argv):
+    source = open(argv[1], 'rb') if len(argv) > 1 else sys.stdin.buffer
+    decoder = Decoder(sys.stdout)
+    pending = b''
+    while True:
+        chunk = source.read(4096)
+        if not chunk:
+            break
+        pending = decoder.feed(pending + chunk)
+    decoder.flush_text()
+    if decoder.errors:
+        sys.stderr.write('%d bad frames skipped\n' % decoder.errors)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
@@ -0,0 +1,139 @@
+#!/usr/bin/env python3
+"""Run flow_data payloads through lambda_function.py against an in-memory
+DynamoDB stand-in, without AWS credentials.
+
+Reads the simulator's --dump-publishes output (a file, or stdin), wraps each
+flow_data payload in a webhook event and passes it to lambda_handler, then
+prints what the table holds. The stand-in enforces BatchWriteItem's limits
+(25 puts, no duplicate keys in one request) and can hold back part of each
+request as UnprocessedItems, to exercise the retries.
+
+    sim/build/boron_sim --days 7 --dump-publishes | tools/ingest_local.py
+    tools/ingest_local.py --redeliver 2 --unprocessed 0.3 --key timestamp publishes.txt
+
+sim/tests/test_ingest.py drives the same stand-in with assertions.
+"""
+
+import argparse
+import json
+import os
+import random
+import re
+import sys
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '..'))
+
+import lambda_function  # noqa: E402
+
+PUBLISH = re.compile(r'publish\s+[\d.]+ s (\S+)\s+\S+\s+(.*)$')
+
+
+class FakeDynamoDB:
+    """The part of the boto3 DynamoDB service resource the lambda uses."""
+
+    def __init__(self, sort_key, unprocessed=0.0, seed=1):
+        self.sort_key = sort_key
+        self.unprocessed = unprocessed
+        self.random = random.Random(seed)
+        self.tables = {}
+        self.requests = 0
+        self.puts = 0
+        self.held = 0
+
+    def batch_write_item(self, RequestItems):
+        self.requests += 1
+        count = sum(len(requests) for requests in RequestItems.values())
+        if count > lambda_function.BATCH_WRITE_LIMIT:
+            raise ValueError('Too many items requested for the BatchWriteItem call')
+
+        unprocessed = {}
+        for name, requests in RequestItems.items():
+            keys = [self.key(request['PutRequest']['Item']) for request in requests]
+            if len(set(keys)) != len(keys):
+                raise ValueError('Provided list of item keys contains duplicates')
+            table = self.tables.setdefault(name, {})
+            for key, request in zip(keys, requests):
+                if self.random.random() < self.unprocessed:
+                    unprocessed.setdefault(name, []).append(request)
+                    self.held += 1
+                else:
+                    table[key] = request['PutRequest']['Item']
+                    self.puts += 1
+        return {'UnprocessedItems': unprocessed}
+
+    def key(self, item):
+        return (item['deviceId'], item[self.sort_key])
+
+    def items(self):
+        return list(self.tables.get(lambda_function.TABLE_NAME, {}).values())
+
+
+def use_stand_in(fake):
+    """Point the lambda at fake, keyed the way fake is, with no backoff
+    sleeps or logging."""
+    lambda_function.dynamodb = fake
+    lambda_function.TABLE_SORT_KEY = fake.sort_key
+    lambda_function.RETRY_BASE_SECONDS = 0
+    lambda_function.print = lambda *a, **k: None
+
+
+def flow_data_payloads(lines):
+    """The flow_data payloads in --dump-publishes output."""
+    for line in lines:
+        match = PUBLISH.match(line.rstrip())
+        if match and match.group(1) == 'flow_data':
+            yield match.group(2)
+
+
+def deliver(payload, event_name='flow_data'):
+    """One webhook delivery; returns the status code and response body."""
+    event = {'body': json.dumps({'event': event_name, 'data': payload})}
+    result = lambda_function.lambda_handler(event, None)
+    return result['statusCode'], json.loads(result['body'])
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n\n')[0])
+    parser.add_argument('input', nargs='?', help='--dump-publishes output (default: stdin)')
+    parser.add_argument('--redeliver', type=int, default=1, metavar='N',
+                        help='deliver every payload N times, as webhook retries would')
+    parser.add_argument('--unprocessed', type=float, default=0.0, metavar='FRACTION',
+                        help='share of puts the stand-in returns as unprocessed')
+    parser.add_argument('--key', choices=['recordKey', 'timestamp'], default='recordKey',
+                        help='sort key of the stand-in table (default: recordKey)')
+    args = parser.parse_args()
+
+    fake = FakeDynamoDB(args.key, args.unprocessed)
+    use_stand_in(fake)
+
+    statuses = {}
+    payloads = 0
+    source = open(args.input) if args.input else sys.stdin
+    for payload in flow_data_payloads(source):
+        payloads += 1
+        for _ in range(args.redeliver):
+            status, body = deliver(payload)
+            statuses[status] = statuses.get(status, 0) + 1
+            if status != 200:
+                print('%d: %s' % (status, body.get('error')))
+
+    items = fake.items()
+    total = sum(item['gallonsUsed'] for item in items)
+    channels = {}
+    for item in items:
+        for name, value in item.get('channelGallons', {}).items():
+            channels[name] = channels.get(name, 0) + value
+
+    print('payloads:   %d flow_data, %d deliveries (%s)' %
+          (payloads, sum(statuses.values()),
+           ', '.join('%d x %d' % (count, status) for status, count in sorted(statuses.items()))))
+    print('writes:     %d requests, %d puts, %d returned unprocessed' % (fake.requests, fake.puts, fake.held))
+    print('table:      %d items keyed on deviceId + %s' % (len(items), args.key))
+    print('gallons:    %s' % total)
+    for name, value in sorted(channels.items()):
+        print('  %-10s %s' % (name, value))
+    return 0 if set(statuses) <= {200} else 1
+
+
+if __name__ == '__main__':
+    sys.exit(main())